@@ -0,0 +1,339 @@
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ INCLUDES
+#include <math.h>
+
+#include "bench.h"
+
+#include "mbt-srv.h"
+#include "mbt-adu.h"
+#include "mbt-regs.h"
+#include "mbt-sim.h"
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ DEFINITIONS
+#define SIM_BLOCK       10000                     ///< Registers of the generator cases
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ TYPES
+struct case_t{
+  const char *name;
+  bench_fn_t  fn;
+};
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ GLOBAL VARS
+struct regs_store_t *store = NULL;
+struct regs_store_t *store_be = NULL;             ///< Registers stored in wire order
+modbus_mapping_t    *mapping = NULL;
+uint8_t              rsp[ MODBUS_MAX_ADU_LENGTH ];
+uint8_t              wire[ MODBUS_MAX_ADU_LENGTH ];
+uint8_t              q_fc03[ 12 ], q_fc01[ 12 ], q_fc05[ 12 ], q_fc03_rtu[ 8 ];
+uint8_t              q_fc16[ MBAP_HEADER_LEN + 6 + 2 * MODBUS_MAX_WRITE_REGISTERS ];
+uint8_t              q_fc15[ MBAP_HEADER_LEN + 6 + MODBUS_MAX_WRITE_BITS / 8 ];
+uint8_t              bytes[ 0x1000 ];             ///< Coils one byte per bit, as libmodbus and the store kept them
+uint8_t              packed[ 0x1000 / 8 ];        ///< The same coils packed
+struct sim_t        *sim = NULL;                  ///< A sine and a walk over SIM_BLOCK registers
+uint16_t             block[ SIM_BLOCK ];
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS
+/**
+ * @brief      Builds a query ADU around a PDU
+ *
+ * @return     The ADU length
+ */
+int query( uint8_t *adu, enum mdb_proto_type proto, const uint8_t *pdu, int plen ){
+  if( proto == MDB_PROTO_TCP ){
+    adu[0] = 0x12;
+    adu[1] = 0x34;
+    adu[2] = 0;
+    adu[3] = 0;
+    adu[4] = ( plen + 1 ) >> 8;
+    adu[5] = ( plen + 1 ) & 0xFF;
+    adu[6] = 1;
+    memcpy( adu + MBAP_HEADER_LEN, pdu, plen );
+    return MBAP_HEADER_LEN + plen;
+  }
+
+  adu[0] = 1;
+  memcpy( adu + RTU_HEADER_LEN, pdu, plen );
+  uint16_t crc = crc16( adu, RTU_HEADER_LEN + plen );
+  adu[ RTU_HEADER_LEN + plen ]     = crc & 0xFF;
+  adu[ RTU_HEADER_LEN + plen + 1 ] = crc >> 8;
+  return RTU_HEADER_LEN + plen + 2;
+}
+
+uint64_t run_frame_len( uint64_t iters ){
+  uint64_t acc = 0;
+  for( uint64_t i = 0; i < iters; i++ ){ acc += mbap_frame_len( q_fc03, sizeof( q_fc03 ) ); }
+  return acc;
+}
+
+uint64_t run_query_tcp( uint64_t iters ){
+  uint64_t acc = 0;
+  for( uint64_t i = 0; i < iters; i++ ){ acc += mb_query( q_fc03, sizeof( q_fc03 ), MDB_PROTO_TCP, mapping ); }
+  return acc;
+}
+
+uint64_t run_query_rtu( uint64_t iters ){
+  uint64_t acc = 0;
+  for( uint64_t i = 0; i < iters; i++ ){ acc += mb_query( q_fc03_rtu, sizeof( q_fc03_rtu ), MDB_PROTO_RTU, mapping ); }
+  return acc;
+}
+
+uint64_t run_crc16( uint64_t iters ){
+  uint64_t acc = 0;
+  for( uint64_t i = 0; i < iters; i++ ){ acc += crc16( wire, 256 ); }
+  return acc;
+}
+
+uint64_t run_reply_fc03( uint64_t iters ){
+  uint64_t acc = 0;
+  for( uint64_t i = 0; i < iters; i++ ){ acc += adu_reply( q_fc03, sizeof( q_fc03 ), MDB_PROTO_TCP, store, 0, store->hdr->nb, rsp ); }
+  return acc;
+}
+
+uint64_t run_reply_fc03_rtu( uint64_t iters ){
+  uint64_t acc = 0;
+  for( uint64_t i = 0; i < iters; i++ ){ acc += adu_reply( q_fc03_rtu, sizeof( q_fc03_rtu ), MDB_PROTO_RTU, store, 0, store->hdr->nb, rsp ); }
+  return acc;
+}
+
+uint64_t run_reply_fc01( uint64_t iters ){
+  uint64_t acc = 0;
+  for( uint64_t i = 0; i < iters; i++ ){ acc += adu_reply( q_fc01, sizeof( q_fc01 ), MDB_PROTO_TCP, store, 0, store->hdr->nb, rsp ); }
+  return acc;
+}
+
+uint64_t run_reply_fc05( uint64_t iters ){
+  uint64_t acc = 0;
+  for( uint64_t i = 0; i < iters; i++ ){ acc += adu_reply( q_fc05, sizeof( q_fc05 ), MDB_PROTO_TCP, store, 0, store->hdr->nb, rsp ); }
+  return acc;
+}
+
+uint64_t run_reply_fc15( uint64_t iters ){
+  uint64_t acc = 0;
+  for( uint64_t i = 0; i < iters; i++ ){ acc += adu_reply( q_fc15, sizeof( q_fc15 ), MDB_PROTO_TCP, store, 0, store->hdr->nb, rsp ); }
+  return acc;
+}
+
+uint64_t run_reply_fc16( uint64_t iters ){
+  uint64_t acc = 0;
+  for( uint64_t i = 0; i < iters; i++ ){ acc += adu_reply( q_fc16, sizeof( q_fc16 ), MDB_PROTO_TCP, store, 0, store->hdr->nb, rsp ); }
+  return acc;
+}
+
+uint64_t run_reply_fc03_be( uint64_t iters ){
+  uint64_t acc = 0;
+  for( uint64_t i = 0; i < iters; i++ ){ acc += adu_reply( q_fc03, sizeof( q_fc03 ), MDB_PROTO_TCP, store_be, 0, store_be->hdr->nb, rsp ); }
+  return acc;
+}
+
+uint64_t run_reply_fc16_be( uint64_t iters ){
+  uint64_t acc = 0;
+  for( uint64_t i = 0; i < iters; i++ ){ acc += adu_reply( q_fc16, sizeof( q_fc16 ), MDB_PROTO_TCP, store_be, 0, store_be->hdr->nb, rsp ); }
+  return acc;
+}
+
+uint64_t run_exception( uint64_t iters ){
+  uint64_t acc = 0;
+  for( uint64_t i = 0; i < iters; i++ ){ acc += adu_exception( q_fc03, MDB_PROTO_TCP, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp ); }
+  return acc;
+}
+
+uint64_t run_regs_read_1( uint64_t iters ){
+  for( uint64_t i = 0; i < iters; i++ ){ regs_read( store, 0, REGS_HOLDING, i & 0xFF, 1, wire ); }
+  return wire[0];
+}
+
+uint64_t run_regs_read_125( uint64_t iters ){
+  for( uint64_t i = 0; i < iters; i++ ){ regs_read( store, 0, REGS_HOLDING, i & 0xFF, MODBUS_MAX_READ_REGISTERS, wire ); }
+  return wire[0];
+}
+
+uint64_t run_regs_write_1( uint64_t iters ){
+  uint64_t acc = 0;
+  for( uint64_t i = 0; i < iters; i++ ){ acc += regs_write( store, 0, REGS_HOLDING, i & 0xFF, 1, wire ); }
+  return acc;
+}
+
+uint64_t run_regs_write_123( uint64_t iters ){
+  uint64_t acc = 0;
+  for( uint64_t i = 0; i < iters; i++ ){ acc += regs_write( store, 0, REGS_HOLDING, i & 0xFF, MODBUS_MAX_WRITE_REGISTERS, wire ); }
+  return acc;
+}
+
+uint64_t run_regs_read_125_be( uint64_t iters ){
+  for( uint64_t i = 0; i < iters; i++ ){ regs_read( store_be, 0, REGS_HOLDING, i & 0xFF, MODBUS_MAX_READ_REGISTERS, wire ); }
+  return wire[0];
+}
+
+uint64_t run_regs_write_123_be( uint64_t iters ){
+  uint64_t acc = 0;
+  for( uint64_t i = 0; i < iters; i++ ){ acc += regs_write( store_be, 0, REGS_HOLDING, i & 0xFF, MODBUS_MAX_WRITE_REGISTERS, wire ); }
+  return acc;
+}
+
+uint64_t run_coils_read_2000( uint64_t iters ){
+  for( uint64_t i = 0; i < iters; i++ ){ regs_read( store, 0, REGS_COILS, i & 0xFF, MODBUS_MAX_READ_BITS, wire ); }
+  return wire[0];
+}
+
+uint64_t run_coils_write_1968( uint64_t iters ){
+  uint64_t acc = 0;
+  for( uint64_t i = 0; i < iters; i++ ){ acc += regs_write( store, 0, REGS_COILS, i & 0xFF, MODBUS_MAX_WRITE_BITS, wire ); }
+  return acc;
+}
+
+// Bit by bit from and to one byte per bit, the path packed storage replaced
+uint64_t run_bits_pack_loop( uint64_t iters ){
+  for( uint64_t i = 0; i < iters; i++ ){
+    const uint8_t *bits = bytes + ( i & 0xFF );
+    memset( wire, 0, MODBUS_MAX_READ_BITS / 8 );
+    for( int b = 0; b < MODBUS_MAX_READ_BITS; b++ ){
+      if( bits[b] ){ wire[ b / 8 ] |= 1 << ( b % 8 ); }
+    }
+  }
+  return wire[0];
+}
+
+uint64_t run_bits_unpack_loop( uint64_t iters ){
+  for( uint64_t i = 0; i < iters; i++ ){
+    uint8_t *bits = bytes + ( i & 0xFF );
+    for( int b = 0; b < MODBUS_MAX_WRITE_BITS; b++ ){ bits[b] = ( wire[ b / 8 ] >> ( b % 8 ) ) & 1; }
+  }
+  return bytes[0];
+}
+
+uint64_t run_bits_to_wire( uint64_t iters ){
+  for( uint64_t i = 0; i < iters; i++ ){ regs_bits_to_wire( wire, packed, i & 0xFF, MODBUS_MAX_READ_BITS ); }
+  return wire[0];
+}
+
+uint64_t run_bits_from_wire( uint64_t iters ){
+  for( uint64_t i = 0; i < iters; i++ ){ regs_bits_from_wire( packed, i & 0xFF, wire, MODBUS_MAX_WRITE_BITS ); }
+  return packed[0];
+}
+
+// A sine block computed register by register with libm, the path the generators kernels replace
+uint64_t run_sim_sine_loop( uint64_t iters ){
+  const struct sim_gen_t *gen = &sim->gens[0];
+  const float mid = ( gen->min + gen->max ) / 2.0f, amp = ( gen->max - gen->min ) / 2.0f;
+
+  for( uint64_t i = 0; i < iters; i++ ){
+    float u0 = ( i & 0xFF ) / 256.0f;
+    for( int r = 0; r < SIM_BLOCK; r++ ){
+      float u = u0 + r * gen->spread / SIM_BLOCK;
+      block[r] = (uint16_t)( mid + amp * sinf( 2 * (float)M_PI * ( u - (int)u ) ) + 0.5f );
+    }
+  }
+  return block[0];
+}
+
+uint64_t run_sim_sine( uint64_t iters ){
+  for( uint64_t i = 0; i < iters; i++ ){ sim_update( &sim->gens[0], i * 1000000ULL ); }
+  return sim->gens[0].vals[0];
+}
+
+uint64_t run_sim_walk( uint64_t iters ){
+  for( uint64_t i = 0; i < iters; i++ ){ sim_update( &sim->gens[1], i ); }
+  return sim->gens[1].vals[0];
+}
+
+uint64_t run_regs_write_block( uint64_t iters ){
+  uint64_t acc = 0;
+  for( uint64_t i = 0; i < iters; i++ ){ acc += regs_write_block( store, 0, REGS_INPUT, 0, SIM_BLOCK, sim->gens[0].vals ); }
+  return acc;
+}
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ MAIN
+int main( int argc, char **argv ){
+  const char *json = argc > 1 ? argv[1] : NULL;
+  struct bench_json_t j;
+  const struct case_t cases[] = {
+    { "mbap_frame_len",          run_frame_len       },
+    { "mb_query/tcp",            run_query_tcp       },
+    { "mb_query/rtu",            run_query_rtu       },
+    { "crc16/256",               run_crc16           },
+    { "adu_reply/fc03_125",      run_reply_fc03      },
+    { "adu_reply/fc03_10_rtu",   run_reply_fc03_rtu  },
+    { "adu_reply/fc01_2000",     run_reply_fc01      },
+    { "adu_reply/fc05",          run_reply_fc05      },
+    { "adu_reply/fc15_1968",     run_reply_fc15      },
+    { "adu_reply/fc16_123",      run_reply_fc16      },
+    { "adu_reply/fc03_125_wire", run_reply_fc03_be   },
+    { "adu_reply/fc16_123_wire", run_reply_fc16_be   },
+    { "adu_exception",           run_exception       },
+    { "regs_read/1",             run_regs_read_1     },
+    { "regs_read/125",           run_regs_read_125   },
+    { "regs_read/coils_2000",    run_coils_read_2000 },
+    { "regs_write/1",            run_regs_write_1    },
+    { "regs_write/123",          run_regs_write_123  },
+    { "regs_read/125_wire",      run_regs_read_125_be  },
+    { "regs_write/123_wire",     run_regs_write_123_be },
+    { "regs_write/coils_1968",   run_coils_write_1968 },
+    { "bits_pack/2000_loop",     run_bits_pack_loop   },
+    { "bits_pack/2000",          run_bits_to_wire     },
+    { "bits_unpack/1968_loop",   run_bits_unpack_loop },
+    { "bits_unpack/1968",        run_bits_from_wire   },
+    { "sim/sine_10000_loop",     run_sim_sine_loop    },
+    { "sim/sine_10000",          run_sim_sine         },
+    { "sim/walk_10000",          run_sim_walk         },
+    { "regs_write_block/10000",  run_regs_write_block },
+  };
+
+  set_debug( DBG_NONE );
+
+  store    = regs_new( MB_BITS_MAX, MB_BITS_IN_MAX, MB_REGS_MAX, MB_REGS_IN_MAX, 0, 0, NULL );
+  store_be = regs_new( MB_BITS_MAX, MB_BITS_IN_MAX, MB_REGS_MAX, MB_REGS_IN_MAX, 0, 1, NULL );
+  mapping  = modbus_mapping_new( 0, 0, 0, 0 );
+  sim      = sim_parse( "sine:ir=0-9999:max=1000:spread=1;walk:ir=0-9999:min=100:max=900:step=5" );
+  if( !store || !store_be || !mapping || !sim ){
+    fprintf( stderr, "Failed allocating the register store\n" );
+    return 1;
+  }
+
+  // Every page touched before timing: the first write of a page allocates it
+  for( int i = 0; i < sizeof( wire ); i++ ){ wire[i] = i; }
+  for( int a = 0; a < 0x200; a += MODBUS_MAX_WRITE_REGISTERS ){
+    regs_write( store, 0, REGS_HOLDING, a, MODBUS_MAX_WRITE_REGISTERS, wire );
+    regs_write( store_be, 0, REGS_HOLDING, a, MODBUS_MAX_WRITE_REGISTERS, wire );
+  }
+  for( int a = 0; a < 0x1000; a += MODBUS_MAX_WRITE_BITS ){ regs_write( store, 0, REGS_COILS, a, MODBUS_MAX_WRITE_BITS, wire ); }
+  for( int g = 0; g < sim->n; g++ ){
+    sim->gens[g].vals = calloc( SIM_BLOCK, sizeof( uint16_t ) );
+    for( int l = 0; l < 4; l++ ){ sim->gens[g].rng[l] = l + 1; }
+  }
+  for( int r = 0; r < SIM_BLOCK; r++ ){ sim->gens[1].vals[r] = 500; }
+  regs_write_block( store, 0, REGS_INPUT, 0, SIM_BLOCK, sim->gens[1].vals );
+  for( int b = 0; b < sizeof( bytes ); b++ ){ bytes[b] = ( wire[ ( b / 8 ) % sizeof( wire ) ] >> ( b % 8 ) ) & 1; }
+  for( int b = 0; b < sizeof( packed ); b++ ){ packed[b] = wire[ b % sizeof( wire ) ]; }
+
+  uint8_t pdu[ 6 + 2 * MODBUS_MAX_WRITE_REGISTERS ] = { MODBUS_FC_READ_HOLDING_REGISTERS, 0x00, 0x10, 0x00, MODBUS_MAX_READ_REGISTERS };
+  query( q_fc03, MDB_PROTO_TCP, pdu, 5 );
+  pdu[4] = 10;
+  query( q_fc03_rtu, MDB_PROTO_RTU, pdu, 5 );
+  pdu[0] = MODBUS_FC_READ_COILS; pdu[3] = MODBUS_MAX_READ_BITS >> 8; pdu[4] = MODBUS_MAX_READ_BITS & 0xFF;
+  query( q_fc01, MDB_PROTO_TCP, pdu, 5 );
+  pdu[0] = MODBUS_FC_WRITE_SINGLE_COIL; pdu[3] = 0xFF; pdu[4] = 0x00;
+  query( q_fc05, MDB_PROTO_TCP, pdu, 5 );
+  pdu[0] = MODBUS_FC_WRITE_MULTIPLE_REGISTERS; pdu[3] = 0; pdu[4] = MODBUS_MAX_WRITE_REGISTERS; pdu[5] = 2 * MODBUS_MAX_WRITE_REGISTERS;
+  memcpy( pdu + 6, wire, 2 * MODBUS_MAX_WRITE_REGISTERS );
+  query( q_fc16, MDB_PROTO_TCP, pdu, sizeof( pdu ) );
+  pdu[0] = MODBUS_FC_WRITE_MULTIPLE_COILS; pdu[3] = MODBUS_MAX_WRITE_BITS >> 8; pdu[4] = MODBUS_MAX_WRITE_BITS & 0xFF;
+  pdu[5] = MODBUS_MAX_WRITE_BITS / 8;
+  query( q_fc15, MDB_PROTO_TCP, pdu, 6 + MODBUS_MAX_WRITE_BITS / 8 );
+
+  if( bench_json_open( &j, json, "adu" ) != 0 ){ return 1; }
+
+  printf( "Query decoding, reply encoding and register access: median of %d runs\n", BENCH_RUNS );
+  for( int c = 0; c < sizeof( cases ) / sizeof( cases[0] ); c++ ){
+    uint64_t iters;
+    double ns = bench_time( cases[c].fn, &iters );
+    printf( "  %-24s %10.1f ns/op %14.0f ops/s\n", cases[c].name, ns, 1e9 / ns );
+    bench_json_add( &j, "\"name\": \"%s\", \"ns_per_op\": %.2f, \"ops_per_sec\": %.0f, \"iters\": %lu",
+                    cases[c].name, ns, 1e9 / ns, iters );
+  }
+
+  bench_json_close( &j );
+  modbus_mapping_free( mapping );
+  regs_free( store );
+  regs_free( store_be );
+  sim_free( sim );
+  return 0;
+}
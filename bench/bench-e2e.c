@@ -0,0 +1,182 @@
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ INCLUDES
+#include "bench.h"
+
+#include "mbt-srv.h"
+#include "mbt-load.h"
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ DEFINITIONS
+#define DEF_SECONDS      2
+#define DEF_PORT         "15502"                  ///< Loopback port of the in-process server
+#define WARMUP_SECONDS   1
+#define SCALE_CONNS      64                       ///< Load of the worker sweep: enough connections to spread
+#define SCALE_DEPTH      8
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ TYPES
+struct point_t{
+  int         conns;
+  int         depth;
+  char       *mix;
+};
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ GLOBAL VARS
+const struct point_t points[] = {
+  { 1,  1,  "3"          },
+  { 1,  8,  "3"          },
+  { 1,  32, "3"          },
+  { 8,  1,  "3"          },
+  { 8,  8,  "3"          },
+  { 8,  32, "3"          },
+  { 64, 1,  "3"          },
+  { 64, 8,  "3"          },
+  { 8,  8,  "3:80,16:20" },
+};
+const int backends[] = { MBTCP_BACKEND_EPOLL, MBTCP_BACKEND_URING };
+const char *prefixes[] = { "tcp", "tcp-uring" };   ///< Result names by backend, epoll keeping the names of older runs
+
+static struct load_result_t res;
+static struct stats_hist_t lat;
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS
+/**
+ * @brief      Starts the server and waits for its listening sockets with a first short run
+ *
+ * @return     0 on success, -1 on failure
+ */
+int server_start( struct tcp_args_t *tcp_args, struct rtu_args_t *rtu_args, struct load_args_t *args ){
+  if( mbsrv_start( tcp_args, rtu_args ) != 0 ){
+    fprintf( stderr, "Failed starting the server\n" );
+    return -1;
+  }
+
+  args->conns   = 1;
+  args->depth   = 1;
+  args->mix     = "3";
+  args->seconds = WARMUP_SECONDS;
+  load_run( args, &res );
+  return 0;
+}
+
+/**
+ * @brief      Runs a load point, its latencies of every function code summed in lat
+ *
+ * @return     Replies per second, -1 on failure
+ */
+double measure( struct load_args_t *args ){
+  uint64_t replies = 0;
+
+  if( load_run( args, &res ) != 0 ){
+    fprintf( stderr, "Load run failed\n" );
+    return -1;
+  }
+
+  memset( &lat, 0, sizeof( lat ) );
+  for( int f = 0; f < STATS_FCS; f++ ){
+    replies += res.fc[f].replies;
+    stats_hist_add( &lat, &res.fc[f].lat );
+  }
+  return replies / res.elapsed;
+}
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ MAIN
+int main( int argc, char **argv ){
+  int seconds      = argc > 1 ? atoi( argv[1] ) : DEF_SECONDS;
+  const char *json = argc > 2 ? argv[2] : NULL;
+  int max_workers  = argc > 3 ? atoi( argv[3] ) : sysconf( _SC_NPROCESSORS_ONLN );
+  struct bench_json_t j;
+
+  struct rtu_args_t rtu_args = { .enabled = 0 };
+  struct tcp_args_t tcp_args = {
+    .enabled    = 1,
+    .common     = { .error_rate = 0.0, .init_value = 0 },
+    .addr       = "127.0.0.1",
+    .port       = DEF_PORT,
+    .max_conn   = DEF_MAX_CONN,
+    .workers    = DEF_WORKERS
+  };
+  struct load_args_t args = {
+    .proto        = MDB_PROTO_TCP,
+    .addr         = "127.0.0.1",
+    .port         = DEF_PORT,
+    .unit         = DEF_LOAD_UNIT,
+    .workers      = 1,
+    .count        = DEF_LOAD_COUNT,
+    .span         = 1000,
+    .timeout_msec = DEF_LOAD_TIMEOUT_MSEC
+  };
+
+  if( max_workers < 1 ){ max_workers = 1; }
+  set_debug( DBG_ERR );
+  if( bench_json_open( &j, json, "e2e" ) != 0 ){ return 1; }
+
+  printf( "Loopback server: %d workers, %d s per run, FC3/FC16 %d registers\n", DEF_WORKERS, seconds, DEF_LOAD_COUNT );
+  printf( "  backend  conns depth  mix            replies/s    p50 usec    p99 usec  p99.9 usec  errors\n" );
+  for( int b = 0; b < sizeof( backends ) / sizeof( backends[0] ); b++ ){
+    tcp_args.backend = backends[b];
+    tcp_args.workers = DEF_WORKERS;
+    args.workers     = 1;
+    if( server_start( &tcp_args, &rtu_args, &args ) != 0 ){ return 1; }
+
+    for( int p = 0; p < sizeof( points ) / sizeof( points[0] ); p++ ){
+      double rate;
+      uint64_t errors;
+
+      args.conns   = points[p].conns;
+      args.depth   = points[p].depth;
+      args.mix     = points[p].mix;
+      args.seconds = seconds;
+      if( ( rate = measure( &args ) ) < 0 ){ return 1; }
+      errors = res.errors + res.timeouts;
+
+      printf( "  %-7s %5d %5d  %-12s %11.0f %11.1f %11.1f %11.1f %7lu\n", mbtcp_backend_strings[ backends[b] ],
+              args.conns, args.depth, args.mix, rate, stats_percentile( &lat, 50.0 ) / 1e3,
+              stats_percentile( &lat, 99.0 ) / 1e3, stats_percentile( &lat, 99.9 ) / 1e3, errors );
+      bench_json_add( &j, "\"name\": \"%s/c%d/d%d/fc%s\", \"backend\": \"%s\", \"conns\": %d, \"depth\": %d, "
+                          "\"mix\": \"%s\", \"server_workers\": %d, \"replies_per_sec\": %.0f, \"p50_us\": %.1f, "
+                          "\"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f, \"errors\": %lu",
+                      prefixes[b], args.conns, args.depth, args.mix, mbtcp_backend_strings[ backends[b] ], args.conns,
+                      args.depth, args.mix, DEF_WORKERS, rate, stats_percentile( &lat, 50.0 ) / 1e3,
+                      stats_percentile( &lat, 99.0 ) / 1e3, stats_percentile( &lat, 99.9 ) / 1e3, lat.max / 1e3, errors );
+    }
+    mbsrv_stop();
+  }
+
+  // Worker sweep: 1, 2, 4... then max_workers. The client keeps max_workers threads, so only the server changes
+  printf( "\nWorker scaling: %d connections, depth %d, FC3, %d client threads\n", SCALE_CONNS, SCALE_DEPTH, max_workers );
+  printf( "  backend  workers    replies/s  speedup    p99 usec  errors\n" );
+  for( int b = 0; b < sizeof( backends ) / sizeof( backends[0] ); b++ ){
+    double base = 0;
+
+    for( int w = 1; w <= max_workers; w = ( w < max_workers && w * 2 > max_workers ) ? max_workers : w * 2 ){
+      double rate;
+      uint64_t errors;
+
+      tcp_args.backend = backends[b];
+      tcp_args.workers = w;
+      args.workers     = max_workers;
+      if( server_start( &tcp_args, &rtu_args, &args ) != 0 ){ return 1; }
+
+      args.conns   = SCALE_CONNS;
+      args.depth   = SCALE_DEPTH;
+      args.mix     = "3";
+      args.seconds = seconds;
+      rate = measure( &args );
+      mbsrv_stop();
+      if( rate < 0 ){ return 1; }
+      if( w == 1 ){ base = rate; }
+      errors = res.errors + res.timeouts;
+
+      printf( "  %-7s %8d %12.0f %7.2fx %11.1f %7lu\n", mbtcp_backend_strings[ backends[b] ], w, rate,
+              base > 0 ? rate / base : 0, stats_percentile( &lat, 99.0 ) / 1e3, errors );
+      bench_json_add( &j, "\"name\": \"%s/workers%d\", \"backend\": \"%s\", \"conns\": %d, \"depth\": %d, "
+                          "\"mix\": \"3\", \"server_workers\": %d, \"client_workers\": %d, \"replies_per_sec\": %.0f, "
+                          "\"speedup\": %.2f, \"p99_us\": %.1f, \"errors\": %lu",
+                      prefixes[b], w, mbtcp_backend_strings[ backends[b] ], SCALE_CONNS, SCALE_DEPTH, w, max_workers,
+                      rate, base > 0 ? rate / base : 0, stats_percentile( &lat, 99.0 ) / 1e3, errors );
+      if( w == max_workers ){ break; }
+    }
+  }
+
+  bench_json_close( &j );
+  msg_flush();
+  return 0;
+}
@@ -0,0 +1,199 @@
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ INCLUDES
+#include "bench.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include "mbt-srv.h"
+#include "mbt-adu.h"
+#include "mbt-gw.h"
+#include "mbt-load.h"
+#include "mbt-tty.h"
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ DEFINITIONS
+#define DEF_SECONDS      2
+#define DEF_PORT         "15503"                  ///< Loopback port of the in-process gateway
+#define BUS_SPEED        115200
+#define QUERY_LEN        8                        ///< FC3 query length
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ TYPES
+/**
+ * RTU slave on the master side of a pseudo terminal, the gateway opening its slave side. A pty moves bytes at once:
+ * every reply is held for the time the query and the reply would take on a real line, turnaround included.
+ */
+struct slave_t{
+  int                 fd;                         ///< Pty master
+  char                pts[ TTY_PTS_LEN ];         ///< Pty slave path, given to the gateway
+  struct tty_times_t  times;
+  pthread_t           thread;
+  volatile int        stop;
+  uint64_t            queries;                    ///< Queries answered
+};
+
+struct point_t{
+  int         conns;
+  int         span;                               ///< Masters read 10 registers anywhere in the first span
+};
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ GLOBAL VARS
+const struct point_t points[] = {
+  { 1,  10 },
+  { 8,  10 },
+  { 32, 10 },
+  { 8,  60 },
+  { 32, 60 },
+};
+const int ttls[] = { 0, DEF_GW_TTL_MSEC };
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS
+void *slave_run( struct slave_t *s ){
+  uint8_t q[ MODBUS_RTU_MAX_ADU_LENGTH ], r[ MODBUS_RTU_MAX_ADU_LENGTH ];
+  struct pollfd pfd = { .fd = s->fd, .events = POLLIN };
+  int qlen = 0;
+
+  while( !s->stop ){
+    if( poll( &pfd, 1, 100 ) <= 0 ){ continue; }
+    ssize_t n = read( s->fd, q + qlen, sizeof( q ) - qlen );
+    if( n <= 0 ){
+      // Hung up while the gateway restarts
+      usleep( 10000 );
+      continue;
+    }
+    qlen += n;
+
+    while( qlen >= QUERY_LEN ){
+      if( q[1] != MODBUS_FC_READ_HOLDING_REGISTERS || crc16( q, QUERY_LEN - 2 ) != ( q[6] | ( q[7] << 8 ) ) ){
+        qlen = 0;
+        break;
+      }
+
+      // Register i reads i
+      int addr = ( q[2] << 8 ) | q[3], count = ( q[4] << 8 ) | q[5], rlen = 5 + 2 * count;
+      r[0] = q[0];
+      r[1] = q[1];
+      r[2] = 2 * count;
+      for( int i = 0; i < count; i++ ){
+        r[ 3 + 2 * i ] = ( addr + i ) >> 8;
+        r[ 4 + 2 * i ] = ( addr + i ) & 0xFF;
+      }
+      uint16_t crc = crc16( r, rlen - 2 );
+      r[ rlen - 2 ] = crc & 0xFF;
+      r[ rlen - 1 ] = crc >> 8;
+
+      uint64_t line = ( QUERY_LEN + rlen ) * s->times.tchar + s->times.t35;
+      struct timespec ts = { line / 1000000000ULL, line % 1000000000ULL };
+      nanosleep( &ts, NULL );
+      if( write( s->fd, r, rlen ) == rlen ){ s->queries++; }
+
+      qlen -= QUERY_LEN;
+      memmove( q, q + QUERY_LEN, qlen );
+    }
+  }
+  return NULL;
+}
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ MAIN
+int main( int argc, char **argv ){
+  int seconds      = argc > 1 ? atoi( argv[1] ) : DEF_SECONDS;
+  const char *json = argc > 2 ? argv[2] : NULL;
+  static struct load_result_t res;
+  static struct stats_hist_t lat;
+  static struct gw_counters_t before, after;
+  static struct slave_t slave;
+  struct bench_json_t j;
+  char routes[ 128 ];
+
+  slave.fd = posix_openpt( O_RDWR | O_NOCTTY );
+  if( slave.fd == -1 || grantpt( slave.fd ) != 0 || unlockpt( slave.fd ) != 0 ||
+      ptsname_r( slave.fd, slave.pts, sizeof( slave.pts ) ) != 0 ){
+    fprintf( stderr, "Failed creating a pseudo terminal\n" );
+    return 1;
+  }
+  tty_times( BUS_SPEED, &slave.times );
+  snprintf( routes, sizeof( routes ), "1=%s@%d", slave.pts, BUS_SPEED );
+  pthread_create( &slave.thread, NULL, (void *)&slave_run, &slave );
+
+  struct rtu_args_t rtu_args = { .enabled = 0 };
+  struct tcp_args_t tcp_args = {
+    .enabled         = 1,
+    .addr            = "127.0.0.1",
+    .port            = DEF_PORT,
+    .max_conn        = DEF_MAX_CONN,
+    .workers         = 1,
+    .gateway         = routes,
+    .gw_speed        = BUS_SPEED,
+    .gw_timeout_msec = DEF_GW_TIMEOUT_MSEC
+  };
+  struct load_args_t args = {
+    .proto        = MDB_PROTO_TCP,
+    .addr         = "127.0.0.1",
+    .port         = DEF_PORT,
+    .unit         = 1,
+    .workers      = 1,
+    .depth        = 1,
+    .mix          = "3",
+    .count        = DEF_LOAD_COUNT,
+    .timeout_msec = DEF_LOAD_TIMEOUT_MSEC
+  };
+
+  set_debug( DBG_ERR );
+  if( bench_json_open( &j, json, "gw" ) != 0 ){ return 1; }
+
+  printf( "Gateway to one RTU bus at %d baud, slave emulating the line time: FC3 %d registers, %d s per run\n",
+          BUS_SPEED, DEF_LOAD_COUNT, seconds );
+  printf( "  cache  conns  span    replies/s     bus tx/s  queries/tx    p50 usec    p99 usec  errors\n" );
+  for( size_t t = 0; t < sizeof( ttls ) / sizeof( ttls[0] ); t++ ){
+    tcp_args.gw_ttl_msec = ttls[t];
+    if( mbsrv_start( &tcp_args, &rtu_args ) != 0 ){
+      fprintf( stderr, "Failed starting the gateway\n" );
+      return 1;
+    }
+
+    // The first run also waits for the listening socket and the bus
+    args.conns   = 1;
+    args.span    = DEF_LOAD_COUNT;
+    args.seconds = 1;
+    load_run( &args, &res );
+
+    for( size_t p = 0; p < sizeof( points ) / sizeof( points[0] ); p++ ){
+      uint64_t replies = 0, errors;
+
+      args.conns   = points[p].conns;
+      args.span    = points[p].span;
+      args.seconds = seconds;
+      gw_counters( &before );
+      if( load_run( &args, &res ) != 0 ){
+        fprintf( stderr, "Load run failed\n" );
+        return 1;
+      }
+      gw_counters( &after );
+
+      memset( &lat, 0, sizeof( lat ) );
+      for( int f = 0; f < STATS_FCS; f++ ){
+        replies += res.fc[f].replies;
+        stats_hist_add( &lat, &res.fc[f].lat );
+      }
+      errors = res.errors + res.timeouts;
+
+      double txs = ( after.transactions - before.transactions ) / res.elapsed;
+      double rps = replies / res.elapsed;
+      printf( "  %5d %6d %5d %12.0f %12.1f %11.1f %11.1f %11.1f %7lu\n", ttls[t], args.conns, args.span, rps, txs,
+              txs > 0.0 ? rps / txs : 0.0, stats_percentile( &lat, 50.0 ) / 1e3, stats_percentile( &lat, 99.0 ) / 1e3, errors );
+      bench_json_add( &j, "\"name\": \"gw/ttl%d/c%d/s%d\", \"ttl_ms\": %d, \"conns\": %d, \"span\": %d, "
+                          "\"replies_per_sec\": %.0f, \"bus_tx_per_sec\": %.1f, \"cached\": %lu, \"coalesced\": %lu, "
+                          "\"p50_us\": %.1f, \"p99_us\": %.1f, \"errors\": %lu",
+                      ttls[t], args.conns, args.span, ttls[t], args.conns, args.span, rps, txs,
+                      after.cached - before.cached, after.coalesced - before.coalesced,
+                      stats_percentile( &lat, 50.0 ) / 1e3, stats_percentile( &lat, 99.0 ) / 1e3, errors );
+    }
+    mbsrv_stop();
+  }
+
+  bench_json_close( &j );
+  slave.stop = 1;
+  pthread_join( slave.thread, NULL );
+  close( slave.fd );
+  msg_flush();
+  return 0;
+}
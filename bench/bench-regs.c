@@ -0,0 +1,130 @@
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ INCLUDES
+#include <pthread.h>
+
+#include "bench.h"
+
+#include "mbt-regs.h"
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ DEFINITIONS
+#define SLOT_REGS      125                        ///< Registers per read/write, max FC3 length
+#define SLOTS           16                        ///< Slots shared by all threads, most cross a lock block
+#define DEF_SECONDS      2
+#define DEF_READERS      4
+#define DEF_WRITERS      2
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ TYPES
+struct worker_t{
+  pthread_t thread;
+  int       writer;
+  uint32_t  seed;
+  uint64_t  ops;
+  uint64_t  torn;                                 ///< Reads that mixed two writes
+};
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ GLOBAL VARS
+struct regs_store_t *store = NULL;
+pthread_mutex_t      big_lock = PTHREAD_MUTEX_INITIALIZER;
+uint16_t             big_regs[ SLOTS * SLOT_REGS ];
+int                  use_mutex = 0;
+volatile int         stop = 0;
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS
+void *worker_run( void *arg ){
+  struct worker_t *w = arg;
+  uint8_t wire[ SLOT_REGS * 2 ];
+  uint16_t val = 0;
+
+  while( !stop ){
+    int slot = rand_r( &w->seed ) % SLOTS;
+
+    if( w->writer ){
+      // Every register of a slot gets the same value: a reader must never see two of them
+      val++;
+      for( int i = 0; i < SLOT_REGS; i++ ){ wire[ i * 2 ] = val >> 8; wire[ i * 2 + 1 ] = val & 0xFF; }
+
+      if( use_mutex ){
+        pthread_mutex_lock( &big_lock );
+        regs_from_wire( big_regs + slot * SLOT_REGS, wire, SLOT_REGS );
+        pthread_mutex_unlock( &big_lock );
+      }
+      else{ regs_write( store, 0, REGS_HOLDING, slot * SLOT_REGS, SLOT_REGS, wire ); }
+    }
+    else{
+      if( use_mutex ){
+        pthread_mutex_lock( &big_lock );
+        regs_to_wire( wire, big_regs + slot * SLOT_REGS, SLOT_REGS );
+        pthread_mutex_unlock( &big_lock );
+      }
+      else{ regs_read( store, 0, REGS_HOLDING, slot * SLOT_REGS, SLOT_REGS, wire ); }
+
+      if( memcmp( wire, wire + 2, sizeof( wire ) - 2 ) != 0 ){ w->torn++; }
+    }
+    w->ops++;
+  }
+
+  return NULL;
+}
+
+double run( int seconds, int readers, int writers, uint64_t *rd_ops, uint64_t *wr_ops, uint64_t *torn ){
+  struct worker_t workers[ readers + writers ];
+  struct timespec t0, t1;
+
+  stop = 0;
+  memset( workers, 0, sizeof( workers ) );
+  clock_gettime( CLOCK_MONOTONIC, &t0 );
+  for( int i = 0; i < readers + writers; i++ ){
+    workers[i].writer = i >= readers;
+    workers[i].seed   = i + 1;
+    pthread_create( &workers[i].thread, NULL, worker_run, &workers[i] );
+  }
+
+  sleep( seconds );
+  stop = 1;
+
+  *rd_ops = *wr_ops = *torn = 0;
+  for( int i = 0; i < readers + writers; i++ ){
+    pthread_join( workers[i].thread, NULL );
+    if( workers[i].writer ){ *wr_ops += workers[i].ops; }
+    else{ *rd_ops += workers[i].ops; }
+    *torn += workers[i].torn;
+  }
+  clock_gettime( CLOCK_MONOTONIC, &t1 );
+
+  return ( t1.tv_sec - t0.tv_sec ) + ( t1.tv_nsec - t0.tv_nsec ) / 1e9;
+}
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ MAIN
+int main( int argc, char **argv ){
+  int seconds = argc > 1 ? atoi( argv[1] ) : DEF_SECONDS;
+  int readers = argc > 2 ? atoi( argv[2] ) : DEF_READERS;
+  int writers = argc > 3 ? atoi( argv[3] ) : DEF_WRITERS;
+  const char *json = argc > 4 ? argv[4] : NULL;
+  uint64_t rd_ops, wr_ops, torn;
+  struct bench_json_t j;
+
+  store = regs_new( 0, 0, SLOTS * SLOT_REGS, 0, 0, 0, NULL );
+  if( !store ){
+    fprintf( stderr, "Failed allocating the register store\n" );
+    return 1;
+  }
+  if( bench_json_open( &j, json, "regs" ) != 0 ){ return 1; }
+
+  printf( "Register store contention: %d readers, %d writers, %d regs per op, %ds per run\n", readers, writers, SLOT_REGS, seconds );
+  for( use_mutex = 0; use_mutex <= 1; use_mutex++ ){
+    double elapsed = run( seconds, readers, writers, &rd_ops, &wr_ops, &torn );
+    printf( "  %-12s reads %10.0f/s  writes %10.0f/s  torn reads %lu\n",
+            use_mutex ? "global mutex" : "seqlock",
+            rd_ops / elapsed, wr_ops / elapsed, torn );
+    bench_json_add( &j, "\"name\": \"%s\", \"readers\": %d, \"writers\": %d, \"regs_per_op\": %d, "
+                        "\"reads_per_sec\": %.0f, \"writes_per_sec\": %.0f, \"torn\": %lu",
+                    use_mutex ? "mutex" : "seqlock", readers, writers, SLOT_REGS, rd_ops / elapsed, wr_ops / elapsed, torn );
+    if( !use_mutex && torn ){
+      bench_json_close( &j );
+      return 1;
+    }
+  }
+
+  bench_json_close( &j );
+  regs_free( store );
+  return 0;
+}
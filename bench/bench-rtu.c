@@ -0,0 +1,173 @@
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ INCLUDES
+#include "bench.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/prctl.h>
+
+#include "mbt-srv.h"
+#include "mbt-adu.h"
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ DEFINITIONS
+#define DEF_SECONDS      2
+#define QUERY_REGS       10                       ///< Registers read by every query
+#define QUERY_LEN        8                        ///< FC3 query length
+#define REPLY_LEN        ( 5 + 2 * QUERY_REGS )   ///< FC3 reply length
+#define TIMEOUT_NS       100000000ULL             ///< A reply missing for this long is an error
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ TYPES
+/**
+ * Master side of a pseudo terminal, the server serving the slave side. A pty moves bytes at once: what is
+ * measured is the server turnaround, the line time is added back from the baud rate.
+ */
+struct line_t{
+  int                 speed;
+  int                 fd;                         ///< Pty master
+  char                pts[ 64 ];                  ///< Pty slave path, given to the server
+  uint64_t            t35;                        ///< 3.5 characters silence, ns
+  uint64_t            next;                       ///< Time of the next query
+  uint64_t            sent;                       ///< Time the query in flight was written, 0 if none
+  int                 rlen;                       ///< Reply bytes received
+  uint8_t             rsp[ MODBUS_RTU_MAX_ADU_LENGTH ];
+  uint64_t            replies;
+  uint64_t            errors;
+  struct stats_hist_t lat;                        ///< Query written to reply complete
+};
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ GLOBAL VARS
+const int speeds[] = { 9600, 19200, 115200, 115200, 115200, 115200 };
+#define NLINES ( (int)( sizeof( speeds ) / sizeof( speeds[0] ) ) )
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS
+int line_open( struct line_t *l, int speed ){
+  memset( l, 0, sizeof( struct line_t ) );
+  l->speed = speed;
+  l->t35   = ( speed > 19200 ) ? 1750000ULL : 38500000000ULL / speed;
+  l->fd    = posix_openpt( O_RDWR | O_NOCTTY | O_NONBLOCK );
+  if( l->fd == -1 || grantpt( l->fd ) != 0 || unlockpt( l->fd ) != 0 || ptsname_r( l->fd, l->pts, sizeof( l->pts ) ) != 0 ){
+    fprintf( stderr, "Failed creating a pseudo terminal\n" );
+    return -1;
+  }
+  return 0;
+}
+
+void line_query( struct line_t *l, uint64_t now ){
+  uint8_t q[ QUERY_LEN ] = { 1, MODBUS_FC_READ_HOLDING_REGISTERS, 0x00, 0x00, 0x00, QUERY_REGS };
+  uint16_t crc = crc16( q, QUERY_LEN - 2 );
+
+  q[6] = crc & 0xFF;
+  q[7] = crc >> 8;
+  if( write( l->fd, q, QUERY_LEN ) != QUERY_LEN ){ l->errors++; }
+  l->sent = now;
+  l->rlen = 0;
+}
+
+void line_read( struct line_t *l, uint64_t now ){
+  ssize_t n;
+
+  while( ( n = read( l->fd, l->rsp + l->rlen, sizeof( l->rsp ) - l->rlen ) ) > 0 ){ l->rlen += n; }
+  if( !l->sent || l->rlen < REPLY_LEN ){ return; }
+
+  if( l->rlen != REPLY_LEN || crc16( l->rsp, REPLY_LEN - 2 ) != ( l->rsp[ REPLY_LEN - 2 ] | ( l->rsp[ REPLY_LEN - 1 ] << 8 ) ) ){ l->errors++; }
+  else{
+    l->replies++;
+    stats_record( &l->lat, now - l->sent );
+  }
+
+  // As a master on a real line: silent for 3.5 characters before the next query
+  l->sent = 0;
+  l->next = now + l->t35;
+}
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ MAIN
+int main( int argc, char **argv ){
+  int seconds      = argc > 1 ? atoi( argv[1] ) : DEF_SECONDS;
+  const char *json = argc > 2 ? argv[2] : NULL;
+  static struct line_t lines[ NLINES ];
+  struct pollfd pfds[ NLINES ];
+  struct bench_json_t j;
+  char devs[ NLINES * 80 ] = "";
+
+  for( int i = 0; i < NLINES; i++ ){
+    if( line_open( &lines[i], speeds[i] ) != 0 ){ return 1; }
+    snprintf( devs + strlen( devs ), sizeof( devs ) - strlen( devs ), "%s%s@%d", i ? "," : "", lines[i].pts, speeds[i] );
+  }
+
+  struct tcp_args_t tcp_args = { .enabled = 0 };
+  struct rtu_args_t rtu_args = {
+    .enabled    = 1,
+    .common     = { .error_rate = 0.0, .init_value = 0 },
+    .dev        = devs,
+    .addr       = DEF_RTU_ADDR,
+    .speed      = DEF_RTU_SPEED
+  };
+
+  set_debug( DBG_ERR );
+  if( mbsrv_start( &tcp_args, &rtu_args ) != 0 ){
+    fprintf( stderr, "Failed starting the server\n" );
+    return 1;
+  }
+  if( bench_json_open( &j, json, "rtu" ) != 0 ){ return 1; }
+
+  // Queries timed to the usec, as the server replies
+  prctl( PR_SET_TIMERSLACK, 1UL );
+  sleep( 1 );
+
+  uint64_t start = bench_now(), end = start + seconds * 1000000000ULL, now;
+  for( int i = 0; i < NLINES; i++ ){ lines[i].next = start; }
+
+  while( ( now = bench_now() ) < end ){
+    uint64_t wait = end - now;
+
+    for( int i = 0; i < NLINES; i++ ){
+      struct line_t *l = &lines[i];
+      if( l->sent && now - l->sent > TIMEOUT_NS ){
+        l->errors++;
+        l->sent = 0;
+        l->next = now;
+      }
+      if( !l->sent && now >= l->next ){ line_query( l, now ); }
+
+      uint64_t due = l->sent ? l->sent + TIMEOUT_NS : l->next;
+      uint64_t left = due > now ? due - now : 0;
+      if( left < wait ){ wait = left; }
+      pfds[i].fd     = l->fd;
+      pfds[i].events = POLLIN;
+    }
+
+    struct timespec to = { wait / 1000000000ULL, wait % 1000000000ULL };
+    if( ppoll( pfds, NLINES, &to, NULL ) <= 0 ){ continue; }
+
+    now = bench_now();
+    for( int i = 0; i < NLINES; i++ ){
+      if( pfds[i].revents & POLLIN ){ line_read( &lines[i], now ); }
+    }
+  }
+
+  printf( "RTU lines served by one loop: FC3 %d registers, %d s, pseudo terminals with the line time added back\n",
+          QUERY_REGS, seconds );
+  printf( "  line   baud   turnaround    extra p50    extra p99   line tx/s     max tx/s  efficiency  errors\n" );
+  for( int i = 0; i < NLINES; i++ ){
+    struct line_t *l = &lines[i];
+
+    // The best a line can do: both frames on the wire, both 3.5 characters silences
+    double wire    = ( QUERY_LEN + REPLY_LEN ) * 11e9 / l->speed;
+    double best    = 1e9 / ( wire + 2 * l->t35 );
+    double p50     = stats_percentile( &l->lat, 50.0 ) - l->t35, p99 = stats_percentile( &l->lat, 99.0 ) - l->t35;
+    double mean    = l->lat.count ? (double)l->lat.sum / l->lat.count : 0.0;
+    double reached = l->lat.count ? 1e9 / ( wire + mean + l->t35 ) : 0.0;
+
+    printf( "  %4d %6d %9.1f us %9.1f us %9.1f us %11.1f %12.1f %10.1f%% %7lu\n", i, l->speed, l->t35 / 1e3,
+            p50 / 1e3, p99 / 1e3, reached, best, 100.0 * reached / best, l->errors );
+    bench_json_add( &j, "\"name\": \"rtu/line%d/%d\", \"baud\": %d, \"replies\": %lu, \"turnaround_us\": %.1f, "
+                        "\"extra_p50_us\": %.1f, \"extra_p99_us\": %.1f, \"line_tx_per_sec\": %.1f, "
+                        "\"max_tx_per_sec\": %.1f, \"efficiency\": %.4f, \"errors\": %lu",
+                    i, l->speed, l->speed, l->replies, l->t35 / 1e3, p50 / 1e3, p99 / 1e3, reached, best,
+                    reached / best, l->errors );
+  }
+
+  bench_json_close( &j );
+  mbsrv_stop();
+  msg_flush();
+  return 0;
+}
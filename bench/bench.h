@@ -0,0 +1,138 @@
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/utsname.h>
+
+#include <modbus/modbus.h>
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ DEFINITIONS
+#ifndef BENCH_REV
+#define BENCH_REV               "unknown"          ///< Source revision, set by the makefile
+#endif
+#define BENCH_RUNS              5                  ///< Timed runs of a microbenchmark, the median is reported
+#define BENCH_RUN_NS            100000000ULL       ///< Shortest timed run, iterations are calibrated to last at least this
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ TYPES
+/**
+ * Results file: one JSON object with the run environment and a results array, so two runs can be diffed
+ * entry by entry. Disabled when opened without a path.
+ */
+struct bench_json_t{
+  FILE *f;                                         ///< Output file, NULL if disabled
+  int   n;                                         ///< Results written so far
+};
+
+/**
+ * A microbenchmark: runs iters operations and returns a value depending on all of them, so that the compiler
+ * can not drop the work
+ */
+typedef uint64_t (*bench_fn_t)( uint64_t iters );
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS
+static inline uint64_t bench_now(){
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline int bench_cmp( const void *a, const void *b ){
+  double da = *(const double *)a, db = *(const double *)b;
+  return ( da > db ) - ( da < db );
+}
+
+static volatile uint64_t bench_sink;               ///< Results of the microbenchmarks, never read
+
+/**
+ * @brief      Times a microbenchmark: iterations doubled up to BENCH_RUN_NS, then the median of BENCH_RUNS runs
+ *
+ * @param[in]  fn     The microbenchmark
+ * @param[out] iters  The iterations of every timed run
+ *
+ * @return     ns per operation
+ */
+static inline double bench_time( bench_fn_t fn, uint64_t *iters ){
+  double ns[ BENCH_RUNS ];
+  uint64_t n = 1, t0;
+
+  while( 1 ){
+    t0 = bench_now();
+    bench_sink += fn( n );
+    if( bench_now() - t0 >= BENCH_RUN_NS ){ break; }
+    n *= 2;
+  }
+
+  for( int r = 0; r < BENCH_RUNS; r++ ){
+    t0 = bench_now();
+    bench_sink += fn( n );
+    ns[r] = (double)( bench_now() - t0 ) / n;
+  }
+  qsort( ns, BENCH_RUNS, sizeof( double ), bench_cmp );
+
+  *iters = n;
+  return ns[ BENCH_RUNS / 2 ];
+}
+
+/**
+ * @brief      Opens a results file and writes the run environment
+ *
+ * @param      j      The results file
+ * @param[in]  path   The file path, NULL to disable
+ * @param[in]  suite  The benchmark name
+ *
+ * @return     0 on success, -1 on failure
+ */
+static inline int bench_json_open( struct bench_json_t *j, const char *path, const char *suite ){
+  struct utsname un;
+  char date[32];
+  time_t now = time( NULL );
+
+  j->n = 0;
+  j->f = NULL;
+  if( !path ){ return 0; }
+
+  j->f = fopen( path, "w" );
+  if( !j->f ){
+    fprintf( stderr, "Can not write %s\n", path );
+    return -1;
+  }
+
+  uname( &un );
+  strftime( date, sizeof( date ), "%Y-%m-%dT%H:%M:%SZ", gmtime( &now ) );
+  fprintf( j->f, "{\n  \"suite\": \"%s\",\n  \"rev\": \"%s\",\n  \"libmodbus\": \"%s\",\n  \"date\": \"%s\",\n"
+                 "  \"machine\": \"%s\",\n  \"kernel\": \"%s\",\n  \"cpus\": %ld,\n  \"results\": [",
+           suite, BENCH_REV, LIBMODBUS_VERSION_STRING, date, un.machine, un.release, sysconf( _SC_NPROCESSORS_ONLN ) );
+  return 0;
+}
+
+/**
+ * @brief      Writes a result: the members of a JSON object, eg. "\"name\": \"%s\", \"ns_per_op\": %.2f"
+ */
+static inline void bench_json_add( struct bench_json_t *j, const char *fmt, ... ) __attribute__(( format( printf, 2, 3 ) ));
+static inline void bench_json_add( struct bench_json_t *j, const char *fmt, ... ){
+  va_list ap;
+
+  if( !j->f ){ return; }
+
+  fprintf( j->f, "%s\n    { ", j->n++ ? "," : "" );
+  va_start( ap, fmt );
+  vfprintf( j->f, fmt, ap );
+  va_end( ap );
+  fprintf( j->f, " }" );
+}
+
+static inline void bench_json_close( struct bench_json_t *j ){
+  if( !j->f ){ return; }
+
+  fprintf( j->f, "\n  ]\n}\n" );
+  fclose( j->f );
+  j->f = NULL;
+}
+
+#endif // _BENCH_H_
@@ -0,0 +1,288 @@
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ INCLUDES
+#include "mbt-adu.h"
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ DEFINITIONS
+#define GET_U16( p )     ( (((uint16_t)(p)[0]) << 8) + (uint16_t)(p)[1] )
+#define SET_U16( p, v )  do{ (p)[0] = (uint8_t)((v) >> 8); (p)[1] = (uint8_t)((v) & 0xFF); }while( 0 )
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ GLOBAL VARS
+const char *mdb_proto_strings[] = {
+  "TCP",
+  "RTU"
+};
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS
+int mbap_frame_len( const uint8_t *buf, size_t len ){
+  if( len < MBAP_HEADER_LEN ){ return 0; }
+
+  // Protocol identifier is always 0 for modbus, anything else means the stream is out of sync
+  if( buf[2] != 0 || buf[3] != 0 ){ return -1; }
+
+  // Length field counts unit identifier and PDU
+  uint16_t mlen = GET_U16( buf + 4 );
+  if( mlen < 2 || mlen > MODBUS_TCP_MAX_ADU_LENGTH - 6 ){ return -1; }
+
+  return ( len < (size_t)mlen + 6 ) ? 0 : mlen + 6;
+}
+
+int rtu_query_len( const uint8_t *buf, size_t len ){
+  if( len < RTU_HEADER_LEN + 1 ){ return 0; }
+
+  // Address, PDU and CRC: byte counts are checked against what is already there
+  switch( buf[ RTU_HEADER_LEN ] ){
+    case MODBUS_FC_READ_EXCEPTION_STATUS:
+    case MODBUS_FC_REPORT_SLAVE_ID:
+    case 0x0B:                                // Get comm event counter
+    case 0x0C:                                // Get comm event log
+      return 4;
+    case 0x18:                                // Read FIFO queue
+      return 6;
+    case MODBUS_FC_READ_COILS:
+    case MODBUS_FC_READ_DISCRETE_INPUTS:
+    case MODBUS_FC_READ_HOLDING_REGISTERS:
+    case MODBUS_FC_READ_INPUT_REGISTERS:
+    case MODBUS_FC_WRITE_SINGLE_COIL:
+    case MODBUS_FC_WRITE_SINGLE_REGISTER:
+    case 0x08:                                // Diagnostics, with a single data word
+      return 8;
+    case MODBUS_FC_MASK_WRITE_REGISTER:
+      return 10;
+    case 0x14:                                // Read and write file record
+    case 0x15:
+      return len < 3 ? 0 : 5 + buf[2];
+    case MODBUS_FC_WRITE_MULTIPLE_COILS:
+    case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+      return len < 7 ? 0 : 9 + buf[6];
+    case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+      return len < 11 ? 0 : 13 + buf[10];
+    default:
+      return -1;
+  }
+}
+
+int rtu_reply_len( const uint8_t *buf, size_t len ){
+  int flen;
+
+  if( len < RTU_HEADER_LEN + 2 ){ return 0; }
+
+  // Exceptions and byte counted replies are told by their first bytes
+  if( buf[ RTU_HEADER_LEN ] & 0x80 ){ flen = 5; }
+  else{
+    switch( buf[ RTU_HEADER_LEN ] ){
+      case MODBUS_FC_READ_EXCEPTION_STATUS:
+        flen = 5;
+        break;
+      case MODBUS_FC_READ_COILS:
+      case MODBUS_FC_READ_DISCRETE_INPUTS:
+      case MODBUS_FC_READ_HOLDING_REGISTERS:
+      case MODBUS_FC_READ_INPUT_REGISTERS:
+      case MODBUS_FC_REPORT_SLAVE_ID:
+      case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+      case 0x0C:                              // Get comm event log
+      case 0x14:                              // Read and write file record
+      case 0x15:
+        flen = 5 + buf[2];
+        break;
+      case MODBUS_FC_WRITE_SINGLE_COIL:
+      case MODBUS_FC_WRITE_SINGLE_REGISTER:
+      case MODBUS_FC_WRITE_MULTIPLE_COILS:
+      case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+      case 0x08:                              // Diagnostics, with a single data word
+      case 0x0B:                              // Get comm event counter
+        flen = 8;
+        break;
+      case MODBUS_FC_MASK_WRITE_REGISTER:
+        flen = 10;
+        break;
+      default:
+        return -1;
+    }
+  }
+
+  return len >= (size_t)flen ? flen : 0;
+}
+
+uint16_t crc16( const uint8_t *buf, int len ){
+  uint16_t crc = 0xFFFF;
+
+  for( int i = 0; i < len; i++ ){
+    crc ^= buf[i];
+    for( int b = 0; b < 8; b++ ){ crc = ( crc & 1 ) ? ( crc >> 1 ) ^ 0xA001 : crc >> 1; }
+  }
+
+  return crc;
+}
+
+/**
+ * @brief      Completes a reply whose PDU has been written after the header: returns the ADU length
+ */
+int adu_finalize( const uint8_t *query, enum mdb_proto_type mproto, uint8_t *rsp, int pdu_len ){
+  switch( mproto ){
+    case MDB_PROTO_TCP:
+      rsp[0] = query[0];                      // Transaction identifier
+      rsp[1] = query[1];
+      rsp[2] = 0;                             // Protocol identifier
+      rsp[3] = 0;
+      SET_U16( rsp + 4, pdu_len + 1 );        // Length, unit identifier included
+      rsp[6] = query[6];                      // Unit identifier
+      return MBAP_HEADER_LEN + pdu_len;
+
+    case MDB_PROTO_RTU:
+    default:{
+      rsp[0] = query[0];                      // Slave address
+      uint16_t crc = crc16( rsp, RTU_HEADER_LEN + pdu_len );
+      rsp[ RTU_HEADER_LEN + pdu_len     ] = crc & 0xFF;
+      rsp[ RTU_HEADER_LEN + pdu_len + 1 ] = crc >> 8;
+      return RTU_HEADER_LEN + pdu_len + 2;
+    }
+  }
+}
+
+int adu_exception( const uint8_t *query, enum mdb_proto_type mproto, int exception, uint8_t *rsp ){
+  int hlen = ( mproto == MDB_PROTO_TCP ) ? MBAP_HEADER_LEN : RTU_HEADER_LEN;
+
+  rsp[ hlen     ] = query[ hlen ] | 0x80;
+  rsp[ hlen + 1 ] = exception;
+
+  return adu_finalize( query, mproto, rsp, 2 );
+}
+
+int adu_native( uint8_t fc ){
+  switch( fc ){
+    case MODBUS_FC_READ_COILS:
+    case MODBUS_FC_READ_DISCRETE_INPUTS:
+    case MODBUS_FC_READ_HOLDING_REGISTERS:
+    case MODBUS_FC_READ_INPUT_REGISTERS:
+    case MODBUS_FC_WRITE_SINGLE_COIL:
+    case MODBUS_FC_WRITE_SINGLE_REGISTER:
+    case MODBUS_FC_WRITE_MULTIPLE_COILS:
+    case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+    case MODBUS_FC_MASK_WRITE_REGISTER:
+    case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+int adu_reply( const uint8_t *query, int qlen, enum mdb_proto_type mproto, struct regs_store_t *store, int unit, const int32_t *nb,
+               uint8_t *rsp ){
+  int hlen = ( mproto == MDB_PROTO_TCP ) ? MBAP_HEADER_LEN : RTU_HEADER_LEN;
+  int tlen = ( mproto == MDB_PROTO_TCP ) ? 0 : 2;                           // Trailing CRC
+  const uint8_t *req = query + hlen;                                         // Query PDU
+  uint8_t       *pdu = rsp + hlen;                                           // Reply PDU
+  int plen = qlen - hlen - tlen;                                             // Query PDU length
+  int ex   = 0;                                                              // Modbus exception
+  int len  = 0;                                                              // Reply PDU length
+
+  if( plen < 5 ){ return adu_native( req[0] ) ? adu_exception( query, mproto, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp ) : 0; }
+
+  // Header decoded once: each function checks its own bounds on these values and writes in place
+  uint8_t  mcmd = req[0];
+  uint16_t mreg = GET_U16( req + 1 );
+  uint16_t mlen = GET_U16( req + 3 );
+
+  pdu[0] = mcmd;
+  switch( mcmd ){
+    case MODBUS_FC_READ_COILS:
+    case MODBUS_FC_READ_DISCRETE_INPUTS:{
+      enum regs_table_type table = ( mcmd == MODBUS_FC_READ_COILS ) ? REGS_COILS : REGS_DISCRETE_INPUTS;
+
+      if( mlen < 1 || mlen > MODBUS_MAX_READ_BITS ){     ex = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;   break; }
+      if( mreg + mlen > nb[ table ] ){                    ex = MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS; break; }
+
+      pdu[1] = ( mlen + 7 ) / 8;
+      regs_read( store, unit, table, mreg, mlen, pdu + 2 );
+      len = 2 + pdu[1];
+      break;
+    }
+
+    case MODBUS_FC_READ_HOLDING_REGISTERS:
+    case MODBUS_FC_READ_INPUT_REGISTERS:{
+      enum regs_table_type table = ( mcmd == MODBUS_FC_READ_HOLDING_REGISTERS ) ? REGS_HOLDING : REGS_INPUT;
+
+      if( mlen < 1 || mlen > MODBUS_MAX_READ_REGISTERS ){ ex = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;   break; }
+      if( mreg + mlen > nb[ table ] ){                    ex = MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS; break; }
+
+      pdu[1] = mlen * 2;
+      regs_read( store, unit, table, mreg, mlen, pdu + 2 );
+      len = 2 + pdu[1];
+      break;
+    }
+
+    case MODBUS_FC_WRITE_SINGLE_COIL:{
+      // mlen holds the value here
+      uint8_t bit = mlen ? 1 : 0;
+      if( mreg >= nb[ REGS_COILS ] ){                    ex = MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS; break; }
+      if( mlen != 0xFF00 && mlen != 0x0000 ){             ex = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;   break; }
+
+      if( regs_write( store, unit, REGS_COILS, mreg, 1, &bit ) ){ ex = MODBUS_EXCEPTION_SLAVE_OR_SERVER_FAILURE; break; }
+      memcpy( pdu, req, 5 );
+      len = 5;
+      break;
+    }
+
+    case MODBUS_FC_WRITE_SINGLE_REGISTER:
+      if( mreg >= nb[ REGS_HOLDING ] ){                  ex = MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS; break; }
+
+      if( regs_write( store, unit, REGS_HOLDING, mreg, 1, req + 3 ) ){ ex = MODBUS_EXCEPTION_SLAVE_OR_SERVER_FAILURE; break; }
+      memcpy( pdu, req, 5 );
+      len = 5;
+      break;
+
+    case MODBUS_FC_WRITE_MULTIPLE_COILS:
+      if( plen < 6 || mlen < 1 || mlen > MODBUS_MAX_WRITE_BITS ||
+          req[5] != ( mlen + 7 ) / 8 || plen < 6 + req[5] ){ ex = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;   break; }
+      if( mreg + mlen > nb[ REGS_COILS ] ){                  ex = MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS; break; }
+
+      if( regs_write( store, unit, REGS_COILS, mreg, mlen, req + 6 ) ){ ex = MODBUS_EXCEPTION_SLAVE_OR_SERVER_FAILURE; break; }
+      memcpy( pdu, req, 5 );
+      len = 5;
+      break;
+
+    case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+      if( plen < 6 || mlen < 1 || mlen > MODBUS_MAX_WRITE_REGISTERS ||
+          req[5] != mlen * 2 || plen < 6 + req[5] ){          ex = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;   break; }
+      if( mreg + mlen > nb[ REGS_HOLDING ] ){                ex = MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS; break; }
+
+      if( regs_write( store, unit, REGS_HOLDING, mreg, mlen, req + 6 ) ){ ex = MODBUS_EXCEPTION_SLAVE_OR_SERVER_FAILURE; break; }
+      memcpy( pdu, req, 5 );
+      len = 5;
+      break;
+
+    case MODBUS_FC_MASK_WRITE_REGISTER:
+      // mlen holds the and mask here
+      if( plen < 7 ){                                     ex = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;   break; }
+      if( mreg >= nb[ REGS_HOLDING ] ){                  ex = MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS; break; }
+
+      if( regs_mask_write( store, unit, mreg, mlen, GET_U16( req + 5 ) ) ){ ex = MODBUS_EXCEPTION_SLAVE_OR_SERVER_FAILURE; break; }
+      memcpy( pdu, req, 7 );
+      len = 7;
+      break;
+
+    case MODBUS_FC_WRITE_AND_READ_REGISTERS:{
+      // Read address and length come first, the write is applied before the read
+      uint16_t wreg = ( plen >= 9 ) ? GET_U16( req + 5 ) : 0;
+      uint16_t wlen = ( plen >= 9 ) ? GET_U16( req + 7 ) : 0;
+
+      if( plen < 10 || mlen < 1 || mlen > MODBUS_MAX_WR_READ_REGISTERS ||
+          wlen < 1 || wlen > MODBUS_MAX_WR_WRITE_REGISTERS ||
+          req[9] != wlen * 2 || plen < 10 + req[9] ){         ex = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;   break; }
+      if( mreg + mlen > nb[ REGS_HOLDING ] ||
+          wreg + wlen > nb[ REGS_HOLDING ] ){                ex = MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS; break; }
+
+      if( regs_write( store, unit, REGS_HOLDING, wreg, wlen, req + 10 ) ){ ex = MODBUS_EXCEPTION_SLAVE_OR_SERVER_FAILURE; break; }
+      pdu[1] = mlen * 2;
+      regs_read( store, unit, REGS_HOLDING, mreg, mlen, pdu + 2 );
+      len = 2 + pdu[1];
+      break;
+    }
+
+    default:
+      return 0;
+  }
+
+  if( ex ){ return adu_exception( query, mproto, ex, rsp ); }
+
+  return adu_finalize( query, mproto, rsp, len );
+}
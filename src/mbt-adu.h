@@ -0,0 +1,94 @@
+#ifndef _MBT_ADU_H_
+#define _MBT_ADU_H_
+
+#include <stdint.h>
+
+#include <modbus/modbus.h>
+
+#include "mbt-srv.h"
+#include "mbt-regs.h"
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ DEFINITIONS
+#define MBAP_HEADER_LEN         7                  ///< MBAP header length, unit identifier included
+#define RTU_HEADER_LEN          1                  ///< RTU header length: the slave address
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS
+
+/**
+ * @brief      Gets the length of the first MBAP frame in a receive buffer
+ *
+ * @param[in]  buf   The buffer
+ * @param[in]  len   The bytes available in buf
+ *
+ * @return     The frame length, 0 if the frame is not complete yet, -1 if the header is invalid
+ */
+int mbap_frame_len( const uint8_t *buf, size_t len );
+
+/**
+ * @brief      Gets the length of the RTU query at the start of a receive buffer, from its function code
+ *
+ * @param[in]  buf   The buffer
+ * @param[in]  len   The bytes available in buf
+ *
+ * @return     The query length, 0 if more bytes are needed to tell it, -1 if the function code does not give it
+ */
+int rtu_query_len( const uint8_t *buf, size_t len );
+
+/**
+ * @brief      Gets the length of the RTU reply at the start of a receive buffer, from its function code
+ *
+ * @param[in]  buf   The buffer
+ * @param[in]  len   The bytes available in buf
+ *
+ * @return     The reply length, 0 if not complete yet, -1 if the function code does not give it
+ */
+int rtu_reply_len( const uint8_t *buf, size_t len );
+
+/**
+ * @brief      Computes the modbus RTU CRC, to be sent low byte first
+ *
+ * @param[in]  buf   The frame
+ * @param[in]  len   The bytes covered by the CRC
+ *
+ * @return     The CRC
+ */
+uint16_t crc16( const uint8_t *buf, int len );
+
+/**
+ * @brief      Tells if a function code is answered by adu_reply()
+ *
+ * @param[in]  fc    The function code
+ *
+ * @return     1 if natively handled, 0 if left to libmodbus
+ */
+int adu_native( uint8_t fc );
+
+/**
+ * @brief      Builds the reply to a query, reading and writing the register store
+ *
+ * @param[in]  query       The complete query ADU
+ * @param[in]  qlen        The query length
+ * @param[in]  mproto      The query protocol
+ * @param      store       The register store
+ * @param[in]  unit        The unit addressed by the query, from conf_unit()
+ * @param[in]  nb          Entries of each table of the unit: addresses beyond get an exception
+ * @param[out] rsp         The reply buffer, at least MODBUS_MAX_ADU_LENGTH bytes
+ *
+ * @return     The reply length, 0 when the function code is not handled natively
+ */
+int adu_reply( const uint8_t *query, int qlen, enum mdb_proto_type mproto, struct regs_store_t *store, int unit, const int32_t *nb,
+               uint8_t *rsp );
+
+/**
+ * @brief      Builds an exception reply to a query
+ *
+ * @param[in]  query      The query ADU
+ * @param[in]  mproto     The query protocol
+ * @param[in]  exception  The modbus exception code
+ * @param[out] rsp        The reply buffer
+ *
+ * @return     The reply length
+ */
+int adu_exception( const uint8_t *query, enum mdb_proto_type mproto, int exception, uint8_t *rsp );
+
+#endif // _MBT_ADU_H_
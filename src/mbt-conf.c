@@ -0,0 +1,315 @@
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ INCLUDES
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mbt-conf.h"
+#include "mbt-log.h"
+#include "mbt-stats.h"
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ DEFINITIONS
+#define CONF_LINE_LEN       4096                           ///< Longest line of a layout file
+#define CONF_GRACE_USEC     100                            ///< Interval between two looks at the readers
+#define CONF_SEPS           " \t\r\n"
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ GLOBAL VARS
+struct conf_t *conf_cur   = NULL;
+uint64_t       conf_epoch = 1;                             ///< Never 0: a reader holding a layout has a non 0 epoch
+
+struct conf_reader_t conf_readers[ CONF_READERS_MAX ];     ///< One per thread serving queries
+int                  conf_nreaders = 0;
+pthread_mutex_t      conf_lock = PTHREAD_MUTEX_INITIALIZER;   ///< Serializes the readers creation
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS
+static inline int conf_table( const char *name ){
+  if( strcmp( name, "co" ) == 0 ){ return REGS_COILS; }
+  if( strcmp( name, "di" ) == 0 ){ return REGS_DISCRETE_INPUTS; }
+  if( strcmp( name, "hr" ) == 0 ){ return REGS_HOLDING; }
+  if( strcmp( name, "ir" ) == 0 ){ return REGS_INPUT; }
+  return -1;
+}
+
+/**
+ * @brief      Allocates a layout serving every id with the same registers, tables at the given sizes
+ */
+struct conf_t *conf_alloc( const int32_t *nb ){
+  struct conf_t *conf = calloc( 1, sizeof( struct conf_t ) );
+
+  if( !conf ){ return NULL; }
+  for( int u = 0; u < REGS_UNITS; u++ ){ memcpy( conf->nb[u], nb, sizeof( conf->nb[u] ) ); }
+  return conf;
+}
+
+void conf_free( struct conf_t *conf ){
+  if( !conf ){ return; }
+  free( conf->faults );
+  free( conf->inits );
+  free( conf );
+}
+
+struct conf_t *conf_new( const char *units, const char *faults, const int32_t *nb ){
+  struct conf_t *conf = conf_alloc( nb );
+
+  if( !conf ){ return NULL; }
+  if( units ){
+    if( fault_parse_list( units, conf->units ) != 0 ){
+      log_err( "Invalid unit ids: %s", units );
+      conf_free( conf );
+      return NULL;
+    }
+    conf->routed = 1;
+  }
+  if( faults && !( conf->faults = fault_parse( faults ) ) ){
+    log_err( "Invalid fault rules: %s", faults );
+    conf_free( conf );
+    return NULL;
+  }
+  return conf;
+}
+
+/**
+ * @brief      Parses the fields of a unit line, after the keyword
+ *
+ * @return     0 on success, -1 if invalid
+ */
+int conf_parse_unit( struct conf_t *conf, char *fields, const int32_t *nb, int *shared ){
+  char *save = NULL, *ids = strtok_r( fields, CONF_SEPS, &save ), *field, *end;
+  int32_t sizes[ REGS_TABLES ];
+  uint8_t map[ REGS_UNITS / 8 ];
+  int given = 0;
+
+  if( !ids ){ return -1; }
+  memcpy( sizes, nb, sizeof( sizes ) );
+
+  // The first table given drops the others
+  while( ( field = strtok_r( NULL, CONF_SEPS, &save ) ) ){
+    char *eq = strchr( field, '=' );
+    if( !eq ){ return -1; }
+    *eq = '\0';
+
+    int table = conf_table( field );
+    long n = strtol( eq + 1, &end, 0 );
+    if( table < 0 || end == eq + 1 || *end || n < 0 || n > nb[ table ] ){ return -1; }
+    if( !given++ ){ memset( sizes, 0, sizeof( sizes ) ); }
+    sizes[ table ] = n;
+  }
+
+  // Every id sharing the same registers, or a list with registers of its own: not both
+  if( strcmp( ids, "*" ) == 0 ){
+    if( conf->routed ){ return -1; }
+    memcpy( conf->nb[0], sizes, sizeof( sizes ) );
+    *shared = 1;
+    return 0;
+  }
+  if( *shared || fault_parse_list( ids, map ) != 0 ){ return -1; }
+
+  for( int u = 0; u < REGS_UNITS; u++ ){
+    if( !( ( map[ u / 8 ] >> ( u % 8 ) ) & 1 ) ){ continue; }
+    conf->units[ u / 8 ] |= 1 << ( u % 8 );
+    memcpy( conf->nb[u], sizes, sizeof( sizes ) );
+  }
+  conf->routed = 1;
+  return 0;
+}
+
+/**
+ * @brief      Parses the fields of an init line, after the keyword. The unit is the id until the whole file is read
+ *
+ * @return     0 on success, -1 if invalid
+ */
+int conf_parse_init( struct conf_init_t *init, char *fields ){
+  char *save = NULL, *end;
+  char *uid   = strtok_r( fields, CONF_SEPS, &save );
+  char *table = strtok_r( NULL,   CONF_SEPS, &save );
+  char *addr  = strtok_r( NULL,   CONF_SEPS, &save );
+  char *value;
+
+  // Zeroed whole: lines are compared byte by byte with the ones of the previous layout
+  memset( init, 0, sizeof( struct conf_init_t ) );
+  if( !uid || !table || !addr ){ return -1; }
+
+  long n = strtol( uid, &end, 0 );
+  if( end == uid || *end || n < 0 || n >= REGS_UNITS ){ return -1; }
+  init->unit = n;
+
+  if( conf_table( table ) < 0 ){ return -1; }
+  init->table = conf_table( table );
+
+  n = strtol( addr, &end, 0 );
+  if( end == addr || *end || n < 0 || n > 0xFFFF ){ return -1; }
+  init->addr = n;
+
+  const long max = ( init->table == REGS_COILS || init->table == REGS_DISCRETE_INPUTS ) ? 1 : 0xFFFF;
+  while( ( value = strtok_r( NULL, CONF_SEPS, &save ) ) ){
+    n = strtol( value, &end, 0 );
+    if( init->nb == CONF_INIT_MAX || end == value || *end || n < 0 || n > max ){ return -1; }
+    init->values[ init->nb++ ] = n;
+  }
+  return init->nb ? 0 : -1;
+}
+
+struct conf_t *conf_load( const char *path, const int32_t *nb ){
+  char line[ CONF_LINE_LEN ], *faults = NULL;
+  size_t flen = 0;
+  int nline = 0, cinits = 0, shared = 0, rc = 0;
+  struct conf_t *conf;
+
+  FILE *f = fopen( path, "r" );
+  if( !f ){
+    log_err( "Can not open %s: %s", path, strerror( errno ) );
+    return NULL;
+  }
+  if( !( conf = conf_alloc( nb ) ) ){
+    fclose( f );
+    return NULL;
+  }
+
+  while( rc == 0 && fgets( line, sizeof( line ), f ) ){
+    char *p = line + strspn( line, " \t" ), *kw, *save = NULL;
+
+    nline++;
+    if( !strchr( line, '\n' ) && !feof( f ) ){
+      log_err( "%s:%d: line too long", path, nline );
+      rc = -1;
+      break;
+    }
+    if( *p == '#' || *p == '\n' || *p == '\r' || *p == '\0' ){ continue; }
+    kw = strtok_r( p, CONF_SEPS, &save );
+
+    if( strcmp( kw, "unit" ) == 0 ){
+      if( conf_parse_unit( conf, save, nb, &shared ) != 0 ){
+        log_err( "%s:%d: invalid unit line", path, nline );
+        rc = -1;
+      }
+    }
+    else if( strcmp( kw, "init" ) == 0 ){
+      if( conf->ninits == cinits ){
+        cinits = cinits ? 2 * cinits : 16;
+        struct conf_init_t *inits = realloc( conf->inits, cinits * sizeof( struct conf_init_t ) );
+        if( !inits ){ rc = -1; break; }
+        conf->inits = inits;
+      }
+      if( conf_parse_init( &conf->inits[ conf->ninits ], save ) != 0 ){
+        log_err( "%s:%d: invalid init line", path, nline );
+        rc = -1;
+      }
+      conf->ninits++;
+    }
+    else if( strcmp( kw, "fault" ) == 0 ){
+      // Rules of every line are joined in a single set, in file order. A rule per line: more tokens are a typo
+      char *rule = strtok_r( NULL, CONF_SEPS, &save );
+      size_t rlen = rule ? strlen( rule ) : 0;
+      char *spec = rlen && !strtok_r( NULL, CONF_SEPS, &save ) ? realloc( faults, flen + rlen + 2 ) : NULL;
+      if( !spec ){
+        log_err( "%s:%d: invalid fault line", path, nline );
+        rc = -1;
+        break;
+      }
+      faults = spec;
+      if( flen ){ faults[ flen++ ] = ';'; }
+      memcpy( faults + flen, rule, rlen + 1 );
+      flen += rlen;
+    }
+    else{
+      log_err( "%s:%d: invalid line", path, nline );
+      rc = -1;
+    }
+  }
+  fclose( f );
+
+  if( rc == 0 && faults && !( conf->faults = fault_parse( faults ) ) ){
+    log_err( "%s: invalid fault rules", path );
+    rc = -1;
+  }
+  free( faults );
+
+  // Units are known once the whole file is read: values go to the register space of their id, within its tables
+  for( int i = 0; rc == 0 && i < conf->ninits; i++ ){
+    struct conf_init_t *init = &conf->inits[i];
+    int unit = conf_unit( conf, init->unit );
+    if( unit < 0 || init->addr + init->nb > conf->nb[ unit ][ init->table ] ){
+      log_err( "%s: init of unit %d at %d, %d values, outside of its tables", path, init->unit, init->addr, init->nb );
+      rc = -1;
+    }
+    init->unit = unit;
+  }
+
+  if( rc != 0 ){
+    conf_free( conf );
+    return NULL;
+  }
+  return conf;
+}
+
+int conf_apply( const struct conf_t *conf, const struct conf_t *prev, struct regs_store_t *store ){
+  uint8_t buf[ 2 * CONF_INIT_MAX ];
+  int written = 0;
+
+  for( int i = 0; i < conf->ninits; i++ ){
+    const struct conf_init_t *init = &conf->inits[i];
+    int same = 0;
+
+    // A line left as it was keeps what masters wrote since
+    for( int j = 0; prev && j < prev->ninits && !same; j++ ){ same = memcmp( init, &prev->inits[j], sizeof( struct conf_init_t ) ) == 0; }
+    if( same ){ continue; }
+
+    // Written as a master would: bits packed, registers big endian
+    memset( buf, 0, sizeof( buf ) );
+    for( int v = 0; v < init->nb; v++ ){
+      if( init->table == REGS_COILS || init->table == REGS_DISCRETE_INPUTS ){ buf[ v / 8 ] |= init->values[v] << ( v % 8 ); }
+      else{
+        buf[ 2 * v     ] = init->values[v] >> 8;
+        buf[ 2 * v + 1 ] = init->values[v] & 0xFF;
+      }
+    }
+    if( regs_write( store, init->unit, init->table, init->addr, init->nb, buf ) != 0 ){ return -1; }
+    written++;
+  }
+  return written;
+}
+
+struct conf_reader_t *conf_reader(){
+  struct conf_reader_t *reader = NULL;
+
+  pthread_mutex_lock( &conf_lock );
+  if( conf_nreaders < CONF_READERS_MAX ){
+    reader = &conf_readers[ conf_nreaders ];
+    reader->epoch = 0;
+    __atomic_store_n( &conf_nreaders, conf_nreaders + 1, __ATOMIC_RELEASE );
+  }
+  pthread_mutex_unlock( &conf_lock );
+  return reader;
+}
+
+uint64_t conf_publish( struct conf_t *conf ){
+  struct conf_t *old = conf_cur;
+  struct timespec ts = { 0, CONF_GRACE_USEC * 1000L };
+  uint64_t start = stats_now();
+
+  // Readers getting the layout from now on get the new one. Pairs with the fence of conf_online()
+  __atomic_store_n( &conf_cur, conf, __ATOMIC_RELEASE );
+  uint64_t epoch = __atomic_add_fetch( &conf_epoch, 1, __ATOMIC_SEQ_CST );
+  __atomic_thread_fence( __ATOMIC_SEQ_CST );
+
+  // The old one is still held by the readers online since before: each is waited for until its next wait
+  int n = __atomic_load_n( &conf_nreaders, __ATOMIC_ACQUIRE );
+  for( int r = 0; r < n; r++ ){
+    uint64_t seen;
+    while( ( seen = __atomic_load_n( &conf_readers[r].epoch, __ATOMIC_ACQUIRE ) ) && seen < epoch ){ nanosleep( &ts, NULL ); }
+  }
+
+  conf_free( old );
+  return stats_now() - start;
+}
+
+void conf_end(){
+  conf_free( conf_cur );
+  conf_cur = NULL;
+
+  pthread_mutex_lock( &conf_lock );
+  conf_nreaders = 0;
+  pthread_mutex_unlock( &conf_lock );
+}
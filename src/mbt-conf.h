@@ -0,0 +1,154 @@
+#ifndef _MBT_CONF_H_
+#define _MBT_CONF_H_
+
+#include <stdint.h>
+
+#include "mbt-regs.h"
+#include "mbt-fault.h"
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ DEFINITIONS
+#define CONF_READERS_MAX        256                ///< Threads reading the layout
+#define CONF_INIT_MAX           256                ///< Values of an init line
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ TYPES
+/**
+ * Values written to a table when the layout is loaded
+ */
+struct conf_init_t{
+  uint8_t               unit;                      ///< Register space, from conf_unit()
+  uint8_t               table;                     ///< An regs_table_type
+  uint16_t              addr;                      ///< First register or bit
+  uint16_t              nb;                        ///< Values
+  uint16_t              values[ CONF_INIT_MAX ];   ///< Registers, or bits as 0 and 1
+};
+
+/**
+ * Served units, their table sizes, initial values and fault rules. A layout is never modified once published:
+ * a reload builds a new one and swaps it in whole.
+ */
+struct conf_t{
+  uint8_t               routed;                    ///< Units have their own registers, all share unit 0 otherwise
+  uint8_t               units[ REGS_UNITS / 8 ];   ///< Bitmap of the served unit identifiers when routed
+  int32_t               nb[ REGS_UNITS ][ REGS_TABLES ];   ///< Entries of each table, by register space
+  struct fault_rules_t *faults;                    ///< Fault rules, NULL if none
+  int                   ninits;                    ///< Init lines
+  struct conf_init_t   *inits;                     ///< Init lines, in file order
+};
+
+/**
+ * A thread reading the layout: the epoch it last saw a layout at, 0 while it holds none
+ */
+struct conf_reader_t{
+  uint64_t              epoch __attribute__(( aligned( 64 ) ));
+};
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ GLOBAL VARS
+extern struct conf_t *conf_cur;                    ///< Layout in use
+extern uint64_t       conf_epoch;                  ///< Bumped by every layout published
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS
+
+/**
+ * @brief      Builds a layout from the command line
+ *
+ * @param[in]  units   Unit ids with registers of their own, eg. "1,5,10-20". NULL for every id sharing the same
+ * @param[in]  faults  Fault rules, as fault_parse() takes them. NULL for none
+ * @param[in]  nb      Entries of each table, the store sizes
+ *
+ * @return     The layout, to be released with conf_free(). NULL if invalid
+ */
+struct conf_t *conf_new( const char *units, const char *faults, const int32_t *nb );
+
+/**
+ * @brief      Loads a layout file. Lines are, '#' starting a comment:
+ *
+ *     unit <ids | *> [co=<n>] [di=<n>] [hr=<n>] [ir=<n>]
+ *     init <unit> <co | di | hr | ir> <address> <value> [<value> ...]
+ *     fault <rule>
+ *
+ * Ids are lists like "1,5,10-20", each getting registers of its own, '*' every id sharing the same. Tables not
+ * given have no entries, a unit line giving none has every table at the store size. Without unit lines every
+ * id shares the same registers.
+ *
+ * @param[in]  path  The file
+ * @param[in]  nb    Entries of each table, the store sizes: the largest a unit may have
+ *
+ * @return     The layout, to be released with conf_free(). NULL if invalid, the error logged
+ */
+struct conf_t *conf_load( const char *path, const int32_t *nb );
+
+/**
+ * @brief      Frees a layout
+ */
+void conf_free( struct conf_t *conf );
+
+/**
+ * @brief      Writes the initial values of a layout to the store, the ones new or changed from the previous layout
+ *
+ * @param      conf   The layout
+ * @param      prev   The previous layout, NULL to write them all
+ * @param      store  The store
+ *
+ * @return     The init lines written, -1 on store failure
+ */
+int conf_apply( const struct conf_t *conf, const struct conf_t *prev, struct regs_store_t *store );
+
+/**
+ * @brief      Gets a reader for a thread, one per thread. It starts holding no layout
+ *
+ * @return     The reader, NULL if CONF_READERS_MAX are already in use
+ */
+struct conf_reader_t *conf_reader();
+
+/**
+ * @brief      Publishes a layout, then frees the previous one once no reader can hold it anymore
+ *
+ * Readers never wait: only the caller does, until every reader went through conf_offline() or conf_online().
+ * To be called by a single thread.
+ *
+ * @param      conf  The new layout
+ *
+ * @return     The ns waited for the readers
+ */
+uint64_t conf_publish( struct conf_t *conf );
+
+/**
+ * @brief      Frees the layout in use and forgets the readers, once every reader thread ended
+ */
+void conf_end();
+
+/**
+ * @brief      Gets the layout in use, valid until the calling thread next conf_offline()
+ */
+static inline const struct conf_t *conf_get(){
+  return __atomic_load_n( &conf_cur, __ATOMIC_ACQUIRE );
+}
+
+/**
+ * @brief      Tells the layouts got so far are not used anymore, before a thread waits
+ */
+static inline void conf_offline( struct conf_reader_t *reader ){
+  __atomic_store_n( &reader->epoch, 0, __ATOMIC_RELEASE );
+}
+
+/**
+ * @brief      Tells a thread is going to get layouts again. Pairs with the fence of conf_publish(): either the
+ *             publisher sees the reader online, or the reader gets the new layout
+ */
+static inline void conf_online( struct conf_reader_t *reader ){
+  __atomic_store_n( &reader->epoch, __atomic_load_n( &conf_epoch, __ATOMIC_ACQUIRE ), __ATOMIC_RELAXED );
+  __atomic_thread_fence( __ATOMIC_SEQ_CST );
+}
+
+/**
+ * @brief      Gets the register space serving a unit identifier
+ *
+ * @return     The unit, -1 if uid is not served
+ */
+static inline int conf_unit( const struct conf_t *conf, uint8_t uid ){
+  if( !conf->routed ){ return 0; }
+
+  return ( conf->units[ uid / 8 ] >> ( uid % 8 ) ) & 1 ? uid : -1;
+}
+
+#endif // _MBT_CONF_H_
@@ -0,0 +1,225 @@
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ INCLUDES
+#include <stdlib.h>
+#include <string.h>
+
+#include <modbus/modbus.h>
+
+#include "mbt-fault.h"
+#include "mbt-log.h"
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ DEFINITIONS
+#define MSEC                1000000ULL                     ///< Nanoseconds in a millisecond, the wheel tick
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS
+int fault_parse_list( const char *list, uint8_t *map ){
+  const char *p = list;
+
+  memset( map, 0, 32 );
+  while( *p ){
+    char *end;
+    long lo = strtol( p, &end, 0 ), hi = lo;
+    if( end == p ){ return -1; }
+    if( *end == '-' ){
+      p  = end + 1;
+      hi = strtol( p, &end, 0 );
+      if( end == p ){ return -1; }
+    }
+    if( lo < 0 || hi > 0xFF || lo > hi ){ return -1; }
+    for( long i = lo; i <= hi; i++ ){ map[ i / 8 ] |= 1 << ( i % 8 ); }
+
+    p = end;
+    if( *p == ',' ){ p++; }
+    else if( *p ){ return -1; }
+  }
+  return 0;
+}
+
+/**
+ * @brief      Parses a single rule, fields separated by ':'
+ *
+ * @return     0 on success, -1 if invalid
+ */
+int fault_parse_rule( char *spec, struct fault_rule_t *rule ){
+  char *save = NULL, *field = strtok_r( spec, ":", &save );
+  char *end;
+
+  memset( rule, 0, sizeof( struct fault_rule_t ) );
+  memset( rule->fcs, 0xFF, sizeof( rule->fcs ) );
+  memset( rule->units, 0xFF, sizeof( rule->units ) );
+  rule->threshold = 1ULL << 32;
+  rule->addr_lo   = -1;
+  rule->exception = MODBUS_EXCEPTION_SLAVE_OR_SERVER_FAILURE;
+  if( !field ){ return -1; }
+
+  if(      strcmp( field, "drop"      ) == 0 ){ rule->action = FAULT_DROP; }
+  else if( strcmp( field, "truncate"  ) == 0 ){ rule->action = FAULT_TRUNCATE; }
+  else if( strcmp( field, "reset"     ) == 0 ){ rule->action = FAULT_RESET; }
+  else if( strcmp( field, "exception" ) == 0 ){ rule->action = FAULT_EXCEPTION; }
+  else if( strncmp( field, "exception=", 10 ) == 0 ){
+    long code = strtol( field + 10, &end, 0 );
+    if( *end || code <= 0 || code > 0xFF ){ return -1; }
+    rule->action    = FAULT_EXCEPTION;
+    rule->exception = code;
+  }
+  else if( strncmp( field, "delay=", 6 ) == 0 ){
+    rule->action    = FAULT_DELAY;
+    rule->delay_min = rule->delay_max = strtoul( field + 6, &end, 10 );
+    if( *end == '-' ){ rule->delay_max = strtoul( end + 1, &end, 10 ); }
+    if( *end || rule->delay_max < rule->delay_min ){ return -1; }
+  }
+  else{ return -1; }
+
+  while( ( field = strtok_r( NULL, ":", &save ) ) ){
+    if( strncmp( field, "rate=", 5 ) == 0 ){
+      double rate = strtod( field + 5, &end );
+      if( *end || rate < 0.0 || rate > 100.0 ){ return -1; }
+      rule->threshold = (uint64_t)( rate / 100.0 * 4294967296.0 );
+    }
+    else if( strncmp( field, "fc=", 3 ) == 0 ){
+      if( fault_parse_list( field + 3, rule->fcs ) != 0 ){ return -1; }
+    }
+    else if( strncmp( field, "unit=", 5 ) == 0 ){
+      if( fault_parse_list( field + 5, rule->units ) != 0 ){ return -1; }
+    }
+    else if( strncmp( field, "addr=", 5 ) == 0 ){
+      rule->addr_lo = rule->addr_hi = strtol( field + 5, &end, 0 );
+      if( *end == '-' ){ rule->addr_hi = strtol( end + 1, &end, 0 ); }
+      if( *end || rule->addr_lo < 0 || rule->addr_hi > 0xFFFF || rule->addr_lo > rule->addr_hi ){ return -1; }
+    }
+    else{ return -1; }
+  }
+  return 0;
+}
+
+struct fault_rules_t *fault_parse( const char *spec ){
+  struct fault_rules_t *rules = calloc( 1, sizeof( struct fault_rules_t ) );
+  char *copy = strdup( spec ), *save = NULL, *tok;
+
+  if( !rules || !copy ){
+    free( rules );
+    free( copy );
+    return NULL;
+  }
+
+  for( tok = strtok_r( copy, ";", &save ); tok; tok = strtok_r( NULL, ";", &save ) ){
+    if( rules->n == FAULT_RULES_MAX || fault_parse_rule( tok, &rules->rules[ rules->n ] ) != 0 ){
+      log_err( "Invalid fault rule: %s", tok );
+      free( rules );
+      free( copy );
+      return NULL;
+    }
+    rules->n++;
+  }
+
+  free( copy );
+  return rules;
+}
+
+void fault_seed( struct fault_rng_t *rng, uint64_t seed ){
+  // splitmix64 spreads close seeds apart
+  seed += 0x9E3779B97F4A7C15ULL;
+  seed  = ( seed ^ ( seed >> 30 ) ) * 0xBF58476D1CE4E5B9ULL;
+  seed  = ( seed ^ ( seed >> 27 ) ) * 0x94D049BB133111EBULL;
+  rng->s = ( seed ^ ( seed >> 31 ) ) | 1;
+}
+
+enum fault_action_type fault_check( const struct fault_rules_t *rules, struct fault_rng_t *rng, uint8_t unit,
+                                    const uint8_t *pdu, int plen, struct fault_t *fault ){
+  fault->action = FAULT_NONE;
+  if( !rules || plen < 1 ){ return FAULT_NONE; }
+
+  for( int i = 0; i < rules->n; i++ ){
+    const struct fault_rule_t *rule = &rules->rules[i];
+
+    if( !( rule->fcs[ pdu[0] / 8 ] & ( 1 << ( pdu[0] % 8 ) ) ) || !( rule->units[ unit / 8 ] & ( 1 << ( unit % 8 ) ) ) ){ continue; }
+
+    // Address filters match the queries whose range overlaps theirs
+    if( rule->addr_lo >= 0 ){
+      int addr, nb = 1;
+      if( plen < 3 ){ continue; }
+      addr = ( pdu[1] << 8 ) | pdu[2];
+      if( plen >= 5 && pdu[0] != MODBUS_FC_WRITE_SINGLE_COIL && pdu[0] != MODBUS_FC_WRITE_SINGLE_REGISTER &&
+          pdu[0] != MODBUS_FC_MASK_WRITE_REGISTER ){ nb = ( pdu[3] << 8 ) | pdu[4]; }
+      if( addr > rule->addr_hi || addr + nb <= rule->addr_lo ){ continue; }
+    }
+
+    if( fault_rand( rng ) >= rule->threshold ){ continue; }
+
+    fault->action    = rule->action;
+    fault->exception = rule->exception;
+    fault->delay     = rule->delay_min;
+    if( rule->delay_max > rule->delay_min ){ fault->delay += fault_rand( rng ) % ( rule->delay_max - rule->delay_min + 1 ); }
+    fault->cut       = fault_rand( rng );
+    return fault->action;
+  }
+  return FAULT_NONE;
+}
+
+void fault_wheel_init( struct fault_wheel_t *wheel, uint64_t now ){
+  memset( wheel, 0, sizeof( struct fault_wheel_t ) );
+  wheel->start = now;
+}
+
+void fault_wheel_add( struct fault_wheel_t *wheel, struct fault_timer_t *timer, uint64_t now, uint32_t msec ){
+  // Never in a tick already expired, at least the next one
+  timer->due = ( now - wheel->start ) / MSEC + ( msec ? msec : 1 );
+  if( timer->due <= wheel->tick ){ timer->due = wheel->tick + 1; }
+
+  struct fault_timer_t **slot = &wheel->slots[ timer->due & ( FAULT_WHEEL_SLOTS - 1 ) ];
+  timer->next  = *slot;
+  timer->armed = 1;
+  *slot = timer;
+  wheel->armed++;
+}
+
+void fault_wheel_del( struct fault_wheel_t *wheel, struct fault_timer_t *timer ){
+  if( !timer->armed ){ return; }
+
+  for( struct fault_timer_t **p = &wheel->slots[ timer->due & ( FAULT_WHEEL_SLOTS - 1 ) ]; *p; p = &(*p)->next ){
+    if( *p == timer ){
+      *p = timer->next;
+      break;
+    }
+  }
+  timer->armed = 0;
+  wheel->armed--;
+}
+
+struct fault_timer_t *fault_wheel_expire( struct fault_wheel_t *wheel, uint64_t now ){
+  struct fault_timer_t *expired = NULL;
+  uint64_t tick = ( now - wheel->start ) / MSEC;
+
+  if( !wheel->armed ){
+    wheel->tick = tick;
+    return NULL;
+  }
+
+  // A loop late by more than a turn visits every slot once
+  if( tick - wheel->tick > FAULT_WHEEL_SLOTS ){ wheel->tick = tick - FAULT_WHEEL_SLOTS; }
+
+  while( wheel->tick < tick ){
+    struct fault_timer_t **p = &wheel->slots[ ++wheel->tick & ( FAULT_WHEEL_SLOTS - 1 ) ];
+    while( *p ){
+      struct fault_timer_t *timer = *p;
+      if( timer->due > wheel->tick ){
+        p = &timer->next;
+        continue;
+      }
+      *p = timer->next;
+      timer->armed = 0;
+      timer->next  = expired;
+      expired      = timer;
+      wheel->armed--;
+    }
+  }
+  return expired;
+}
+
+int fault_wheel_wait( struct fault_wheel_t *wheel, uint64_t now, int msec ){
+  if( !wheel->armed ){ return msec; }
+
+  // Up to the end of the current tick
+  uint64_t next = wheel->start + ( ( now - wheel->start ) / MSEC + 1 ) * MSEC;
+  int wait = ( next - now + MSEC - 1 ) / MSEC;
+  return wait < msec ? wait : msec;
+}
@@ -0,0 +1,175 @@
+#ifndef _MBT_FAULT_H_
+#define _MBT_FAULT_H_
+
+#include <stdint.h>
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ DEFINITIONS
+#define FAULT_RULES_MAX         32                 ///< Rules in a set
+#define FAULT_WHEEL_SLOTS       1024               ///< Timer wheel slots, one per millisecond tick: a power of 2
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ TYPES
+enum fault_action_type {
+  FAULT_NONE,                                      ///< The query is served as usual
+  FAULT_DROP,                                      ///< No reply
+  FAULT_DELAY,                                     ///< Reply held for a while
+  FAULT_EXCEPTION,                                 ///< Exception reply
+  FAULT_TRUNCATE,                                  ///< Reply cut short
+  FAULT_RESET                                      ///< Connection reset, a drop over RTU
+};
+
+struct fault_rule_t{
+  enum fault_action_type action;                   ///< What happens to a query hit
+  uint64_t               threshold;                ///< Hit probability, scaled to 2^32
+  uint32_t               delay_min;                ///< Delay: shortest, msec
+  uint32_t               delay_max;                ///< Delay: longest, msec
+  uint8_t                exception;                ///< Exception: the code
+  uint8_t                fcs[ 32 ];                ///< Bitmap of the function codes matched
+  uint8_t                units[ 32 ];              ///< Bitmap of the unit ids matched
+  int                    addr_lo;                  ///< First register or bit matched, -1 for any query
+  int                    addr_hi;                  ///< Last register or bit matched
+};
+
+/**
+ * Rules are checked in order, the first one matching the query and hit by its probability applies. A set is
+ * never modified once in use.
+ */
+struct fault_rules_t{
+  int                 n;                           ///< Rules in the set
+  struct fault_rule_t rules[ FAULT_RULES_MAX ];    ///< The rules
+};
+
+struct fault_t{
+  enum fault_action_type action;                   ///< What happens to the query
+  uint32_t               delay;                    ///< Delay: msec
+  uint8_t                exception;                ///< Exception: the code
+  uint16_t               cut;                      ///< Truncate: random value, the reply keeps cut % length bytes
+};
+
+/**
+ * Thread own generator, xorshift64*: no shared state, no lock
+ */
+struct fault_rng_t{
+  uint64_t s;                                      ///< State, never 0
+};
+
+struct fault_timer_t{
+  uint64_t              due;                       ///< Expiry tick
+  struct fault_timer_t *next;                      ///< Next timer in the same slot
+  uint8_t               armed;                     ///< In the wheel
+};
+
+/**
+ * Hashed timer wheel with millisecond ticks, for a single thread. Timers are embedded in their owner, longer
+ * than a turn ones stay in their slot until their tick comes.
+ */
+struct fault_wheel_t{
+  uint64_t              start;                     ///< Time of tick 0, ns
+  uint64_t              tick;                      ///< Last tick expired
+  int                   armed;                     ///< Timers in the wheel
+  struct fault_timer_t *slots[ FAULT_WHEEL_SLOTS ]; ///< Timers by tick modulo the wheel size
+};
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS
+
+/**
+ * @brief      Parses a rule set: rules separated by ';', each an action followed by ':' separated filters
+ *
+ *     drop | delay=<msec>[-<msec>] | exception[=<code>] | truncate | reset
+ *     rate=<percent>  fc=<list>  unit=<list>  addr=<first>[-<last>]
+ *
+ * Lists are like "3,4,15-16". Missing filters match every query, a missing rate hits every one.
+ *
+ * @param[in]  spec  The rules, eg. "delay=50-200:rate=10:fc=3;drop:rate=1:unit=5"
+ *
+ * @return     The rules, to be released with free(). NULL if invalid
+ */
+struct fault_rules_t *fault_parse( const char *spec );
+
+/**
+ * @brief      Sets the bits of a list like "3,4,15-16" in a 256 bits map, cleared first
+ *
+ * @param[in]  list  The list
+ * @param[out] map   The map, 32 bytes
+ *
+ * @return     0 on success, -1 if invalid
+ */
+int fault_parse_list( const char *list, uint8_t *map );
+
+/**
+ * @brief      Seeds a thread generator
+ *
+ * @param      rng   The generator
+ * @param[in]  seed  Any value, threads must use different ones
+ */
+void fault_seed( struct fault_rng_t *rng, uint64_t seed );
+
+/**
+ * @brief      Draws 32 random bits
+ */
+static inline uint32_t fault_rand( struct fault_rng_t *rng ){
+  rng->s ^= rng->s >> 12;
+  rng->s ^= rng->s << 25;
+  rng->s ^= rng->s >> 27;
+  return ( rng->s * 0x2545F4914F6CDD1DULL ) >> 32;
+}
+
+/**
+ * @brief      Picks the fault of a query
+ *
+ * @param      rules  The rules, NULL for none
+ * @param      rng    The thread generator
+ * @param[in]  unit   The unit id: MBAP unit or RTU address
+ * @param[in]  pdu    The query PDU
+ * @param[in]  plen   The PDU length
+ * @param[out] fault  The fault
+ *
+ * @return     The fault action, FAULT_NONE if the query is served as usual
+ */
+enum fault_action_type fault_check( const struct fault_rules_t *rules, struct fault_rng_t *rng, uint8_t unit,
+                                    const uint8_t *pdu, int plen, struct fault_t *fault );
+
+/**
+ * @brief      Starts a timer wheel
+ *
+ * @param      wheel  The wheel
+ * @param[in]  now    The current time, ns
+ */
+void fault_wheel_init( struct fault_wheel_t *wheel, uint64_t now );
+
+/**
+ * @brief      Arms a timer
+ *
+ * @param      wheel  The wheel
+ * @param      timer  The timer, not armed
+ * @param[in]  now    The current time, ns
+ * @param[in]  msec   The delay
+ */
+void fault_wheel_add( struct fault_wheel_t *wheel, struct fault_timer_t *timer, uint64_t now, uint32_t msec );
+
+/**
+ * @brief      Disarms a timer, if armed
+ */
+void fault_wheel_del( struct fault_wheel_t *wheel, struct fault_timer_t *timer );
+
+/**
+ * @brief      Takes out every timer expired
+ *
+ * @param      wheel  The wheel
+ * @param[in]  now    The current time, ns
+ *
+ * @return     The timers expired, linked by next. NULL if none
+ */
+struct fault_timer_t *fault_wheel_expire( struct fault_wheel_t *wheel, uint64_t now );
+
+/**
+ * @brief      Gets how long an event loop may sleep without delaying a timer
+ *
+ * @param      wheel  The wheel
+ * @param[in]  now    The current time, ns
+ * @param[in]  msec   The longest sleep
+ *
+ * @return     The sleep, msec
+ */
+int fault_wheel_wait( struct fault_wheel_t *wheel, uint64_t now, int msec );
+
+#endif // _MBT_FAULT_H_
@@ -0,0 +1,856 @@
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ INCLUDES
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+
+#include "mbt-gw.h"
+#include "mbt-adu.h"
+#include "mbt-log.h"
+#include "mbt-tty.h"
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ DEFINITIONS
+#define GW_BUCKET_BITS          6                  ///< Fair queue buckets of a bus: 64, masters hashing to the same one share a turn
+#define GW_BUCKETS              ( 1 << GW_BUCKET_BITS )
+#define GW_CACHE_SIZE           64                 ///< Cached reads of a bus
+#define GW_RETRY_SEC            2                  ///< Wait before reopening a failed bus
+#define GW_WAIT_MSEC            1000               ///< Longest poll, bounds the reaction to gw_stop()
+#define MSEC                    1000000ULL         ///< Nanoseconds in a millisecond
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ TYPES
+/**
+ * A serial transaction: a single query on the bus, its reply answering every request attached to it
+ */
+struct gw_txn_t{
+  struct gw_txn_t *next;                           ///< Next transaction of the same bucket
+  struct gw_req_t *reqs;                           ///< Requests answered by the transaction
+  int              bucket;                         ///< Fair queue bucket
+  uint8_t          unit;                           ///< Slave address
+  uint8_t          fc;                             ///< Function code
+  uint8_t          read;                           ///< A FC1-4 read: requests for a range within it share it
+  uint16_t         addr;                           ///< Read: first bit or register
+  uint16_t         count;                          ///< Read: bits or registers
+};
+
+struct gw_bucket_t{
+  struct gw_txn_t *head, *tail;                    ///< Transactions waiting, in arrival order
+  uint16_t         writes;                         ///< Other than reads, waiting or on the line: the bucket reads are not shared meanwhile
+};
+
+struct gw_entry_t{
+  uint64_t         time;                           ///< Time the read was answered, 0 for a free entry
+  uint8_t          unit;                           ///< Slave address
+  uint8_t          fc;                             ///< Read function code
+  uint16_t         addr;                           ///< First bit or register
+  uint16_t         count;                          ///< Bits or registers
+  uint8_t          data[ MODBUS_MAX_PDU_LENGTH ];  ///< Reply data, as on the wire
+};
+
+struct gw_bus_t{
+  char               dev[ 128 ];                   ///< tty path, or TTY_PTY
+  int                speed;                        ///< Baud rate
+  int                fd;                           ///< Serial line, -1 while closed
+  int                pty;                          ///< Slave side of an own pseudo terminal, -1 otherwise
+  uint64_t           retry;                        ///< Time to reopen a failed line
+  struct tty_times_t times;                        ///< Character time and silences
+  struct gw_bucket_t buckets[ GW_BUCKETS ];        ///< Stochastic fair queue, by master
+  uint8_t            ring[ GW_BUCKETS ];           ///< Buckets with transactions waiting, served one transaction each in turn
+  int                rhead;                        ///< First bucket of the ring
+  int                rlen;                         ///< Buckets in the ring
+  struct gw_txn_t   *cur;                          ///< Transaction on the line, NULL if none
+  uint64_t           idle;                         ///< Time the line is free: 3.5 characters after its last frame
+  uint64_t           deadline;                     ///< Time the reply of cur is given up
+  uint64_t           tlast;                        ///< Time of the last bytes written or read
+  uint16_t           olen;                         ///< Query bytes in obuf
+  uint16_t           osent;                        ///< Query bytes already written
+  uint16_t           ilen;                         ///< Reply bytes in ibuf
+  uint8_t            obuf[ MODBUS_RTU_MAX_ADU_LENGTH ];
+  uint8_t            ibuf[ MODBUS_RTU_MAX_ADU_LENGTH ];
+  struct gw_entry_t  cache[ GW_CACHE_SIZE ];       ///< Recent reads
+};
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ GLOBAL VARS
+uint8_t               gw_route[ 256 ] = { 0 };     ///< Bus of every unit plus one, 0 if not routed
+struct gw_bus_t      *gw_buses = NULL;             ///< The buses
+int                   gw_nbuses = 0;               ///< Number of buses
+int                   gw_nqueues = 0;              ///< Number of completion queues
+int                   gw_submit_fd = -1;           ///< Raised by the submitters
+int                  *gw_queue_fds = NULL;         ///< Raised by the gateway, one per queue
+struct gw_req_t      *gw_submitted = NULL;         ///< Requests submitted, last first
+struct gw_req_t     **gw_completed = NULL;         ///< Requests completed per queue, last first
+uint8_t              *gw_kick = NULL;              ///< Queues to raise once the loop round is over
+pthread_t             gw_thread = 0;               ///< Serves every bus
+int                   gw_terminate = 0;            ///< If set the gateway thread stops
+uint64_t              gw_timeout = 0;              ///< Wait for a slave reply, ns
+uint64_t              gw_ttl = 0;                  ///< Age of the cached reads still served, ns
+struct gw_counters_t  gw_cnt;                      ///< Written by the gateway thread only
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS
+/**
+ * @brief      Pushes a request on a lock free stack
+ *
+ * @return     1 if the stack was empty
+ */
+static inline int gw_push( struct gw_req_t **head, struct gw_req_t *req ){
+  struct gw_req_t *old = __atomic_load_n( head, __ATOMIC_RELAXED );
+  do{ req->next = old; }
+  while( !__atomic_compare_exchange_n( head, &old, req, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED ) );
+  return old == NULL;
+}
+
+/**
+ * @brief      Takes every request of a lock free stack, in push order
+ */
+static inline struct gw_req_t *gw_pop_all( struct gw_req_t **head ){
+  struct gw_req_t *req = __atomic_exchange_n( head, NULL, __ATOMIC_ACQUIRE ), *list = NULL, *next;
+  for( ; req; req = next ){
+    next      = req->next;
+    req->next = list;
+    list      = req;
+  }
+  return list;
+}
+
+static inline int gw_read_max( uint8_t fc ){
+  return fc <= MODBUS_FC_READ_DISCRETE_INPUTS ? MODBUS_MAX_READ_BITS : MODBUS_MAX_READ_REGISTERS;
+}
+
+static inline int gw_read_bytes( uint8_t fc, int count ){
+  return fc <= MODBUS_FC_READ_DISCRETE_INPUTS ? ( count + 7 ) / 8 : 2 * count;
+}
+
+/**
+ * @brief      Decodes a FC1-4 read
+ *
+ * @return     1 for a valid read, 0 otherwise
+ */
+int gw_read_range( const uint8_t *query, int qlen, uint16_t *addr, uint16_t *count ){
+  uint8_t fc = query[ MBAP_HEADER_LEN ];
+
+  if( qlen != MBAP_HEADER_LEN + 5 || fc < MODBUS_FC_READ_COILS || fc > MODBUS_FC_READ_INPUT_REGISTERS ){ return 0; }
+  *addr  = ( query[ MBAP_HEADER_LEN + 1 ] << 8 ) | query[ MBAP_HEADER_LEN + 2 ];
+  *count = ( query[ MBAP_HEADER_LEN + 3 ] << 8 ) | query[ MBAP_HEADER_LEN + 4 ];
+  return *count >= 1 && *count <= gw_read_max( fc ) && *addr + *count <= 0x10000;
+}
+
+/**
+ * @brief      Gets the range of the reads a write changes
+ *
+ * @return     The read function code whose range changes, 0 if unknown: every read of the unit
+ */
+uint8_t gw_write_range( const uint8_t *pdu, int plen, uint16_t *addr, uint16_t *count ){
+  if( plen < 5 ){ return 0; }
+
+  *addr  = ( pdu[1] << 8 ) | pdu[2];
+  *count = ( pdu[3] << 8 ) | pdu[4];
+  switch( pdu[0] ){
+    case MODBUS_FC_WRITE_SINGLE_COIL:
+      *count = 1;
+      return MODBUS_FC_READ_COILS;
+    case MODBUS_FC_WRITE_MULTIPLE_COILS:
+      return MODBUS_FC_READ_COILS;
+    case MODBUS_FC_WRITE_SINGLE_REGISTER:
+    case MODBUS_FC_MASK_WRITE_REGISTER:
+      *count = 1;
+      return MODBUS_FC_READ_HOLDING_REGISTERS;
+    case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+      return MODBUS_FC_READ_HOLDING_REGISTERS;
+    case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+      if( plen < 9 ){ return 0; }
+      *addr  = ( pdu[5] << 8 ) | pdu[6];
+      *count = ( pdu[7] << 8 ) | pdu[8];
+      return MODBUS_FC_READ_HOLDING_REGISTERS;
+    default:
+      return 0;
+  }
+}
+
+/**
+ * @brief      Sets the units of a list like "1,5,10-20" to a bus
+ *
+ * @return     0 on success, -1 if invalid
+ */
+int gw_parse_units( const char *list, int bus ){
+  const char *p = list;
+
+  while( *p ){
+    char *end;
+    long lo = strtol( p, &end, 0 ), hi = lo;
+    if( end == p ){ return -1; }
+    if( *end == '-' ){
+      p  = end + 1;
+      hi = strtol( p, &end, 0 );
+      if( end == p ){ return -1; }
+    }
+    if( lo < 1 || hi > 247 || lo > hi ){ return -1; }
+    for( long i = lo; i <= hi; i++ ){ gw_route[i] = bus + 1; }
+
+    p = end;
+    if( *p == ',' ){ p++; }
+    else if( *p ){ return -1; }
+  }
+  return 0;
+}
+
+/**
+ * @brief      Fills the buses from the routes, the same tty named twice being the same bus
+ *
+ * @return     0 on success, -1 if invalid
+ */
+int gw_parse( const char *routes, int speed ){
+  char *copy = strdup( routes ), *save = NULL, *tok;
+  if( !copy ){ return -1; }
+
+  for( tok = strtok_r( copy, ";", &save ); tok; tok = strtok_r( NULL, ";", &save ) ){
+    char *dev = strchr( tok, '=' ), *at;
+    int bus, bspeed = speed;
+
+    if( !dev ){ goto fail; }
+    *dev++ = 0;
+    if( ( at = strchr( dev, '@' ) ) ){
+      *at    = 0;
+      bspeed = atoi( at + 1 );
+    }
+    if( !*dev || strlen( dev ) >= sizeof( gw_buses->dev ) || tty_baud( bspeed ) == B0 ){ goto fail; }
+
+    for( bus = 0; bus < gw_nbuses && strcmp( gw_buses[ bus ].dev, dev ) != 0; bus++ );
+    if( bus == gw_nbuses ){
+      if( gw_nbuses == GW_BUSES_MAX ){ goto fail; }
+      strcpy( gw_buses[ bus ].dev, dev );
+      gw_buses[ bus ].speed = bspeed;
+      gw_buses[ bus ].fd    = -1;
+      gw_buses[ bus ].pty   = -1;
+      tty_times( bspeed, &gw_buses[ bus ].times );
+      gw_nbuses++;
+    }
+    if( gw_parse_units( tok, bus ) != 0 ){ goto fail; }
+  }
+
+  free( copy );
+  return gw_nbuses ? 0 : -1;
+
+fail:
+  free( copy );
+  return -1;
+}
+
+/**
+ * @brief      Builds a reply from its PDU, behind the MBAP header of its query
+ */
+void gw_reply( struct gw_req_t *req, const uint8_t *pdu, int plen ){
+  memcpy( req->rsp, req->query, 4 );
+  req->rsp[4] = ( plen + 1 ) >> 8;
+  req->rsp[5] = ( plen + 1 ) & 0xFF;
+  req->rsp[6] = req->query[6];
+  memcpy( req->rsp + MBAP_HEADER_LEN, pdu, plen );
+  req->rlen = MBAP_HEADER_LEN + plen;
+}
+
+void gw_exception( struct gw_req_t *req, uint8_t code ){
+  uint8_t pdu[2] = { req->query[ MBAP_HEADER_LEN ] | 0x80, code };
+  gw_reply( req, pdu, 2 );
+}
+
+/**
+ * @brief      Answers a read with its own range out of a wider one
+ *
+ * @param      req    The request
+ * @param[in]  addr   First bit or register of data
+ * @param[in]  data   Reply data of the wider read, as on the wire
+ */
+void gw_slice( struct gw_req_t *req, uint16_t addr, const uint8_t *data ){
+  uint8_t pdu[ MODBUS_MAX_PDU_LENGTH ];
+  uint16_t raddr, count;
+  uint8_t fc = req->query[ MBAP_HEADER_LEN ];
+
+  gw_read_range( req->query, req->qlen, &raddr, &count );
+  int off = raddr - addr, bytes = gw_read_bytes( fc, count );
+
+  pdu[0] = fc;
+  pdu[1] = bytes;
+  if( fc <= MODBUS_FC_READ_DISCRETE_INPUTS ){ regs_bits_to_wire( pdu + 2, data, off, count ); }
+  else{ memcpy( pdu + 2, data + 2 * off, bytes ); }
+  gw_reply( req, pdu, 2 + bytes );
+}
+
+/**
+ * @brief      Hands a request back to its queue, raised once the loop round is over
+ */
+void gw_complete( struct gw_req_t *req, uint64_t now ){
+  stats_record( &gw_cnt.lat, now - req->tsubmit );
+  if( gw_push( &gw_completed[ req->queue ], req ) ){ gw_kick[ req->queue ] = 1; }
+}
+
+/**
+ * @brief      Ends a transaction with the same exception for all its requests
+ */
+void gw_fail( struct gw_bus_t *bus, struct gw_txn_t *txn, uint8_t code, uint64_t now ){
+  struct gw_req_t *req, *next;
+
+  for( req = txn->reqs; req; req = next ){
+    next = req->next;
+    gw_exception( req, code );
+    gw_complete( req, now );
+  }
+  if( !txn->read ){ bus->buckets[ txn->bucket ].writes--; }
+  free( txn );
+}
+
+struct gw_entry_t *gw_cache_find( struct gw_bus_t *bus, uint8_t unit, uint8_t fc, uint16_t addr, uint16_t count, uint64_t now ){
+  if( !gw_ttl ){ return NULL; }
+
+  for( int i = 0; i < GW_CACHE_SIZE; i++ ){
+    struct gw_entry_t *e = &bus->cache[i];
+    if( e->time && now - e->time < gw_ttl && e->unit == unit && e->fc == fc &&
+        addr >= e->addr && addr + count <= e->addr + e->count ){ return e; }
+  }
+  return NULL;
+}
+
+void gw_cache_store( struct gw_bus_t *bus, const struct gw_txn_t *txn, const uint8_t *data, uint64_t now ){
+  struct gw_entry_t *e = &bus->cache[0];
+  if( !gw_ttl ){ return; }
+
+  // The same read replaced, otherwise the oldest one
+  for( int i = 0; i < GW_CACHE_SIZE; i++ ){
+    struct gw_entry_t *c = &bus->cache[i];
+    if( c->time && c->unit == txn->unit && c->fc == txn->fc && c->addr == txn->addr && c->count == txn->count ){
+      e = c;
+      break;
+    }
+    if( c->time < e->time ){ e = c; }
+  }
+  e->time  = now;
+  e->unit  = txn->unit;
+  e->fc    = txn->fc;
+  e->addr  = txn->addr;
+  e->count = txn->count;
+  memcpy( e->data, data, gw_read_bytes( txn->fc, txn->count ) );
+}
+
+/**
+ * @brief      Drops the cached reads a write changes: when it is sent, and again once it is answered
+ */
+void gw_cache_drop( struct gw_bus_t *bus, const struct gw_txn_t *txn ){
+  const struct gw_req_t *req = txn->reqs;
+  uint16_t addr = 0, count = 0;
+  uint8_t fc = gw_write_range( req->query + MBAP_HEADER_LEN, req->qlen - MBAP_HEADER_LEN, &addr, &count );
+
+  for( int i = 0; i < GW_CACHE_SIZE; i++ ){
+    struct gw_entry_t *e = &bus->cache[i];
+    if( !e->time || e->unit != txn->unit ){ continue; }
+    if( !fc || ( e->fc == fc && e->addr < addr + count && addr < e->addr + e->count ) ){ e->time = 0; }
+  }
+}
+
+void gw_enqueue( struct gw_bus_t *bus, struct gw_txn_t *txn ){
+  struct gw_bucket_t *b = &bus->buckets[ txn->bucket ];
+
+  txn->next = NULL;
+  if( b->tail ){ b->tail->next = txn; }
+  else{
+    b->head = txn;
+    bus->ring[ ( bus->rhead + bus->rlen++ ) % GW_BUCKETS ] = txn->bucket;
+  }
+  b->tail = txn;
+}
+
+/**
+ * @brief      Takes the next transaction: the first of the bucket whose turn it is, the bucket going back at the end
+ *             of the ring if it has more
+ */
+struct gw_txn_t *gw_dequeue( struct gw_bus_t *bus ){
+  int bucket = bus->ring[ bus->rhead ];
+  struct gw_bucket_t *b = &bus->buckets[ bucket ];
+  struct gw_txn_t *txn = b->head;
+
+  bus->rhead = ( bus->rhead + 1 ) % GW_BUCKETS;
+  bus->rlen--;
+  b->head = txn->next;
+  if( b->head ){ bus->ring[ ( bus->rhead + bus->rlen++ ) % GW_BUCKETS ] = bucket; }
+  else{ b->tail = NULL; }
+  return txn;
+}
+
+/**
+ * @brief      Attaches a read to a transaction already reading its range, or about to
+ *
+ * @return     1 if attached, 0 if it needs a transaction of its own
+ */
+int gw_coalesce( struct gw_bus_t *bus, struct gw_req_t *req, uint8_t unit, uint8_t fc, uint16_t addr, uint16_t count ){
+  struct gw_txn_t *txn = bus->cur;
+
+  // The transaction on the line covers it: answered by the same reply
+  if( txn && txn->read && txn->unit == unit && txn->fc == fc && addr >= txn->addr && addr + count <= txn->addr + txn->count ){
+    req->next = txn->reqs;
+    txn->reqs = req;
+    return 1;
+  }
+
+  // A read next in its bucket turn grows to cover it. Only overlapping or adjacent ranges are merged: the union has
+  // no address outside the two, the slave can't refuse it if it accepts both
+  for( int r = 0; r < bus->rlen; r++ ){
+    txn = bus->buckets[ bus->ring[ ( bus->rhead + r ) % GW_BUCKETS ] ].head;
+    if( !txn->read || txn->unit != unit || txn->fc != fc ||
+        addr > txn->addr + txn->count || txn->addr > addr + count ){ continue; }
+
+    int lo = addr < txn->addr ? addr : txn->addr;
+    int hi = addr + count > txn->addr + txn->count ? addr + count : txn->addr + txn->count;
+    if( hi - lo > gw_read_max( fc ) ){ continue; }
+
+    txn->addr  = lo;
+    txn->count = hi - lo;
+    req->next  = txn->reqs;
+    txn->reqs  = req;
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * @brief      Queues the requests submitted, answering at once the cached ones and those for a bus down
+ */
+void gw_take( uint64_t now ){
+  struct gw_req_t *req = gw_pop_all( &gw_submitted ), *next;
+
+  for( ; req; req = next ){
+    struct gw_bus_t *bus = &gw_buses[ gw_route[ req->query[6] ] - 1 ];
+    uint8_t unit = req->query[6], fc = req->query[ MBAP_HEADER_LEN ];
+    int bucket = ( (uint64_t)req->source * 0x9E3779B97F4A7C15ULL ) >> ( 64 - GW_BUCKET_BITS );
+    uint16_t addr = 0, count = 0;
+    int read = gw_read_range( req->query, req->qlen, &addr, &count );
+
+    next = req->next;
+    stats_add( &gw_cnt.requests, 1 );
+    if( bus->fd == -1 ){
+      gw_exception( req, MODBUS_EXCEPTION_GATEWAY_PATH );
+      gw_complete( req, now );
+      continue;
+    }
+
+    // A read is shared only by a master with no write waiting before it, that would change what it reads
+    if( read && !bus->buckets[ bucket ].writes ){
+      struct gw_entry_t *e = gw_cache_find( bus, unit, fc, addr, count, now );
+      if( e ){
+        stats_add( &gw_cnt.cached, 1 );
+        gw_slice( req, e->addr, e->data );
+        gw_complete( req, now );
+        continue;
+      }
+      if( gw_coalesce( bus, req, unit, fc, addr, count ) ){
+        stats_add( &gw_cnt.coalesced, 1 );
+        continue;
+      }
+    }
+
+    struct gw_txn_t *txn = malloc( sizeof( struct gw_txn_t ) );
+    if( !txn ){
+      gw_exception( req, MODBUS_EXCEPTION_SLAVE_OR_SERVER_FAILURE );
+      gw_complete( req, now );
+      continue;
+    }
+    req->next   = NULL;
+    txn->reqs   = req;
+    txn->bucket = bucket;
+    txn->unit   = unit;
+    txn->fc     = fc;
+    txn->read   = read;
+    txn->addr   = addr;
+    txn->count  = count;
+    if( !read ){ bus->buckets[ bucket ].writes++; }
+    gw_enqueue( bus, txn );
+  }
+}
+
+int gw_send( struct gw_bus_t *bus, uint64_t now ){
+  while( bus->osent < bus->olen ){
+    ssize_t n = write( bus->fd, bus->obuf + bus->osent, bus->olen - bus->osent );
+    if( n < 0 ){ return ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ) ? 0 : -1; }
+    bus->osent += n;
+  }
+
+  // The reply is waited for from the end of the query
+  bus->deadline = now + gw_timeout;
+  bus->tlast    = now;
+  return 0;
+}
+
+/**
+ * @brief      Puts the next transaction on the line
+ *
+ * @return     0 on success, -1 on line errors
+ */
+int gw_begin( struct gw_bus_t *bus, uint64_t now ){
+  struct gw_txn_t *txn = gw_dequeue( bus );
+
+  bus->obuf[0] = txn->unit;
+  if( txn->read ){
+    bus->obuf[1] = txn->fc;
+    bus->obuf[2] = txn->addr >> 8;
+    bus->obuf[3] = txn->addr & 0xFF;
+    bus->obuf[4] = txn->count >> 8;
+    bus->obuf[5] = txn->count & 0xFF;
+    bus->olen    = 6;
+  }
+  else{
+    bus->olen = 1 + txn->reqs->qlen - MBAP_HEADER_LEN;
+    memcpy( bus->obuf + 1, txn->reqs->query + MBAP_HEADER_LEN, bus->olen - 1 );
+    gw_cache_drop( bus, txn );
+  }
+  uint16_t crc = crc16( bus->obuf, bus->olen );
+  bus->obuf[ bus->olen++ ] = crc & 0xFF;
+  bus->obuf[ bus->olen++ ] = crc >> 8;
+  bus->osent = 0;
+  bus->ilen  = 0;
+  bus->cur   = txn;
+
+  return gw_send( bus, now );
+}
+
+/**
+ * @brief      Answers the transaction on the line with the reply received
+ */
+void gw_finish( struct gw_bus_t *bus, int len, uint64_t now ){
+  struct gw_txn_t *txn = bus->cur;
+  const uint8_t *frame = bus->ibuf;
+  struct gw_req_t *req, *next;
+
+  bus->cur  = NULL;
+  bus->ilen = 0;
+  bus->idle = now + bus->times.t35;
+  if( !txn->read ){ gw_cache_drop( bus, txn ); }
+
+  if( len < 5 || crc16( frame, len - 2 ) != ( frame[ len - 2 ] | ( frame[ len - 1 ] << 8 ) ) ||
+      frame[0] != txn->unit || ( frame[1] & 0x7F ) != txn->fc ||
+      ( txn->read && !( frame[1] & 0x80 ) && ( frame[2] != gw_read_bytes( txn->fc, txn->count ) || len != 5 + frame[2] ) ) ){
+    log_ver( "Gateway bus %s: invalid reply of %d bytes from unit %d", bus->dev, len, txn->unit );
+    stats_add( &gw_cnt.errors, 1 );
+    gw_fail( bus, txn, MODBUS_EXCEPTION_GATEWAY_TARGET, now );
+    return;
+  }
+
+  stats_add( &gw_cnt.transactions, 1 );
+  if( frame[1] & 0x80 ){
+    gw_fail( bus, txn, frame[2], now );
+    return;
+  }
+  if( txn->read ){ gw_cache_store( bus, txn, frame + 3, now ); }
+
+  // Every request attached gets its own range
+  for( req = txn->reqs; req; req = next ){
+    next = req->next;
+    if( txn->read ){ gw_slice( req, txn->addr, frame + 3 ); }
+    else{ gw_reply( req, frame + RTU_HEADER_LEN, len - RTU_HEADER_LEN - 2 ); }
+    gw_complete( req, now );
+  }
+  if( !txn->read ){ bus->buckets[ txn->bucket ].writes--; }
+  free( txn );
+}
+
+/**
+ * @brief      Reads every byte available on a bus, answering the transaction once its reply is complete
+ *
+ * @return     0 on success, -1 on line errors
+ */
+int gw_read( struct gw_bus_t *bus, uint64_t now ){
+  while( 1 ){
+    ssize_t n = read( bus->fd, bus->ibuf + bus->ilen, sizeof( bus->ibuf ) - bus->ilen );
+    if( n < 0 && errno == EINTR ){ continue; }
+    if( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ){ break; }
+    if( n <= 0 ){ return -1; }
+
+    // Bytes with no query waiting for them are late replies of a transaction given up: the line is busy meanwhile
+    bus->tlast = now;
+    if( !bus->cur || bus->osent < bus->olen ){
+      bus->idle = now + bus->times.t35;
+      continue;
+    }
+    bus->ilen += n;
+    if( bus->ilen == sizeof( bus->ibuf ) ){ break; }
+  }
+
+  // Replies of known length end with their last byte, the others with a 3.5 characters silence
+  int len = bus->cur ? rtu_reply_len( bus->ibuf, bus->ilen ) : 0;
+  if( len > 0 || bus->ilen == sizeof( bus->ibuf ) ){ gw_finish( bus, len > 0 ? len : bus->ilen, now ); }
+  return 0;
+}
+
+/**
+ * @brief      Drops the bytes received since the last read, before the line takes its next transaction: late replies
+ *             would otherwise be taken as the reply of the next query
+ *
+ * @return     1 if bytes were dropped: the line is free 3.5 characters later. 0 if none, -1 on line errors
+ */
+int gw_drain( struct gw_bus_t *bus, uint64_t now ){
+  uint8_t buf[ MODBUS_RTU_MAX_ADU_LENGTH ];
+  int dropped = 0;
+
+  while( 1 ){
+    ssize_t n = read( bus->fd, buf, sizeof( buf ) );
+    if( n < 0 && errno == EINTR ){ continue; }
+    if( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ){ break; }
+    if( n <= 0 ){ return -1; }
+    dropped += n;
+  }
+  if( !dropped ){ return 0; }
+
+  log_ver( "Gateway bus %s: dropping %d late bytes", bus->dev, dropped );
+  bus->tlast = now;
+  bus->idle  = now + bus->times.t35;
+  return 1;
+}
+
+/**
+ * @brief      Closes a failed bus: its transactions get the gateway path exception until it is reopened
+ */
+void gw_down( struct gw_bus_t *bus, uint64_t now ){
+  log_err( "Gateway bus %s failed: %s. Retrying in %d seconds", bus->dev, errno ? strerror( errno ) : "hung up", GW_RETRY_SEC );
+  stats_add( &gw_cnt.errors, 1 );
+
+  if( bus->fd  != -1 ){ close( bus->fd ); }
+  if( bus->pty != -1 ){ close( bus->pty ); }
+  bus->fd    = -1;
+  bus->pty   = -1;
+  bus->retry = now + GW_RETRY_SEC * 1000000000ULL;
+
+  if( bus->cur ){ gw_fail( bus, bus->cur, MODBUS_EXCEPTION_GATEWAY_PATH, now ); }
+  bus->cur = NULL;
+  while( bus->rlen ){ gw_fail( bus, gw_dequeue( bus ), MODBUS_EXCEPTION_GATEWAY_PATH, now ); }
+}
+
+void gw_open( struct gw_bus_t *bus, uint64_t now ){
+  char pts[ TTY_PTS_LEN ];
+
+  bus->fd = tty_open( bus->dev, bus->speed, &bus->pty, pts );
+  if( bus->fd == -1 ){
+    log_err( "Unable to open gateway bus %s: %s. Retrying in %d seconds", bus->dev, strerror( errno ), GW_RETRY_SEC );
+    bus->retry = now + GW_RETRY_SEC * 1000000000ULL;
+    return;
+  }
+
+  // Whatever was on the line is over after a silence
+  bus->idle = now + bus->times.t35;
+  if( bus->pty != -1 ){ log_inf( "Gateway bus %s: %s, %d baud", bus->dev, pts, bus->speed ); }
+  else{ log_inf( "Gateway bus %s: %d baud", bus->dev, bus->speed ); }
+}
+
+void gw_runner( void *arg ){
+  struct pollfd pfds[ 1 + GW_BUSES_MAX ];
+
+  // Transactions are timed to the usec, as the RTU slave replies
+  prctl( PR_SET_TIMERSLACK, 1UL );
+  log_inf( "Gateway thread started: %d buses", gw_nbuses );
+
+  while( !__atomic_load_n( &gw_terminate, __ATOMIC_RELAXED ) ){
+    uint64_t now = stats_now(), next = now + GW_WAIT_MSEC * MSEC;
+
+    // Every free line takes its next transaction, sleeping up to the first line time to wait for
+    for( int i = 0; i < gw_nbuses; i++ ){
+      struct gw_bus_t *bus = &gw_buses[i];
+
+      pfds[ 1 + i ].fd      = -1;
+      pfds[ 1 + i ].events  = POLLIN;
+      pfds[ 1 + i ].revents = 0;
+      if( bus->fd == -1 && now >= bus->retry ){ gw_open( bus, now ); }
+      if( bus->fd == -1 ){
+        if( bus->retry < next ){ next = bus->retry; }
+        continue;
+      }
+
+      if( !bus->cur && bus->rlen ){
+        int late = now >= bus->idle ? gw_drain( bus, now ) : 0;
+        if( late < 0 || ( now >= bus->idle && gw_begin( bus, now ) != 0 ) ){
+          gw_down( bus, now );
+          continue;
+        }
+        if( now < bus->idle && bus->idle < next ){ next = bus->idle; }
+      }
+      pfds[ 1 + i ].fd = bus->fd;
+      if( bus->cur && bus->osent < bus->olen ){ pfds[ 1 + i ].events |= POLLOUT; }
+      else if( bus->cur ){
+        uint64_t due = bus->ilen ? bus->tlast + bus->times.t35 : bus->deadline;
+        if( due < next ){ next = due; }
+      }
+    }
+
+    pfds[0].fd      = gw_submit_fd;
+    pfds[0].events  = POLLIN;
+    pfds[0].revents = 0;
+    uint64_t wait = next > now ? next - now : 0;
+    struct timespec to = { wait / 1000000000ULL, wait % 1000000000ULL };
+    if( ppoll( pfds, 1 + gw_nbuses, &to, NULL ) < 0 && errno != EINTR ){
+      log_err( "Gateway poll failed: %s", strerror( errno ) );
+      break;
+    }
+
+    now = stats_now();
+    if( pfds[0].revents & POLLIN ){
+      eventfd_t val;
+      eventfd_read( gw_submit_fd, &val );
+      gw_take( now );
+    }
+
+    for( int i = 0; i < gw_nbuses; i++ ){
+      struct gw_bus_t *bus = &gw_buses[i];
+      if( bus->fd == -1 ){ continue; }
+
+      errno = 0;
+      if( ( pfds[ 1 + i ].revents & ( POLLERR | POLLHUP | POLLNVAL ) ) ||
+          ( ( pfds[ 1 + i ].revents & POLLIN  ) && gw_read( bus, now ) != 0 ) ||
+          ( ( pfds[ 1 + i ].revents & POLLOUT ) && gw_send( bus, now ) != 0 ) ){
+        gw_down( bus, now );
+        continue;
+      }
+
+      // A reply cut short or of unknown length ends with the silence, a missing one with the deadline
+      if( !bus->cur || bus->osent < bus->olen ){ continue; }
+      if( bus->ilen && now - bus->tlast >= bus->times.t35 ){ gw_finish( bus, bus->ilen, now ); }
+      else if( !bus->ilen && now >= bus->deadline ){
+        log_ver( "Gateway bus %s: no reply from unit %d", bus->dev, bus->cur->unit );
+        stats_add( &gw_cnt.timeouts, 1 );
+        gw_fail( bus, bus->cur, MODBUS_EXCEPTION_GATEWAY_TARGET, now );
+        bus->cur  = NULL;
+        bus->idle = now + bus->times.t35;
+      }
+    }
+
+    // A single wake up per queue, however many requests completed to it
+    for( int q = 0; q < gw_nqueues; q++ ){
+      if( !gw_kick[q] ){ continue; }
+      gw_kick[q] = 0;
+      eventfd_write( gw_queue_fds[q], 1 );
+    }
+  }
+
+  log_inf( "Gateway thread terminated: %lu requests, %lu transactions", gw_cnt.requests, gw_cnt.transactions );
+  pthread_exit( NULL );
+}
+
+int gw_start( const char *routes, int speed, int queues, uint32_t timeout_msec, uint32_t ttl_msec ){
+  memset( gw_route, 0, sizeof( gw_route ) );
+  memset( &gw_cnt, 0, sizeof( gw_cnt ) );
+  gw_terminate = 0;
+  gw_timeout   = timeout_msec * MSEC;
+  gw_ttl       = ttl_msec * MSEC;
+  gw_nqueues   = queues;
+
+  gw_buses     = calloc( GW_BUSES_MAX, sizeof( struct gw_bus_t ) );
+  gw_queue_fds = calloc( queues, sizeof( int ) );
+  gw_completed = calloc( queues, sizeof( struct gw_req_t * ) );
+  gw_kick      = calloc( queues, sizeof( uint8_t ) );
+  if( !gw_buses || !gw_queue_fds || !gw_completed || !gw_kick ){
+    log_err( "Failed to allocate the gateway" );
+    return -1;
+  }
+  if( gw_parse( routes, speed ) != 0 ){
+    log_err( "Invalid gateway routes: %s", routes );
+    return -1;
+  }
+
+  for( int q = 0; q < queues; q++ ){ gw_queue_fds[q] = -1; }
+  gw_submit_fd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+  for( int q = 0; q < queues && gw_submit_fd != -1; q++ ){
+    if( ( gw_queue_fds[q] = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC ) ) == -1 ){ break; }
+  }
+  if( gw_submit_fd == -1 || gw_queue_fds[ queues - 1 ] == -1 ){
+    log_err( "Failed creating the gateway eventfds: %s", strerror( errno ) );
+    return -1;
+  }
+
+  if( pthread_create( &gw_thread, NULL, (void *)&gw_runner, NULL ) ){
+    log_err( "FAILED CREATING gateway thread" );
+    gw_thread = 0;
+    return -1;
+  }
+  pthread_setname_np( gw_thread, "mbgw" );
+
+  log_inf( "Gateway: %d buses, replies waited %u ms, reads cached %u ms", gw_nbuses, timeout_msec, ttl_msec );
+  return 0;
+}
+
+void gw_free_reqs( struct gw_req_t *req ){
+  struct gw_req_t *next;
+  for( ; req; req = next ){
+    next = req->next;
+    free( req );
+  }
+}
+
+void gw_stop(){
+  if( gw_thread ){
+    __atomic_store_n( &gw_terminate, 1, __ATOMIC_RELAXED );
+    eventfd_write( gw_submit_fd, 1 );
+    pthread_join( gw_thread, NULL );
+    gw_thread = 0;
+  }
+
+  // Nobody submits nor takes completions anymore
+  gw_free_reqs( gw_pop_all( &gw_submitted ) );
+  for( int i = 0; gw_buses && i < gw_nbuses; i++ ){
+    struct gw_bus_t *bus = &gw_buses[i];
+
+    if( bus->cur ){
+      gw_free_reqs( bus->cur->reqs );
+      free( bus->cur );
+    }
+    while( bus->rlen ){
+      struct gw_txn_t *txn = gw_dequeue( bus );
+      gw_free_reqs( txn->reqs );
+      free( txn );
+    }
+    if( bus->fd  != -1 ){ close( bus->fd ); }
+    if( bus->pty != -1 ){ close( bus->pty ); }
+  }
+  for( int q = 0; q < gw_nqueues; q++ ){
+    if( gw_completed ){ gw_free_reqs( gw_pop_all( &gw_completed[q] ) ); }
+    if( gw_queue_fds && gw_queue_fds[q] != -1 ){ close( gw_queue_fds[q] ); }
+  }
+  if( gw_submit_fd != -1 ){ close( gw_submit_fd ); }
+
+  free( gw_buses );
+  free( gw_queue_fds );
+  free( gw_completed );
+  free( gw_kick );
+  gw_buses     = NULL;
+  gw_queue_fds = NULL;
+  gw_completed = NULL;
+  gw_kick      = NULL;
+  gw_submit_fd = -1;
+  gw_nbuses    = 0;
+  gw_nqueues   = 0;
+  memset( gw_route, 0, sizeof( gw_route ) );
+}
+
+int gw_routed( uint8_t unit ){
+  return gw_route[ unit ] != 0;
+}
+
+int gw_fd( int queue ){
+  return gw_queue_fds[ queue ];
+}
+
+void gw_submit( struct gw_req_t *req ){
+  req->tsubmit = stats_now();
+
+  // Only the request finding the stack empty raises the gateway, the others are taken with it
+  if( gw_push( &gw_submitted, req ) ){ eventfd_write( gw_submit_fd, 1 ); }
+}
+
+struct gw_req_t *gw_done( int queue ){
+  return gw_pop_all( &gw_completed[ queue ] );
+}
+
+void gw_counters( struct gw_counters_t *counters ){
+  counters->requests     = __atomic_load_n( &gw_cnt.requests,     __ATOMIC_RELAXED );
+  counters->transactions = __atomic_load_n( &gw_cnt.transactions, __ATOMIC_RELAXED );
+  counters->coalesced    = __atomic_load_n( &gw_cnt.coalesced,    __ATOMIC_RELAXED );
+  counters->cached       = __atomic_load_n( &gw_cnt.cached,       __ATOMIC_RELAXED );
+  counters->timeouts     = __atomic_load_n( &gw_cnt.timeouts,     __ATOMIC_RELAXED );
+  counters->errors       = __atomic_load_n( &gw_cnt.errors,       __ATOMIC_RELAXED );
+  memset( &counters->lat, 0, sizeof( counters->lat ) );
+  stats_hist_add( &counters->lat, &gw_cnt.lat );
+}
@@ -0,0 +1,105 @@
+#ifndef _MBT_GW_H_
+#define _MBT_GW_H_
+
+#include <stdint.h>
+
+#include <modbus/modbus.h>
+
+#include "mbt-fault.h"
+#include "mbt-stats.h"
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ DEFINITIONS
+#define GW_BUSES_MAX            16                 ///< RTU buses served by the gateway
+#define GW_PENDING_MAX          64                 ///< Queries of a TCP connection waiting for a bus, its next ones stay in the kernel
+#define DEF_GW_TIMEOUT_MSEC     500                ///< Default wait for a slave reply
+#define DEF_GW_TTL_MSEC         100                ///< Default age of the cached reads still served, 0 disables the cache
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ TYPES
+/**
+ * A TCP query routed to a bus, and its reply. Allocated by the submitter, it comes back to it through its queue.
+ */
+struct gw_req_t{
+  struct gw_req_t *next;                           ///< Next request in the same list
+  void            *owner;                          ///< Submitter own reference, the connection
+  int              queue;                          ///< Queue the request completes to, the submitter worker
+  uintptr_t        source;                         ///< Master of the query: requests of the same master share a fair queue bucket
+  uint64_t         tsubmit;                        ///< Time the request was submitted
+  uint16_t         qlen;                           ///< Query length
+  uint16_t         rlen;                           ///< Reply length, set on completion
+  struct fault_t   fault;                          ///< Fault injected into the reply by the submitter: none, delay or truncate
+  uint8_t          query[ MODBUS_TCP_MAX_ADU_LENGTH ]; ///< Query ADU, MBAP header included
+  uint8_t          rsp[ MODBUS_TCP_MAX_ADU_LENGTH ];   ///< Reply ADU, MBAP header included
+};
+
+struct gw_counters_t{
+  uint64_t            requests;                    ///< Queries routed
+  uint64_t            transactions;                ///< Serial transactions completed, each answering one or more queries
+  uint64_t            coalesced;                   ///< Reads answered by the transaction of another query
+  uint64_t            cached;                      ///< Reads answered from the cache
+  uint64_t            timeouts;                    ///< Transactions never answered
+  uint64_t            errors;                      ///< Invalid replies and line failures
+  struct stats_hist_t lat;                         ///< Query routed to reply ready
+};
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS
+
+/**
+ * @brief      Starts the gateway thread, serving every bus
+ *
+ * @param[in]  routes        Units and their bus, ';' separated: "<units>=<tty>[@<speed>]", units being a list like "1,5,10-20"
+ * @param[in]  speed         Baud rate of the buses without their own
+ * @param[in]  queues        Completion queues, one per submitter
+ * @param[in]  timeout_msec  Wait for a slave reply
+ * @param[in]  ttl_msec      Age of the cached reads still served, 0 for no cache
+ *
+ * @return     0 on success, -1 on failure
+ */
+int gw_start( const char *routes, int speed, int queues, uint32_t timeout_msec, uint32_t ttl_msec );
+
+/**
+ * @brief      Stops the gateway thread. Requests still queued are freed, submitters must be stopped first
+ */
+void gw_stop();
+
+/**
+ * @brief      Tells if a unit is routed to a bus
+ *
+ * @param[in]  unit  The unit id
+ *
+ * @return     1 if routed, 0 otherwise
+ */
+int gw_routed( uint8_t unit );
+
+/**
+ * @brief      Gets the eventfd of a completion queue: readable once requests completed
+ *
+ * @param[in]  queue  The queue
+ *
+ * @return     The eventfd, non-blocking
+ */
+int gw_fd( int queue );
+
+/**
+ * @brief      Hands a request over to its bus, from any thread
+ *
+ * @param      req   The request: owner, queue, source and query must be set
+ */
+void gw_submit( struct gw_req_t *req );
+
+/**
+ * @brief      Takes the requests completed to a queue, its eventfd must be read first
+ *
+ * @param[in]  queue  The queue
+ *
+ * @return     The requests in completion order, linked by next. NULL if none
+ */
+struct gw_req_t *gw_done( int queue );
+
+/**
+ * @brief      Reads the gateway counters
+ *
+ * @param[out] counters  Filled with a snapshot of the counters
+ */
+void gw_counters( struct gw_counters_t *counters );
+
+#endif // _MBT_GW_H_
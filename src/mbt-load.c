@@ -0,0 +1,660 @@
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ INCLUDES
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+
+#include "mbt-load.h"
+#include "mbt-adu.h"
+#include "mbt-tty.h"
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ DEFINITIONS
+#define LOAD_IBUF_SIZE  ( 4 * MODBUS_TCP_MAX_ADU_LENGTH )  ///< Per connection receive buffer
+#define LOAD_REQ_MAX          MODBUS_TCP_MAX_ADU_LENGTH    ///< Longest request
+#define LOAD_DEPTH_MAX     1024                            ///< Max requests in flight per connection
+#define LOAD_RETRY_MSEC     100                            ///< Wait before opening again a failed connection
+#define LOAD_WAIT_MSEC      100                            ///< Longest event loop sleep
+#define LOAD_CHECK_MSEC      10                            ///< Interval between two reply timeout checks
+#define LOAD_EVENTS         256                            ///< Max events returned by a single wait
+#define MSEC                1000000ULL                     ///< Nanoseconds in a millisecond
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ TYPES
+enum load_state_type {
+  LOAD_CLOSED,
+  LOAD_CONNECTING,
+  LOAD_UP
+};
+
+struct load_req_t{
+  uint64_t due;                                            ///< Time the request was due: sent time in a closed loop
+  uint64_t sent;                                           ///< Time the request was queued for sending
+  uint8_t  fc;                                             ///< Function code
+  uint8_t  used;                                           ///< Waiting for its reply
+};
+
+struct load_conn_t{
+  int                  fd;                                 ///< Socket or tty
+  enum load_state_type state;                              ///< Connection state
+  uint64_t             next;                               ///< Open loop: time the next request is due
+  uint64_t             retry;                              ///< Time a closed connection is opened again
+  uint64_t             idle;                               ///< RTU: end of the line silence after a reply
+  int                  nfree;                              ///< Free request slots
+  uint16_t            *free;                               ///< Free request slots stack
+  struct load_req_t   *reqs;                               ///< Request slots: a TCP transaction identifier is its slot
+  uint16_t             ilen;                               ///< Bytes waiting in ibuf
+  uint16_t             olen;                               ///< Bytes queued in obuf
+  uint16_t             osent;                              ///< Bytes of obuf already sent
+  uint8_t              ibuf[ LOAD_IBUF_SIZE ];             ///< Receive buffer, may end with a partial reply
+  uint8_t             *obuf;                               ///< Send buffer, room for depth requests
+};
+
+struct load_worker_t{
+  int                  id;                                 ///< Worker index
+  pthread_t            thread;                             ///< Event loop thread
+  struct load_args_t  *args;                               ///< Test arguments, shared by all workers
+  struct load_conn_t  *conns;                              ///< Connections served by the worker
+  int                  nconns;                             ///< Number of connections
+  uint64_t             interval;                           ///< Open loop: ns between two requests of a connection
+  struct tty_times_t   times;                              ///< RTU line times
+  uint32_t             seed;                               ///< Worker own random generator state
+  uint64_t             timeouts;                           ///< Requests never answered
+  uint64_t             errors;                             ///< Failed connections, invalid replies
+  uint64_t             connects;                           ///< Connections opened
+  struct load_fc_t     fc[ STATS_FCS ];                    ///< Per function code results, written by the worker only
+};
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ GLOBAL VARS
+int                     load_terminate = 0;                ///< If set the workers stop
+int                     load_nmix = 0;                     ///< Function codes in the mix
+uint8_t                 load_mix_fc[ LOAD_MIX_MAX ];       ///< Function codes of the mix
+uint32_t                load_mix_cum[ LOAD_MIX_MAX ];      ///< Cumulated weights of the mix
+struct sockaddr_storage load_sa;                           ///< TCP server address, resolved once
+socklen_t               load_salen = 0;                    ///< TCP server address length
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS
+uint32_t load_rand( uint32_t *seed ){
+  uint32_t x = *seed;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *seed = x;
+}
+
+/**
+ * @brief      Gets the most registers or bits a function code can carry
+ */
+int load_fc_max( uint8_t fc ){
+  switch( fc ){
+    case MODBUS_FC_READ_COILS:
+    case MODBUS_FC_READ_DISCRETE_INPUTS:     return MODBUS_MAX_READ_BITS;
+    case MODBUS_FC_READ_HOLDING_REGISTERS:
+    case MODBUS_FC_READ_INPUT_REGISTERS:     return MODBUS_MAX_READ_REGISTERS;
+    case MODBUS_FC_WRITE_SINGLE_COIL:
+    case MODBUS_FC_WRITE_SINGLE_REGISTER:    return 0xFFFF;
+    case MODBUS_FC_WRITE_MULTIPLE_COILS:     return MODBUS_MAX_WRITE_BITS;
+    case MODBUS_FC_WRITE_MULTIPLE_REGISTERS: return MODBUS_MAX_WRITE_REGISTERS;
+    default:                                 return 0;
+  }
+}
+
+/**
+ * @brief      Parses a function code mix, eg. "3:80,16:20", checking every code can carry count entries
+ *
+ * @return     0 on success, -1 if invalid
+ */
+int load_parse_mix( const char *mix, int count ){
+  const char *p = mix;
+  uint32_t total = 0;
+
+  load_nmix = 0;
+  while( *p ){
+    char *end;
+    long fc = strtol( p, &end, 0 ), weight = 1;
+    if( end == p || load_nmix == LOAD_MIX_MAX ){ return -1; }
+    if( *end == ':' ){
+      p = end + 1;
+      weight = strtol( p, &end, 10 );
+      if( end == p || weight <= 0 ){ return -1; }
+    }
+    if( fc <= 0 || fc > 0x7F || load_fc_max( fc ) < count ){
+      log_err( "Function code %ld can not carry %d entries", fc, count );
+      return -1;
+    }
+
+    total += weight;
+    load_mix_fc[ load_nmix ]  = fc;
+    load_mix_cum[ load_nmix ] = total;
+    load_nmix++;
+
+    p = end;
+    if( *p == ',' ){ p++; }
+    else if( *p ){ return -1; }
+  }
+
+  return load_nmix ? 0 : -1;
+}
+
+uint8_t load_pick_fc( struct load_worker_t *w ){
+  if( load_nmix == 1 ){ return load_mix_fc[0]; }
+
+  uint32_t r = load_rand( &w->seed ) % load_mix_cum[ load_nmix - 1 ];
+  int i = 0;
+  while( r >= load_mix_cum[i] ){ i++; }
+  return load_mix_fc[i];
+}
+
+/**
+ * @brief      Builds a request PDU
+ *
+ * @return     The PDU length
+ */
+int load_pdu( struct load_worker_t *w, uint8_t fc, uint8_t *pdu ){
+  struct load_args_t *args = w->args;
+  int count = ( fc == MODBUS_FC_WRITE_SINGLE_COIL || fc == MODBUS_FC_WRITE_SINGLE_REGISTER ) ? 1 : args->count;
+  int addr  = args->reg_addr;
+  int nb;
+
+  if( args->span > count ){ addr += load_rand( &w->seed ) % ( args->span - count + 1 ); }
+
+  pdu[0] = fc;
+  pdu[1] = addr >> 8;
+  pdu[2] = addr & 0xFF;
+  switch( fc ){
+    case MODBUS_FC_WRITE_SINGLE_COIL:
+      pdu[3] = ( load_rand( &w->seed ) & 1 ) ? 0xFF : 0x00;
+      pdu[4] = 0x00;
+      return 5;
+
+    case MODBUS_FC_WRITE_SINGLE_REGISTER:
+      nb = load_rand( &w->seed );
+      pdu[3] = nb >> 8;
+      pdu[4] = nb & 0xFF;
+      return 5;
+
+    case MODBUS_FC_WRITE_MULTIPLE_COILS:
+    case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+      nb = ( fc == MODBUS_FC_WRITE_MULTIPLE_COILS ) ? ( count + 7 ) / 8 : count * 2;
+      pdu[3] = count >> 8;
+      pdu[4] = count & 0xFF;
+      pdu[5] = nb;
+      for( int i = 0; i < nb; i++ ){ pdu[ 6 + i ] = load_rand( &w->seed ); }
+      return 6 + nb;
+
+    default:
+      pdu[3] = count >> 8;
+      pdu[4] = count & 0xFF;
+      return 5;
+  }
+}
+
+void load_queue( struct load_worker_t *w, struct load_conn_t *conn, uint64_t due, uint64_t now ){
+  struct load_args_t *args = w->args;
+  uint16_t slot = conn->free[ --conn->nfree ];
+  struct load_req_t *req = &conn->reqs[ slot ];
+  uint8_t *adu = conn->obuf + conn->olen;
+  int len;
+
+  req->fc   = load_pick_fc( w );
+  req->due  = due;
+  req->sent = now;
+  req->used = 1;
+
+  if( args->proto == MDB_PROTO_TCP ){
+    int plen = load_pdu( w, req->fc, adu + MBAP_HEADER_LEN );
+    adu[0] = slot >> 8;
+    adu[1] = slot & 0xFF;
+    adu[2] = 0;
+    adu[3] = 0;
+    adu[4] = ( plen + 1 ) >> 8;
+    adu[5] = ( plen + 1 ) & 0xFF;
+    adu[6] = args->unit;
+    len = MBAP_HEADER_LEN + plen;
+  }
+  else{
+    adu[0] = args->unit;
+    len = RTU_HEADER_LEN + load_pdu( w, req->fc, adu + RTU_HEADER_LEN );
+    uint16_t crc = crc16( adu, len );
+    adu[ len++ ] = crc & 0xFF;
+    adu[ len++ ] = crc >> 8;
+  }
+  conn->olen += len;
+
+  struct load_fc_t *st = &w->fc[ stats_slot( req->fc ) ];
+  stats_add( &st->sent, 1 );
+  stats_add( &st->bytes_out, len );
+}
+
+/**
+ * @brief      Queues every request due: depth of them in a closed loop, the ones whose time came in an open loop
+ */
+void load_fill( struct load_worker_t *w, struct load_conn_t *conn, uint64_t now ){
+  if( now < conn->idle ){ return; }
+
+  if( !w->interval ){
+    while( conn->nfree ){ load_queue( w, conn, now, now ); }
+    return;
+  }
+
+  // Requests late because every slot was taken keep their due time: their wait is part of their latency
+  while( conn->nfree && conn->next <= now ){
+    load_queue( w, conn, conn->next, now );
+    conn->next += w->interval;
+  }
+}
+
+int load_flush( struct load_worker_t *w, struct load_conn_t *conn ){
+  while( conn->osent < conn->olen ){
+    ssize_t wr = ( w->args->proto == MDB_PROTO_TCP ) ?
+                 send( conn->fd, conn->obuf + conn->osent, conn->olen - conn->osent, MSG_NOSIGNAL ) :
+                 write( conn->fd, conn->obuf + conn->osent, conn->olen - conn->osent );
+    if( wr < 0 ){
+      if( errno == EINTR ){ continue; }
+      if( errno == EAGAIN || errno == EWOULDBLOCK ){ break; }
+      return -1;
+    }
+    conn->osent += wr;
+  }
+
+  // Unsent bytes go back to the start: the buffer only has room for depth requests
+  if( conn->osent ){
+    memmove( conn->obuf, conn->obuf + conn->osent, conn->olen - conn->osent );
+    conn->olen -= conn->osent;
+    conn->osent = 0;
+  }
+  return 0;
+}
+
+void load_reset( struct load_worker_t *w, struct load_conn_t *conn ){
+  for( int i = 0; i < w->args->depth; i++ ){
+    conn->reqs[i].used = 0;
+    conn->free[i] = w->args->depth - 1 - i;
+  }
+  conn->nfree = w->args->depth;
+  conn->ilen  = 0;
+  conn->olen  = 0;
+  conn->osent = 0;
+}
+
+void load_close( struct load_worker_t *w, struct load_conn_t *conn, uint64_t now ){
+  // Requests still in flight will never be answered
+  stats_add( &w->timeouts, w->args->depth - conn->nfree );
+  load_reset( w, conn );
+
+  if( conn->fd != -1 ){ close( conn->fd ); }
+  conn->fd    = -1;
+  conn->state = LOAD_CLOSED;
+  conn->retry = now + LOAD_RETRY_MSEC * MSEC;
+}
+
+void load_open( struct load_worker_t *w, int epfd, struct load_conn_t *conn, uint64_t now ){
+  struct load_args_t *args = w->args;
+  struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = conn };
+
+  if( args->proto == MDB_PROTO_TCP ){
+    int on = 1;
+    conn->fd = socket( load_sa.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+    if( conn->fd == -1 ){ goto fail; }
+    setsockopt( conn->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof( on ) );
+    if( connect( conn->fd, (struct sockaddr *)&load_sa, load_salen ) == -1 && errno != EINPROGRESS ){ goto fail; }
+    conn->state = LOAD_CONNECTING;
+  }
+  else{
+    int pty;
+    char pts[ TTY_PTS_LEN ];
+    conn->fd = tty_open( args->dev, args->speed, &pty, pts );
+    if( conn->fd == -1 ){ goto fail; }
+    conn->state = LOAD_UP;
+    conn->idle  = now + w->times.t35;
+    stats_add( &w->connects, 1 );
+  }
+
+  if( epoll_ctl( epfd, EPOLL_CTL_ADD, conn->fd, &ev ) == -1 ){ goto fail; }
+  return;
+
+fail:
+  log_ver( "Worker %d failed opening a connection: %s", w->id, strerror( errno ) );
+  stats_add( &w->errors, 1 );
+  load_close( w, conn, now );
+}
+
+void load_reply( struct load_worker_t *w, struct load_conn_t *conn, const uint8_t *adu, int len, uint64_t now ){
+  int slot;
+  uint8_t fc;
+
+  if( w->args->proto == MDB_PROTO_TCP ){
+    slot = ( adu[0] << 8 ) | adu[1];
+    fc   = adu[ MBAP_HEADER_LEN ];
+  }
+  else{
+    if( crc16( adu, len - 2 ) != ( adu[ len - 2 ] | ( adu[ len - 1 ] << 8 ) ) ){
+      stats_add( &w->errors, 1 );
+      return;
+    }
+    for( slot = 0; slot < w->args->depth && !conn->reqs[ slot ].used; slot++ );
+    fc   = adu[ RTU_HEADER_LEN ];
+    conn->idle = now + w->times.t35;
+  }
+
+  if( slot >= w->args->depth || !conn->reqs[ slot ].used ){
+    stats_add( &w->errors, 1 );
+    return;
+  }
+
+  struct load_req_t *req = &conn->reqs[ slot ];
+  struct load_fc_t *st = &w->fc[ stats_slot( req->fc ) ];
+  uint64_t lat = now - req->sent;
+
+  if( ( fc & 0x7F ) != req->fc ){ stats_add( &w->errors, 1 ); }
+  if( fc & 0x80 ){ stats_add( &st->exceptions, 1 ); }
+  stats_add( &st->bytes_in, len );
+
+  // Open loop latencies start from the due time. A closed loop has no schedule to be late on: nothing to correct
+  if( w->interval ){ stats_record( &st->lat_co, now - req->due ); }
+  else{ stats_record( &st->lat_co, lat ); }
+  stats_record( &st->lat, lat );
+  stats_add( &st->replies, 1 );
+
+  req->used = 0;
+  conn->free[ conn->nfree++ ] = slot;
+}
+
+/**
+ * @brief      Reads and matches every reply available
+ *
+ * @return     0 on success, -1 if the connection must be closed
+ */
+int load_recv( struct load_worker_t *w, struct load_conn_t *conn, uint64_t now ){
+  while( 1 ){
+    ssize_t rd = read( conn->fd, conn->ibuf + conn->ilen, sizeof( conn->ibuf ) - conn->ilen );
+    if( rd == 0 ){ return -1; }
+    if( rd < 0 ){
+      if( errno == EINTR ){ continue; }
+      if( errno == EAGAIN || errno == EWOULDBLOCK ){ return 0; }
+      return -1;
+    }
+    conn->ilen += rd;
+
+    int off = 0, flen;
+    while( ( flen = ( w->args->proto == MDB_PROTO_TCP ) ? mbap_frame_len( conn->ibuf + off, conn->ilen - off ) :
+                                                          rtu_reply_len( conn->ibuf + off, conn->ilen - off ) ) > 0 ){
+      load_reply( w, conn, conn->ibuf + off, flen, now );
+      off += flen;
+    }
+    if( flen < 0 ){
+      stats_add( &w->errors, 1 );
+      return -1;
+    }
+    memmove( conn->ibuf, conn->ibuf + off, conn->ilen - off );
+    conn->ilen -= off;
+  }
+}
+
+/**
+ * @brief      Closes the connections with a request unanswered for too long
+ */
+void load_check_timeouts( struct load_worker_t *w, uint64_t now ){
+  uint64_t timeout = w->args->timeout_msec * MSEC;
+
+  for( int c = 0; c < w->nconns; c++ ){
+    struct load_conn_t *conn = &w->conns[c];
+    if( conn->state != LOAD_UP || conn->nfree == w->args->depth ){ continue; }
+
+    for( int i = 0; i < w->args->depth; i++ ){
+      if( conn->reqs[i].used && now - conn->reqs[i].sent > timeout ){
+        log_dbg( "Worker %d: reply timeout on connection %d", w->id, c );
+        load_close( w, conn, now );
+        break;
+      }
+    }
+  }
+}
+
+void *load_worker_run( struct load_worker_t *w ){
+  struct epoll_event events[ LOAD_EVENTS ];
+  uint64_t next_check = 0;
+
+  int epfd = epoll_create1( EPOLL_CLOEXEC );
+  if( epfd == -1 ){
+    log_err( "Worker %d failed creating epoll: %s", w->id, strerror( errno ) );
+    return NULL;
+  }
+
+  // Open loop requests must leave on time: the default 50us timer slack would delay them all
+  prctl( PR_SET_TIMERSLACK, 1 );
+
+  while( !__atomic_load_n( &load_terminate, __ATOMIC_RELAXED ) ){
+    uint64_t now  = stats_now();
+    uint64_t wait = LOAD_WAIT_MSEC * MSEC;
+
+    for( int c = 0; c < w->nconns; c++ ){
+      struct load_conn_t *conn = &w->conns[c];
+
+      if( conn->state == LOAD_CLOSED && now >= conn->retry ){ load_open( w, epfd, conn, now ); }
+      if( conn->state == LOAD_CLOSED ){
+        if( conn->retry - now < wait ){ wait = conn->retry - now; }
+        continue;
+      }
+      if( conn->state != LOAD_UP ){ continue; }
+
+      load_fill( w, conn, now );
+      if( load_flush( w, conn ) < 0 ){
+        stats_add( &w->errors, 1 );
+        load_close( w, conn, now );
+        continue;
+      }
+
+      // Next wake up: the line silence over RTU, the next request due in an open loop
+      if( conn->nfree && now < conn->idle && conn->idle - now < wait ){ wait = conn->idle - now; }
+      if( conn->nfree && w->interval && conn->next > now && conn->next - now < wait ){ wait = conn->next - now; }
+    }
+
+    if( now >= next_check ){
+      load_check_timeouts( w, now );
+      next_check = now + LOAD_CHECK_MSEC * MSEC;
+    }
+
+    struct timespec to = { wait / 1000000000ULL, wait % 1000000000ULL };
+    int nev = epoll_pwait2( epfd, events, LOAD_EVENTS, &to, NULL );
+    if( nev == -1 && errno == ENOSYS ){ nev = epoll_wait( epfd, events, LOAD_EVENTS, ( wait + MSEC - 1 ) / MSEC ); }
+    if( nev == -1 ){
+      if( errno != EINTR ){ log_err( "Worker %d epoll failure: %s", w->id, strerror( errno ) ); }
+      continue;
+    }
+
+    now = stats_now();
+    for( int i = 0; i < nev; i++ ){
+      struct load_conn_t *conn = events[i].data.ptr;
+
+      if( conn->state == LOAD_CONNECTING ){
+        int err = 0;
+        socklen_t errlen = sizeof( err );
+        if( !( events[i].events & ( EPOLLOUT | EPOLLERR | EPOLLHUP ) ) ){ continue; }
+        if( getsockopt( conn->fd, SOL_SOCKET, SO_ERROR, &err, &errlen ) == -1 || err ){
+          log_ver( "Worker %d failed connecting: %s", w->id, strerror( err ? err : errno ) );
+          stats_add( &w->errors, 1 );
+          load_close( w, conn, now );
+          continue;
+        }
+        conn->state = LOAD_UP;
+        stats_add( &w->connects, 1 );
+      }
+      if( conn->state != LOAD_UP ){ continue; }
+
+      if( load_recv( w, conn, now ) < 0 ){
+        log_ver( "Worker %d: connection closed", w->id );
+        stats_add( &w->errors, 1 );
+        load_close( w, conn, now );
+        continue;
+      }
+
+      // A closed loop sends again right away, the replies just freed their slots
+      load_fill( w, conn, now );
+      if( load_flush( w, conn ) < 0 ){
+        stats_add( &w->errors, 1 );
+        load_close( w, conn, now );
+      }
+    }
+  }
+
+  for( int c = 0; c < w->nconns; c++ ){
+    if( w->conns[c].fd != -1 ){ close( w->conns[c].fd ); }
+  }
+  close( epfd );
+  return NULL;
+}
+
+uint64_t load_replies( struct load_worker_t *workers, int nworkers ){
+  uint64_t tot = 0;
+
+  for( int i = 0; i < nworkers; i++ ){
+    for( int f = 0; f < STATS_FCS; f++ ){ tot += __atomic_load_n( &workers[i].fc[f].replies, __ATOMIC_RELAXED ); }
+  }
+  return tot;
+}
+
+void load_free( struct load_worker_t *workers, int nworkers ){
+  for( int i = 0; i < nworkers; i++ ){
+    for( int c = 0; c < workers[i].nconns; c++ ){
+      free( workers[i].conns[c].free );
+      free( workers[i].conns[c].reqs );
+      free( workers[i].conns[c].obuf );
+    }
+    free( workers[i].conns );
+  }
+  free( workers );
+}
+
+int load_run( struct load_args_t *args, struct load_result_t *result ){
+  memset( result, 0, sizeof( struct load_result_t ) );
+
+  // A serial line carries a single request at a time
+  if( args->proto == MDB_PROTO_RTU ){
+    args->conns   = 1;
+    args->depth   = 1;
+    args->workers = 1;
+    if( tty_baud( args->speed ) == B0 ){
+      log_err( "Unsupported serial speed %d", args->speed );
+      return -1;
+    }
+  }
+  if( args->conns <= 0 || args->depth <= 0 || args->depth > LOAD_DEPTH_MAX || args->workers <= 0 || args->rate < 0.0 ||
+      args->count <= 0 || args->reg_addr < 0 || args->reg_addr + ( args->span > args->count ? args->span : args->count ) > 0x10000 ){
+    log_err( "Invalid load arguments" );
+    return -1;
+  }
+  if( load_parse_mix( args->mix, args->count ) != 0 ){
+    log_err( "Invalid function codes mix: %s", args->mix );
+    return -1;
+  }
+  if( args->workers > args->conns ){ args->workers = args->conns; }
+
+  if( args->proto == MDB_PROTO_TCP ){
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *ai;
+    int rc = getaddrinfo( args->addr, args->port, &hints, &ai );
+    if( rc != 0 ){
+      log_err( "getaddrinfo( %s, %s ) failed: %s", args->addr, args->port, gai_strerror( rc ) );
+      return -1;
+    }
+    memcpy( &load_sa, ai->ai_addr, ai->ai_addrlen );
+    load_salen = ai->ai_addrlen;
+    freeaddrinfo( ai );
+  }
+
+  struct load_worker_t *workers = calloc( args->workers, sizeof( struct load_worker_t ) );
+  if( !workers ){ return -1; }
+
+  uint64_t start = stats_now();
+  for( int i = 0; i < args->workers; i++ ){
+    struct load_worker_t *w = &workers[i];
+    w->id       = i;
+    w->args     = args;
+    w->seed     = 0x9E3779B9u * ( i + 1 ) ^ (uint32_t)start;
+    w->interval = args->rate > 0.0 ? (uint64_t)( 1e9 * args->conns / args->rate ) : 0;
+    if( args->proto == MDB_PROTO_RTU ){ tty_times( args->speed, &w->times ); }
+    w->nconns   = args->conns / args->workers + ( i < args->conns % args->workers );
+    w->conns    = calloc( w->nconns, sizeof( struct load_conn_t ) );
+    if( !w->conns ){
+      load_free( workers, i + 1 );
+      return -1;
+    }
+
+    for( int c = 0; c < w->nconns; c++ ){
+      struct load_conn_t *conn = &w->conns[c];
+      conn->fd    = -1;
+      conn->state = LOAD_CLOSED;
+      conn->free  = malloc( args->depth * sizeof( uint16_t ) );
+      conn->reqs  = malloc( args->depth * sizeof( struct load_req_t ) );
+      conn->obuf  = malloc( args->depth * LOAD_REQ_MAX );
+      if( !conn->free || !conn->reqs || !conn->obuf ){
+        w->nconns = c + 1;
+        load_free( workers, i + 1 );
+        return -1;
+      }
+      load_reset( w, conn );
+
+      // Open loop connections start spread over their interval, not all together
+      conn->next = start + ( w->interval ? load_rand( &w->seed ) % w->interval : 0 );
+    }
+  }
+
+  __atomic_store_n( &load_terminate, 0, __ATOMIC_RELAXED );
+  int started;
+  for( started = 0; started < args->workers; started++ ){
+    if( pthread_create( &workers[ started ].thread, NULL, (void *)&load_worker_run, (void *)&workers[ started ] ) ){
+      log_err( "FAILED CREATING load worker thread %d", started );
+      __atomic_store_n( &load_terminate, 1, __ATOMIC_RELAXED );
+      break;
+    }
+
+    char tname[16];
+    snprintf( tname, sizeof( tname ), "mbld-%d", started );
+    pthread_setname_np( workers[ started ].thread, tname );
+  }
+
+  // Progress every second, until the time is over or load_stop()
+  uint64_t end = args->seconds ? start + args->seconds * 1000000000ULL : UINT64_MAX, last = start, last_replies = 0;
+  while( !__atomic_load_n( &load_terminate, __ATOMIC_RELAXED ) && stats_now() < end ){
+    usleep( 100000 );
+
+    uint64_t now = stats_now();
+    if( now - last < 1000000000ULL ){ continue; }
+
+    uint64_t replies = load_replies( workers, started );
+    log_inf( "%.0f replies/s, %lu replies", ( replies - last_replies ) * 1e9 / ( now - last ), replies );
+    last_replies = replies;
+    last         = now;
+  }
+  __atomic_store_n( &load_terminate, 1, __ATOMIC_RELAXED );
+
+  for( int i = 0; i < started; i++ ){ pthread_join( workers[i].thread, NULL ); }
+  result->elapsed = ( stats_now() - start ) / 1e9;
+
+  for( int i = 0; i < started; i++ ){
+    struct load_worker_t *w = &workers[i];
+    result->timeouts += w->timeouts;
+    result->errors   += w->errors;
+    result->connects += w->connects;
+
+    for( int f = 0; f < STATS_FCS; f++ ){
+      result->fc[f].sent       += w->fc[f].sent;
+      result->fc[f].replies    += w->fc[f].replies;
+      result->fc[f].exceptions += w->fc[f].exceptions;
+      result->fc[f].bytes_out  += w->fc[f].bytes_out;
+      result->fc[f].bytes_in   += w->fc[f].bytes_in;
+      stats_hist_add( &result->fc[f].lat, &w->fc[f].lat );
+      stats_hist_add( &result->fc[f].lat_co, &w->fc[f].lat_co );
+    }
+  }
+
+  load_free( workers, args->workers );
+  return started == args->workers ? 0 : -1;
+}
+
+void load_stop(){
+  __atomic_store_n( &load_terminate, 1, __ATOMIC_RELAXED );
+}
@@ -0,0 +1,78 @@
+#ifndef _MBT_LOAD_H_
+#define _MBT_LOAD_H_
+
+#include <stdint.h>
+
+#include "mbt-srv.h"
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ DEFINITIONS
+#define LOAD_MIX_MAX            8                  ///< Function codes in a mix
+#define DEF_LOAD_CONNS          1                  ///< Default num of TCP connections
+#define DEF_LOAD_DEPTH          1                  ///< Default requests in flight per connection
+#define DEF_LOAD_SECONDS        10                 ///< Default test length
+#define DEF_LOAD_MIX            "3"                ///< Default function code mix
+#define DEF_LOAD_COUNT          10                 ///< Default registers or bits per request
+#define DEF_LOAD_TIMEOUT_MSEC   1000               ///< Default reply timeout
+#define DEF_LOAD_UNIT           1                  ///< Default unit identifier
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ TYPES
+struct load_args_t{
+  enum mdb_proto_type proto;                       ///< Transport
+  char    *addr;                                   ///< TCP server address
+  char    *port;                                   ///< TCP server port
+  char    *dev;                                    ///< RTU tty
+  int      speed;                                  ///< RTU serial speed
+  uint8_t  unit;                                   ///< Unit identifier, the slave address over RTU
+  int      conns;                                  ///< TCP connections, RTU always has one
+  int      depth;                                  ///< Requests in flight per connection, 1 over RTU
+  int      workers;                                ///< Event loop threads, connections are spread among them
+  double   rate;                                   ///< Requests per second over all connections, 0 for a closed loop
+  int      seconds;                                ///< Test length, 0 until load_stop()
+  char    *mix;                                    ///< Function codes with their weights, eg. "3:80,16:20"
+  int      reg_addr;                               ///< First register or bit
+  int      count;                                  ///< Registers or bits per request
+  int      span;                                   ///< Requests start anywhere in reg_addr .. reg_addr + span - count
+  int      timeout_msec;                           ///< Reply timeout, the connection is reopened when it expires
+};
+
+struct load_fc_t{
+  uint64_t            sent;                        ///< Requests sent
+  uint64_t            replies;                     ///< Replies received, exceptions included
+  uint64_t            exceptions;                  ///< Exception replies
+  uint64_t            bytes_out;                   ///< Request bytes
+  uint64_t            bytes_in;                    ///< Reply bytes
+  struct stats_hist_t lat;                         ///< Latency from the request sent
+  struct stats_hist_t lat_co;                      ///< Latency corrected for coordinated omission
+};
+
+struct load_result_t{
+  double           elapsed;                        ///< Seconds the test lasted
+  uint64_t         timeouts;                       ///< Requests never answered
+  uint64_t         errors;                         ///< Failed connections, invalid replies
+  uint64_t         connects;                       ///< Connections opened
+  struct load_fc_t fc[ STATS_FCS ];                ///< Per function code, see stats_slot()
+};
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS
+
+/**
+ * @brief      Runs a load test, logging the requests rate every second
+ *
+ * In a closed loop (rate 0) every connection keeps depth requests in flight. In an open loop every connection
+ * sends at its share of rate, whatever the replies: a late request still counts its latency from the time it
+ * was due, so a stalled server cannot hide its stall: those are the corrected latencies. A closed loop has no
+ * schedule to be late on, its corrected latencies are the raw ones.
+ *
+ * @param      args    The test arguments
+ * @param[out] result  The test results
+ *
+ * @return     0 on success, -1 on invalid arguments or when no connection could be started
+ */
+int load_run( struct load_args_t *args, struct load_result_t *result );
+
+/**
+ * @brief      Stops a running load test before its time, safe from a signal handler
+ */
+void load_stop();
+
+#endif // _MBT_LOAD_H_
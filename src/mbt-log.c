@@ -0,0 +1,475 @@
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ INCLUDES
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mbt-log.h"
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ DEFINITIONS
+#define LOG_RING_SIZE         65536                ///< Bytes of every thread ring, a power of 2
+#define LOG_REC_MAX            1024                ///< Max bytes of a record, arguments included
+#define LOG_STR_MAX             255                ///< Longest string argument kept
+#define LOG_SPEC_MAX             32                ///< Longest conversion specification, eg. "%-08.3lu"
+#define LOG_LINE_MAX           2048                ///< Room reserved for a formatted line
+#define LOG_OUT_SIZE          65536                ///< Writer batch buffer, written with a single call
+#define LOG_IDLE_USEC          2000                ///< Writer sleep when every ring is empty
+#define LOG_SKIP               0xFF                ///< Level of the filler record at the end of a ring
+#define LOG_ALIGN( x )         ( ( (x) + 7 ) & ~7 )
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ TYPES
+struct log_rec_t{
+  uint16_t    size;                                ///< Record bytes, arguments included, multiple of 8
+  uint8_t     lvl;                                 ///< Message level, LOG_SKIP for the filler
+  uint8_t     text;                                ///< args holds the formatted message: logstr could not be parsed
+  uint32_t    alen;                                ///< Arguments bytes
+  time_t      sec;                                 ///< Timestamp
+  const char *pfx;                                 ///< Message prefix, a literal
+  const char *fmt;                                 ///< Message format, a literal
+  uint8_t     args[];                              ///< Arguments in format order, 8 bytes each, strings copied
+};
+struct log_ring_t{
+  uint64_t           head __attribute__(( aligned( 64 ) ));   ///< Bytes ever queued, owned by the thread
+  uint64_t           dropped;                                  ///< Messages lost to a full ring
+  uint64_t           tail __attribute__(( aligned( 64 ) ));   ///< Bytes ever written out, owned by the writer
+  uint64_t           reported;                                 ///< Lost messages already reported
+  int                used;                                     ///< Held by a running thread
+  struct log_ring_t *next;                                     ///< Rings list, only ever grows
+  uint8_t            buf[ LOG_RING_SIZE ] __attribute__(( aligned( 8 ) ));
+};
+struct log_spec_t{
+  int  len;                                        ///< Specification length, '%' included
+  int  star;                                       ///< Width and precision taken from arguments
+  char mod;                                        ///< Length modifier, 'H' for hh and 'q' for ll
+  char conv;                                       ///< Conversion
+};
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ GLOBAL VARS
+int msg_colors = 0;                                ///< Global variable to set colored msg output
+int msg_dbgl   = DBG_INF;                          ///< Sets debug level, higher means more informations
+
+struct log_ring_t *log_rings = NULL;               ///< Every ring ever created
+pthread_mutex_t log_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_once_t  log_once = PTHREAD_ONCE_INIT;
+pthread_key_t   log_ring_key;                      ///< Gives the ring back when its thread exits
+pthread_t       log_thread;                        ///< Formats and writes the queued messages
+int             log_stop = 0;                      ///< The writer is asked to empty the rings and exit
+int             log_sync = 0;                      ///< No writer running: messages are written by their caller
+__thread struct log_ring_t *log_ring = NULL;       ///< Calling thread ring
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS
+void set_debug( int lvl ){
+  msg_dbgl = lvl;
+}
+void set_msg_colors( int on ){
+  msg_colors = on == 1 ? 1 : 0;
+}
+
+int is_msg_colors(){
+  return msg_colors;
+}
+int get_debug(){
+  return msg_dbgl;
+}
+
+/**
+ * @brief      Parses the printf conversion specification starting at f
+ *
+ * @return     0 on success, -1 for anything not supported
+ */
+int log_spec( const char *f, struct log_spec_t *sp ){
+  const char *p = f + 1;
+
+  sp->star = 0;
+  p += strspn( p, "-+ #0'" );
+  if( *p == '*' ){ sp->star++; p++; }
+  else{ p += strspn( p, "0123456789" ); }
+  if( *p == '.' ){
+    p++;
+    if( *p == '*' ){ sp->star++; p++; }
+    else{ p += strspn( p, "0123456789" ); }
+  }
+
+  sp->mod = 0;
+  if(      p[0] == 'h' && p[1] == 'h' ){ sp->mod = 'H'; p += 2; }
+  else if( p[0] == 'l' && p[1] == 'l' ){ sp->mod = 'q'; p += 2; }
+  else if( *p && strchr( "hlzjtL", *p ) ){ sp->mod = *p++; }
+
+  sp->conv = *p;
+  sp->len  = p + 1 - f;
+  if( !*p || !strchr( "diouxXcsfFeEgGaAp%", *p ) || sp->len >= LOG_SPEC_MAX ){ return -1; }
+
+  return 0;
+}
+
+/**
+ * @brief      Copies the arguments of a message, nothing is formatted yet
+ *
+ * @return     The bytes used, -1 if the format is not supported or the arguments do not fit
+ */
+int log_capture( uint8_t *args, int room, const char *fmt, va_list ap ){
+  const char *f = strchr( fmt, '%' );
+  struct log_spec_t sp;
+  int n = 0;
+
+  for( ; f; f = strchr( f + sp.len, '%' ) ){
+    if( log_spec( f, &sp ) ){ return -1; }
+    if( sp.conv == '%' ){ continue; }
+    if( n + 8 * ( sp.star + 1 ) > room ){ return -1; }
+
+    for( int i = 0; i < sp.star; i++, n += 8 ){
+      int64_t v = va_arg( ap, int );
+      memcpy( args + n, &v, 8 );
+    }
+
+    switch( sp.conv ){
+      case 's':{
+        const char *s = va_arg( ap, const char * );
+        if( !s ){ s = "(null)"; }
+        size_t l = strnlen( s, LOG_STR_MAX );
+        if( n + LOG_ALIGN( l + 1 ) > room ){ return -1; }
+        memcpy( args + n, s, l );
+        args[ n + l ] = '\0';
+        n += LOG_ALIGN( l + 1 );
+        continue;
+      }
+      case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':{
+        double v = ( sp.mod == 'L' ) ? (double)va_arg( ap, long double ) : va_arg( ap, double );
+        memcpy( args + n, &v, 8 );
+        break;
+      }
+      case 'p':{
+        uint64_t v = (uintptr_t)va_arg( ap, void * );
+        memcpy( args + n, &v, 8 );
+        break;
+      }
+      default:{
+        int64_t v;
+        switch( sp.mod ){
+          case 'l': v = va_arg( ap, long );      break;
+          case 'q': v = va_arg( ap, long long ); break;
+          case 'z': v = va_arg( ap, size_t );    break;
+          case 'j': v = va_arg( ap, intmax_t );  break;
+          case 't': v = va_arg( ap, ptrdiff_t ); break;
+          default:  v = va_arg( ap, int );       break;
+        }
+        memcpy( args + n, &v, 8 );
+        break;
+      }
+    }
+    n += 8;
+  }
+
+  return n;
+}
+
+/**
+ * @brief      Formats a captured message, one conversion at a time
+ *
+ * @return     The characters written
+ */
+int log_format( char *out, int room, const char *fmt, const uint8_t *args ){
+  const char *f = fmt;
+  int n = 0;
+
+  while( *f && n < room - 1 ){
+    const char *pct = strchr( f, '%' );
+    int lit = pct ? pct - f : (int)strlen( f );
+    if( lit > room - 1 - n ){ lit = room - 1 - n; }
+    memcpy( out + n, f, lit );
+    n += lit;
+    if( !pct ){ break; }
+
+    struct log_spec_t sp;
+    char spec[ LOG_SPEC_MAX ];
+    int star[2] = { 0, 0 }, r = 0;
+    int64_t iv;
+    double dv;
+
+    log_spec( pct, &sp );
+    memcpy( spec, pct, sp.len );
+    spec[ sp.len ] = '\0';
+    f = pct + sp.len;
+    for( int i = 0; i < sp.star; i++, args += 8 ){ memcpy( &iv, args, 8 ); star[i] = iv; }
+
+#define LOG_PUT( v )  ( sp.star == 0 ? snprintf( out + n, room - n, spec, v ) : \
+                        sp.star == 1 ? snprintf( out + n, room - n, spec, star[0], v ) : \
+                                       snprintf( out + n, room - n, spec, star[0], star[1], v ) )
+    switch( sp.conv ){
+      case '%':
+        out[ n ] = '%';
+        r = 1;
+        break;
+      case 's':
+        r = LOG_PUT( (const char *)args );
+        args += LOG_ALIGN( strlen( (const char *)args ) + 1 );
+        break;
+      case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+        memcpy( &dv, args, 8 );
+        args += 8;
+        r = ( sp.mod == 'L' ) ? LOG_PUT( (long double)dv ) : LOG_PUT( dv );
+        break;
+      case 'p':
+        memcpy( &iv, args, 8 );
+        args += 8;
+        r = LOG_PUT( (void *)(uintptr_t)iv );
+        break;
+      default:
+        memcpy( &iv, args, 8 );
+        args += 8;
+        switch( sp.mod ){
+          case 'l': r = LOG_PUT( (long)iv );      break;
+          case 'q': r = LOG_PUT( (long long)iv ); break;
+          case 'z': r = LOG_PUT( (size_t)iv );    break;
+          case 'j': r = LOG_PUT( (intmax_t)iv );  break;
+          case 't': r = LOG_PUT( (ptrdiff_t)iv ); break;
+          default:  r = LOG_PUT( (int)iv );       break;
+        }
+        break;
+    }
+#undef LOG_PUT
+
+    n += ( r < 0 ) ? 0 : ( r < room - 1 - n ) ? r : room - 1 - n;
+  }
+
+  out[ n ] = '\0';
+  return n;
+}
+
+/**
+ * @brief      Formats a whole log line: timestamp, level, prefix and message
+ *
+ * @return     The characters written
+ */
+int log_line( char *out, int room, const struct log_rec_t *rec ){
+  static __thread time_t stamp_sec = -1;           // The writer thread formats most lines, callers without a ring the others
+  static __thread char   stamp[20];
+  const char *lvl_col, *lvl_str;
+  int n;
+
+  // One localtime() per second at most
+  if( rec->sec != stamp_sec ){
+    struct tm tm_info;
+    localtime_r( &rec->sec, &tm_info );
+    strftime( stamp, sizeof( stamp ), "%Y%m%d %H%M%S", &tm_info );
+    stamp_sec = rec->sec;
+  }
+
+  switch( rec->lvl ){
+    case DBG_ERR: lvl_col = COL_BRIGHT_RED;    lvl_str = "ERR"; break;
+    case DBG_WAR: lvl_col = COL_BRIGHT_YELLOW; lvl_str = "WAR"; break;
+    case DBG_INF: lvl_col = COL_BRIGHT_CYAN;   lvl_str = "INF"; break;
+    case DBG_VER: lvl_col = COL_BRIGHT_PURPLE; lvl_str = "VER"; break;
+    case DBG_DBG: lvl_col = COL_BRIGHT_GREEN;  lvl_str = "DBG"; break;
+    default:      lvl_col = COL_BRIGHT_BLACK;  lvl_str = "UNK"; break;
+  }
+
+  n = snprintf( out, room, "%s%s%s %s%s%s ",
+                ( msg_colors ? COL_BRIGHT_BLACK : "" ), stamp, ( msg_colors ? COL_RESET : "" ),
+                ( msg_colors ? lvl_col : "" ), lvl_str, ( msg_colors ? COL_RESET : "" ) );
+  if( rec->pfx ){ n += snprintf( out + n, room - n, "[%s%s%s] ", ( msg_colors ? COL_BRIGHT_BLACK : "" ), rec->pfx, ( msg_colors ? COL_RESET : "" ) ); }
+
+  if( rec->text ){ n += snprintf( out + n, room - n - 1, "%s", (const char *)rec->args ); }
+  else{ n += log_format( out + n, room - n - 1, rec->fmt, rec->args ); }
+  if( n > room - 2 ){ n = room - 2; }
+
+  // Forcing newline
+  out[ n++ ] = '\n';
+  return n;
+}
+
+void log_write( const char *buf, int len ){
+  while( len > 0 ){
+    ssize_t w = write( STDOUT_FILENO, buf, len );
+    if( w < 0 && errno == EINTR ){ continue; }
+    if( w <= 0 ){ return; }
+    buf += w;
+    len -= w;
+  }
+}
+
+/**
+ * @brief      Empties every ring into out, written whenever it fills up
+ *
+ * @return     The messages found
+ */
+int log_drain( char *out, int *olen ){
+  struct log_ring_t *ring = __atomic_load_n( &log_rings, __ATOMIC_ACQUIRE );
+  int found = 0;
+
+  // Rings are drained one after the other: messages of different threads may come out of order
+  for( ; ring; ring = ring->next ){
+    uint64_t head = __atomic_load_n( &ring->head, __ATOMIC_ACQUIRE );
+    uint64_t tail = ring->tail;
+
+    while( tail != head ){
+      const struct log_rec_t *rec = (const struct log_rec_t *)( ring->buf + ( tail & ( LOG_RING_SIZE - 1 ) ) );
+      if( rec->lvl != LOG_SKIP ){
+        if( *olen > LOG_OUT_SIZE - LOG_LINE_MAX ){
+          log_write( out, *olen );
+          *olen = 0;
+        }
+        *olen += log_line( out + *olen, LOG_LINE_MAX, rec );
+        found++;
+      }
+      tail += rec->size;
+    }
+    __atomic_store_n( &ring->tail, tail, __ATOMIC_RELEASE );
+
+    uint64_t dropped = __atomic_load_n( &ring->dropped, __ATOMIC_RELAXED );
+    if( dropped != ring->reported && *olen <= LOG_OUT_SIZE - LOG_LINE_MAX ){
+      *olen += snprintf( out + *olen, LOG_LINE_MAX, "%lu log messages dropped: full buffer\n", dropped - ring->reported );
+      ring->reported = dropped;
+    }
+  }
+
+  return found;
+}
+
+void *log_writer( void *arg ){
+  char *out = malloc( LOG_OUT_SIZE );
+  int olen = 0;
+
+  if( !out ){
+    __atomic_store_n( &log_sync, 1, __ATOMIC_RELEASE );
+    return NULL;
+  }
+
+  for( ;; ){
+    int stop  = __atomic_load_n( &log_stop, __ATOMIC_ACQUIRE );
+    int found = log_drain( out, &olen );
+
+    if( olen ){
+      log_write( out, olen );
+      olen = 0;
+    }
+    if( !found ){
+      if( stop ){ break; }
+      usleep( LOG_IDLE_USEC );
+    }
+  }
+
+  free( out );
+  return NULL;
+}
+
+void log_ring_release( void *ring ){
+  __atomic_store_n( &( (struct log_ring_t *)ring )->used, 0, __ATOMIC_RELEASE );
+}
+
+void log_init(){
+  pthread_key_create( &log_ring_key, log_ring_release );
+  if( pthread_create( &log_thread, NULL, log_writer, NULL ) ){
+    log_sync = 1;
+    return;
+  }
+  pthread_setname_np( log_thread, "mblog" );
+  atexit( msg_flush );
+}
+
+/**
+ * @brief      Gets the calling thread ring, reusing the emptied ring of an exited thread if any
+ */
+struct log_ring_t *log_ring_get(){
+  if( log_ring ){ return log_ring; }
+
+  pthread_once( &log_once, log_init );
+  pthread_mutex_lock( &log_rings_lock );
+
+  struct log_ring_t *ring = log_rings;
+  while( ring && ( __atomic_load_n( &ring->used, __ATOMIC_ACQUIRE ) ||
+                   __atomic_load_n( &ring->tail, __ATOMIC_ACQUIRE ) != ring->head ) ){ ring = ring->next; }
+  if( !ring && ( ring = aligned_alloc( 64, sizeof( struct log_ring_t ) ) ) ){
+    memset( ring, 0, offsetof( struct log_ring_t, buf ) );
+    ring->next = log_rings;
+    __atomic_store_n( &log_rings, ring, __ATOMIC_RELEASE );
+  }
+  if( ring ){
+    ring->used = 1;
+    pthread_setspecific( log_ring_key, ring );
+  }
+
+  pthread_mutex_unlock( &log_rings_lock );
+  return log_ring = ring;
+}
+
+/**
+ * @brief      Appends a record to a ring, or counts it as dropped if the writer is too far behind
+ */
+void log_ring_push( struct log_ring_t *ring, const struct log_rec_t *rec ){
+  uint64_t head = ring->head;
+  uint64_t tail = __atomic_load_n( &ring->tail, __ATOMIC_ACQUIRE );
+  uint32_t pos  = head & ( LOG_RING_SIZE - 1 );
+  uint32_t pad  = ( pos + rec->size > LOG_RING_SIZE ) ? LOG_RING_SIZE - pos : 0;
+
+  if( head + pad + rec->size - tail > LOG_RING_SIZE ){
+    __atomic_store_n( &ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED );
+    return;
+  }
+
+  // Records never wrap: a filler takes the end of the ring
+  if( pad ){
+    struct log_rec_t *skip = (struct log_rec_t *)( ring->buf + pos );
+    skip->size = pad;
+    skip->lvl  = LOG_SKIP;
+    head += pad;
+    pos   = 0;
+  }
+
+  memcpy( ring->buf + pos, rec, rec->size );
+  __atomic_store_n( &ring->head, head + rec->size, __ATOMIC_RELEASE );
+}
+
+void msg( int lvl, const char* pfx, const char *logstr , ... ){
+  if( msg_dbgl < lvl ){ return; }
+
+  uint64_t rec_buf[ LOG_REC_MAX / 8 ];
+  struct log_rec_t *rec = (struct log_rec_t *)rec_buf;
+  const int room = LOG_REC_MAX - sizeof( struct log_rec_t );
+  struct timespec now;
+  va_list arglist;
+
+  // Coarse clock: a vDSO read, the timestamp only has seconds
+  clock_gettime( CLOCK_REALTIME_COARSE, &now );
+  rec->lvl  = lvl;
+  rec->sec  = now.tv_sec;
+  rec->pfx  = pfx;
+  rec->fmt  = logstr;
+  rec->text = 0;
+
+  va_start( arglist, logstr );
+  int alen = log_capture( rec->args, room, logstr, arglist );
+  va_end( arglist );
+
+  // Unusual formats are printed right away, in the record
+  if( alen < 0 ){
+    va_start( arglist, logstr );
+    vsnprintf( (char *)rec->args, room, logstr, arglist );
+    va_end( arglist );
+    alen = strlen( (const char *)rec->args ) + 1;
+    rec->text = 1;
+  }
+  rec->alen = alen;
+  rec->size = LOG_ALIGN( sizeof( struct log_rec_t ) + alen );
+
+  struct log_ring_t *ring = log_ring_get();
+  if( !ring || __atomic_load_n( &log_sync, __ATOMIC_ACQUIRE ) ){
+    char line[ LOG_LINE_MAX ];
+    log_write( line, log_line( line, sizeof( line ), rec ) );
+    return;
+  }
+
+  log_ring_push( ring, rec );
+}
+
+void msg_flush(){
+  if( __atomic_exchange_n( &log_stop, 1, __ATOMIC_ACQ_REL ) ){ return; }
+
+  pthread_join( log_thread, NULL );
+  __atomic_store_n( &log_sync, 1, __ATOMIC_RELEASE );
+}
@@ -0,0 +1,87 @@
+#ifndef _MBT_LOG_H_
+#define _MBT_LOG_H_
+
+#include <stdint.h>
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ DEFINITIONS
+// Term colors
+#define COL_RESET               "\e[0m"
+#define COL_BRIGHT_RED          "\e[0;91m"
+#define COL_BRIGHT_CYAN         "\e[0;96m"
+#define COL_BRIGHT_GREEN        "\e[0;92m"
+#define COL_BRIGHT_YELLOW       "\e[0;93m"
+#define COL_BRIGHT_BLACK        "\e[0;90m"
+#define COL_BRIGHT_BLUE         "\e[0;94m"
+#define COL_BRIGHT_PURPLE       "\e[0;95m"
+#define COL_BRIGHT_WHITE        "\e[0;97m"
+
+// Debug levels
+#define DBG_NONE  0
+#define DBG_ERR   1
+#define DBG_WAR   2
+#define DBG_INF   3
+#define DBG_VER   4
+#define DBG_DBG   5
+
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX           DBG_DBG            ///< Most verbose level compiled in, the ones above cost nothing
+#endif
+
+// Debug shortcut: the level is checked before evaluating any argument
+#define log_lvl( lvl, ... )     do{ if( (lvl) <= LOG_LEVEL_MAX && (lvl) <= msg_dbgl ){ msg( (lvl), __FUNCTION__, __VA_ARGS__ ); } }while( 0 )
+#define log_dbg(...)  log_lvl( DBG_DBG, __VA_ARGS__ )
+#define log_ver(...)  log_lvl( DBG_VER, __VA_ARGS__ )
+#define log_inf(...)  log_lvl( DBG_INF, __VA_ARGS__ )
+#define log_war(...)  log_lvl( DBG_WAR, __VA_ARGS__ )
+#define log_err(...)  log_lvl( DBG_ERR, __VA_ARGS__ )
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ GLOBAL VARS
+extern int msg_dbgl;                               ///< Debug level, higher means more informations
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS
+
+/**
+ * @brief      Sets the debug level.
+ *
+ * @param[in]  lvl   The new value
+ */
+void set_debug( int lvl );
+
+/**
+ * @brief      Sets the colored output for debug messages.
+ *
+ * @param[in]  on    The new value
+ */
+void set_msg_colors( int on );
+
+/**
+ * @brief      Determines if messages are colored.
+ *
+ * @return     1 if message are colored, 0 otherwise.
+ */
+int is_msg_colors();
+
+/**
+ * @brief      Gets the debug level.
+ *
+ * @return     The debug.
+ */
+int get_debug();
+
+/**
+ * @brief      Queues a message for the log writer thread. The caller never blocks: arguments are copied
+ *             in the thread own ring buffer, or the message is dropped and counted when it is full
+ *
+ * @param[in]  lvl        The Message Level
+ * @param[in]  pfx        The Message Prefix
+ * @param[in]  logstr     The String to be logged (as for printf), it must be a literal
+ * @param[in]  <unnamed>  printf arguments
+ */
+void msg( int lvl, const char* pfx, const char *logstr , ... ) __attribute__(( format( printf, 3, 4 ) ));
+
+/**
+ * @brief      Writes every queued message out, waiting for it
+ */
+void msg_flush();
+
+#endif // _MBT_LOG_H_
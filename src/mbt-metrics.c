@@ -0,0 +1,332 @@
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ INCLUDES
+#include <errno.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+#include "mbt-metrics.h"
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ DEFINITIONS
+#define METRICS_BACKLOG          16
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ GLOBAL VARS
+const char   *metrics_phases[ STATS_PHASES ] = { "receive", "query", "reply" };
+const double  metrics_quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS
+int metrics_open( struct metrics_t *metrics, const char *spec ){
+  int on = 1;
+
+  metrics->fd        = -1;
+  metrics->path      = NULL;
+  metrics->sample_ns = stats_now();
+  for( int c = 0; c < METRICS_CLIENTS_MAX; c++ ){ metrics->clients[c].fd = -1; }
+  for( int p = 0; p < 2; p++ ){
+    metrics->sample_req[p] = 0;
+    metrics->rps[p]        = 0.0;
+  }
+  if( !spec ){ return 0; }
+
+  // A path is a UNIX socket, anything else a TCP port
+  if( spec[0] == '/' ){
+    struct sockaddr_un sun = { .sun_family = AF_UNIX };
+    if( strlen( spec ) >= sizeof( sun.sun_path ) ){
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+    strcpy( sun.sun_path, spec );
+    unlink( spec );
+
+    metrics->fd = socket( AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+    if( metrics->fd == -1 ){ return -1; }
+    if( bind( metrics->fd, (struct sockaddr *)&sun, sizeof( sun ) ) == -1 ){ goto fail; }
+    metrics->path = spec;
+  }
+  else{
+    struct sockaddr_in6 sin6 = { .sin6_family = AF_INET6, .sin6_addr = in6addr_any };
+    int port = atoi( spec );
+    if( port <= 0 || port > 0xFFFF ){
+      errno = EINVAL;
+      return -1;
+    }
+    sin6.sin6_port = htons( port );
+
+    metrics->fd = socket( AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+    if( metrics->fd == -1 ){ return -1; }
+    if( setsockopt( metrics->fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof( on ) ) == -1 ||
+        bind( metrics->fd, (struct sockaddr *)&sin6, sizeof( sin6 ) ) == -1 ){ goto fail; }
+  }
+
+  if( listen( metrics->fd, METRICS_BACKLOG ) == -1 ){ goto fail; }
+  return 0;
+
+fail:
+  close( metrics->fd );
+  metrics->fd = -1;
+  return -1;
+}
+
+/**
+ * @brief      Ends a scrape, freeing its slot
+ */
+void metrics_client_close( struct metrics_client_t *client ){
+  close( client->fd );
+  free( client->out );
+  client->fd  = -1;
+  client->out = NULL;
+}
+
+void metrics_close( struct metrics_t *metrics ){
+  for( int c = 0; c < METRICS_CLIENTS_MAX; c++ ){
+    if( metrics->clients[c].fd != -1 ){ metrics_client_close( &metrics->clients[c] ); }
+  }
+  if( metrics->fd != -1 ){ close( metrics->fd ); }
+  if( metrics->path ){ unlink( metrics->path ); }
+  metrics->fd   = -1;
+  metrics->path = NULL;
+}
+
+uint64_t metrics_requests( struct stats_t *stats ){
+  uint64_t tot = 0;
+  for( int f = 0; f < STATS_FCS; f++ ){ tot += stats->fc[f].requests; }
+  return tot;
+}
+
+void metrics_sample( struct metrics_t *metrics ){
+  uint64_t now = stats_now();
+  double elapsed = ( now - metrics->sample_ns ) / 1e9;
+
+  for( int p = 0; p < 2; p++ ){
+    if( !metrics->enabled[p] ){ continue; }
+
+    mbsrv_stats( p, &metrics->stats[p] );
+    uint64_t req = metrics_requests( &metrics->stats[p] );
+    metrics->rps[p]        = elapsed > 0.0 ? ( req - metrics->sample_req[p] ) / elapsed : 0.0;
+    metrics->sample_req[p] = req;
+  }
+  metrics->sample_ns = now;
+}
+
+/**
+ * @brief      Gets the resident memory of the process
+ *
+ * @return     The bytes, 0 if unknown
+ */
+uint64_t metrics_rss(){
+  unsigned long size = 0, resident = 0;
+  FILE *f = fopen( "/proc/self/statm", "r" );
+
+  if( !f ){ return 0; }
+  if( fscanf( f, "%lu %lu", &size, &resident ) != 2 ){ resident = 0; }
+  fclose( f );
+
+  return (uint64_t)resident * sysconf( _SC_PAGESIZE );
+}
+
+/**
+ * @brief      Writes the labels of a function code slot
+ */
+void metrics_labels( char *labels, size_t size, int proto, int slot ){
+  if( stats_slot_fc[ slot ] ){ snprintf( labels, size, "proto=\"%s\",fc=\"%d\"", mdb_proto_strings[ proto ], stats_slot_fc[ slot ] ); }
+  else{ snprintf( labels, size, "proto=\"%s\",fc=\"other\"", mdb_proto_strings[ proto ] ); }
+}
+
+void metrics_render( struct metrics_t *metrics, FILE *out ){
+  static const struct{ size_t field; const char *name, *help; } counters[] = {
+    { offsetof( struct stats_fc_t, requests   ), "modbus_requests_total",           "Queries received" },
+    { offsetof( struct stats_fc_t, exceptions ), "modbus_exceptions_total",         "Exception replies sent" },
+    { offsetof( struct stats_fc_t, injected   ), "modbus_injected_errors_total",    "Queries hit by a fault rule" },
+    { offsetof( struct stats_fc_t, bytes_in   ), "modbus_received_bytes_total",     "Query bytes" },
+    { offsetof( struct stats_fc_t, bytes_out  ), "modbus_sent_bytes_total",         "Reply bytes" },
+  };
+  char labels[64];
+
+  fprintf( out, "# HELP modbus_requests_per_second Queries per second over the last %d ms\n", METRICS_SAMPLE_MSEC );
+  fprintf( out, "# TYPE modbus_requests_per_second gauge\n" );
+  for( int p = 0; p < 2; p++ ){
+    if( metrics->enabled[p] ){ fprintf( out, "modbus_requests_per_second{proto=\"%s\"} %.1f\n", mdb_proto_strings[p], metrics->rps[p] ); }
+  }
+
+  // Every family is written once, all the transports within it
+  for( int p = 0; p < 2; p++ ){
+    if( metrics->enabled[p] ){ mbsrv_stats( p, &metrics->stats[p] ); }
+  }
+
+  for( size_t c = 0; c < sizeof( counters ) / sizeof( counters[0] ); c++ ){
+    fprintf( out, "# HELP %s %s\n# TYPE %s counter\n", counters[c].name, counters[c].help, counters[c].name );
+    for( int p = 0; p < 2; p++ ){
+      for( int f = 0; metrics->enabled[p] && f < STATS_FCS; f++ ){
+        if( !metrics->stats[p].fc[f].requests ){ continue; }
+
+        metrics_labels( labels, sizeof( labels ), p, f );
+        fprintf( out, "%s{%s} %lu\n", counters[c].name, labels, *(const uint64_t *)( (const uint8_t *)&metrics->stats[p].fc[f] + counters[c].field ) );
+      }
+    }
+  }
+
+  fprintf( out, "# HELP modbus_latency_seconds Time spent by queries in each phase\n# TYPE modbus_latency_seconds summary\n" );
+  for( int p = 0; p < 2; p++ ){
+    for( int f = 0; metrics->enabled[p] && f < STATS_FCS; f++ ){
+      if( !metrics->stats[p].fc[f].requests ){ continue; }
+      metrics_labels( labels, sizeof( labels ), p, f );
+
+      for( int ph = 0; ph < STATS_PHASES; ph++ ){
+        const struct stats_hist_t *hist = &metrics->stats[p].fc[f].lat[ph];
+        for( size_t q = 0; q < sizeof( metrics_quantiles ) / sizeof( metrics_quantiles[0] ); q++ ){
+          fprintf( out, "modbus_latency_seconds{%s,phase=\"%s\",quantile=\"%g\"} %.9f\n", labels, metrics_phases[ph],
+                   metrics_quantiles[q], stats_percentile( hist, metrics_quantiles[q] * 100.0 ) / 1e9 );
+        }
+        fprintf( out, "modbus_latency_seconds_sum{%s,phase=\"%s\"} %.9f\n", labels, metrics_phases[ph], hist->sum / 1e9 );
+        fprintf( out, "modbus_latency_seconds_count{%s,phase=\"%s\"} %lu\n", labels, metrics_phases[ph], hist->count );
+      }
+    }
+  }
+
+  if( metrics->enabled[ MDB_PROTO_TCP ] ){
+    struct mbtcp_counters_t tcp;
+    mbsrv_tcp_counters( &tcp );
+
+    fprintf( out, "# HELP modbus_tcp_connections Connections currently open\n# TYPE modbus_tcp_connections gauge\n" );
+    fprintf( out, "modbus_tcp_connections %lu\n", tcp.active );
+    fprintf( out, "# HELP modbus_tcp_connections_total Connections by outcome\n# TYPE modbus_tcp_connections_total counter\n" );
+    fprintf( out, "modbus_tcp_connections_total{state=\"accepted\"} %lu\n", tcp.accepted );
+    fprintf( out, "modbus_tcp_connections_total{state=\"closed\"} %lu\n", tcp.closed );
+    fprintf( out, "modbus_tcp_connections_total{state=\"rejected\"} %lu\n", tcp.rejected );
+  }
+
+  if( metrics->gateway ){
+    gw_counters( &metrics->gw );
+
+    fprintf( out, "# HELP modbus_gateway_requests_total Queries routed to a RTU bus, by how they were answered\n" );
+    fprintf( out, "# TYPE modbus_gateway_requests_total counter\n" );
+    fprintf( out, "modbus_gateway_requests_total{answer=\"cache\"} %lu\n", metrics->gw.cached );
+    fprintf( out, "modbus_gateway_requests_total{answer=\"coalesced\"} %lu\n", metrics->gw.coalesced );
+    fprintf( out, "modbus_gateway_requests_total{answer=\"bus\"} %lu\n", metrics->gw.requests - metrics->gw.cached - metrics->gw.coalesced );
+    fprintf( out, "# HELP modbus_gateway_transactions_total Serial transactions, by outcome\n# TYPE modbus_gateway_transactions_total counter\n" );
+    fprintf( out, "modbus_gateway_transactions_total{state=\"answered\"} %lu\n", metrics->gw.transactions );
+    fprintf( out, "modbus_gateway_transactions_total{state=\"timeout\"} %lu\n", metrics->gw.timeouts );
+    fprintf( out, "modbus_gateway_transactions_total{state=\"error\"} %lu\n", metrics->gw.errors );
+    fprintf( out, "# HELP modbus_gateway_latency_seconds Query routed to reply ready\n# TYPE modbus_gateway_latency_seconds summary\n" );
+    for( size_t q = 0; q < sizeof( metrics_quantiles ) / sizeof( metrics_quantiles[0] ); q++ ){
+      fprintf( out, "modbus_gateway_latency_seconds{quantile=\"%g\"} %.9f\n", metrics_quantiles[q],
+               stats_percentile( &metrics->gw.lat, metrics_quantiles[q] * 100.0 ) / 1e9 );
+    }
+    fprintf( out, "modbus_gateway_latency_seconds_sum %.9f\n", metrics->gw.lat.sum / 1e9 );
+    fprintf( out, "modbus_gateway_latency_seconds_count %lu\n", metrics->gw.lat.count );
+  }
+
+  fprintf( out, "# HELP modbus_registers_bytes Memory taken by the registers written so far\n# TYPE modbus_registers_bytes gauge\n" );
+  fprintf( out, "modbus_registers_bytes %lu\n", mbsrv_regs_used() );
+  fprintf( out, "# HELP process_resident_memory_bytes Resident memory size in bytes\n# TYPE process_resident_memory_bytes gauge\n" );
+  fprintf( out, "process_resident_memory_bytes %lu\n", metrics_rss() );
+}
+
+/**
+ * @brief      Builds the reply to a whole request: status line, headers and every metric
+ *
+ * @return     0 on success, -1 on failure
+ */
+int metrics_reply( struct metrics_t *metrics, struct metrics_client_t *client ){
+  char *body = NULL;
+  size_t body_len = 0;
+  FILE *out = open_memstream( &body, &body_len );
+  if( !out ){ return -1; }
+
+  const char *status = "200 OK";
+  if( strncmp( client->req, "GET ", 4 ) != 0 ){ status = "405 Method Not Allowed"; }
+  else if( strncmp( client->req + 4, "/ ", 2 ) != 0 && strncmp( client->req + 4, "/metrics", 8 ) != 0 ){ status = "404 Not Found"; }
+  else{ metrics_render( metrics, out ); }
+  fclose( out );
+
+  out = open_memstream( &client->out, &client->olen );
+  if( !out ){
+    free( body );
+    return -1;
+  }
+  fprintf( out, "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+           status, body_len );
+  fwrite( body, 1, body_len, out );
+  fclose( out );
+  free( body );
+
+  client->osent = 0;
+  return 0;
+}
+
+/**
+ * @brief      Reads the request of a scrape, then writes its reply, until the socket would block
+ *
+ * @return     1 while in progress, 0 once done or failed
+ */
+int metrics_client_run( struct metrics_t *metrics, struct metrics_client_t *client ){
+  while( !client->out ){
+    ssize_t rd = recv( client->fd, client->req + client->len, METRICS_REQ_SIZE - client->len, 0 );
+    if( rd < 0 && errno == EINTR ){ continue; }
+    if( rd < 0 && errno == EAGAIN ){ return 1; }
+
+    // Replying once the request ended, or the scraper stopped sending
+    if( rd > 0 ){
+      client->len += rd;
+      client->req[ client->len ] = '\0';
+      if( client->len < METRICS_REQ_SIZE && !strstr( client->req, "\r\n\r\n" ) && !strstr( client->req, "\n\n" ) ){ continue; }
+    }
+    else if( rd < 0 ){ return 0; }
+    if( metrics_reply( metrics, client ) != 0 ){ return 0; }
+  }
+
+  while( client->osent < client->olen ){
+    ssize_t wr = send( client->fd, client->out + client->osent, client->olen - client->osent, MSG_NOSIGNAL );
+    if( wr < 0 && errno == EINTR ){ continue; }
+    if( wr < 0 && errno == EAGAIN ){ return 1; }
+    if( wr < 0 ){ return 0; }
+    client->osent += wr;
+  }
+  return 0;
+}
+
+void metrics_pollfds( struct metrics_t *metrics, struct pollfd *pfd ){
+  int busy = 0;
+
+  for( int c = 0; c < METRICS_CLIENTS_MAX; c++ ){
+    struct metrics_client_t *client = &metrics->clients[c];
+    pfd[ 1 + c ] = (struct pollfd){ .fd = client->fd, .events = client->out ? POLLOUT : POLLIN };
+    busy += client->fd != -1;
+  }
+
+  // With every slot busy new scrapers wait in the backlog
+  pfd[0] = (struct pollfd){ .fd = busy < METRICS_CLIENTS_MAX ? metrics->fd : -1, .events = POLLIN };
+}
+
+void metrics_serve( struct metrics_t *metrics, const struct pollfd *pfd ){
+  uint64_t now = stats_now();
+
+  for( int c = 0; c < METRICS_CLIENTS_MAX; c++ ){
+    struct metrics_client_t *client = &metrics->clients[c];
+    if( client->fd == -1 ){ continue; }
+
+    if( pfd[ 1 + c ].revents && !metrics_client_run( metrics, client ) ){ metrics_client_close( client ); }
+    else if( now >= client->deadline ){
+      log_ver( "Metrics scraper too slow, given up on after %d ms", METRICS_IO_MSEC );
+      metrics_client_close( client );
+    }
+  }
+
+  if( !pfd[0].revents ){ return; }
+  for( int c = 0; c < METRICS_CLIENTS_MAX; c++ ){
+    struct metrics_client_t *client = &metrics->clients[c];
+    if( client->fd != -1 ){ continue; }
+
+    client->fd = accept4( metrics->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC );
+    if( client->fd == -1 ){
+      if( errno != EAGAIN && errno != EINTR ){ log_ver( "Metrics accept() error: %s", strerror( errno ) ); }
+      return;
+    }
+    client->deadline = now + METRICS_IO_MSEC * 1000000ULL;
+    client->len      = 0;
+    client->req[0]   = '\0';
+
+    // Most requests are already there
+    if( !metrics_client_run( metrics, client ) ){ metrics_client_close( client ); }
+  }
+}
@@ -0,0 +1,87 @@
+#ifndef _MBT_METRICS_H_
+#define _MBT_METRICS_H_
+
+#include <poll.h>
+#include <stdint.h>
+
+#include "mbt-srv.h"
+#include "mbt-gw.h"
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ DEFINITIONS
+#define METRICS_SAMPLE_MSEC     1000               ///< Requests per second are measured over this interval
+#define METRICS_IO_MSEC          200               ///< Time a scraper has to send its request and read the reply
+#define METRICS_REQ_SIZE        2048               ///< Longest scrape request read, the rest is ignored
+#define METRICS_CLIENTS_MAX        4               ///< Scrapes served at once, the next ones wait in the backlog
+#define METRICS_POLLFDS         ( 1 + METRICS_CLIENTS_MAX )   ///< Descriptors polled for the metrics: listener, then clients
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ TYPES
+/**
+ * A scrape in progress: its request read, then its reply written, as the socket allows
+ */
+struct metrics_client_t{
+  int             fd;                              ///< Client socket, -1 when the slot is free
+  uint64_t        deadline;                        ///< Time the scraper is given up on
+  int             len;                             ///< Request bytes read
+  char           *out;                             ///< Whole reply, NULL while reading the request
+  size_t          olen;                            ///< Reply length
+  size_t          osent;                           ///< Reply bytes written
+  char            req[ METRICS_REQ_SIZE + 1 ];     ///< Request
+};
+
+struct metrics_t{
+  int             fd;                              ///< Listening socket, -1 when metrics are not served
+  const char     *path;                            ///< UNIX socket path, removed when closed
+  int             enabled[2];                      ///< Transports running, by mdb_proto_type
+  int             gateway;                         ///< Gateway running
+  uint64_t        sample_ns;                       ///< Time of the last sample
+  uint64_t        sample_req[2];                   ///< Requests seen by the last sample
+  double          rps[2];                          ///< Requests per second over the last sample interval
+  struct stats_t  stats[2];                        ///< Merge buffers, by mdb_proto_type
+  struct gw_counters_t gw;                         ///< Gateway counters buffer
+  struct metrics_client_t clients[ METRICS_CLIENTS_MAX ];   ///< Scrapes in progress
+};
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS
+
+/**
+ * @brief      Opens the metrics endpoint
+ *
+ * @param      metrics  The metrics state, enabled must be set
+ * @param[in]  spec     A TCP port, bound on every address, or a UNIX socket path (starting with '/'). NULL to only sample
+ *
+ * @return     0 on success, -1 on failure
+ */
+int metrics_open( struct metrics_t *metrics, const char *spec );
+
+/**
+ * @brief      Updates the rates, to be called every METRICS_SAMPLE_MSEC
+ *
+ * @param      metrics  The metrics state
+ */
+void metrics_sample( struct metrics_t *metrics );
+
+/**
+ * @brief      Fills the descriptors to poll for the metrics, revents cleared. A -1 fd is skipped by poll()
+ *
+ * @param      metrics  The metrics state
+ * @param[out] pfd      METRICS_POLLFDS descriptors
+ */
+void metrics_pollfds( struct metrics_t *metrics, struct pollfd *pfd );
+
+/**
+ * @brief      Serves the scrapes as far as their sockets allow, every metric in Prometheus text format. Never
+ *             blocks: scrapers not done within METRICS_IO_MSEC are given up on
+ *
+ * @param      metrics  The metrics state
+ * @param[in]  pfd      The descriptors filled by metrics_pollfds(), after poll()
+ */
+void metrics_serve( struct metrics_t *metrics, const struct pollfd *pfd );
+
+/**
+ * @brief      Closes the metrics endpoint
+ *
+ * @param      metrics  The metrics state
+ */
+void metrics_close( struct metrics_t *metrics );
+
+#endif // _MBT_METRICS_H_
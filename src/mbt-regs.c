@@ -0,0 +1,761 @@
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ INCLUDES
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "mbt-regs.h"
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ DEFINITIONS
+#define GET_U16( p )     ( (((uint16_t)(p)[0]) << 8) + (uint16_t)(p)[1] )
+#define SET_U16( p, v )  do{ (p)[0] = (uint8_t)((v) >> 8); (p)[1] = (uint8_t)((v) & 0xFF); }while( 0 )
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+#define cpu_relax()      __builtin_ia32_pause()
+#else
+#define cpu_relax()      do{ }while( 0 )
+#endif
+#define SPIN_MAX         128                       ///< Busy waits on a page before yielding the cpu to its writer
+
+#define REGS_HDR_SIZE    4096                      ///< Header room, keeps the directory page aligned
+#define REGS_DIR_LEN     ( (size_t)REGS_UNITS * REGS_TABLES * REGS_DIR_SIZE * sizeof( uint32_t ) )
+#define REGS_MAX_PAGES   8                         ///< Pages touched by one access: 2000 bits or 125 registers
+#define REGS_MAX_ENTRIES 0x10000                   ///< Entries a table can address
+#define REGS_BITS_SHIFT  12                        ///< Bits per page are 1 << REGS_BITS_SHIFT, 8 per byte
+#define REGS_ALIGN( x )  ( ( (x) + 4095 ) & ~(uint64_t)4095 )
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ TYPES
+typedef uint16_t v8u16 __attribute__(( vector_size( 16 ) ));       ///< 8 registers, gcc vector extension
+typedef uint8_t  v16u8 __attribute__(( vector_size( 16 ) ));       ///< 16 bytes of packed bits
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS
+void regs_backoff( int *spins ){
+  // A preempted writer keeps its pages: spinning any longer would only burn its time slice
+  if( ++(*spins) < SPIN_MAX ){ cpu_relax(); }
+  else{
+    *spins = 0;
+    sched_yield();
+  }
+}
+
+/**
+ * @brief      Waits while a sequence lock is taken, odd: a page being written or a page being handed out.
+ *             The holder is never overtaken, however long it is stopped: locks left by a dead one are only
+ *             released when the segment is reused, by regs_new()
+ *
+ * @return     The even sequence
+ */
+static inline uint32_t regs_seq_wait( uint32_t *lock, int *spins ){
+  uint32_t seq;
+
+  while( ( seq = __atomic_load_n( lock, __ATOMIC_ACQUIRE ) ) & 1 ){ regs_backoff( spins ); }
+  return seq;
+}
+
+void regs_to_wire( uint8_t *dst, const uint16_t *src, int nb ){
+  int i = 0;
+
+  // 8 registers per step, swapped with lane shifts every SIMD flavour has. Big endian hosts already hold them as
+  // they travel, as the tail does there
+  for( ; i + 8 <= nb; i += 8 ){
+    v8u16 v;
+    memcpy( &v, src + i, sizeof( v ) );
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    v = ( v << 8 ) | ( v >> 8 );
+#endif
+    memcpy( dst + i * 2, &v, sizeof( v ) );
+  }
+  for( ; i < nb; i++ ){ SET_U16( dst + i * 2, src[i] ); }
+}
+
+void regs_from_wire( uint16_t *dst, const uint8_t *src, int nb ){
+  int i = 0;
+
+  for( ; i + 8 <= nb; i += 8 ){
+    v8u16 v;
+    memcpy( &v, src + i * 2, sizeof( v ) );
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    v = ( v << 8 ) | ( v >> 8 );
+#endif
+    memcpy( dst + i, &v, sizeof( v ) );
+  }
+  for( ; i < nb; i++ ){ dst[i] = GET_U16( src + i * 2 ); }
+}
+
+void regs_bits_to_wire( uint8_t *dst, const uint8_t *src, int first, int nb ){
+  const int s = first & 7, bytes = ( nb + 7 ) / 8, sbytes = ( s + nb + 7 ) / 8;
+  int k = 0;
+
+  src += first / 8;
+  if( !s ){ memcpy( dst, src, bytes ); }
+  else{
+    // 16 bytes per step, each one made of two neighbours: loads stay within the sbytes of src
+    for( ; k + 17 <= sbytes; k += 16 ){
+      v16u8 lo, hi;
+      memcpy( &lo, src + k, sizeof( lo ) );
+      memcpy( &hi, src + k + 1, sizeof( hi ) );
+      lo = ( lo >> s ) | ( hi << ( 8 - s ) );
+      memcpy( dst + k, &lo, sizeof( lo ) );
+    }
+    for( ; k < bytes; k++ ){ dst[k] = ( src[k] >> s ) | ( k + 1 < sbytes ? src[ k + 1 ] << ( 8 - s ) : 0 ); }
+  }
+
+  if( nb & 7 ){ dst[ bytes - 1 ] &= ( 1 << ( nb & 7 ) ) - 1; }
+}
+
+void regs_bits_from_wire( uint8_t *dst, int first, const uint8_t *src, int nb ){
+  const int s = first & 7, bytes = ( nb + 7 ) / 8, dbytes = ( s + nb + 7 ) / 8;
+  const uint8_t head = 0xFF << s, tail = 0xFF >> ( 7 - ( ( s + nb - 1 ) & 7 ) );
+  int k = 1;
+
+  dst += first / 8;
+
+  // Edge bytes keep the bits out of the range, the ones between are replaced whole
+  uint8_t b = src[0] << s;
+  if( dbytes == 1 ){
+    dst[0] = ( dst[0] & ~( head & tail ) ) | ( b & head & tail );
+    return;
+  }
+  dst[0] = ( dst[0] & ~head ) | ( b & head );
+
+  if( !s ){
+    memcpy( dst + 1, src + 1, dbytes - 2 );
+    k = dbytes - 1;
+  }
+  else{
+    for( ; k + 16 <= dbytes - 1; k += 16 ){
+      v16u8 lo, hi;
+      memcpy( &lo, src + k - 1, sizeof( lo ) );
+      memcpy( &hi, src + k, sizeof( hi ) );
+      hi = ( hi << s ) | ( lo >> ( 8 - s ) );
+      memcpy( dst + k, &hi, sizeof( hi ) );
+    }
+    for( ; k < dbytes - 1; k++ ){ dst[k] = ( src[k] << s ) | ( src[ k - 1 ] >> ( 8 - s ) ); }
+  }
+
+  b = ( k < bytes ? src[k] << s : 0 ) | ( s ? src[ k - 1 ] >> ( 8 - s ) : 0 );
+  dst[k] = ( dst[k] & ~tail ) | ( b & tail );
+}
+
+/**
+ * @brief      Copies registers already in wire order, 8 per step as regs_to_wire() does: reads are too short
+ *             for the setup of a library memcpy to pay off
+ */
+static inline void regs_copy( uint8_t *dst, const uint8_t *src, int nb ){
+  int i = 0;
+
+  for( ; i + 8 <= nb; i += 8 ){
+    v8u16 v;
+    memcpy( &v, src + i * 2, sizeof( v ) );
+    memcpy( dst + i * 2, &v, sizeof( v ) );
+  }
+  for( ; i < nb; i++ ){
+    dst[ i * 2 ]     = src[ i * 2 ];
+    dst[ i * 2 + 1 ] = src[ i * 2 + 1 ];
+  }
+}
+
+/**
+ * @brief      Entries per page are 1 << regs_shift(): bits are packed 8 per byte, registers take two
+ */
+static inline int regs_shift( enum regs_table_type table ){
+  return ( table == REGS_COILS || table == REGS_DISCRETE_INPUTS ) ? REGS_BITS_SHIFT : 8;
+}
+
+static inline uint32_t *regs_dir( struct regs_store_t *store, int unit, enum regs_table_type table ){
+  return store->dir + ( (size_t)unit * REGS_TABLES + table ) * REGS_DIR_SIZE;
+}
+
+static inline uint8_t *regs_page_data( struct regs_store_t *store, uint32_t page ){
+  return store->pages + (size_t)( page - 1 ) * REGS_PAGE_SIZE;
+}
+
+/**
+ * @brief      Points the store at the arena sections, as recorded in the header
+ */
+void regs_map( struct regs_store_t *store, void *arena ){
+  store->hdr   = arena;
+  store->size  = store->hdr->size;
+  store->dir   = (uint32_t *)( (uint8_t *)arena + store->hdr->dir_off );
+  store->seq   = (uint32_t *)( (uint8_t *)arena + store->hdr->seq_off );
+  store->dirty = (uint64_t *)( (uint8_t *)arena + store->hdr->dirty_off );
+  store->pages = (uint8_t *)arena + store->hdr->pages_off;
+}
+
+/**
+ * @brief      Tells if a header describes a valid arena of the given length
+ */
+int regs_hdr_valid( const struct regs_hdr_t *hdr, size_t size ){
+  return hdr->magic == REGS_MAGIC && hdr->version == REGS_VERSION && hdr->page_size == REGS_PAGE_SIZE &&
+         hdr->size == size && hdr->pages_off + (uint64_t)hdr->max_pages * REGS_PAGE_SIZE <= size;
+}
+
+struct regs_store_t *regs_new( int nb_bits, int nb_input_bits, int nb_regs, int nb_input_regs, uint8_t init_value, int wire_order,
+                               const char *shm ){
+  int fd = -1;
+
+  if( shm && ( fd = shm_open( shm, O_RDWR | O_CREAT, 0660 ) ) == -1 ){ return NULL; }
+  return regs_new_fd( nb_bits, nb_input_bits, nb_regs, nb_input_regs, init_value, wire_order, fd );
+}
+
+struct regs_store_t *regs_new_fd( int nb_bits, int nb_input_bits, int nb_regs, int nb_input_regs, uint8_t init_value, int wire_order,
+                                  int fd ){
+  int nb[ REGS_TABLES ] = { nb_bits, nb_input_bits, nb_regs, nb_input_regs };
+  uint32_t unit_pages = 0;
+  struct regs_hdr_t old = { 0 };
+  int reuse = 0;
+
+  for( int t = 0; t < REGS_TABLES; t++ ){
+    if( nb[t] < 0 || nb[t] > REGS_MAX_ENTRIES ){
+      if( fd != -1 ){ close( fd ); }
+      return NULL;
+    }
+    unit_pages += ( nb[t] + ( 1 << regs_shift( t ) ) - 1 ) >> regs_shift( t );
+  }
+
+  struct regs_store_t *store = calloc( 1, sizeof( struct regs_store_t ) );
+  if( !store ){
+    if( fd != -1 ){ close( fd ); }
+    return NULL;
+  }
+  store->shm_fd = fd;
+
+  // Room for every unit writing every register, but only reserved: untouched pages cost nothing
+  uint32_t max_pages = unit_pages * REGS_UNITS;
+  uint64_t seq_off   = REGS_HDR_SIZE + REGS_DIR_LEN;
+  uint64_t dirty_off = seq_off + (uint64_t)max_pages * sizeof( uint32_t );
+  uint64_t pages_off = REGS_ALIGN( dirty_off + ( max_pages + 63 ) / 64 * sizeof( uint64_t ) );
+  size_t size = pages_off + (size_t)max_pages * REGS_PAGE_SIZE;
+  void *arena = MAP_FAILED;
+
+  if( fd == -1 ){ arena = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 ); }
+  else{
+    // A segment left by a previous run keeps its registers if the tables did not change, it is wiped otherwise
+    reuse = pread( store->shm_fd, &old, sizeof( old ), 0 ) == sizeof( old ) && regs_hdr_valid( &old, size ) &&
+            old.wire_order == !!wire_order;
+    for( int t = 0; t < REGS_TABLES && reuse; t++ ){ reuse = old.nb[t] == nb[t]; }
+
+    // Sized sparse: shared memory pages are only allocated when touched
+    if( reuse || ( ftruncate( store->shm_fd, 0 ) == 0 && ftruncate( store->shm_fd, size ) == 0 ) ){
+      arena = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, store->shm_fd, 0 );
+    }
+  }
+  if( arena == MAP_FAILED ){
+    if( store->shm_fd != -1 ){ close( store->shm_fd ); }
+    free( store );
+    return NULL;
+  }
+
+  struct regs_hdr_t *hdr = arena;
+  if( !reuse ){
+    hdr->magic     = REGS_MAGIC;
+    hdr->version   = REGS_VERSION;
+    hdr->page_size = REGS_PAGE_SIZE;
+    hdr->max_pages = max_pages;
+    hdr->size      = size;
+    hdr->dir_off   = REGS_HDR_SIZE;
+    hdr->seq_off   = seq_off;
+    hdr->dirty_off = dirty_off;
+    hdr->pages_off = pages_off;
+    hdr->wire_order = !!wire_order;
+    for( int t = 0; t < REGS_TABLES; t++ ){ hdr->nb[t] = nb[t]; }
+  }
+  regs_map( store, arena );
+
+  // A process killed in the middle of a write leaves its locks taken
+  if( reuse ){
+    hdr->alloc_lock += hdr->alloc_lock & 1;
+    for( uint32_t p = 0; p < hdr->npages; p++ ){ store->seq[p] += store->seq[p] & 1; }
+  }
+
+  // Routing is up to the new owner, unit ids are set back by regs_set_units() or regs_add_units()
+  hdr->init_value = init_value;
+  hdr->routed     = 0;
+  memset( hdr->units, 0, sizeof( hdr->units ) );
+
+  return store;
+}
+
+struct regs_store_t *regs_attach( const char *shm ){
+  struct regs_hdr_t hdr;
+  struct stat st;
+
+  struct regs_store_t *store = calloc( 1, sizeof( struct regs_store_t ) );
+  if( !store ){ return NULL; }
+
+  store->shm_fd = shm_open( shm, O_RDWR, 0 );
+  if( store->shm_fd == -1 ||
+      fstat( store->shm_fd, &st ) != 0 ||
+      pread( store->shm_fd, &hdr, sizeof( hdr ), 0 ) != sizeof( hdr ) ||
+      !regs_hdr_valid( &hdr, st.st_size ) ){
+    if( store->shm_fd != -1 ){ close( store->shm_fd ); }
+    free( store );
+    return NULL;
+  }
+
+  void *arena = mmap( NULL, hdr.size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, store->shm_fd, 0 );
+  if( arena == MAP_FAILED ){
+    close( store->shm_fd );
+    free( store );
+    return NULL;
+  }
+  regs_map( store, arena );
+
+  return store;
+}
+
+void regs_free( struct regs_store_t *store ){
+  if( !store ){ return; }
+
+  munmap( store->hdr, store->size );
+  if( store->shm_fd != -1 ){ close( store->shm_fd ); }
+  free( store );
+}
+
+int regs_add_units( struct regs_store_t *store, const char *spec ){
+  const char *p = spec;
+
+  while( *p ){
+    char *end;
+    long from = strtol( p, &end, 10 ), to = from;
+
+    if( end == p ){ return -1; }
+    if( *end == '-' ){
+      p  = end + 1;
+      to = strtol( p, &end, 10 );
+      if( end == p ){ return -1; }
+    }
+    if( from < 0 || to >= REGS_UNITS || from > to ){ return -1; }
+    if( *end == ',' ){ end++; }
+    else if( *end ){ return -1; }
+
+    for( long u = from; u <= to; u++ ){ store->hdr->units[ u / 8 ] |= 1 << ( u % 8 ); }
+    p = end;
+  }
+
+  store->hdr->routed = 1;
+  return 0;
+}
+
+void regs_set_units( struct regs_store_t *store, int routed, const uint8_t *units ){
+  for( int i = 0; i < REGS_UNITS / 8; i++ ){ __atomic_store_n( &store->hdr->units[i], units[i], __ATOMIC_RELAXED ); }
+  __atomic_store_n( &store->hdr->routed, routed, __ATOMIC_RELEASE );
+}
+
+int regs_routed( struct regs_store_t *store ){
+  return store->hdr->routed;
+}
+
+int regs_unit( struct regs_store_t *store, uint8_t uid ){
+  if( !store->hdr->routed ){ return 0; }
+
+  return ( store->hdr->units[ uid / 8 ] >> ( uid % 8 ) ) & 1 ? uid : -1;
+}
+
+int regs_size( struct regs_store_t *store, enum regs_table_type table ){
+  return store->hdr->nb[ table ];
+}
+
+size_t regs_used( struct regs_store_t *store ){
+  return (size_t)__atomic_load_n( &store->hdr->npages, __ATOMIC_RELAXED ) * REGS_PAGE_SIZE;
+}
+
+/**
+ * @brief      Marks a page for the next checkpoint. Most writes find it already marked and store nothing
+ */
+static inline void regs_dirty( struct regs_store_t *store, uint32_t page ){
+  uint64_t *word = &store->dirty[ ( page - 1 ) / 64 ];
+  uint64_t  bit  = 1ULL << ( ( page - 1 ) % 64 );
+
+  if( !( __atomic_load_n( word, __ATOMIC_RELAXED ) & bit ) ){ __atomic_fetch_or( word, bit, __ATOMIC_RELEASE ); }
+}
+
+/**
+ * @brief      Takes the page allocation lock
+ *
+ * @return     The sequence to give back to regs_alloc_unlock()
+ */
+static inline uint32_t regs_alloc_lock( struct regs_store_t *store ){
+  uint32_t *lock = &store->hdr->alloc_lock;
+  int spins = 0;
+  uint32_t seq = regs_seq_wait( lock, &spins );
+
+  while( !__atomic_compare_exchange_n( lock, &seq, seq + 1, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED ) ){
+    seq = regs_seq_wait( lock, &spins );
+  }
+  return seq;
+}
+
+static inline void regs_alloc_unlock( struct regs_store_t *store, uint32_t seq ){
+  __atomic_store_n( &store->hdr->alloc_lock, seq + 2, __ATOMIC_RELEASE );
+}
+
+/**
+ * @brief      Gets the page of a directory entry, handing out a new one filled with the init value on first write
+ *
+ * @return     The page number plus one, 0 if the pool is exhausted
+ */
+uint32_t regs_page_get( struct regs_store_t *store, uint32_t *entry, enum regs_table_type table ){
+  struct regs_hdr_t *hdr = store->hdr;
+  uint32_t page = __atomic_load_n( entry, __ATOMIC_ACQUIRE );
+
+  if( page ){ return page; }
+
+  uint32_t seq = regs_alloc_lock( store );
+
+  // Another writer may have won the race for this same entry
+  page = __atomic_load_n( entry, __ATOMIC_RELAXED );
+  if( !page && hdr->npages < hdr->max_pages ){
+    page = hdr->npages + 1;
+    memset( regs_page_data( store, page ), regs_shift( table ) == REGS_BITS_SHIFT ? ( hdr->init_value ? 0xFF : 0 ) : hdr->init_value,
+            REGS_PAGE_SIZE );
+    __atomic_store_n( &hdr->npages, page, __ATOMIC_RELAXED );
+    regs_dirty( store, page );
+
+    // Readers seeing the entry must see the page filled, checkpoints must see it counted and dirty
+    __atomic_store_n( entry, page, __ATOMIC_RELEASE );
+  }
+
+  regs_alloc_unlock( store, seq );
+  return page;
+}
+
+/**
+ * @brief      Takes the pages of an access. They come in address order, so writers never deadlock
+ */
+void regs_lock( struct regs_store_t *store, const uint32_t *pages, int n ){
+  int spins = 0;
+
+  for( int i = 0; i < n; i++ ){
+    uint32_t *lock = &store->seq[ pages[i] - 1 ];
+    uint32_t seq = regs_seq_wait( lock, &spins );
+    while( !__atomic_compare_exchange_n( lock, &seq, seq + 1, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED ) ){
+      seq = regs_seq_wait( lock, &spins );
+    }
+  }
+
+  // Odd sequences must be visible before any data store
+  __atomic_thread_fence( __ATOMIC_RELEASE );
+}
+
+void regs_unlock( struct regs_store_t *store, const uint32_t *pages, int n ){
+  for( int i = 0; i < n; i++ ){
+    uint32_t *lock = &store->seq[ pages[i] - 1 ];
+    __atomic_store_n( lock, __atomic_load_n( lock, __ATOMIC_RELAXED ) + 1, __ATOMIC_RELEASE );
+    regs_dirty( store, pages[i] );
+  }
+}
+
+void regs_read( struct regs_store_t *store, int unit, enum regs_table_type table, int addr, int nb, uint8_t *dst ){
+  const int shift = regs_shift( table );
+  const int mask  = ( 1 << shift ) - 1;
+  const int first = addr >> shift;
+  const int n     = ( ( addr + nb - 1 ) >> shift ) - first + 1;
+  const uint8_t init = store->hdr->init_value;
+  const int wire = store->hdr->wire_order;
+  uint32_t *dir = regs_dir( store, unit, table ) + first;
+  uint32_t page[ REGS_MAX_PAGES ], seq[ REGS_MAX_PAGES ];
+  uint8_t tmp[ REGS_PAGE_SIZE ];
+  int retry, spins = 0;
+
+  do{
+    // Waiting for running writers, then copying with no lock at all
+    for( int p = 0; p < n; p++ ){
+      page[p] = __atomic_load_n( &dir[p], __ATOMIC_ACQUIRE );
+      if( page[p] ){
+        seq[p] = regs_seq_wait( &store->seq[ page[p] - 1 ], &spins );
+      }
+    }
+
+    if( shift == REGS_BITS_SHIFT ){ memset( dst, 0, ( nb + 7 ) / 8 ); }
+    for( int i = 0, p = 0; i < nb; p++ ){
+      int off   = ( addr + i ) & mask;
+      int chunk = ( mask + 1 - off < nb - i ) ? mask + 1 - off : nb - i;
+
+      // Never written pages hold the init value
+      if( shift == REGS_BITS_SHIFT ){
+        if( !i && page[p] ){ regs_bits_to_wire( dst, regs_page_data( store, page[p] ), off, chunk ); }
+        else{
+          // Past the first page, the range does not start on a byte of dst any more
+          if( page[p] ){ regs_bits_to_wire( tmp, regs_page_data( store, page[p] ), off, chunk ); }
+          else{ memset( tmp, init ? 0xFF : 0, ( chunk + 7 ) / 8 ); }
+          regs_bits_from_wire( dst, i, tmp, chunk );
+        }
+        i += chunk;
+      }
+      else{
+        // The init value fills both bytes: the same in either order
+        if( !page[p] ){ memset( dst + i * 2, init, chunk * 2 ); }
+        else if( wire ){ regs_copy( dst + i * 2, regs_page_data( store, page[p] ) + off * 2, chunk ); }
+        else{ regs_to_wire( dst + i * 2, (const uint16_t *)regs_page_data( store, page[p] ) + off, chunk ); }
+        i += chunk;
+      }
+    }
+
+    // Any sequence moved or page appeared: a writer touched the range during the copy
+    __atomic_thread_fence( __ATOMIC_ACQUIRE );
+    retry = 0;
+    for( int p = 0; p < n && !retry; p++ ){
+      retry = __atomic_load_n( &dir[p], __ATOMIC_RELAXED ) != page[p] ||
+              ( page[p] && __atomic_load_n( &store->seq[ page[p] - 1 ], __ATOMIC_RELAXED ) != seq[p] );
+    }
+  } while( retry );
+}
+
+int regs_write( struct regs_store_t *store, int unit, enum regs_table_type table, int addr, int nb, const uint8_t *src ){
+  const int shift = regs_shift( table );
+  const int mask  = ( 1 << shift ) - 1;
+  const int first = addr >> shift;
+  const int n     = ( ( addr + nb - 1 ) >> shift ) - first + 1;
+  uint32_t *dir = regs_dir( store, unit, table ) + first;
+  uint32_t page[ REGS_MAX_PAGES ];
+  uint8_t tmp[ REGS_PAGE_SIZE ];
+  const int wire = store->hdr->wire_order;
+
+  for( int p = 0; p < n; p++ ){
+    if( !( page[p] = regs_page_get( store, &dir[p], table ) ) ){ return -1; }
+  }
+
+  regs_lock( store, page, n );
+
+  for( int i = 0, p = 0; i < nb; p++ ){
+    int off   = ( addr + i ) & mask;
+    int chunk = ( mask + 1 - off < nb - i ) ? mask + 1 - off : nb - i;
+
+    if( shift == REGS_BITS_SHIFT ){
+      if( !i ){ regs_bits_from_wire( regs_page_data( store, page[p] ), off, src, chunk ); }
+      else{
+        regs_bits_to_wire( tmp, src, i, chunk );
+        regs_bits_from_wire( regs_page_data( store, page[p] ), off, tmp, chunk );
+      }
+      i += chunk;
+    }
+    else{
+      if( wire ){ regs_copy( regs_page_data( store, page[p] ) + off * 2, src + i * 2, chunk ); }
+      else{ regs_from_wire( (uint16_t *)regs_page_data( store, page[p] ) + off, src + i * 2, chunk ); }
+      i += chunk;
+    }
+  }
+
+  regs_unlock( store, page, n );
+  return 0;
+}
+
+int regs_write_block( struct regs_store_t *store, int unit, enum regs_table_type table, int addr, int nb, const uint16_t *src ){
+  const int first = addr >> 8;
+  const int n     = ( ( addr + nb - 1 ) >> 8 ) - first + 1;
+  uint32_t *dir = regs_dir( store, unit, table ) + first;
+  uint32_t page[ REGS_DIR_SIZE ];
+  const int wire = store->hdr->wire_order;
+
+  for( int p = 0; p < n; p++ ){
+    if( !( page[p] = regs_page_get( store, &dir[p], table ) ) ){ return -1; }
+  }
+
+  // Every page of the block at once: a read across two of them never mixes two updates. The lock is held for
+  // the copy only, the values are computed beforehand
+  regs_lock( store, page, n );
+  for( int i = 0, p = 0; i < nb; p++ ){
+    int off   = ( addr + i ) & 0xFF;
+    int chunk = ( 0x100 - off < nb - i ) ? 0x100 - off : nb - i;
+    uint8_t *dst = regs_page_data( store, page[p] ) + off * 2;
+
+    if( wire ){ regs_to_wire( dst, src + i, chunk ); }
+    else{ regs_copy( dst, (const uint8_t *)( src + i ), chunk ); }
+    i += chunk;
+  }
+  regs_unlock( store, page, n );
+  return 0;
+}
+
+int regs_mask_write( struct regs_store_t *store, int unit, int addr, uint16_t and_mask, uint16_t or_mask ){
+  uint32_t page = regs_page_get( store, regs_dir( store, unit, REGS_HOLDING ) + ( addr >> 8 ), REGS_HOLDING );
+  if( !page ){ return -1; }
+
+  uint16_t *reg = (uint16_t *)regs_page_data( store, page ) + ( addr & 0xFF );
+
+  // Masks work bit by bit: in wire order, they apply to a big endian register as they are
+  if( store->hdr->wire_order ){
+    and_mask = htons( and_mask );
+    or_mask  = htons( or_mask );
+  }
+
+  regs_lock( store, &page, 1 );
+  *reg = ( *reg & and_mask ) | ( or_mask & ~and_mask );
+  regs_unlock( store, &page, 1 );
+
+  return 0;
+}
+
+/**
+ * @brief      Copies a whole page as a reader would
+ */
+void regs_page_copy( struct regs_store_t *store, uint32_t page, uint8_t *dst ){
+  uint32_t *lock = &store->seq[ page - 1 ];
+  uint32_t seq;
+  int spins = 0;
+
+  do{
+    seq = regs_seq_wait( lock, &spins );
+    memcpy( dst, regs_page_data( store, page ), REGS_PAGE_SIZE );
+    __atomic_thread_fence( __ATOMIC_ACQUIRE );
+  } while( __atomic_load_n( lock, __ATOMIC_RELAXED ) != seq );
+}
+
+/**
+ * @brief      Copies the registers of a mapped snapshot into an empty store
+ *
+ * @return     The pages restored, 0 if the snapshot does not fit the store
+ */
+uint32_t regs_restore( struct regs_store_t *store, int fd, const struct regs_hdr_t *snap ){
+  struct regs_hdr_t *hdr = store->hdr;
+
+  if( snap->npages > hdr->max_pages || snap->dir_off != hdr->dir_off || snap->pages_off != hdr->pages_off ||
+      snap->wire_order != hdr->wire_order ){ return 0; }
+  for( int t = 0; t < REGS_TABLES; t++ ){
+    if( snap->nb[t] != hdr->nb[t] ){ return 0; }
+  }
+
+  const uint8_t *file = mmap( NULL, hdr->size, PROT_READ, MAP_PRIVATE | MAP_NORESERVE, fd, 0 );
+  if( file == MAP_FAILED ){ return 0; }
+
+  // Nobody serves the store yet: plain copies, published by the page count
+  memcpy( store->dir, file + snap->dir_off, REGS_DIR_LEN );
+  memcpy( store->pages, file + snap->pages_off, (size_t)snap->npages * REGS_PAGE_SIZE );
+  __atomic_store_n( &hdr->npages, snap->npages, __ATOMIC_RELEASE );
+
+  munmap( (void *)file, hdr->size );
+  return snap->npages;
+}
+
+struct regs_ckpt_t *regs_ckpt_open( struct regs_store_t *store, const char *path ){
+  struct regs_hdr_t *hdr = store->hdr;
+  struct regs_hdr_t snap = { 0 };
+
+  struct regs_ckpt_t *ckpt = calloc( 1, sizeof( struct regs_ckpt_t ) );
+  if( !ckpt ){ return NULL; }
+  ckpt->dir  = malloc( REGS_DIR_LEN );
+  ckpt->path = strdup( path );
+  ckpt->fd   = open( path, O_RDWR | O_CREAT | O_CLOEXEC, 0644 );
+  if( !ckpt->dir || !ckpt->path || ckpt->fd == -1 ){
+    regs_ckpt_close( ckpt );
+    return NULL;
+  }
+
+  if( pread( ckpt->fd, &snap, sizeof( snap ), 0 ) == sizeof( snap ) && regs_hdr_valid( &snap, hdr->size ) &&
+      __atomic_load_n( &hdr->npages, __ATOMIC_ACQUIRE ) == 0 ){ ckpt->restored = regs_restore( store, ckpt->fd, &snap ); }
+
+  if( ckpt->restored ){ ckpt->npages = ckpt->restored; }
+  else{
+    // The file does not hold this store, yet it may be the only copy of the registers: it stays until a
+    // replacement, sized sparse as the arena, holds every page
+    close( ckpt->fd );
+    ckpt->fd = -1;
+    if( asprintf( &ckpt->tmp, "%s.tmp", path ) < 0 ){ ckpt->tmp = NULL; }
+    if( !ckpt->tmp || ( ckpt->fd = open( ckpt->tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 ) ) == -1 ||
+        ftruncate( ckpt->fd, hdr->size ) != 0 ){
+      regs_ckpt_close( ckpt );
+      return NULL;
+    }
+    ckpt->npages = UINT32_MAX;
+    for( uint32_t p = 1; p <= __atomic_load_n( &hdr->npages, __ATOMIC_ACQUIRE ); p++ ){ regs_dirty( store, p ); }
+  }
+
+  return ckpt;
+}
+
+/**
+ * @brief      Flushes the directory holding a file, so that a rename in it survives a crash
+ */
+void regs_ckpt_sync_dir( const char *path ){
+  const char *slash = strrchr( path, '/' );
+  char *dir = slash ? strndup( path, slash > path ? slash - path : 1 ) : strdup( "." );
+  int fd = dir ? open( dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC ) : -1;
+
+  if( fd != -1 ){
+    fsync( fd );
+    close( fd );
+  }
+  free( dir );
+}
+
+int regs_ckpt_run( struct regs_store_t *store, struct regs_ckpt_t *ckpt ){
+  struct regs_hdr_t *hdr = store->hdr;
+  uint32_t npages = __atomic_load_n( &hdr->npages, __ATOMIC_ACQUIRE );
+  int written = 0;
+
+  // Directory copied first, under the allocation lock: a page is counted before its entry is published, the
+  // copy lists exactly the npages pages. New pages wait for the copy, reads and writes never do
+  int grown = npages != ckpt->npages;
+  if( grown ){
+    uint32_t seq = regs_alloc_lock( store );
+    npages = hdr->npages;
+    memcpy( ckpt->dir, store->dir, REGS_DIR_LEN );
+    regs_alloc_unlock( store, seq );
+  }
+
+  for( uint32_t w = 0; w < ( npages + 63 ) / 64; w++ ){
+    // Pages counted later are left to the round listing them
+    uint64_t mask = npages - w * 64 >= 64 ? ~0ULL : ( 1ULL << ( npages - w * 64 ) ) - 1;
+    if( !( __atomic_load_n( &store->dirty[w], __ATOMIC_RELAXED ) & mask ) ){ continue; }
+
+    // Cleared before copying: a write landing after the copy marks its page again
+    uint64_t bits = __atomic_fetch_and( &store->dirty[w], ~mask, __ATOMIC_ACQ_REL ) & mask;
+    while( bits ){
+      uint32_t page = w * 64 + __builtin_ctzll( bits ) + 1;
+
+      regs_page_copy( store, page, ckpt->page );
+      if( pwrite( ckpt->fd, ckpt->page, REGS_PAGE_SIZE, hdr->pages_off + (uint64_t)( page - 1 ) * REGS_PAGE_SIZE ) != REGS_PAGE_SIZE ){
+        // This page and the ones not written yet go to the next round
+        __atomic_fetch_or( &store->dirty[w], bits, __ATOMIC_RELEASE );
+        return -1;
+      }
+      bits &= bits - 1;
+      written++;
+    }
+  }
+
+  // The directory only lands once the pages it points to are on disk
+  if( grown ){
+    struct regs_hdr_t snap = *hdr;
+    snap.npages     = npages;
+    snap.alloc_lock = 0;
+
+    if( fdatasync( ckpt->fd ) != 0 ||
+        pwrite( ckpt->fd, ckpt->dir, REGS_DIR_LEN, hdr->dir_off ) != (ssize_t)REGS_DIR_LEN ||
+        pwrite( ckpt->fd, &snap, sizeof( snap ), 0 ) != sizeof( snap ) ){ return -1; }
+    ckpt->npages = npages;
+  }
+  int synced = !( written || grown ) || fdatasync( ckpt->fd ) == 0;
+
+  // The first checkpoint is complete and on disk: it replaces the snapshot, later ones update it in place. Until
+  // then every round writes the directory again
+  if( ckpt->tmp ){
+    if( !synced || rename( ckpt->tmp, ckpt->path ) != 0 ){
+      ckpt->npages = UINT32_MAX;
+      return -1;
+    }
+    free( ckpt->tmp );
+    ckpt->tmp = NULL;
+    regs_ckpt_sync_dir( ckpt->path );
+  }
+
+  return written;
+}
+
+void regs_ckpt_close( struct regs_ckpt_t *ckpt ){
+  if( !ckpt ){ return; }
+
+  // A replacement never completed is dropped, the snapshot stays as it was
+  if( ckpt->fd != -1 ){ close( ckpt->fd ); }
+  if( ckpt->tmp ){ unlink( ckpt->tmp ); }
+  free( ckpt->tmp );
+  free( ckpt->path );
+  free( ckpt->dir );
+  free( ckpt );
+}
@@ -0,0 +1,310 @@
+#ifndef _MBT_REGS_H_
+#define _MBT_REGS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ DEFINITIONS
+#define REGS_MAGIC              0x4D425452         ///< "MBTR", first word of a register arena
+#define REGS_VERSION            5                  ///< Arena layout version
+#define REGS_UNITS              256                ///< Register spaces: one per modbus unit identifier
+#define REGS_PAGE_SIZE          512                ///< Page bytes: 256 registers or 4096 bits (8 per byte)
+#define REGS_DIR_SIZE           256                ///< Directory entries per table, enough for 65536 registers
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ TYPES
+enum regs_table_type {
+  REGS_COILS,
+  REGS_DISCRETE_INPUTS,
+  REGS_HOLDING,
+  REGS_INPUT,
+  REGS_TABLES
+};
+
+/**
+ * Arena header. The arena is a single mapping, private or a named shared memory segment, holding: this
+ * header, the page directory ( uint32_t dir[ REGS_UNITS ][ REGS_TABLES ][ REGS_DIR_SIZE ] ), one uint32_t
+ * sequence per page, a bitmap of the pages written since the last checkpoint and the page pool, each at
+ * the offset given here. A snapshot file has the same layout. Directory entries are page numbers
+ * plus one, 0 while the page was never written: it reads as the init value. Only offsets are stored, the
+ * arena can be mapped anywhere. Everything is in host byte order, registers included unless wire_order is set:
+ * then they are big endian, as on the wire. Bits are packed as on the wire: entry n of a page is bit n % 8 of
+ * byte n / 8.
+ *
+ * Every page has its own sequence lock: odd while a writer owns it, bumped to the next even value when
+ * released, then the page dirty bit is set. Readers copy without locking and retry when a sequence or a
+ * directory entry changed. Pages are handed out under alloc_lock: npages is bumped and the page filled and
+ * marked dirty before its directory entry is published.
+ *
+ * Locks are held for a copy at most and never taken over: a writer stopped while holding one stalls that page until
+ * it resumes, one that died until the segment is reused, when every odd sequence is released.
+ */
+struct regs_hdr_t{
+  uint32_t magic;                                  ///< REGS_MAGIC
+  uint32_t version;                                ///< REGS_VERSION
+  uint32_t page_size;                              ///< REGS_PAGE_SIZE
+  uint32_t max_pages;                              ///< Pages in the pool
+  uint64_t size;                                   ///< Arena length
+  uint64_t dir_off;                                ///< Page directory offset
+  uint64_t seq_off;                                ///< Page sequences offset
+  uint64_t dirty_off;                              ///< Dirty pages bitmap offset, uint64_t words
+  uint64_t pages_off;                              ///< Page pool offset
+  uint32_t npages;                                 ///< Pages already handed out
+  uint32_t alloc_lock;                             ///< Sequence lock serializing page allocations, odd while taken
+  int32_t  nb[ REGS_TABLES ];                      ///< Entries per table, the same for every unit
+  uint8_t  init_value;                             ///< Byte registers are filled with, bits are set when not 0
+  uint8_t  routed;                                 ///< Units have their own registers, all share unit 0 otherwise
+  uint8_t  wire_order;                             ///< Registers are stored big endian: reads and writes are plain copies
+  uint8_t  units[ REGS_UNITS / 8 ];                ///< Bitmap of the served unit identifiers when routed
+};
+
+struct regs_store_t{
+  struct regs_hdr_t *hdr;                          ///< Arena header, start of the mapping
+  uint32_t          *dir;                          ///< Page directory
+  uint32_t          *seq;                          ///< Page sequence locks
+  uint64_t          *dirty;                        ///< Pages written since the last checkpoint
+  uint8_t           *pages;                        ///< Page pool
+  size_t             size;                         ///< Arena length
+  int                shm_fd;                       ///< Shared memory segment or memory file, -1 for a private arena
+};
+
+struct regs_ckpt_t{
+  int                fd;                           ///< Snapshot file, or its replacement until the first checkpoint
+  char              *path;                         ///< Snapshot file path
+  char              *tmp;                          ///< Replacement renamed over the snapshot by the first checkpoint, NULL if none
+  uint32_t           npages;                       ///< Pages listed by the snapshot directory
+  uint32_t           restored;                     ///< Pages restored from the snapshot when opened
+  uint32_t          *dir;                          ///< Directory copy, written after the pages it lists
+  uint8_t            page[ REGS_PAGE_SIZE ];       ///< Page copy
+};
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS
+
+/**
+ * @brief      Allocates a register store. Memory is only committed for the pages actually written
+ *
+ * @param[in]  nb_bits        The number of coils
+ * @param[in]  nb_input_bits  The number of discrete inputs
+ * @param[in]  nb_regs        The number of holding registers
+ * @param[in]  nb_input_regs  The number of input registers
+ * @param[in]  init_value     The byte every register is filled with, bits are set when not 0
+ * @param[in]  wire_order     Registers stored big endian rather than in host byte order
+ * @param[in]  shm            The shared memory segment name (eg. "/mbt-regs"), NULL for a private store.
+ *                            An existing segment with the same sizes and order is reused with its registers
+ *
+ * @return     The store, NULL on failure
+ */
+struct regs_store_t *regs_new( int nb_bits, int nb_input_bits, int nb_regs, int nb_input_regs, uint8_t init_value, int wire_order,
+                               const char *shm );
+
+/**
+ * @brief      Allocates a register store in a memory file, eg. from memfd_create(): the file can be handed to
+ *             another process, which gets the same registers from it
+ *
+ * @param[in]  fd  The memory file, owned by the store and closed on failure. An arena it already holds with
+ *                 the same sizes and order is reused with its registers. -1 for a private store
+ *
+ * The other parameters are the ones of regs_new().
+ *
+ * @return     The store, NULL on failure
+ */
+struct regs_store_t *regs_new_fd( int nb_bits, int nb_input_bits, int nb_regs, int nb_input_regs, uint8_t init_value, int wire_order,
+                                  int fd );
+
+/**
+ * @brief      Maps the store of a running server from another process: regs_read() and regs_write() work
+ *             on it as they do in the server, with no system call
+ *
+ * @param[in]  shm   The shared memory segment name
+ *
+ * @return     The store, to be released with regs_free(). NULL if missing or not a register store
+ */
+struct regs_store_t *regs_attach( const char *shm );
+
+/**
+ * @brief      Frees a register store
+ *
+ * @param      store  The store
+ */
+void regs_free( struct regs_store_t *store );
+
+/**
+ * @brief      Enables per unit routing and adds the unit identifiers in spec to the served ones
+ *
+ * @param      store  The store
+ * @param[in]  spec   Comma separated ids or ranges, eg. "1,5,10-20"
+ *
+ * @return     0 on success, -1 if spec is invalid
+ */
+int regs_add_units( struct regs_store_t *store, const char *spec );
+
+/**
+ * @brief      Replaces the served unit identifiers, for the processes attached to the store
+ *
+ * @param      store   The store
+ * @param[in]  routed  Units have their own registers, all share unit 0 otherwise
+ * @param[in]  units   Bitmap of the served unit identifiers, REGS_UNITS bits
+ */
+void regs_set_units( struct regs_store_t *store, int routed, const uint8_t *units );
+
+/**
+ * @brief      Tells if the store routes on the unit identifier
+ *
+ * @param      store  The store
+ *
+ * @return     1 if every served unit has its own registers, 0 if all of them share unit 0
+ */
+int regs_routed( struct regs_store_t *store );
+
+/**
+ * @brief      Gets the register space serving a unit identifier
+ *
+ * @param      store  The store
+ * @param[in]  uid    The unit identifier (MBAP unit or RTU address)
+ *
+ * @return     The unit to pass to the other functions, -1 if uid is not served
+ */
+int regs_unit( struct regs_store_t *store, uint8_t uid );
+
+/**
+ * @brief      Gets the number of entries of a table
+ *
+ * @param      store  The store
+ * @param[in]  table  The table
+ *
+ * @return     The table size
+ */
+int regs_size( struct regs_store_t *store, enum regs_table_type table );
+
+/**
+ * @brief      Gets the memory used by the pages written so far
+ *
+ * @param      store  The store
+ *
+ * @return     The bytes
+ */
+size_t regs_used( struct regs_store_t *store );
+
+/**
+ * @brief      Reads a consistent snapshot of a range, in wire format: big endian registers or packed bits
+ *
+ * @param      store  The store
+ * @param[in]  unit   The unit, from regs_unit()
+ * @param[in]  table  The table
+ * @param[in]  addr   The first entry, the range must be within bounds
+ * @param[in]  nb     The number of entries
+ * @param[out] dst    The destination
+ */
+void regs_read( struct regs_store_t *store, int unit, enum regs_table_type table, int addr, int nb, uint8_t *dst );
+
+/**
+ * @brief      Writes a range atomically, from wire format: big endian registers or packed bits
+ *
+ * @param      store  The store
+ * @param[in]  unit   The unit, from regs_unit()
+ * @param[in]  table  The table
+ * @param[in]  addr   The first entry, the range must be within bounds
+ * @param[in]  nb     The number of entries
+ * @param[in]  src    The source
+ *
+ * @return     0 on success, -1 if the page pool is exhausted
+ */
+int regs_write( struct regs_store_t *store, int unit, enum regs_table_type table, int addr, int nb, const uint8_t *src );
+
+/**
+ * @brief      Writes a block of registers of any length atomically, from host order registers: every page of the
+ *             block is locked at once, readers see the block either before or after the write
+ *
+ * @param      store  The store
+ * @param[in]  unit   The unit, from regs_unit()
+ * @param[in]  table  REGS_HOLDING or REGS_INPUT
+ * @param[in]  addr   The first register, the block must be within bounds
+ * @param[in]  nb     The number of registers
+ * @param[in]  src    The registers
+ *
+ * @return     0 on success, -1 if the page pool is exhausted
+ */
+int regs_write_block( struct regs_store_t *store, int unit, enum regs_table_type table, int addr, int nb, const uint16_t *src );
+
+/**
+ * @brief      Applies a modbus mask write to a holding register: ( reg & and ) | ( or & ~and )
+ *
+ * @param      store     The store
+ * @param[in]  unit      The unit, from regs_unit()
+ * @param[in]  addr      The register, within bounds
+ * @param[in]  and_mask  The and mask
+ * @param[in]  or_mask   The or mask
+ *
+ * @return     0 on success, -1 if the page pool is exhausted
+ */
+int regs_mask_write( struct regs_store_t *store, int unit, int addr, uint16_t and_mask, uint16_t or_mask );
+
+/**
+ * @brief      Opens a snapshot file for checkpoints. An empty store gets back the registers of a valid snapshot
+ *             with the same tables, copied from the mapped file: no write is replayed. Otherwise every page of
+ *             the store is written by the first checkpoint to "<path>.tmp", renamed over the snapshot once
+ *             complete: the snapshot is never emptied
+ *
+ * @param      store  The store
+ * @param[in]  path   The snapshot file, created if missing
+ *
+ * @return     The checkpoint state, NULL on failure
+ */
+struct regs_ckpt_t *regs_ckpt_open( struct regs_store_t *store, const char *path );
+
+/**
+ * @brief      Writes the pages dirtied since the last checkpoint, then the directory when new pages appeared.
+ *             Pages are copied like any reader does: writers are never waited for
+ *
+ * @param      store  The store
+ * @param      ckpt   The checkpoint state
+ *
+ * @return     The pages written, -1 on file errors
+ */
+int regs_ckpt_run( struct regs_store_t *store, struct regs_ckpt_t *ckpt );
+
+/**
+ * @brief      Closes a snapshot file
+ *
+ * @param      ckpt  The checkpoint state
+ */
+void regs_ckpt_close( struct regs_ckpt_t *ckpt );
+
+/**
+ * @brief      Copies registers into a frame, big endian
+ *
+ * @param[out] dst   The frame data
+ * @param[in]  src   The registers
+ * @param[in]  nb    The number of registers
+ */
+void regs_to_wire( uint8_t *dst, const uint16_t *src, int nb );
+
+/**
+ * @brief      Copies registers out of a frame, big endian
+ *
+ * @param[out] dst   The registers
+ * @param[in]  src   The frame data
+ * @param[in]  nb    The number of registers
+ */
+void regs_from_wire( uint16_t *dst, const uint8_t *src, int nb );
+
+/**
+ * @brief      Copies packed bits into a frame, from its first bit. The unused bits of the last byte are cleared
+ *
+ * @param[out] dst    The frame data
+ * @param[in]  src    The packed bits
+ * @param[in]  first  The first bit of src copied
+ * @param[in]  nb     The number of bits
+ */
+void regs_bits_to_wire( uint8_t *dst, const uint8_t *src, int first, int nb );
+
+/**
+ * @brief      Copies bits out of a frame into packed bits. The bits of dst out of the range are kept
+ *
+ * @param[out] dst    The packed bits
+ * @param[in]  first  The first bit of dst written
+ * @param[in]  src    The frame data, from its first bit
+ * @param[in]  nb     The number of bits
+ */
+void regs_bits_from_wire( uint8_t *dst, int first, const uint8_t *src, int nb );
+
+#endif // _MBT_REGS_H_
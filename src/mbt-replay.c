@@ -0,0 +1,444 @@
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ INCLUDES
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+
+#include "mbt-replay.h"
+#include "mbt-adu.h"
+#include "mbt-trace.h"
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ DEFINITIONS
+#define REPLAY_IBUF_SIZE  ( 4 * MODBUS_TCP_MAX_ADU_LENGTH )  ///< Per connection receive buffer
+#define REPLAY_DEPTH_MAX   1024                            ///< Max requests in flight per connection
+#define REPLAY_HASH        4096                            ///< Connection id buckets, a power of 2
+#define REPLAY_WAIT_MSEC    100                            ///< Longest event loop sleep
+#define REPLAY_CHECK_MSEC    10                            ///< Interval between two reply timeout checks
+#define REPLAY_LATE_MSEC      1                            ///< Queries sent later than this after their due time are late
+#define REPLAY_EVENTS       256                            ///< Max events returned by a single wait
+#define MSEC                1000000ULL                     ///< Nanoseconds in a millisecond
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ TYPES
+struct replay_req_t{
+  uint64_t due;                                            ///< Time the query was due, its recorded time over speed
+  uint64_t sent;                                           ///< Time the query was queued for sending
+  uint8_t  fc;                                             ///< Function code
+  uint8_t  used;                                           ///< Waiting for its reply
+};
+
+struct replay_conn_t{
+  uint32_t              id;                                ///< Connection id in the trace
+  int                   fd;                                ///< Socket
+  int                   up;                                ///< Connected
+  int                   closing;                           ///< Closed by the trace: closed once its replies are in
+  struct replay_conn_t *hnext;                             ///< Next connection of the same bucket
+  struct replay_conn_t *prev, *next;                       ///< Open connections list
+  int                   nfree;                             ///< Free request slots
+  uint16_t             *free;                              ///< Free request slots stack
+  struct replay_req_t  *reqs;                              ///< Request slots: a transaction identifier is its slot
+  uint16_t              ilen;                              ///< Bytes waiting in ibuf
+  uint16_t              olen;                              ///< Bytes queued in obuf
+  uint16_t              osent;                             ///< Bytes of obuf already sent
+  uint8_t               ibuf[ REPLAY_IBUF_SIZE ];          ///< Receive buffer, may end with a partial reply
+  uint8_t              *obuf;                              ///< Send buffer, room for depth requests
+};
+
+struct replay_t{
+  struct replay_args_t   *args;
+  struct replay_result_t *res;
+  int                     epfd;
+  struct replay_conn_t   *buckets[ REPLAY_HASH ];          ///< Open connections by trace id
+  struct replay_conn_t   *conns;                           ///< Open connections
+  struct sockaddr_storage sa;                              ///< Server address, resolved once
+  socklen_t               salen;
+};
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ GLOBAL VARS
+int replay_terminate = 0;                                  ///< If set the replay stops
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS
+static inline struct replay_conn_t **replay_bucket( struct replay_t *r, uint32_t id ){
+  return &r->buckets[ ( id * 0x9E3779B1u ) >> 20 & ( REPLAY_HASH - 1 ) ];
+}
+
+struct replay_conn_t *replay_find( struct replay_t *r, uint32_t id ){
+  struct replay_conn_t *conn = *replay_bucket( r, id );
+  while( conn && conn->id != id ){ conn = conn->hnext; }
+  return conn;
+}
+
+/**
+ * @brief      Closes a connection: requests still in flight will never be answered
+ */
+void replay_close( struct replay_t *r, struct replay_conn_t *conn ){
+  struct replay_conn_t **pp = replay_bucket( r, conn->id );
+
+  stats_add( &r->res->load.timeouts, r->args->depth - conn->nfree );
+  close( conn->fd );
+
+  while( *pp != conn ){ pp = &(*pp)->hnext; }
+  *pp = conn->hnext;
+  if( conn->prev ){ conn->prev->next = conn->next; }
+  else{ r->conns = conn->next; }
+  if( conn->next ){ conn->next->prev = conn->prev; }
+
+  free( conn->free );
+  free( conn->reqs );
+  free( conn->obuf );
+  free( conn );
+}
+
+/**
+ * @brief      Opens the connection of a trace id, connecting in background
+ *
+ * @return     The connection, NULL on failure
+ */
+struct replay_conn_t *replay_open( struct replay_t *r, uint32_t id ){
+  struct replay_conn_t *conn = calloc( 1, sizeof( struct replay_conn_t ) );
+  int depth = r->args->depth, on = 1;
+
+  if( !conn ){ return NULL; }
+  conn->id   = id;
+  conn->free = malloc( depth * sizeof( uint16_t ) );
+  conn->reqs = calloc( depth, sizeof( struct replay_req_t ) );
+  conn->obuf = malloc( depth * MODBUS_TCP_MAX_ADU_LENGTH );
+  conn->fd   = socket( r->sa.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+  if( !conn->free || !conn->reqs || !conn->obuf || conn->fd == -1 ){ goto fail; }
+  for( int i = 0; i < depth; i++ ){ conn->free[i] = depth - 1 - i; }
+  conn->nfree = depth;
+
+  struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = conn };
+  setsockopt( conn->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof( on ) );
+  if( connect( conn->fd, (struct sockaddr *)&r->sa, r->salen ) == -1 && errno != EINPROGRESS ){ goto fail; }
+  if( epoll_ctl( r->epfd, EPOLL_CTL_ADD, conn->fd, &ev ) == -1 ){ goto fail; }
+
+  conn->hnext = *replay_bucket( r, id );
+  *replay_bucket( r, id ) = conn;
+  conn->next = r->conns;
+  if( r->conns ){ r->conns->prev = conn; }
+  r->conns = conn;
+  r->res->conns++;
+  return conn;
+
+fail:
+  log_ver( "Failed opening the connection of trace id %08X: %s", id, strerror( errno ) );
+  if( conn->fd > 0 ){ close( conn->fd ); }
+  free( conn->free );
+  free( conn->reqs );
+  free( conn->obuf );
+  free( conn );
+  return NULL;
+}
+
+/**
+ * @brief      Queues a query of the trace with a transaction id of its own, RTU queries in an MBAP frame
+ */
+void replay_queue( struct replay_t *r, struct replay_conn_t *conn, const struct trace_rec_t *rec, uint64_t due, uint64_t now ){
+  const uint8_t *frame = (const uint8_t *)( rec + 1 );
+  uint16_t slot = conn->free[ --conn->nfree ];
+  struct replay_req_t *req = &conn->reqs[ slot ];
+  uint8_t *adu = conn->obuf + conn->olen;
+  int len;
+
+  if( rec->flags & TRACE_F_RTU ){
+    int plen = rec->len - RTU_HEADER_LEN - 2;
+    adu[2] = 0;
+    adu[3] = 0;
+    adu[4] = ( plen + 1 ) >> 8;
+    adu[5] = ( plen + 1 ) & 0xFF;
+    adu[6] = frame[0];
+    memcpy( adu + MBAP_HEADER_LEN, frame + RTU_HEADER_LEN, plen );
+    len = MBAP_HEADER_LEN + plen;
+  }
+  else{
+    memcpy( adu, frame, rec->len );
+    len = rec->len;
+  }
+  adu[0] = slot >> 8;
+  adu[1] = slot & 0xFF;
+  conn->olen += len;
+
+  req->fc   = adu[ MBAP_HEADER_LEN ];
+  req->due  = due;
+  req->sent = now;
+  req->used = 1;
+  if( now > due + REPLAY_LATE_MSEC * MSEC ){ r->res->late++; }
+
+  struct load_fc_t *st = &r->res->load.fc[ stats_slot( req->fc ) ];
+  stats_add( &st->sent, 1 );
+  stats_add( &st->bytes_out, len );
+}
+
+int replay_flush( struct replay_conn_t *conn ){
+  while( conn->osent < conn->olen ){
+    ssize_t wr = send( conn->fd, conn->obuf + conn->osent, conn->olen - conn->osent, MSG_NOSIGNAL );
+    if( wr < 0 ){
+      if( errno == EINTR ){ continue; }
+      if( errno == EAGAIN || errno == EWOULDBLOCK ){ break; }
+      return -1;
+    }
+    conn->osent += wr;
+  }
+
+  // Unsent bytes go back to the start: the buffer only has room for depth requests
+  if( conn->osent ){
+    memmove( conn->obuf, conn->obuf + conn->osent, conn->olen - conn->osent );
+    conn->olen -= conn->osent;
+    conn->osent = 0;
+  }
+  return 0;
+}
+
+void replay_reply( struct replay_t *r, struct replay_conn_t *conn, const uint8_t *adu, int len, uint64_t now ){
+  int slot = ( adu[0] << 8 ) | adu[1];
+  uint8_t fc = adu[ MBAP_HEADER_LEN ];
+
+  if( slot >= r->args->depth || !conn->reqs[ slot ].used ){
+    stats_add( &r->res->load.errors, 1 );
+    return;
+  }
+
+  struct replay_req_t *req = &conn->reqs[ slot ];
+  struct load_fc_t *st = &r->res->load.fc[ stats_slot( req->fc ) ];
+
+  if( ( fc & 0x7F ) != req->fc ){ stats_add( &r->res->load.errors, 1 ); }
+  if( fc & 0x80 ){ stats_add( &st->exceptions, 1 ); }
+  stats_add( &st->bytes_in, len );
+  stats_record( &st->lat, now - req->sent );
+  stats_record( &st->lat_co, now - req->due );
+  stats_add( &st->replies, 1 );
+
+  req->used = 0;
+  conn->free[ conn->nfree++ ] = slot;
+}
+
+/**
+ * @brief      Reads and matches every reply available
+ *
+ * @return     0 on success, -1 if the connection must be closed
+ */
+int replay_recv( struct replay_t *r, struct replay_conn_t *conn, uint64_t now ){
+  while( 1 ){
+    ssize_t rd = read( conn->fd, conn->ibuf + conn->ilen, sizeof( conn->ibuf ) - conn->ilen );
+    if( rd == 0 ){ return -1; }
+    if( rd < 0 ){
+      if( errno == EINTR ){ continue; }
+      if( errno == EAGAIN || errno == EWOULDBLOCK ){ return 0; }
+      return -1;
+    }
+    conn->ilen += rd;
+
+    int off = 0, flen;
+    while( ( flen = mbap_frame_len( conn->ibuf + off, conn->ilen - off ) ) > 0 ){
+      replay_reply( r, conn, conn->ibuf + off, flen, now );
+      off += flen;
+    }
+    if( flen < 0 ){
+      stats_add( &r->res->load.errors, 1 );
+      return -1;
+    }
+    memmove( conn->ibuf, conn->ibuf + off, conn->ilen - off );
+    conn->ilen -= off;
+  }
+}
+
+/**
+ * @brief      Closes the connections with a request unanswered for too long, and the ones the trace closed once idle
+ */
+void replay_check( struct replay_t *r, uint64_t now ){
+  uint64_t timeout = r->args->timeout_msec * MSEC;
+  struct replay_conn_t *conn = r->conns, *next;
+
+  for( ; conn; conn = next ){
+    next = conn->next;
+    if( conn->closing && conn->nfree == r->args->depth && !conn->olen ){
+      replay_close( r, conn );
+      continue;
+    }
+
+    for( int i = 0; i < r->args->depth; i++ ){
+      if( conn->reqs[i].used && now - conn->reqs[i].sent > timeout ){
+        log_dbg( "Reply timeout on the connection of trace id %08X", conn->id );
+        replay_close( r, conn );
+        break;
+      }
+    }
+  }
+}
+
+/**
+ * @brief      Checks a trace record is a query the replay can send
+ */
+int replay_query_ok( const struct trace_rec_t *rec ){
+  const uint8_t *frame = (const uint8_t *)( rec + 1 );
+
+  if( ( rec->flags & TRACE_KIND_MASK ) != TRACE_RX ){ return 0; }
+  if( rec->flags & TRACE_F_RTU ){ return rec->len >= RTU_HEADER_LEN + 3 && rec->len <= MODBUS_RTU_MAX_ADU_LENGTH; }
+  return rec->len > MBAP_HEADER_LEN && mbap_frame_len( frame, rec->len ) == rec->len;
+}
+
+int replay_run( struct replay_args_t *args, struct replay_result_t *result ){
+  static struct replay_t r;
+  struct epoll_event events[ REPLAY_EVENTS ];
+  const struct trace_rec_t *rec, *last = NULL;
+  struct trace_map_t map;
+
+  memset( result, 0, sizeof( struct replay_result_t ) );
+  if( args->speed < 0.0 || args->depth <= 0 || args->depth > REPLAY_DEPTH_MAX || args->timeout_msec <= 0 ){
+    log_err( "Invalid replay arguments" );
+    return -1;
+  }
+  if( trace_map( args->trace, &map ) != 0 ){
+    log_err( "Failed to map trace %s: %s", args->trace, errno == EINVAL ? "not a trace of this version" : strerror( errno ) );
+    return -1;
+  }
+
+  // The trace span comes from its last record: a pass over the headers only, the frames stay on disk
+  while( ( rec = trace_next( &map ) ) ){ last = rec; }
+  result->span = last ? last->t / 1e9 : 0.0;
+  map.off = map.hdr->hdr_len;
+
+  memset( &r, 0, sizeof( r ) );
+  r.args = args;
+  r.res  = result;
+
+  struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *ai;
+  int rc = getaddrinfo( args->addr, args->port, &hints, &ai );
+  if( rc != 0 ){
+    log_err( "getaddrinfo( %s, %s ) failed: %s", args->addr, args->port, gai_strerror( rc ) );
+    trace_unmap( &map );
+    return -1;
+  }
+  memcpy( &r.sa, ai->ai_addr, ai->ai_addrlen );
+  r.salen = ai->ai_addrlen;
+  freeaddrinfo( ai );
+
+  r.epfd = epoll_create1( EPOLL_CLOEXEC );
+  if( r.epfd == -1 ){
+    log_err( "Failed creating epoll: %s", strerror( errno ) );
+    trace_unmap( &map );
+    return -1;
+  }
+
+  // Queries must leave on time: the default 50us timer slack would delay them all
+  prctl( PR_SET_TIMERSLACK, 1 );
+  log_inf( "Replaying %s: %.2f s recorded, %s", args->trace, result->span, args->speed > 0.0 ? "timed" : "at max speed" );
+
+  uint64_t start = stats_now(), next_check = 0, last_log = start, last_replies = 0;
+  __atomic_store_n( &replay_terminate, 0, __ATOMIC_RELAXED );
+  rec = trace_next( &map );
+  while( !__atomic_load_n( &replay_terminate, __ATOMIC_RELAXED ) && ( rec || r.conns ) ){
+    uint64_t now  = stats_now();
+    uint64_t wait = REPLAY_WAIT_MSEC * MSEC;
+
+    // Records in order, up to the first not due yet or waiting for its connection
+    for( ; rec; rec = trace_next( &map ) ){
+      // At max speed a query is due when its connection can take it
+      uint64_t due = args->speed > 0.0 ? start + (uint64_t)( rec->t / args->speed ) : now;
+      struct replay_conn_t *conn;
+      uint8_t kind = rec->flags & TRACE_KIND_MASK;
+
+      if( due > now ){
+        wait = due - now < wait ? due - now : wait;
+        break;
+      }
+      result->records++;
+
+      if( kind == TRACE_OPEN || kind == TRACE_CLOSE ){
+        conn = replay_find( &r, rec->conn );
+        if( kind == TRACE_OPEN && !conn ){ replay_open( &r, rec->conn ); }
+        if( kind == TRACE_CLOSE && conn ){ conn->closing = 1; }
+        continue;
+      }
+      if( !replay_query_ok( rec ) ){ continue; }
+
+      // A connection closed by the trace and reused, or lost, gets a new one
+      conn = replay_find( &r, rec->conn );
+      if( conn && conn->closing && conn->nfree == args->depth && !conn->olen ){
+        replay_close( &r, conn );
+        conn = NULL;
+      }
+      if( !conn && !( conn = replay_open( &r, rec->conn ) ) ){
+        result->queries++;
+        stats_add( &result->load.errors, 1 );
+        continue;
+      }
+      if( !conn->up || !conn->nfree ){
+        result->records--;
+        break;
+      }
+
+      result->queries++;
+      replay_queue( &r, conn, rec, due, now );
+      if( replay_flush( conn ) < 0 ){
+        stats_add( &result->load.errors, 1 );
+        replay_close( &r, conn );
+      }
+    }
+
+    // Lines of an RTU capture, and TCP connections still open when it stopped, have no close record
+    if( !rec ){
+      for( struct replay_conn_t *conn = r.conns; conn; conn = conn->next ){ conn->closing = 1; }
+    }
+
+    if( now >= next_check ){
+      replay_check( &r, now );
+      next_check = now + REPLAY_CHECK_MSEC * MSEC;
+    }
+    if( now - last_log >= 1000000000ULL ){
+      uint64_t replies = 0;
+      for( int f = 0; f < STATS_FCS; f++ ){ replies += result->load.fc[f].replies; }
+      log_inf( "%.0f replies/s, %lu replies, %.0f%% of the trace", ( replies - last_replies ) * 1e9 / ( now - last_log ),
+               replies, 100.0 * map.off / map.len );
+      last_replies = replies;
+      last_log     = now;
+    }
+    if( r.conns && REPLAY_CHECK_MSEC * MSEC < wait ){ wait = REPLAY_CHECK_MSEC * MSEC; }
+
+    struct timespec to = { wait / 1000000000ULL, wait % 1000000000ULL };
+    int nev = epoll_pwait2( r.epfd, events, REPLAY_EVENTS, &to, NULL );
+    if( nev == -1 && errno == ENOSYS ){ nev = epoll_wait( r.epfd, events, REPLAY_EVENTS, ( wait + MSEC - 1 ) / MSEC ); }
+    if( nev == -1 ){
+      if( errno != EINTR ){ log_err( "Replay epoll failure: %s", strerror( errno ) ); }
+      continue;
+    }
+
+    now = stats_now();
+    for( int i = 0; i < nev; i++ ){
+      struct replay_conn_t *conn = events[i].data.ptr;
+
+      if( !conn->up ){
+        int err = 0;
+        socklen_t errlen = sizeof( err );
+        if( !( events[i].events & ( EPOLLOUT | EPOLLERR | EPOLLHUP ) ) ){ continue; }
+        if( getsockopt( conn->fd, SOL_SOCKET, SO_ERROR, &err, &errlen ) == -1 || err ){
+          log_ver( "Failed connecting: %s", strerror( err ? err : errno ) );
+          stats_add( &result->load.errors, 1 );
+          replay_close( &r, conn );
+          continue;
+        }
+        conn->up = 1;
+        stats_add( &result->load.connects, 1 );
+      }
+
+      if( replay_recv( &r, conn, now ) < 0 || replay_flush( conn ) < 0 ){
+        log_ver( "Connection of trace id %08X closed by the server", conn->id );
+        stats_add( &result->load.errors, 1 );
+        replay_close( &r, conn );
+      }
+    }
+  }
+
+  result->load.elapsed = ( stats_now() - start ) / 1e9;
+  while( r.conns ){ replay_close( &r, r.conns ); }
+  close( r.epfd );
+  trace_unmap( &map );
+  return 0;
+}
+
+void replay_stop(){
+  __atomic_store_n( &replay_terminate, 1, __ATOMIC_RELAXED );
+}
@@ -0,0 +1,54 @@
+#ifndef _MBT_REPLAY_H_
+#define _MBT_REPLAY_H_
+
+#include <stdint.h>
+
+#include "mbt-load.h"
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ DEFINITIONS
+#define DEF_REPLAY_SPEED        1.0                ///< Default time scale, as recorded
+#define DEF_REPLAY_DEPTH        16                 ///< Default requests in flight per connection
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ TYPES
+struct replay_args_t{
+  char    *trace;                                  ///< Trace file, written by modbus-server -k
+  char    *addr;                                   ///< TCP server address
+  char    *port;                                   ///< TCP server port
+  double   speed;                                  ///< Time scale: 1 as recorded, 10 ten times faster, 0 as fast as replies come
+  int      depth;                                  ///< Requests in flight per connection
+  int      timeout_msec;                           ///< Reply timeout, the connection is closed when it expires
+};
+
+struct replay_result_t{
+  double               span;                       ///< Seconds the trace covers
+  uint64_t             records;                    ///< Records read
+  uint64_t             queries;                    ///< Queries found, RTU ones included
+  uint64_t             conns;                      ///< Connections opened
+  uint64_t             late;                       ///< Queries sent more than 1 ms after their due time
+  struct load_result_t load;                       ///< Requests, replies and latencies, as a load test
+};
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS
+
+/**
+ * @brief      Replays the queries of a trace against a TCP server, logging the requests rate every second
+ *
+ * Each connection of the trace gets its own, opened when the trace does or at its first query, closed when the
+ * trace closes it. Queries leave in trace order at their recorded time over speed, with a transaction id of the
+ * replay: a query waits for its connection to be up and to have a free slot, and the ones after it wait too.
+ * Queries recorded on RTU lines go in MBAP frames, each line a connection. Latencies are taken from the query
+ * sent, corrected ones from its due time.
+ *
+ * @param      args    The replay arguments
+ * @param[out] result  The replay results
+ *
+ * @return     0 on success, -1 on invalid arguments or trace
+ */
+int replay_run( struct replay_args_t *args, struct replay_result_t *result );
+
+/**
+ * @brief      Stops a running replay before the trace end, safe from a signal handler
+ */
+void replay_stop();
+
+#endif // _MBT_REPLAY_H_
@@ -0,0 +1,780 @@
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ INCLUDES
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "mbt-scan.h"
+#include "mbt-adu.h"
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ DEFINITIONS
+#define SCAN_NAME_LEN         32                           ///< Longest device or tag name, terminator included
+#define SCAN_IBUF_SIZE  ( 2 * MODBUS_TCP_MAX_ADU_LENGTH )  ///< Per device receive buffer
+#define SCAN_REQ_LEN          12                           ///< A read request: MBAP header, function code, address, count
+#define SCAN_DEPTH_MAX        64                           ///< Max requests in flight per device
+#define SCAN_WHEEL_SLOTS    4096                           ///< Timer wheel slots, one per tick: a power of 2
+#define SCAN_RETRY_MSEC     1000                           ///< Wait before connecting again to a failed device
+#define SCAN_CHECK_MSEC       10                           ///< Interval between two timeout checks
+#define SCAN_EVENTS          256                           ///< Max events returned by a single wait
+#define MSEC             1000000ULL                        ///< Nanoseconds in a millisecond, the wheel tick
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ TYPES
+enum scan_state_type {
+  SCAN_CLOSED,
+  SCAN_CONNECTING,
+  SCAN_UP
+};
+
+struct scan_tag_t{
+  char                 name[ SCAN_NAME_LEN ];              ///< Tag name
+  int                  dev;                                ///< Device index
+  uint8_t              fc;                                 ///< Read function code of its table
+  uint16_t             addr;                               ///< First register or bit
+  uint16_t             count;                              ///< Registers or bits
+  uint32_t             period;                             ///< Poll period, msec
+};
+
+struct scan_block_t{
+  struct scan_dev_t   *dev;                                ///< Device polled
+  uint8_t              fc;                                 ///< Read function code
+  uint16_t             addr;                               ///< First register or bit
+  uint16_t             count;                              ///< Registers or bits, within the function code limit
+  uint32_t             period;                             ///< Poll period, ticks
+  uint64_t             due_tick;                           ///< Tick of the next poll
+  uint64_t             due;                                ///< Time the pending poll was due, its latency start
+  uint64_t             sent;                               ///< Time the pending poll was sent, its timeout start
+  uint8_t              pending;                            ///< Queued or in flight: its next poll is an overrun
+  struct scan_block_t *wnext;                              ///< Next block in the same wheel slot
+  struct scan_block_t *qnext;                              ///< Next block waiting to be sent to the device
+  struct scan_tag_t   *tags;                               ///< Tags read by the block
+  int                  ntags;                              ///< Number of tags
+  uint8_t             *values;                             ///< Last data read, as on the wire
+};
+
+struct scan_dev_t{
+  char                     name[ SCAN_NAME_LEN ];          ///< Device name
+  struct sockaddr_storage  sa;                             ///< Device address, resolved once
+  socklen_t                salen;                          ///< Device address length
+  uint8_t                  unit;                           ///< Unit identifier
+  int                      fd;                             ///< Socket
+  enum scan_state_type     state;                          ///< Connection state
+  uint64_t                 retry;                          ///< Closed: time to connect again. Connecting: time it started
+  struct scan_block_t     *blocks;                         ///< Device blocks
+  int                      nblocks;                        ///< Number of blocks
+  struct scan_block_t    **inflight;                       ///< Block of every transaction slot, NULL if free
+  uint16_t                *free;                           ///< Free transaction slots stack
+  int                      nfree;                          ///< Free transaction slots
+  struct scan_block_t     *qhead;                          ///< First block due waiting for a free slot
+  struct scan_block_t     *qtail;                          ///< Last block due waiting for a free slot
+  uint16_t                 ilen;                           ///< Bytes waiting in ibuf
+  uint16_t                 olen;                           ///< Bytes queued in obuf
+  uint16_t                 osent;                          ///< Bytes of obuf already sent
+  uint8_t                  ibuf[ SCAN_IBUF_SIZE ];         ///< Receive buffer, may end with a partial reply
+  uint8_t                 *obuf;                           ///< Send buffer, room for depth requests
+};
+
+struct scan_worker_t{
+  int                  id;                                 ///< Worker index
+  pthread_t            thread;                             ///< Event loop thread
+  struct scan_args_t  *args;                               ///< Scan arguments, shared by all workers
+  struct scan_dev_t  **devs;                               ///< Devices polled by the worker
+  int                  ndevs;                              ///< Number of devices
+  int                  epfd;                               ///< Event loop
+  uint64_t             start;                              ///< Time of tick 0
+  uint64_t             tick;                               ///< Last tick processed
+  struct scan_block_t *wheel[ SCAN_WHEEL_SLOTS ];          ///< Blocks by due tick modulo the wheel size
+  uint64_t             sent;                               ///< Requests sent
+  uint64_t             replies;                            ///< Valid replies
+  uint64_t             exceptions;                         ///< Exception replies
+  uint64_t             timeouts;                           ///< Requests never answered
+  uint64_t             overruns;                           ///< Polls skipped, the previous one still pending
+  uint64_t             unreachable;                        ///< Polls skipped, the device connection down
+  uint64_t             errors;                             ///< Failed connections, invalid replies
+  struct stats_hist_t  lat;                                ///< Latency from the poll due time
+};
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ GLOBAL VARS
+int                 scan_terminate = 0;                    ///< If set the workers stop
+struct scan_dev_t  *scan_devs = NULL;                      ///< Devices of the config
+int                 scan_ndevs = 0;                        ///< Number of devices
+struct scan_tag_t  *scan_tags = NULL;                      ///< Tags of the config, sorted by block once parsed
+int                 scan_ntags = 0;                        ///< Number of tags
+struct scan_block_t *scan_blocks = NULL;                   ///< Coalesced requests of every device
+int                 scan_nblocks = 0;                      ///< Number of blocks
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS
+uint32_t scan_rand( uint32_t *seed ){
+  uint32_t x = *seed;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *seed = x;
+}
+
+/**
+ * @brief      Gets the most registers or bits a read function code can carry
+ */
+int scan_fc_max( uint8_t fc ){
+  return ( fc == MODBUS_FC_READ_COILS || fc == MODBUS_FC_READ_DISCRETE_INPUTS ) ? MODBUS_MAX_READ_BITS : MODBUS_MAX_READ_REGISTERS;
+}
+
+/**
+ * @brief      Resolves a device address, "host", "host:port" or "[ipv6]:port"
+ *
+ * @return     0 on success, -1 on failure
+ */
+int scan_resolve( struct scan_dev_t *dev, char *spec ){
+  struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *ai;
+  char *host = spec, *port = DEF_TCP_PORT, *sep;
+
+  if( *spec == '[' && ( sep = strchr( spec, ']' ) ) ){
+    host = spec + 1;
+    *sep = '\0';
+    if( sep[1] == ':' ){ port = sep + 2; }
+  }
+  else if( ( sep = strrchr( spec, ':' ) ) && sep == strchr( spec, ':' ) ){
+    *sep = '\0';
+    port = sep + 1;
+  }
+
+  int rc = getaddrinfo( host, port, &hints, &ai );
+  if( rc != 0 ){
+    log_err( "getaddrinfo( %s, %s ) failed: %s", host, port, gai_strerror( rc ) );
+    return -1;
+  }
+  memcpy( &dev->sa, ai->ai_addr, ai->ai_addrlen );
+  dev->salen = ai->ai_addrlen;
+  freeaddrinfo( ai );
+  return 0;
+}
+
+/**
+ * @brief      Parses the devices and tags file
+ *
+ * @return     0 on success, -1 if invalid
+ */
+int scan_parse( const char *path ){
+  char line[256], name[ SCAN_NAME_LEN ], spec[128], table[8];
+  int nline = 0, cdevs = 0, ctags = 0, rc = 0;
+
+  FILE *f = fopen( path, "r" );
+  if( !f ){
+    log_err( "Can not open %s: %s", path, strerror( errno ) );
+    return -1;
+  }
+
+  while( rc == 0 && fgets( line, sizeof( line ), f ) ){
+    char *p = line + strspn( line, " \t" );
+    unsigned unit = DEF_SCAN_UNIT, addr, count, period;
+    int n;
+
+    nline++;
+    if( *p == '#' || *p == '\n' || *p == '\0' ){ continue; }
+
+    if( sscanf( p, "device %31s %127s %n", name, spec, &n ) >= 2 ){
+      if( p[n] && sscanf( p + n, "%u", &unit ) != 1 ){ unit = 0x100; }
+      if( unit > 0xFF ){
+        log_err( "%s:%d: invalid unit", path, nline );
+        rc = -1;
+        break;
+      }
+      if( scan_ndevs == cdevs ){
+        cdevs = cdevs ? 2 * cdevs : 64;
+        struct scan_dev_t *devs = realloc( scan_devs, cdevs * sizeof( struct scan_dev_t ) );
+        if( !devs ){ rc = -1; break; }
+        scan_devs = devs;
+      }
+
+      struct scan_dev_t *dev = &scan_devs[ scan_ndevs ];
+      memset( dev, 0, sizeof( struct scan_dev_t ) );
+      strcpy( dev->name, name );
+      dev->unit  = unit;
+      dev->fd    = -1;
+      dev->state = SCAN_CLOSED;
+      if( scan_resolve( dev, spec ) != 0 ){
+        log_err( "%s:%d: invalid device address %s", path, nline, spec );
+        rc = -1;
+        break;
+      }
+      scan_ndevs++;
+    }
+    else if( sscanf( p, "tag %31s %7s %u %u %u", name, table, &addr, &count, &period ) == 5 ){
+      uint8_t fc = strcmp( table, "co" ) == 0 ? MODBUS_FC_READ_COILS :
+                   strcmp( table, "di" ) == 0 ? MODBUS_FC_READ_DISCRETE_INPUTS :
+                   strcmp( table, "hr" ) == 0 ? MODBUS_FC_READ_HOLDING_REGISTERS :
+                   strcmp( table, "ir" ) == 0 ? MODBUS_FC_READ_INPUT_REGISTERS : 0;
+      if( !scan_ndevs || !fc || !count || count > scan_fc_max( fc ) || addr + count > 0x10000 || !period ){
+        log_err( "%s:%d: invalid tag%s", path, nline, scan_ndevs ? "" : ", no device before it" );
+        rc = -1;
+        break;
+      }
+      if( scan_ntags == ctags ){
+        ctags = ctags ? 2 * ctags : 256;
+        struct scan_tag_t *tags = realloc( scan_tags, ctags * sizeof( struct scan_tag_t ) );
+        if( !tags ){ rc = -1; break; }
+        scan_tags = tags;
+      }
+
+      struct scan_tag_t *tag = &scan_tags[ scan_ntags++ ];
+      strcpy( tag->name, name );
+      tag->dev    = scan_ndevs - 1;
+      tag->fc     = fc;
+      tag->addr   = addr;
+      tag->count  = count;
+      tag->period = period;
+    }
+    else{
+      log_err( "%s:%d: invalid line", path, nline );
+      rc = -1;
+    }
+  }
+  fclose( f );
+
+  if( rc == 0 && !scan_ntags ){
+    log_err( "%s: no tags to poll", path );
+    rc = -1;
+  }
+  return rc;
+}
+
+int scan_tag_cmp( const void *a, const void *b ){
+  const struct scan_tag_t *ta = a, *tb = b;
+
+  if( ta->dev    != tb->dev    ){ return ta->dev    < tb->dev    ? -1 : 1; }
+  if( ta->fc     != tb->fc     ){ return ta->fc     < tb->fc     ? -1 : 1; }
+  if( ta->period != tb->period ){ return ta->period < tb->period ? -1 : 1; }
+  if( ta->addr   != tb->addr   ){ return ta->addr   < tb->addr   ? -1 : 1; }
+  return (int)tb->count - (int)ta->count;
+}
+
+/**
+ * @brief      Merges the tags of every device in the fewest read requests
+ *
+ * Tags sorted by device, table, period and address are walked once: a tag joins the current block if it has the
+ * same table and period, starts within gap entries of the block end and keeps the block within the function code
+ * limit. Overlapping and adjacent tags always join, a longer tag may start a block alone.
+ *
+ * @return     0 on success, -1 on memory failure
+ */
+int scan_coalesce( int gap ){
+  struct scan_block_t *b = NULL;
+  int end = 0;
+
+  qsort( scan_tags, scan_ntags, sizeof( struct scan_tag_t ), scan_tag_cmp );
+
+  scan_blocks = calloc( scan_ntags, sizeof( struct scan_block_t ) );
+  if( !scan_blocks ){ return -1; }
+
+  for( int t = 0; t < scan_ntags; t++ ){
+    struct scan_tag_t *tag = &scan_tags[t];
+    struct scan_dev_t *dev = &scan_devs[ tag->dev ];
+    int tend = tag->addr + tag->count;
+
+    if( !b || b->dev != dev || b->fc != tag->fc || b->period != tag->period || tag->addr > end + gap ||
+        ( tend > end ? tend : end ) - b->addr > scan_fc_max( tag->fc ) ){
+      b = &scan_blocks[ scan_nblocks++ ];
+      b->dev    = dev;
+      b->fc     = tag->fc;
+      b->addr   = tag->addr;
+      b->period = tag->period;
+      b->tags   = tag;
+      end       = tend;
+      if( !dev->blocks ){ dev->blocks = b; }
+      dev->nblocks++;
+    }
+    if( tend > end ){ end = tend; }
+    b->count = end - b->addr;
+    b->ntags++;
+  }
+
+  for( int i = 0; i < scan_nblocks; i++ ){
+    b = &scan_blocks[i];
+    b->values = calloc( 1, ( b->fc <= MODBUS_FC_READ_DISCRETE_INPUTS ) ? ( b->count + 7 ) / 8 : b->count * 2 );
+    if( !b->values ){ return -1; }
+  }
+  return 0;
+}
+
+void scan_schedule( struct scan_worker_t *w, struct scan_block_t *b ){
+  struct scan_block_t **slot = &w->wheel[ b->due_tick & ( SCAN_WHEEL_SLOTS - 1 ) ];
+  b->wnext = *slot;
+  *slot    = b;
+}
+
+/**
+ * @brief      Queues the requests of the blocks due while transaction slots are free, then sends them
+ *
+ * @return     0 on success, -1 if the connection must be closed
+ */
+int scan_send( struct scan_worker_t *w, struct scan_dev_t *dev, uint64_t now ){
+  while( dev->qhead && dev->nfree ){
+    struct scan_block_t *b = dev->qhead;
+    uint16_t slot = dev->free[ --dev->nfree ];
+    uint8_t *adu  = dev->obuf + dev->olen;
+
+    dev->qhead = b->qnext;
+    if( !dev->qhead ){ dev->qtail = NULL; }
+    dev->inflight[ slot ] = b;
+    b->sent = now;
+
+    adu[0]  = slot >> 8;
+    adu[1]  = slot & 0xFF;
+    adu[2]  = 0;
+    adu[3]  = 0;
+    adu[4]  = 0;
+    adu[5]  = 6;
+    adu[6]  = dev->unit;
+    adu[7]  = b->fc;
+    adu[8]  = b->addr >> 8;
+    adu[9]  = b->addr & 0xFF;
+    adu[10] = b->count >> 8;
+    adu[11] = b->count & 0xFF;
+    dev->olen += SCAN_REQ_LEN;
+    stats_add( &w->sent, 1 );
+  }
+
+  while( dev->osent < dev->olen ){
+    ssize_t wr = send( dev->fd, dev->obuf + dev->osent, dev->olen - dev->osent, MSG_NOSIGNAL );
+    if( wr < 0 ){
+      if( errno == EINTR ){ continue; }
+      if( errno == EAGAIN || errno == EWOULDBLOCK ){ break; }
+      return -1;
+    }
+    dev->osent += wr;
+  }
+
+  // Unsent bytes go back to the start: the buffer only has room for depth requests
+  if( dev->osent ){
+    memmove( dev->obuf, dev->obuf + dev->osent, dev->olen - dev->osent );
+    dev->olen -= dev->osent;
+    dev->osent = 0;
+  }
+  return 0;
+}
+
+void scan_close( struct scan_worker_t *w, struct scan_dev_t *dev, uint64_t now ){
+  // Requests in flight will never be answered, the ones queued wait for the next period
+  for( int i = 0; i < w->args->depth; i++ ){
+    if( dev->inflight[i] ){
+      dev->inflight[i]->pending = 0;
+      dev->inflight[i] = NULL;
+      stats_add( &w->timeouts, 1 );
+    }
+    dev->free[i] = w->args->depth - 1 - i;
+  }
+  for( struct scan_block_t *b = dev->qhead; b; b = b->qnext ){ b->pending = 0; }
+  dev->qhead = NULL;
+  dev->qtail = NULL;
+  dev->nfree = w->args->depth;
+  dev->ilen  = 0;
+  dev->olen  = 0;
+  dev->osent = 0;
+
+  if( dev->fd != -1 ){ close( dev->fd ); }
+  dev->fd    = -1;
+  dev->state = SCAN_CLOSED;
+  dev->retry = now + SCAN_RETRY_MSEC * MSEC;
+}
+
+void scan_open( struct scan_worker_t *w, struct scan_dev_t *dev, uint64_t now ){
+  struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = dev };
+  int on = 1;
+
+  dev->fd = socket( dev->sa.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+  if( dev->fd == -1 ){ goto fail; }
+  setsockopt( dev->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof( on ) );
+  if( connect( dev->fd, (struct sockaddr *)&dev->sa, dev->salen ) == -1 && errno != EINPROGRESS ){ goto fail; }
+  if( epoll_ctl( w->epfd, EPOLL_CTL_ADD, dev->fd, &ev ) == -1 ){ goto fail; }
+  dev->state = SCAN_CONNECTING;
+  dev->retry = now;
+  return;
+
+fail:
+  log_ver( "Worker %d failed connecting to %s: %s", w->id, dev->name, strerror( errno ) );
+  stats_add( &w->errors, 1 );
+  scan_close( w, dev, now );
+}
+
+/**
+ * @brief      Starts a poll of a block: queued to its device, skipped if the device is down or the previous poll
+ *             is still pending
+ */
+void scan_fire( struct scan_worker_t *w, struct scan_block_t *b ){
+  struct scan_dev_t *dev = b->dev;
+
+  if( b->pending ){
+    stats_add( &w->overruns, 1 );
+    return;
+  }
+  if( dev->state != SCAN_UP ){
+    stats_add( &w->unreachable, 1 );
+    return;
+  }
+
+  b->pending = 1;
+  b->due     = w->start + b->due_tick * MSEC;
+  b->qnext   = NULL;
+  if( dev->qtail ){ dev->qtail->qnext = b; }
+  else{ dev->qhead = b; }
+  dev->qtail = b;
+}
+
+/**
+ * @brief      Fires the blocks due up to a tick, then sends the requests queued
+ */
+void scan_advance( struct scan_worker_t *w, uint64_t tick, uint64_t now ){
+  // A loop late by more than a turn visits every slot once
+  if( tick - w->tick > SCAN_WHEEL_SLOTS ){ w->tick = tick - SCAN_WHEEL_SLOTS; }
+
+  while( w->tick < tick ){
+    struct scan_block_t **slot = &w->wheel[ ++w->tick & ( SCAN_WHEEL_SLOTS - 1 ) ], *b = *slot, *next;
+
+    // Periods longer than the wheel leave blocks in the slot for the next turns
+    *slot = NULL;
+    for( ; b; b = next ){
+      next = b->wnext;
+      if( b->due_tick <= w->tick ){
+        scan_fire( w, b );
+        b->due_tick += b->period;
+
+        // Periods missed by a late loop are overruns too
+        if( b->due_tick <= w->tick ){
+          uint64_t missed = ( w->tick - b->due_tick ) / b->period + 1;
+          stats_add( &w->overruns, missed );
+          b->due_tick += missed * b->period;
+        }
+      }
+      scan_schedule( w, b );
+    }
+  }
+
+  for( int d = 0; d < w->ndevs; d++ ){
+    struct scan_dev_t *dev = w->devs[d];
+    if( dev->qhead && dev->nfree && scan_send( w, dev, now ) < 0 ){
+      stats_add( &w->errors, 1 );
+      scan_close( w, dev, now );
+    }
+  }
+}
+
+void scan_reply( struct scan_worker_t *w, struct scan_dev_t *dev, const uint8_t *adu, int len, uint64_t now ){
+  int slot = ( adu[0] << 8 ) | adu[1];
+  const uint8_t *pdu = adu + MBAP_HEADER_LEN;
+
+  if( slot >= w->args->depth || !dev->inflight[ slot ] ){
+    stats_add( &w->errors, 1 );
+    return;
+  }
+
+  struct scan_block_t *b = dev->inflight[ slot ];
+  int nb = ( b->fc <= MODBUS_FC_READ_DISCRETE_INPUTS ) ? ( b->count + 7 ) / 8 : b->count * 2;
+
+  dev->inflight[ slot ] = NULL;
+  dev->free[ dev->nfree++ ] = slot;
+  b->pending = 0;
+
+  if( pdu[0] == ( b->fc | 0x80 ) ){
+    stats_add( &w->exceptions, 1 );
+    log_dbg( "%s: exception %d reading %d at %d", dev->name, pdu[1], b->count, b->addr );
+    return;
+  }
+  if( pdu[0] != b->fc || len != MBAP_HEADER_LEN + 2 + nb || pdu[1] != nb ){
+    stats_add( &w->errors, 1 );
+    return;
+  }
+
+  memcpy( b->values, pdu + 2, nb );
+  stats_record( &w->lat, now - b->due );
+  stats_add( &w->replies, 1 );
+
+  if( DBG_DBG <= LOG_LEVEL_MAX && DBG_DBG <= msg_dbgl ){
+    for( int t = 0; t < b->ntags; t++ ){
+      int off = b->tags[t].addr - b->addr;
+      log_dbg( "%s.%s = %u", dev->name, b->tags[t].name, ( b->fc <= MODBUS_FC_READ_DISCRETE_INPUTS ) ?
+               ( b->values[ off / 8 ] >> ( off % 8 ) ) & 1 : ( b->values[ 2 * off ] << 8 ) | b->values[ 2 * off + 1 ] );
+    }
+  }
+}
+
+/**
+ * @brief      Reads and matches every reply available
+ *
+ * @return     0 on success, -1 if the connection must be closed
+ */
+int scan_recv( struct scan_worker_t *w, struct scan_dev_t *dev, uint64_t now ){
+  while( 1 ){
+    ssize_t rd = read( dev->fd, dev->ibuf + dev->ilen, sizeof( dev->ibuf ) - dev->ilen );
+    if( rd == 0 ){ return -1; }
+    if( rd < 0 ){
+      if( errno == EINTR ){ continue; }
+      if( errno == EAGAIN || errno == EWOULDBLOCK ){ return 0; }
+      return -1;
+    }
+    dev->ilen += rd;
+
+    int off = 0, flen;
+    while( ( flen = mbap_frame_len( dev->ibuf + off, dev->ilen - off ) ) > 0 ){
+      scan_reply( w, dev, dev->ibuf + off, flen, now );
+      off += flen;
+    }
+    if( flen < 0 ){
+      stats_add( &w->errors, 1 );
+      return -1;
+    }
+    memmove( dev->ibuf, dev->ibuf + off, dev->ilen - off );
+    dev->ilen -= off;
+  }
+}
+
+/**
+ * @brief      Closes the devices with a request or a connect pending for too long, connects again the failed ones
+ */
+void scan_check( struct scan_worker_t *w, uint64_t now ){
+  uint64_t timeout = w->args->timeout_msec * MSEC;
+
+  for( int d = 0; d < w->ndevs; d++ ){
+    struct scan_dev_t *dev = w->devs[d];
+
+    switch( dev->state ){
+      case SCAN_CLOSED:
+        if( now >= dev->retry ){ scan_open( w, dev, now ); }
+        break;
+
+      case SCAN_CONNECTING:
+        if( now - dev->retry > timeout ){
+          log_ver( "Worker %d: connect timeout on %s", w->id, dev->name );
+          stats_add( &w->errors, 1 );
+          scan_close( w, dev, now );
+        }
+        break;
+
+      case SCAN_UP:
+        for( int i = 0; dev->nfree < w->args->depth && i < w->args->depth; i++ ){
+          if( dev->inflight[i] && now - dev->inflight[i]->sent > timeout ){
+            log_dbg( "Worker %d: reply timeout on %s", w->id, dev->name );
+            scan_close( w, dev, now );
+            break;
+          }
+        }
+        break;
+    }
+  }
+}
+
+void *scan_worker_run( struct scan_worker_t *w ){
+  struct epoll_event events[ SCAN_EVENTS ];
+  uint64_t next_check = 0;
+
+  w->epfd = epoll_create1( EPOLL_CLOEXEC );
+  if( w->epfd == -1 ){
+    log_err( "Worker %d failed creating epoll: %s", w->id, strerror( errno ) );
+    return NULL;
+  }
+
+  while( !__atomic_load_n( &scan_terminate, __ATOMIC_RELAXED ) ){
+    uint64_t now = stats_now();
+
+    if( now >= next_check ){
+      scan_check( w, now );
+      next_check = now + SCAN_CHECK_MSEC * MSEC;
+    }
+    scan_advance( w, ( now - w->start ) / MSEC, now );
+
+    // Sleep up to the next tick
+    uint64_t wait = w->start + ( w->tick + 1 ) * MSEC - now;
+    struct timespec to = { wait / 1000000000ULL, wait % 1000000000ULL };
+    int nev = epoll_pwait2( w->epfd, events, SCAN_EVENTS, &to, NULL );
+    if( nev == -1 && errno == ENOSYS ){ nev = epoll_wait( w->epfd, events, SCAN_EVENTS, ( wait + MSEC - 1 ) / MSEC ); }
+    if( nev == -1 ){
+      if( errno != EINTR ){ log_err( "Worker %d epoll failure: %s", w->id, strerror( errno ) ); }
+      continue;
+    }
+
+    now = stats_now();
+    for( int i = 0; i < nev; i++ ){
+      struct scan_dev_t *dev = events[i].data.ptr;
+
+      if( dev->state == SCAN_CONNECTING ){
+        int err = 0;
+        socklen_t errlen = sizeof( err );
+        if( !( events[i].events & ( EPOLLOUT | EPOLLERR | EPOLLHUP ) ) ){ continue; }
+        if( getsockopt( dev->fd, SOL_SOCKET, SO_ERROR, &err, &errlen ) == -1 || err ){
+          log_ver( "Worker %d failed connecting to %s: %s", w->id, dev->name, strerror( err ? err : errno ) );
+          stats_add( &w->errors, 1 );
+          scan_close( w, dev, now );
+          continue;
+        }
+        dev->state = SCAN_UP;
+      }
+      if( dev->state != SCAN_UP ){ continue; }
+
+      if( scan_recv( w, dev, now ) < 0 ){
+        log_ver( "Worker %d: %s closed the connection", w->id, dev->name );
+        stats_add( &w->errors, 1 );
+        scan_close( w, dev, now );
+        continue;
+      }
+
+      // Replies freed their slots for the blocks waiting
+      if( scan_send( w, dev, now ) < 0 ){
+        stats_add( &w->errors, 1 );
+        scan_close( w, dev, now );
+      }
+    }
+  }
+
+  for( int d = 0; d < w->ndevs; d++ ){
+    if( w->devs[d]->fd != -1 ){ close( w->devs[d]->fd ); }
+  }
+  close( w->epfd );
+  return NULL;
+}
+
+uint64_t scan_replies( struct scan_worker_t *workers, int nworkers ){
+  uint64_t tot = 0;
+
+  for( int i = 0; i < nworkers; i++ ){ tot += __atomic_load_n( &workers[i].replies, __ATOMIC_RELAXED ); }
+  return tot;
+}
+
+void scan_free( struct scan_worker_t *workers, int nworkers ){
+  for( int i = 0; workers && i < nworkers; i++ ){ free( workers[i].devs ); }
+  free( workers );
+
+  for( int d = 0; d < scan_ndevs; d++ ){
+    free( scan_devs[d].inflight );
+    free( scan_devs[d].free );
+    free( scan_devs[d].obuf );
+  }
+  for( int i = 0; i < scan_nblocks; i++ ){ free( scan_blocks[i].values ); }
+  free( scan_devs );
+  free( scan_tags );
+  free( scan_blocks );
+  scan_devs    = NULL;
+  scan_tags    = NULL;
+  scan_blocks  = NULL;
+  scan_ndevs   = 0;
+  scan_ntags   = 0;
+  scan_nblocks = 0;
+}
+
+int scan_run( struct scan_args_t *args, struct scan_result_t *result ){
+  struct scan_worker_t *workers = NULL;
+
+  memset( result, 0, sizeof( struct scan_result_t ) );
+
+  if( !args->config || args->workers <= 0 || args->depth <= 0 || args->depth > SCAN_DEPTH_MAX || args->gap < 0 ||
+      args->timeout_msec <= 0 ){
+    log_err( "Invalid scan arguments" );
+    return -1;
+  }
+  if( scan_parse( args->config ) != 0 || scan_coalesce( args->gap ) != 0 ){
+    scan_free( NULL, 0 );
+    return -1;
+  }
+  if( args->workers > scan_ndevs ){ args->workers = scan_ndevs; }
+
+  result->devices = scan_ndevs;
+  result->tags    = scan_ntags;
+  result->blocks  = scan_nblocks;
+  for( int t = 0; t < scan_ntags; t++ ){ result->tag_polls += 1000.0 / scan_tags[t].period; }
+  for( int i = 0; i < scan_nblocks; i++ ){ result->req_polls += 1000.0 / scan_blocks[i].period; }
+  log_inf( "%d devices, %d tags in %d requests: %.0f tag polls/s as %.0f requests/s",
+           scan_ndevs, scan_ntags, scan_nblocks, result->tag_polls, result->req_polls );
+
+  workers = calloc( args->workers, sizeof( struct scan_worker_t ) );
+  if( !workers ){
+    scan_free( NULL, 0 );
+    return -1;
+  }
+
+  uint64_t start = stats_now();
+  uint32_t seed  = 0x9E3779B9u ^ (uint32_t)start;
+  for( int i = 0; i < args->workers; i++ ){
+    struct scan_worker_t *w = &workers[i];
+    w->id    = i;
+    w->args  = args;
+    w->start = start;
+    w->devs  = malloc( ( scan_ndevs / args->workers + 1 ) * sizeof( struct scan_dev_t * ) );
+    if( !w->devs ){
+      scan_free( workers, args->workers );
+      return -1;
+    }
+  }
+
+  for( int d = 0; d < scan_ndevs; d++ ){
+    struct scan_dev_t *dev = &scan_devs[d];
+    struct scan_worker_t *w = &workers[ d % args->workers ];
+
+    dev->inflight = calloc( args->depth, sizeof( struct scan_block_t * ) );
+    dev->free     = malloc( args->depth * sizeof( uint16_t ) );
+    dev->obuf     = malloc( args->depth * SCAN_REQ_LEN );
+    if( !dev->inflight || !dev->free || !dev->obuf ){
+      scan_free( workers, args->workers );
+      return -1;
+    }
+    for( int i = 0; i < args->depth; i++ ){ dev->free[i] = args->depth - 1 - i; }
+    dev->nfree = args->depth;
+    w->devs[ w->ndevs++ ] = dev;
+
+    // Blocks start spread over their period, not all on the first tick
+    for( int b = 0; b < dev->nblocks; b++ ){
+      dev->blocks[b].due_tick = 1 + scan_rand( &seed ) % dev->blocks[b].period;
+      scan_schedule( w, &dev->blocks[b] );
+    }
+  }
+
+  __atomic_store_n( &scan_terminate, 0, __ATOMIC_RELAXED );
+  int started;
+  for( started = 0; started < args->workers; started++ ){
+    if( pthread_create( &workers[ started ].thread, NULL, (void *)&scan_worker_run, (void *)&workers[ started ] ) ){
+      log_err( "FAILED CREATING scan worker thread %d", started );
+      __atomic_store_n( &scan_terminate, 1, __ATOMIC_RELAXED );
+      break;
+    }
+
+    char tname[16];
+    snprintf( tname, sizeof( tname ), "mbsc-%d", started );
+    pthread_setname_np( workers[ started ].thread, tname );
+  }
+
+  // Progress every second, until the time is over or scan_stop()
+  uint64_t end = start + args->seconds * 1000000000ULL, last = start, last_replies = 0;
+  while( !__atomic_load_n( &scan_terminate, __ATOMIC_RELAXED ) && ( !args->seconds || stats_now() < end ) ){
+    usleep( 100000 );
+
+    uint64_t now = stats_now();
+    if( now - last < 1000000000ULL ){ continue; }
+
+    uint64_t replies = scan_replies( workers, started );
+    log_inf( "%.0f polls/s, %lu polls", ( replies - last_replies ) * 1e9 / ( now - last ), replies );
+    last_replies = replies;
+    last         = now;
+  }
+  __atomic_store_n( &scan_terminate, 1, __ATOMIC_RELAXED );
+
+  for( int i = 0; i < started; i++ ){ pthread_join( workers[i].thread, NULL ); }
+  result->elapsed = ( stats_now() - start ) / 1e9;
+
+  for( int i = 0; i < started; i++ ){
+    struct scan_worker_t *w = &workers[i];
+    result->sent        += w->sent;
+    result->replies     += w->replies;
+    result->exceptions  += w->exceptions;
+    result->timeouts    += w->timeouts;
+    result->overruns    += w->overruns;
+    result->unreachable += w->unreachable;
+    result->errors      += w->errors;
+    stats_hist_add( &result->lat, &w->lat );
+  }
+
+  scan_free( workers, args->workers );
+  return started == args->workers ? 0 : -1;
+}
+
+void scan_stop(){
+  __atomic_store_n( &scan_terminate, 1, __ATOMIC_RELAXED );
+}
@@ -0,0 +1,66 @@
+#ifndef _MBT_SCAN_H_
+#define _MBT_SCAN_H_
+
+#include <stdint.h>
+
+#include "mbt-srv.h"
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ DEFINITIONS
+#define DEF_SCAN_DEPTH          1                  ///< Default requests in flight per device, most devices serve one at a time
+#define DEF_SCAN_GAP            0                  ///< Default unused registers a request may read to join two tags
+#define DEF_SCAN_UNIT           1                  ///< Default unit identifier of a device
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ TYPES
+struct scan_args_t{
+  char    *config;                                 ///< Devices and tags file
+  int      workers;                                ///< Event loop threads, devices are spread among them
+  int      depth;                                  ///< Requests in flight per device
+  int      gap;                                    ///< Unused registers (or bits) a request may read to join two tags
+  int      seconds;                                ///< Scan length, 0 until scan_stop()
+  int      timeout_msec;                           ///< Reply timeout, the connection is reopened when it expires
+};
+
+struct scan_result_t{
+  double              elapsed;                     ///< Seconds the scan lasted
+  int                 devices;                     ///< Devices polled
+  int                 tags;                        ///< Tags polled
+  int                 blocks;                      ///< Requests polling all the tags once
+  double              tag_polls;                   ///< Tag polls per second asked by the config
+  double              req_polls;                   ///< Requests per second needed by the coalesced blocks
+  uint64_t            sent;                        ///< Requests sent
+  uint64_t            replies;                     ///< Valid replies
+  uint64_t            exceptions;                  ///< Exception replies
+  uint64_t            timeouts;                    ///< Requests never answered
+  uint64_t            overruns;                    ///< Polls skipped: the previous one of the same block was still pending
+  uint64_t            unreachable;                 ///< Polls skipped: the device connection was down
+  uint64_t            errors;                      ///< Failed connections, invalid replies
+  struct stats_hist_t lat;                         ///< Latency from the request due to its reply
+};
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS
+
+/**
+ * @brief      Runs a scan, logging the poll rate every second
+ *
+ * The config lists devices, each followed by its tags. Blank lines and lines starting with '#' are skipped:
+ *
+ *     device <name> <host>[:<port>] [<unit>]
+ *     tag <name> <table> <address> <count> <period msec>
+ *
+ * Tables are co (coils), di (discrete inputs), hr (holding registers) and ir (input registers). Tags of a device
+ * with the same table and period are merged in as few requests as the modbus limits allow. Each device is a
+ * connection, polled by a timer wheel of the worker owning it.
+ *
+ * @param      args    The scan arguments
+ * @param[out] result  The scan results
+ *
+ * @return     0 on success, -1 on invalid config or arguments
+ */
+int scan_run( struct scan_args_t *args, struct scan_result_t *result );
+
+/**
+ * @brief      Stops a running scan, safe from a signal handler
+ */
+void scan_stop();
+
+#endif // _MBT_SCAN_H_
@@ -0,0 +1,289 @@
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ INCLUDES
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mbt-sim.h"
+#include "mbt-log.h"
+#include "mbt-stats.h"
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ DEFINITIONS
+#define SIM_SLEEP_MAX_NS    100000000ULL                   ///< Longest sleep of the thread, bounds the reaction to a stop
+#define SIM_SPREAD_MAX      1000.0f                        ///< Longest phase spread, float phases lose precision beyond
+#define SIM_WALK_STEP_MAX   0x7FFF                         ///< Largest walk step: its 2 * step + 1 moves times 16 random bits fit 32 bits
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ TYPES
+typedef float    v4sf __attribute__(( vector_size( 16 ) ));        ///< 4 phases or values, gcc vector extension
+typedef int32_t  v4si __attribute__(( vector_size( 16 ) ));
+typedef uint32_t v4su __attribute__(( vector_size( 16 ) ));
+typedef uint16_t v4hu __attribute__(( vector_size( 8 ) ));         ///< 4 registers
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS
+/**
+ * @brief      Parses "<first>[-<last>]" as a block of registers
+ *
+ * @return     0 on success, -1 if invalid
+ */
+int sim_parse_block( const char *s, struct sim_gen_t *gen ){
+  char *end;
+  long lo = strtol( s, &end, 0 ), hi = lo;
+
+  if( end == s ){ return -1; }
+  if( *end == '-' ){ hi = strtol( end + 1, &end, 0 ); }
+  if( *end || lo < 0 || hi > 0xFFFF || lo > hi ){ return -1; }
+  gen->addr = lo;
+  gen->nb   = hi - lo + 1;
+  return 0;
+}
+
+/**
+ * @brief      Parses a single generator, fields separated by ':'
+ *
+ * @return     0 on success, -1 if invalid
+ */
+int sim_parse_gen( char *spec, struct sim_gen_t *gen ){
+  char *save = NULL, *field = strtok_r( spec, ":", &save );
+  char *end;
+
+  memset( gen, 0, sizeof( struct sim_gen_t ) );
+  gen->uid       = 1;
+  gen->max       = 0xFFFF;
+  gen->step      = 1;
+  gen->period_ms = DEF_SIM_PERIOD_MSEC;
+  gen->hz        = DEF_SIM_HZ;
+  if( !field ){ return -1; }
+
+  if(      strcmp( field, "ramp"    ) == 0 ){ gen->kind = SIM_RAMP; }
+  else if( strcmp( field, "sine"    ) == 0 ){ gen->kind = SIM_SINE; }
+  else if( strcmp( field, "counter" ) == 0 ){ gen->kind = SIM_COUNTER; }
+  else if( strcmp( field, "walk"    ) == 0 ){ gen->kind = SIM_WALK; }
+  else if( strcmp( field, "noise"   ) == 0 ){ gen->kind = SIM_NOISE; }
+  else{ return -1; }
+
+  while( ( field = strtok_r( NULL, ":", &save ) ) ){
+    long v = 0;
+    if( strncmp( field, "hr=", 3 ) == 0 || strncmp( field, "ir=", 3 ) == 0 ){
+      gen->table = field[0] == 'h' ? REGS_HOLDING : REGS_INPUT;
+      if( sim_parse_block( field + 3, gen ) != 0 ){ return -1; }
+      continue;
+    }
+    if( strncmp( field, "spread=", 7 ) == 0 ){
+      gen->spread = strtof( field + 7, &end );
+      if( *end || !( gen->spread >= 0.0f && gen->spread <= SIM_SPREAD_MAX ) ){ return -1; }
+      continue;
+    }
+
+    char *eq = strchr( field, '=' );
+    if( !eq ){ return -1; }
+    v = strtol( eq + 1, &end, 0 );
+    if( *end || end == eq + 1 ){ return -1; }
+
+    if(      strncmp( field, "unit=",   5 ) == 0 && v >= 0 && v <= 0xFF ){ gen->uid = v; }
+    else if( strncmp( field, "min=",    4 ) == 0 && v >= 0 && v <= 0xFFFF ){ gen->min = v; }
+    else if( strncmp( field, "max=",    4 ) == 0 && v >= 0 && v <= 0xFFFF ){ gen->max = v; }
+    else if( strncmp( field, "step=",   5 ) == 0 && v >= 0 && v <= 0xFFFF ){ gen->step = v; }
+    else if( strncmp( field, "period=", 7 ) == 0 && v > 0 ){ gen->period_ms = v; }
+    else if( strncmp( field, "hz=",     3 ) == 0 && v > 0 && v <= SIM_HZ_MAX ){ gen->hz = v; }
+    else{ return -1; }
+  }
+
+  // A counter step beyond the range would wrap more than once, a walk one beyond SIM_WALK_STEP_MAX would overflow the lanes
+  if( !gen->nb || gen->min > gen->max || ( gen->kind == SIM_COUNTER && gen->step > gen->max - gen->min + 1 ) ||
+      ( gen->kind == SIM_WALK && gen->step > SIM_WALK_STEP_MAX ) ){ return -1; }
+  return 0;
+}
+
+struct sim_t *sim_parse( const char *spec ){
+  struct sim_t *sim = calloc( 1, sizeof( struct sim_t ) );
+  char *copy = strdup( spec ), *save = NULL, *tok;
+
+  if( !sim || !copy ){
+    free( sim );
+    free( copy );
+    return NULL;
+  }
+
+  for( tok = strtok_r( copy, ";", &save ); tok; tok = strtok_r( NULL, ";", &save ) ){
+    if( sim->n == SIM_GENS_MAX || sim_parse_gen( tok, &sim->gens[ sim->n ] ) != 0 ){
+      log_err( "Invalid register generator %d", sim->n + 1 );
+      free( sim );
+      free( copy );
+      return NULL;
+    }
+    sim->n++;
+  }
+
+  free( copy );
+  if( !sim->n ){
+    free( sim );
+    return NULL;
+  }
+  return sim;
+}
+
+/**
+ * @brief      Draws 4 random words, one per lane
+ */
+static inline v4su sim_rand( v4su *s ){
+  *s ^= *s << 13;
+  *s ^= *s >> 17;
+  *s ^= *s << 5;
+  return *s;
+}
+
+/**
+ * @brief      Ramps and sines: the values follow the phase of every register, 0 to 1 along a period
+ */
+void sim_wave( struct sim_gen_t *gen, uint64_t t ){
+  const uint64_t period = gen->period_ms * 1000000ULL;
+  const float du   = gen->nb > 1 ? gen->spread / gen->nb : 0.0f;
+  const float lo   = gen->min, span = gen->max - gen->min;
+  const float mid  = lo + span / 2, amp = span / 2;
+  const float u0   = (float)( t % period ) / period;
+  v4sf u = { u0, u0 + du, u0 + 2 * du, u0 + 3 * du };
+
+  for( int i = 0; i < gen->nb; i += 4, u += 4 * du ){
+    // Phases are positive: truncation is the floor
+    v4sf f = u - __builtin_convertvector( __builtin_convertvector( u, v4si ), v4sf ), v;
+
+    if( gen->kind == SIM_RAMP ){ v = lo + f * span; }
+    else{
+      // sin( 2 pi f ) = -sin( 2 pi x ), x in [-0.5, 0.5): parabola then one correction step, 0.1% error
+      v4sf x = f - 0.5f;
+      v4sf ax = (v4sf)( (v4si)x & 0x7FFFFFFF );
+      v4sf y  = 8.0f * x - 16.0f * x * ax;
+      v4sf ay = (v4sf)( (v4si)y & 0x7FFFFFFF );
+      y = 0.225f * ( y * ay - y ) + y;
+      v = mid - amp * y;
+    }
+
+    // Values are within 0 and 65535 by construction: the rounding never wraps
+    v4hu r = __builtin_convertvector( __builtin_convertvector( v + 0.5f, v4si ), v4hu );
+    memcpy( gen->vals + i, &r, sizeof( r ) );
+  }
+}
+
+/**
+ * @brief      Counters, walks and noise: integer lanes, the bounds applied with compare masks
+ */
+void sim_steps( struct sim_gen_t *gen ){
+  const v4si lo = { gen->min, gen->min, gen->min, gen->min }, hi = { gen->max, gen->max, gen->max, gen->max };
+  const uint32_t range = gen->max - gen->min + 1, steps = 2 * gen->step + 1;
+  v4su s;
+
+  memcpy( &s, gen->rng, sizeof( s ) );
+  for( int i = 0; i < gen->nb; i += 4 ){
+    v4hu r;
+    v4si v;
+
+    memcpy( &r, gen->vals + i, sizeof( r ) );
+    v = __builtin_convertvector( r, v4si );
+
+    switch( gen->kind ){
+      case SIM_COUNTER:{
+        v += gen->step;
+        v4si over = v > hi;
+        v = ( v & ~over ) | ( ( v - (int32_t)range ) & over );
+        break;
+      }
+
+      case SIM_WALK:{
+        // 16 random bits scaled to the 2 * step + 1 moves: the product fits 32 bits, step being SIM_WALK_STEP_MAX at most
+        v += (v4si)( ( ( sim_rand( &s ) >> 16 ) * steps ) >> 16 ) - gen->step;
+        v4si under = v < lo, over = v > hi;
+        v = ( v & ~under ) | ( lo & under );
+        v = ( v & ~over ) | ( hi & over );
+        break;
+      }
+
+      default:
+        v = lo + (v4si)( ( ( sim_rand( &s ) >> 16 ) * range ) >> 16 );
+        break;
+    }
+
+    r = __builtin_convertvector( v, v4hu );
+    memcpy( gen->vals + i, &r, sizeof( r ) );
+  }
+  memcpy( gen->rng, &s, sizeof( s ) );
+}
+
+void sim_update( struct sim_gen_t *gen, uint64_t t ){
+  if( gen->kind == SIM_RAMP || gen->kind == SIM_SINE ){ sim_wave( gen, t ); }
+  else{ sim_steps( gen ); }
+}
+
+void *sim_run( struct sim_t *sim ){
+  while( !sim->stop ){
+    uint64_t now = stats_now(), due = now + SIM_SLEEP_MAX_NS;
+
+    for( int g = 0; g < sim->n; g++ ){
+      struct sim_gen_t *gen = &sim->gens[g];
+      uint64_t tick = 1000000000ULL / gen->hz;
+
+      if( gen->next <= now ){
+        // Computed out of the store, published with a single write: readers only wait for the copy
+        sim_update( gen, now - sim->start );
+        if( regs_write_block( sim->store, gen->unit, gen->table, gen->addr, gen->nb, gen->vals ) == 0 ){ sim->updates++; }
+        else{ log_err( "Register pool exhausted, generator %d not published", g ); }
+
+        // Updates keep their pace: a late thread skips the missed ones rather than bursting
+        gen->next += tick;
+        if( gen->next <= now ){
+          uint64_t missed = ( now - gen->next ) / tick + 1;
+          sim->late += missed;
+          gen->next += missed * tick;
+        }
+      }
+      if( gen->next < due ){ due = gen->next; }
+    }
+
+    struct timespec ts = { due / 1000000000ULL, due % 1000000000ULL };
+    while( clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL ) == EINTR && !sim->stop ){ }
+  }
+  return NULL;
+}
+
+int sim_start( struct sim_t *sim, struct regs_store_t *store ){
+  sim->store = store;
+  sim->start = stats_now();
+
+  for( int g = 0; g < sim->n; g++ ){
+    struct sim_gen_t *gen = &sim->gens[g];
+
+    gen->unit = regs_unit( store, gen->uid );
+    if( gen->unit < 0 || gen->addr + gen->nb > regs_size( store, gen->table ) ){
+      log_err( "Generator %d: unit %d not served or registers %d-%d out of bounds", g, gen->uid, gen->addr, gen->addr + gen->nb - 1 );
+      return -1;
+    }
+
+    // Whole vectors: the kernels never handle a tail, only nb registers are published
+    gen->vals = calloc( ( gen->nb + 3 ) & ~3, sizeof( uint16_t ) );
+    if( !gen->vals ){ return -1; }
+
+    // Counters start at min, walks halfway
+    uint16_t v0 = gen->kind == SIM_WALK ? ( gen->min + gen->max ) / 2 : gen->min;
+    for( int i = 0; i < ( ( gen->nb + 3 ) & ~3 ); i++ ){ gen->vals[i] = v0; }
+    for( int l = 0; l < 4; l++ ){ gen->rng[l] = 0x9E3779B9u * ( g * 4 + l + 1 ) | 1; }
+    gen->next = sim->start;
+  }
+
+  sim->stop = 0;
+  if( pthread_create( &sim->thread, NULL, (void *)&sim_run, sim ) != 0 ){ return -1; }
+  pthread_setname_np( sim->thread, "mbsim" );
+  return 0;
+}
+
+void sim_stop( struct sim_t *sim ){
+  if( !sim->thread ){ return; }
+  sim->stop = 1;
+  pthread_join( sim->thread, NULL );
+  sim->thread = 0;
+  log_inf( "Register generators: %lu blocks published, %lu updates late", sim->updates, sim->late );
+}
+
+void sim_free( struct sim_t *sim ){
+  if( !sim ){ return; }
+  sim_stop( sim );
+  for( int g = 0; g < sim->n; g++ ){ free( sim->gens[g].vals ); }
+  free( sim );
+}
@@ -0,0 +1,108 @@
+#ifndef _MBT_SIM_H_
+#define _MBT_SIM_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "mbt-regs.h"
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ DEFINITIONS
+#define SIM_GENS_MAX            32                 ///< Generators in a set
+#define SIM_HZ_MAX              1000               ///< Fastest update rate
+#define DEF_SIM_HZ              10                 ///< Default update rate
+#define DEF_SIM_PERIOD_MSEC     10000              ///< Default ramp and sine period
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ TYPES
+enum sim_kind_type {
+  SIM_RAMP,                                        ///< Sawtooth from min to max over a period
+  SIM_SINE,                                        ///< Sine between min and max over a period
+  SIM_COUNTER,                                     ///< Up by step every update, wrapping from max to min
+  SIM_WALK,                                        ///< Random step up to step either way every update, within min and max
+  SIM_NOISE                                        ///< Random value within min and max every update
+};
+
+/**
+ * A block of registers updated at its own rate. Values are computed 4 registers per step in a buffer of the
+ * generator, then published to the store with a single atomic write.
+ */
+struct sim_gen_t{
+  enum sim_kind_type   kind;
+  enum regs_table_type table;                      ///< REGS_HOLDING or REGS_INPUT
+  uint8_t              uid;                        ///< Unit id of the block
+  int                  unit;                       ///< Register space of uid, set on start
+  int                  addr;                       ///< First register
+  int                  nb;                         ///< Registers in the block
+  int32_t              min, max;                   ///< Value bounds
+  int32_t              step;                       ///< Counter increment, longest walk step
+  uint32_t             period_ms;                  ///< Ramp and sine period
+  float                spread;                     ///< Ramp and sine: periods the phase spans along the block
+  uint32_t             hz;                         ///< Updates per second
+  uint64_t             next;                       ///< Time of the next update, ns
+  uint32_t             rng[4];                     ///< Walk and noise generator, xorshift32 per lane
+  uint16_t            *vals;                       ///< Values, the state of counters and walks: nb rounded up to 4
+};
+
+/**
+ * Generators and the thread running them. A set is never modified once started.
+ */
+struct sim_t{
+  int                  n;                          ///< Generators in the set
+  struct sim_gen_t     gens[ SIM_GENS_MAX ];       ///< The generators
+  struct regs_store_t *store;                      ///< Store the blocks are published to
+  pthread_t            thread;                     ///< Scheduler thread
+  volatile int         stop;                       ///< Asks the thread to end
+  uint64_t             start;                      ///< Time of the start: phase 0 of every ramp and sine, ns
+  uint64_t             updates;                    ///< Blocks published
+  uint64_t             late;                       ///< Updates skipped, the thread being behind
+};
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS
+
+/**
+ * @brief      Parses a generator set: generators separated by ';', each a kind followed by ':' separated fields
+ *
+ *     ramp | sine | counter | walk | noise
+ *     hr=<first>[-<last>] | ir=<first>[-<last>]  unit=<id>  min=<n>  max=<n>  step=<n>  period=<msec>  spread=<periods>  hz=<n>
+ *
+ * The block is required, every other field has a default: unit 1, min 0, max 65535, step 1, period 10 s,
+ * no spread, 10 updates per second.
+ *
+ * @param[in]  spec  The generators, eg. "sine:hr=0-9999:max=1000:period=5000:hz=50;walk:ir=0-99:step=5"
+ *
+ * @return     The set, to be released with sim_free(). NULL if invalid
+ */
+struct sim_t *sim_parse( const char *spec );
+
+/**
+ * @brief      Starts the thread updating the blocks of a set
+ *
+ * @param      sim    The set
+ * @param      store  The store, its units already added
+ *
+ * @return     0 on success, -1 on failure: a unit not served, a block out of bounds
+ */
+int sim_start( struct sim_t *sim, struct regs_store_t *store );
+
+/**
+ * @brief      Stops the thread of a set, if started
+ *
+ * @param      sim   The set
+ */
+void sim_stop( struct sim_t *sim );
+
+/**
+ * @brief      Frees a set, stopped first
+ *
+ * @param      sim   The set
+ */
+void sim_free( struct sim_t *sim );
+
+/**
+ * @brief      Computes the values of a block at a given time, in its buffer
+ *
+ * @param      gen   The generator
+ * @param[in]  t     Time from the start, ns
+ */
+void sim_update( struct sim_gen_t *gen, uint64_t t );
+
+#endif // _MBT_SIM_H_
@@ -1,10 +1,28 @@
 // ~~~~~~~~~~~~~~~~~~~~~~~~~~ INCLUDES
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <poll.h>
 #include <pthread.h>
-#include <stdarg.h>
+#include <stddef.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
 
 #include "mbt-srv.h"
+#include "mbt-adu.h"
+#include "mbt-conf.h"
+#include "mbt-fault.h"
+#include "mbt-gw.h"
+#include "mbt-sim.h"
+#include "mbt-trace.h"
+#include "mbt-tty.h"
+#include "mbt-upgrade.h"
+#include "mbt-uring.h"
 
 // ~~~~~~~~~~~~~~~~~~~~~~~~~~ DEFINITIONS
 #define RESTART_CONTEXT_TO            2                     ///< Sleep time before restarting the context build procedure
@@ -12,20 +30,146 @@
 #define LISTEN_BACKLOG               50                     ///< Growth of socket listen queue
 #define MBCMD_TYPE_TCP                1                     ///< Identify a TCP modbus command structure
 #define MBCMD_TYPE_RTU                2                     ///< Identify a RTU modbus command structure
-#define RTU_SEND_DELAY_MSEC          50                     ///< Milliseconds delay after sending a reply to RTU
+#define RTU_PORTS_MAX                32                     ///< Serial lines served by the RTU runner
+#define EPOLL_MAX_EVENTS            256                     ///< Max events returned by a single epoll_wait()
+#define EPOLL_WAIT_MSEC            1000                     ///< epoll_wait() timeout, bounds the reaction time to srv_terminate
+#define NOFILE_RESERVED              64                     ///< File descriptors kept aside from the connection limit
+#define CKPT_INTERVAL_SEC             1                     ///< Seconds between two checkpoints of the dirty register pages
+#define MBTCP_IBUF_SIZE  ( 4 * MODBUS_TCP_MAX_ADU_LENGTH )  ///< Per connection receive buffer, holds a few queued frames
+#define MBTCP_OBUF_SIZE ( 16 * MODBUS_TCP_MAX_ADU_LENGTH )  ///< Per connection send buffer, replies are batched here
+#define URING_ENTRIES               256                     ///< Submission queue entries of a worker ring
+#define URING_BUFS                  512                     ///< Receive buffers shared by the connections of a worker
+#define URING_BUF_SIZE             2048                     ///< Bytes per receive buffer
+#define URING_BGID                    0                     ///< Buffer group of the receive buffers
+#define URING_HELD_MAX                8                     ///< Receive buffers a connection holds before its receive is stopped
+#define URING_NO_BUF             0xFFFF                     ///< End of a held buffers list
+
+// io_uring requests of a worker: the user data is the connection pointer, the low bits the request
+#define URING_OP_ACCEPT               0
+#define URING_OP_RECV                 1
+#define URING_OP_SEND                 2
+#define URING_OP_POLL                 3                     ///< Gateway replies queue
+#define URING_OP_CANCEL               4
+#define URING_OP_MASK                 7
+
+// Connection state in the worker ring
+#define URING_IO_RECV              0x01                     ///< Multishot receive armed
+#define URING_IO_SEND              0x02                     ///< Send in flight
+#define URING_IO_CANCEL            0x04                     ///< Receive cancel requested
+#define URING_IO_STARVED           0x08                     ///< Receive ended for lack of buffers, in the worker starved list
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ TYPES
+struct mbtcp_conn_t{
+  int                  fd;                                  ///< Client socket
+  uint32_t             id;                                  ///< Connection id in the ADU trace
+  uint16_t             port;                                ///< Client port
+  char                 addr[INET6_ADDRSTRLEN];              ///< Client address in string form
+  struct mbtcp_conn_t *prev, *next;                         ///< Active connections list
+  uint16_t             ilen;                                ///< Bytes waiting in ibuf
+  uint16_t             olen;                                ///< Bytes queued in obuf
+  uint16_t             osent;                               ///< Bytes of obuf already sent
+  uint64_t             trecv;                               ///< Time of the last receive, frames completed by it arrived then
+  uint64_t             tqueued;                             ///< Time the first reply of obuf was queued
+  uint16_t             hold;                                ///< Bytes of obuf sendable while the delay timer is armed
+  uint16_t             pending;                             ///< Queries waiting for the gateway, the connection is freed without
+  struct gw_req_t     *ready, *ready_tail;                  ///< Gateway replies waiting for room in obuf
+  struct mbtcp_conn_t *wake;                                ///< Next connection with gateway replies just come back
+  struct fault_timer_t timer;                               ///< Injected delay: replies from hold on wait for it
+  uint8_t              uring;                               ///< io_uring backend: URING_IO_* state, the connection is freed without
+  uint8_t              held;                                ///< io_uring backend: receive buffers waiting for room in ibuf
+  uint16_t             held_head, held_tail;                ///< io_uring backend: first and last held buffer
+  struct mbtcp_conn_t *starved;                             ///< io_uring backend: next connection waiting for receive buffers
+  uint8_t              ibuf[ MBTCP_IBUF_SIZE ];             ///< Receive buffer, may end with a partial frame
+  uint8_t              obuf[ MBTCP_OBUF_SIZE ];             ///< Send buffer, replies not yet written
+};
+struct mbtcp_worker_t{
+  int                  id;                                  ///< Worker index
+  pthread_t            thread;                              ///< Event loop thread
+  int                  srv_socket;                          ///< Worker own SO_REUSEPORT listening socket
+  struct tcp_args_t   *args;                                ///< TCP configuration, shared by all workers
+  modbus_t            *ctx_tcp;                             ///< Worker own context, for replies built by libmodbus
+  int                  pair[2];                             ///< Replies built by libmodbus, read back into the send buffer
+  uint64_t             tot_req;                             ///< Requests served by the worker
+  struct stats_t      *stats;                               ///< Worker own statistics, merged on demand
+  struct fault_rng_t   rng;                                 ///< Worker own generator for the fault rules
+  struct fault_wheel_t wheel;                               ///< Delayed replies of the worker connections
+  struct mbtcp_conn_t *orphans;                             ///< Connections closed while the gateway or the ring still has requests of them
+  struct uring_t      *ring;                                ///< io_uring backend ring, NULL with epoll
+  uint16_t            *buf_next;                            ///< io_uring backend: per receive buffer, next one held by the same connection
+  uint16_t            *buf_len;                             ///< io_uring backend: per receive buffer, bytes received
+  uint16_t            *buf_off;                             ///< io_uring backend: per receive buffer, bytes already moved to ibuf
+  struct mbtcp_conn_t *starved;                             ///< io_uring backend: connections waiting for receive buffers
+  int                  bufs_back;                           ///< io_uring backend: receive buffers given back since the starved ones were resumed
+  struct trace_ring_t *trace;                               ///< ADU trace ring of the worker, NULL if not recording
+  uint32_t             conn_seq;                            ///< Connections accepted, for their trace ids
+  struct conf_reader_t *conf;                               ///< Layout reader of the worker
+  struct mbtcp_conn_t *adopted;                             ///< Connections taken over from the previous process, served once the loop starts
+};
+struct mbrtu_port_t{
+  char                 dev[ 128 ];                          ///< tty path, or TTY_PTY
+  int                  speed;                               ///< Baud rate
+  int                  fd;                                  ///< Serial line, -1 while closed
+  int                  pty;                                 ///< Slave side of an own pseudo terminal, -1 otherwise
+  uint64_t             retry;                               ///< Time to reopen a failed line
+  struct tty_times_t   times;                               ///< Character time and silences, t3.5 is also the reply turnaround
+  uint16_t             ilen;                                ///< Bytes of the frame being received
+  uint8_t              checked;                             ///< The frame CRC failed after a t1.5 silence, only t3.5 ends it
+  uint64_t             tfirst;                              ///< Time the first byte of the frame arrived
+  uint64_t             tlast;                               ///< Time the last bytes were read
+  uint16_t             olen;                                ///< Reply bytes in obuf
+  uint16_t             osent;                               ///< Reply bytes already written
+  uint64_t             due;                                 ///< Time the reply may be written
+  uint64_t             tqueued;                             ///< Time the reply was built
+  struct stats_fc_t   *st;                                  ///< Statistics of the reply function code
+  uint8_t              ibuf[ MODBUS_RTU_MAX_ADU_LENGTH ];   ///< Frame being received
+  uint8_t              obuf[ MODBUS_RTU_MAX_ADU_LENGTH ];   ///< Reply waiting for the turnaround
+};
+struct mbrtu_loop_t{
+  struct rtu_args_t   *args;                                ///< RTU configuration
+  modbus_t            *ctx;                                 ///< Context writing to pipe the replies built by libmodbus
+  int                  pipe[2];                             ///< Replies built by libmodbus, read back into the line buffer
+  struct fault_rng_t   rng;                                 ///< Generator for the fault rules
+  uint64_t             tot_req;                             ///< Requests served
+  struct trace_ring_t *trace;                               ///< ADU trace ring, NULL if not recording
+  struct conf_reader_t *conf;                               ///< Layout reader of the runner
+};
+struct mbsrv_takeover_t{
+  int                  store_fd;                            ///< Memory file of the registers, -1 if not received
+  int                 *listeners;                           ///< Listening sockets of the previous process
+  int                  nlisteners;                          ///< Number of listening sockets
+  struct mbtcp_conn_t *conns;                               ///< Connections, with their unserved and unsent bytes
+  int                  nconns;                              ///< Number of connections
+};
 
 // ~~~~~~~~~~~~~~~~~~~~~~~~~~ GLOBAL VARS
-int srv_socket    = -1;                                     ///< Main Server socket
-pthread_t trd_tcp = 0,                                      ///< Starts modbus tcp server
-          trd_rtu = 0;                                      ///< Starts modbus rtu slave
-int srv_terminate = 0;                                      ///< If set to true server thread should stop// Modbus Context
-modbus_t *ctx_rtu = NULL;                                   ///< RTU context, i need it global so I can stop it when shutting down
-
-const char *mdb_proto_strings[] = {
-  "TCP",
-  "RTU"
+const char *mbtcp_backend_strings[] = {
+  "epoll",
+  "uring"
 };
 
+pthread_t trd_rtu = 0;                                      ///< Starts modbus rtu slave
+pthread_t trd_ckpt = 0;                                     ///< Writes dirty register pages to the snapshot file
+struct mbtcp_worker_t *tcp_workers = NULL;                  ///< TCP event loop workers
+int tcp_nworkers  = 0;                                      ///< Number of started TCP workers
+struct regs_store_t *mb_store = NULL;                       ///< Register image shared by every transport and thread
+modbus_mapping_t *mb_fallback = NULL;                       ///< Empty mapping for libmodbus: it never touches register data
+struct regs_ckpt_t *mb_ckpt = NULL;                         ///< Snapshot file of the registers, NULL if not persisted
+int srv_terminate = 0;                                      ///< If set to true server thread should stop
+struct mbrtu_port_t *rtu_ports = NULL;                      ///< RTU lines, all served by the RTU runner
+int rtu_nports = 0;                                         ///< Number of RTU lines
+struct mbtcp_counters_t tcp_counters = { 0 };               ///< TCP connections counters
+struct stats_t *rtu_stats = NULL;                           ///< RTU runner statistics
+struct conf_reader_t *rtu_conf = NULL;                      ///< RTU runner layout reader
+const char *mb_config = NULL;                               ///< Layout file, reloaded by mbsrv_reload(). NULL if none
+struct sim_t *mb_sim = NULL;                                ///< Register generators, NULL if none
+struct trace_t *mb_trace = NULL;                            ///< ADU trace, NULL if not recording
+const char *mb_upgrade_path = NULL;                         ///< Upgrade socket path, NULL if none
+int mb_upgrade_fd = -1;                                     ///< Upgrade socket, listening for the next process
+int mb_upgrade_peer = -1;                                   ///< Connection to the process taking over, -1 if none
+int srv_handoff = 0;                                        ///< If set, TCP workers hand everything to the process taking over
+int srv_handed = 0;                                         ///< TCP workers left with nothing to hand
+uint64_t srv_handed_conns = 0;                              ///< Connections handed to the process taking over
+
 // ~~~~~~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS
 int mb_query( const uint8_t *query, const uint16_t qlen, enum mdb_proto_type mproto, modbus_mapping_t *mb_mapping ){
   if( !mb_mapping ){ return MODBUS_EXCEPTION_SLAVE_OR_SERVER_FAILURE; }
@@ -34,7 +178,7 @@ int mb_query( const uint8_t *query, const uint16_t qlen, enum mdb_proto_type mpr
 
   switch( mproto ){
     case MDB_PROTO_TCP:
-      if( qlen < 12 ){
+      if( qlen < 8 ){
         log_war( "Wrong query length (%d) for TCP command", qlen );
         return MODBUS_EXCEPTION_ILLEGAL_FUNCTION;
       }
@@ -42,8 +186,8 @@ int mb_query( const uint8_t *query, const uint16_t qlen, enum mdb_proto_type mpr
       break;
 
     case MDB_PROTO_RTU:
-      if( qlen < 5 ){
-        log_war( "Wrong query length (%d) for TCP command", qlen );
+      if( qlen < 4 ){
+        log_war( "Wrong query length (%d) for RTU command", qlen );
         return MODBUS_EXCEPTION_ILLEGAL_FUNCTION;
       }
       mdb_proto_offset = 1;
@@ -56,6 +200,13 @@ int mb_query( const uint8_t *query, const uint16_t qlen, enum mdb_proto_type mpr
 
 
   uint8_t   mcmd = query[ 0 + mdb_proto_offset ];                                    ///< Modbus Command code
+
+  // Some functions (eg. report slave id) carry neither address nor length
+  if( qlen < mdb_proto_offset + 5 ){
+    log_dbg( "%s l=%d QRY: %02X", mdb_proto_strings[mproto], qlen, mcmd );
+    return 0;
+  }
+
   uint16_t  mreg = (((uint16_t)query[ 1 + mdb_proto_offset ]) << 8) +                ///< Modbus Registry address
                      (uint16_t)query[ 2 + mdb_proto_offset ];
   uint16_t  mlen = (((uint16_t)query[ 3 + mdb_proto_offset ]) << 8) +                ///< Modbus Length (for reading or multi write)
@@ -107,239 +258,1661 @@ int mb_query( const uint8_t *query, const uint16_t qlen, enum mdb_proto_type mpr
 // ========================================
 // Modbus TCP server
 // ========================================
-void mbtcp_runner( struct tcp_args_t *args ){
-  pthread_setcanceltype( PTHREAD_CANCEL_ASYNCHRONOUS, NULL );
+void sockaddr_str( const struct sockaddr_storage *sa, char *addr, uint16_t *port ){
+  addr[0] = '\0';
+  *port   = 0;
+
+  if( sa->ss_family == AF_INET ){
+    const struct sockaddr_in *sin = (const struct sockaddr_in *)sa;
+    inet_ntop( AF_INET, &sin->sin_addr, addr, INET6_ADDRSTRLEN );
+    *port = ntohs( sin->sin_port );
+  }
+  else if( sa->ss_family == AF_INET6 ){
+    const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)sa;
+    inet_ntop( AF_INET6, &sin6->sin6_addr, addr, INET6_ADDRSTRLEN );
+    *port = ntohs( sin6->sin6_port );
+  }
+}
 
-  int master_socket,                // Socket for current Modbus master
-      fdmax;                        // Maximum file descriptor number
-  fd_set refset, rdset;
+void mbtcp_raise_nofile( int max_conn ){
+  struct rlimit rl;
+  rlim_t needed = (rlim_t)max_conn + NOFILE_RESERVED;
 
-  modbus_t *ctx_tcp = NULL;
-  uint8_t query[ MODBUS_TCP_MAX_ADU_LENGTH ] = { 0 };
-  modbus_mapping_t *mb_mapping = modbus_mapping_new( MB_BITS_MAX, MB_BITS_IN_MAX, MB_REGS_MAX, MB_REGS_IN_MAX );
-  if( !mb_mapping ){
-    log_err( "Failed to allocate mapping with err( %d ): %s", errno, modbus_strerror(errno) );
-    pthread_exit( NULL );
+  if( getrlimit( RLIMIT_NOFILE, &rl ) != 0 || rl.rlim_cur >= needed ){ return; }
+
+  rl.rlim_cur = ( rl.rlim_max != RLIM_INFINITY && rl.rlim_max < needed ) ? rl.rlim_max : needed;
+  if( setrlimit( RLIMIT_NOFILE, &rl ) != 0 || rl.rlim_cur < needed ){
+    log_war( "Open files limit is %lu: less than %d connections could be served", (unsigned long)rl.rlim_cur, max_conn );
   }
+}
 
-  // Initializing registry values
-  memset(mb_mapping->tab_bits,            args->init_value, MB_BITS_MAX);
-  memset(mb_mapping->tab_input_bits,      args->init_value, MB_BITS_IN_MAX);
-  memset(mb_mapping->tab_registers,       args->init_value, MB_REGS_MAX);
-  memset(mb_mapping->tab_input_registers, args->init_value, MB_REGS_IN_MAX);
+int mbtcp_listen( const char *addr, const char *port ){
+  struct addrinfo hints = { 0 }, *ai_list, *ai;
+  int on = 1, sock = -1;
 
-  uint64_t tot_req = 0;
+  hints.ai_flags    = AI_PASSIVE;
+  hints.ai_family   = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
 
-  while( !srv_terminate ){
+  int rc = getaddrinfo( strcmp( addr, "*" ) == 0 ? NULL : addr, port, &hints, &ai_list );
+  if( rc != 0 ){
+    log_err( "getaddrinfo( %s, %s ) failed: %s", addr, port, gai_strerror( rc ) );
+    return -1;
+  }
+
+  // First address that can be bound wins, as modbus_tcp_pi_listen() does
+  for( ai = ai_list; ai; ai = ai->ai_next ){
+    sock = socket( ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol );
+    if( sock == -1 ){ continue; }
+
+    // Every worker binds the same address, the kernel spreads the new connections among them
+    if( setsockopt( sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof( on ) ) == 0 &&
+        setsockopt( sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof( on ) ) == 0 &&
+        bind( sock, ai->ai_addr, ai->ai_addrlen ) == 0 &&
+        listen( sock, LISTEN_BACKLOG ) == 0 ){
+      break;
+    }
+    close( sock );
+    sock = -1;
+  }
+  freeaddrinfo( ai_list );
+
+  return sock;
+}
+
+static inline void mbtcp_conn_unlink( struct mbtcp_conn_t **list, struct mbtcp_conn_t *conn ){
+  if( conn->prev ){ conn->prev->next = conn->next; }
+  else{ *list = conn->next; }
+  if( conn->next ){ conn->next->prev = conn->prev; }
+}
+
+/**
+ * @brief      Queues the cancel of the ring requests matching a user data
+ */
+static inline void mbtcp_uring_cancel( struct mbtcp_worker_t *worker, uint64_t user_data ){
+  struct io_uring_sqe *sqe = uring_sqe( worker->ring );
+  if( !sqe ){
+    log_err( "Worker %d ring full, cancel lost", worker->id );
+    return;
+  }
+
+  sqe->opcode       = IORING_OP_ASYNC_CANCEL;
+  sqe->fd           = -1;
+  sqe->addr         = user_data;
+  sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+  sqe->user_data    = URING_OP_CANCEL;
+}
+
+/**
+ * @brief      Arms the multishot receive of a connection, every completion bringing one of the worker buffers
+ */
+void mbtcp_uring_recv( struct mbtcp_worker_t *worker, struct mbtcp_conn_t *conn ){
+  struct io_uring_sqe *sqe = uring_sqe( worker->ring );
+  if( !sqe ){
+    log_err( "Worker %d ring full, receive of socket %d not armed", worker->id, conn->fd );
+    return;
+  }
+
+  sqe->opcode    = IORING_OP_RECV;
+  sqe->fd        = conn->fd;
+  sqe->ioprio    = IORING_RECV_MULTISHOT;
+  sqe->flags     = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BGID;
+  sqe->user_data = (uintptr_t)conn | URING_OP_RECV;
+  conn->uring   |= URING_IO_RECV;
+}
+
+/**
+ * @brief      Ends the ring requests of a closing connection and gives its receive buffers back
+ */
+void mbtcp_uring_release( struct mbtcp_worker_t *worker, struct mbtcp_conn_t *conn ){
+  if( ( conn->uring & ( URING_IO_RECV | URING_IO_CANCEL ) ) == URING_IO_RECV ){
+    mbtcp_uring_cancel( worker, (uintptr_t)conn | URING_OP_RECV );
+    conn->uring |= URING_IO_CANCEL;
+  }
+  if( conn->uring & URING_IO_SEND ){ mbtcp_uring_cancel( worker, (uintptr_t)conn | URING_OP_SEND ); }
+
+  for( uint16_t bid = conn->held_head; bid != URING_NO_BUF; bid = worker->buf_next[ bid ] ){
+    uring_buf_put( worker->ring, bid );
+    worker->bufs_back++;
+  }
+  conn->held      = 0;
+  conn->held_head = URING_NO_BUF;
+  conn->held_tail = URING_NO_BUF;
+}
+
+/**
+ * @brief      Records a frame of a connection in the worker trace, if recording
+ */
+static inline void mbtcp_trace( struct mbtcp_worker_t *worker, struct mbtcp_conn_t *conn, uint8_t kind, const uint8_t *adu, int len, uint64_t t ){
+  if( worker->trace ){ trace_put( worker->trace, t, conn->id, kind, len > 6 ? adu[6] : 0, adu, len ); }
+}
+
+void mbtcp_conn_close( struct mbtcp_worker_t *worker, struct mbtcp_conn_t **conns, struct mbtcp_conn_t *conn ){
+  // Closing the fd also removes it from the epoll set. A ring keeps the socket until its requests end
+  close( conn->fd );
+  mbtcp_trace( worker, conn, TRACE_CLOSE, NULL, 0, stats_now() );
+  fault_wheel_del( &worker->wheel, &conn->timer );
+  mbtcp_conn_unlink( conns, conn );
+  if( worker->ring ){ mbtcp_uring_release( worker, conn ); }
+
+  while( conn->ready ){
+    struct gw_req_t *req = conn->ready;
+    conn->ready = req->next;
+    free( req );
+  }
+
+  // Queries still at the gateway or in the ring come back to it: the connection waits for them out of the active list
+  if( conn->pending || conn->uring ){
+    conn->fd   = -1;
+    conn->prev = NULL;
+    conn->next = worker->orphans;
+    if( worker->orphans ){ worker->orphans->prev = conn; }
+    worker->orphans = conn;
+  }
+  else{ free( conn ); }
+
+  __atomic_fetch_add( &tcp_counters.closed, 1, __ATOMIC_RELAXED );
+  __atomic_fetch_sub( &tcp_counters.active, 1, __ATOMIC_RELAXED );
+}
+
+/**
+ * @brief      Allocates the connection of an accepted socket, the socket is closed on failure
+ *
+ * @return     The connection, NULL if refused
+ */
+struct mbtcp_conn_t *mbtcp_conn_new( int newfd, const struct sockaddr_storage *cli_addr, int max_conn ){
+  if( __atomic_load_n( &tcp_counters.active, __ATOMIC_RELAXED ) >= (uint64_t)max_conn ){
+    log_ver( "Connection limit (%d) reached. Rejecting socket %d", max_conn, newfd );
+    close( newfd );
+    __atomic_fetch_add( &tcp_counters.rejected, 1, __ATOMIC_RELAXED );
+    return NULL;
+  }
+
+  struct mbtcp_conn_t *conn = malloc( sizeof( struct mbtcp_conn_t ) );
+  if( !conn ){
+    log_err( "Failed to allocate connection for socket %d", newfd );
+    close( newfd );
+    return NULL;
+  }
+  conn->fd   = newfd;
+  conn->ilen  = 0;
+  conn->olen  = 0;
+  conn->osent = 0;
+  conn->hold  = 0;
+  conn->pending = 0;
+  conn->ready   = NULL;
+  conn->timer.armed = 0;
+  conn->uring     = 0;
+  conn->held      = 0;
+  conn->held_head = URING_NO_BUF;
+  conn->held_tail = URING_NO_BUF;
+  conn->starved   = NULL;
+  conn->prev = NULL;
+  conn->next = NULL;
+  sockaddr_str( cli_addr, conn->addr, &conn->port );
+  return conn;
+}
+
+void mbtcp_conn_add( struct mbtcp_worker_t *worker, struct mbtcp_conn_t **conns, struct mbtcp_conn_t *conn ){
+  conn->id   = ( (uint32_t)worker->id << 24 ) | ( worker->conn_seq++ & 0xFFFFFF );
+  conn->next = *conns;
+  if( *conns ){ (*conns)->prev = conn; }
+  *conns = conn;
+
+  __atomic_fetch_add( &tcp_counters.accepted, 1, __ATOMIC_RELAXED );
+  __atomic_fetch_add( &tcp_counters.active, 1, __ATOMIC_RELAXED );
+  log_ver( "New connection from %s:%d on socket %d", conn->addr, conn->port, conn->fd );
+
+  if( worker->trace ){
+    char peer[ INET6_ADDRSTRLEN + 8 ];
+    int len = snprintf( peer, sizeof( peer ), "%s:%d", conn->addr, conn->port );
+    trace_put( worker->trace, stats_now(), conn->id, TRACE_OPEN, 0, (const uint8_t *)peer, len );
+  }
+}
+
+void mbtcp_accept( struct mbtcp_worker_t *worker, int epfd, struct mbtcp_conn_t **conns ){
+  struct sockaddr_storage cli_addr;
+  socklen_t cli_addrlen;
+
+  // Edge triggered: the backlog must be emptied, no new event comes for connections already queued
+  while( 1 ){
+    cli_addrlen = sizeof( cli_addr );
+    int newfd = accept4( worker->srv_socket, (struct sockaddr *)&cli_addr, &cli_addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC );
+    if( newfd == -1 ){
+      if( errno == EINTR || errno == ECONNABORTED ){ continue; }
+      if( errno != EAGAIN && errno != EWOULDBLOCK ){ log_ver( "Server accept() error: %s", strerror( errno ) ); }
+      return;
+    }
+
+    struct mbtcp_conn_t *conn = mbtcp_conn_new( newfd, &cli_addr, worker->args->max_conn );
+    if( !conn ){ continue; }
+
+    // EPOLLOUT only fires once a full send buffer gets room again, it resumes a master that is slow reading its replies
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = conn };
+    if( epoll_ctl( epfd, EPOLL_CTL_ADD, newfd, &ev ) == -1 ){
+      log_err( "Failed adding socket %d to epoll: %s", newfd, strerror( errno ) );
+      close( newfd );
+      free( conn );
+      continue;
+    }
+    mbtcp_conn_add( worker, conns, conn );
+  }
+}
+
+/**
+ * @brief      Accounts the replies sent up to end and drops them from the send buffer
+ */
+void mbtcp_conn_sent( struct mbtcp_worker_t *worker, struct mbtcp_conn_t *conn, uint16_t end ){
+  // Every reply of the batch is accounted as sent now: they were all queued within the same receive.
+  // A truncated reply can only be the last one
+  uint64_t wait = stats_now() - conn->tqueued;
+  for( int off = 0; off + MBAP_HEADER_LEN < end; ){
+    int rlen = 6 + ( ( conn->obuf[ off + 4 ] << 8 ) | conn->obuf[ off + 5 ] );
+    uint8_t fc = conn->obuf[ off + MBAP_HEADER_LEN ];
+    struct stats_fc_t *st = &worker->stats->fc[ stats_slot( fc ) ];
+
+    if( rlen > end - off ){ rlen = end - off; }
+    stats_add( &st->bytes_out, rlen );
+    if( fc & 0x80 ){ stats_add( &st->exceptions, 1 ); }
+    stats_record( &st->lat[ STATS_REPLY ], wait );
+    off += rlen;
+  }
+
+  // Held replies move to the start, they go out once their timer expires
+  if( end < conn->olen ){ memmove( conn->obuf, conn->obuf + end, conn->olen - end ); }
+  conn->olen -= end;
+  conn->osent = 0;
+  conn->hold  = 0;
+}
+
+int mbtcp_conn_flush( struct mbtcp_worker_t *worker, struct mbtcp_conn_t *conn ){
+  // A delayed reply and the ones queued after it wait for its timer
+  uint16_t end = conn->timer.armed ? conn->hold : conn->olen;
+
+  while( conn->osent < end ){
+    ssize_t wr = send( conn->fd, conn->obuf + conn->osent, end - conn->osent, MSG_NOSIGNAL );
+    if( wr < 0 ){
+      if( errno == EINTR ){ continue; }
+      if( errno == EAGAIN || errno == EWOULDBLOCK ){ return 0; }
+      log_ver( "Failed send to %s:%d on socket %d - for: %s", conn->addr, conn->port, conn->fd, strerror( errno ) );
+      return -1;
+    }
+    conn->osent += wr;
+  }
+  if( end ){ mbtcp_conn_sent( worker, conn, end ); }
+  return 0;
+}
+
+/**
+ * @brief      Serves a query, queueing its reply in the send buffer
+ *
+ * @return     0 to go on with the batch, 1 to send the batch first, -1 to reset the connection
+ */
+int mbtcp_query( struct mbtcp_worker_t *worker, struct mbtcp_conn_t *conn, const uint8_t *query, int qlen ){
+  uint8_t *rsp = conn->obuf + conn->olen;
+  uint64_t *injected = &worker->stats->fc[ stats_slot( query[ MBAP_HEADER_LEN ] ) ].injected;
+  const struct conf_t *conf = conf_get();
+  struct fault_t fault;
+  int rlen = 0;
+
+  worker->tot_req++;
+
+  // Injected faults: a drop is never answered and a reset closes the connection, the master must hit its timeout
+  switch( fault_check( conf->faults, &worker->rng, query[6], query + MBAP_HEADER_LEN, qlen - MBAP_HEADER_LEN, &fault ) ){
+    case FAULT_NONE:
+      break;
+
+    case FAULT_DROP:
+      stats_add( injected, 1 );
+      log_ver( "[%s:%d] Injected drop %lu", conn->addr, conn->port, worker->tot_req );
+      return 0;
+
+    case FAULT_RESET:{
+      struct linger lg = { .l_onoff = 1, .l_linger = 0 };
+      stats_add( injected, 1 );
+      log_ver( "[%s:%d] Injected reset %lu", conn->addr, conn->port, worker->tot_req );
+      setsockopt( conn->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof( lg ) );
+      return -1;
+    }
+
+    case FAULT_EXCEPTION:
+      stats_add( injected, 1 );
+      log_ver( "[%s:%d] Injected exception %d %lu", conn->addr, conn->port, fault.exception, worker->tot_req );
+      conn->olen += adu_exception( query, MDB_PROTO_TCP, fault.exception, rsp );
+      return 0;
+
+    default:
+      // Delayed and truncated replies are built first
+      break;
+  }
+
+  // Routed units are answered by their RTU bus, the reply comes back through the worker queue
+  if( gw_routed( query[6] ) ){
+    struct gw_req_t *req = malloc( sizeof( struct gw_req_t ) );
+    if( !req ){
+      conn->olen += adu_exception( query, MDB_PROTO_TCP, MODBUS_EXCEPTION_SLAVE_OR_SERVER_FAILURE, rsp );
+      return 0;
+    }
+    req->owner  = conn;
+    req->queue  = worker->id;
+    req->source = (uintptr_t)conn;
+    req->qlen   = qlen;
+    req->fault  = fault;
+    memcpy( req->query, query, qlen );
+    conn->pending++;
+    gw_submit( req );
+    return 0;
+  }
+
+  // Unit identifiers without registers of their own get the gateway exception, as a modbus gateway would do
+  int unit = conf_unit( conf, query[6] );
+  if( unit < 0 ){
+    log_ver( "[%s:%d] Query for unknown unit %d", conn->addr, conn->port, query[6] );
+    conn->olen += adu_exception( query, MDB_PROTO_TCP, MODBUS_EXCEPTION_GATEWAY_TARGET, rsp );
+    return 0;
+  }
+
+  // Common functions are decoded, checked and answered in place in the send buffer, in a single pass
+  rlen = adu_reply( query, qlen, MDB_PROTO_TCP, mb_store, unit, conf->nb[ unit ], rsp );
+  if( rlen > 0 ){
+    log_dbg( "[%s:%d] Reply queued: %02X -> %02X", conn->addr, conn->port, query[ MBAP_HEADER_LEN ], rsp[ MBAP_HEADER_LEN ] );
+
+    // A truncated reply ends the batch, the master gets the replies after it in a new send
+    if( fault.action == FAULT_TRUNCATE ){
+      stats_add( injected, 1 );
+      log_ver( "[%s:%d] Injected truncate %lu", conn->addr, conn->port, worker->tot_req );
+      conn->olen += 1 + fault.cut % ( rlen - 1 );
+      return 1;
+    }
+
+    // A delayed reply is held in the send buffer by the worker timer wheel, the event loop never sleeps
+    if( fault.action == FAULT_DELAY ){
+      stats_add( injected, 1 );
+      log_ver( "[%s:%d] Injected delay %u ms %lu", conn->addr, conn->port, fault.delay, worker->tot_req );
+      conn->hold  = conn->olen;
+      conn->olen += rlen;
+      fault_wheel_add( &worker->wheel, &conn->timer, stats_now(), fault.delay );
+      return 1;
+    }
+
+    conn->olen += rlen;
+    return 0;
+  }
+
+  // Everything else goes to libmodbus, writing to the worker pair: the reply is read back into the send buffer,
+  // so that it leaves with the others however slow the master reads
+  int err = mb_query(query, qlen, MDB_PROTO_TCP, mb_fallback);
+  if( err > 0 ){
+    log_war( "[%s:%d] Query failed. Modbus exception %d %lu", conn->addr, conn->port, err, worker->tot_req );
+    conn->olen += adu_exception( query, MDB_PROTO_TCP, err, rsp );
+    return 0;
+  }
+
+  if( modbus_reply( worker->ctx_tcp, query, qlen, mb_fallback ) < 0 ){
+    log_war( "[%s:%d] libmodbus reply failed: %s", conn->addr, conn->port, modbus_strerror(errno) );
+  }
+  ssize_t n = read( worker->pair[0], rsp, MODBUS_TCP_MAX_ADU_LENGTH );
+  if( n > 0 ){
+    log_dbg( "[%s:%d] Reply queued: %02X -> %02X", conn->addr, conn->port, query[ MBAP_HEADER_LEN ], rsp[ MBAP_HEADER_LEN ] );
+    conn->olen += n;
+  }
+  return 0;
+}
+
+int mbtcp_conn_parse( struct mbtcp_worker_t *worker, struct mbtcp_conn_t *conn ){
+  uint64_t tstart = stats_now();
+  size_t off = 0;
+  int flen = 0;
+
+  // Serving every complete frame while their replies fit the send buffer, a partial one stays in
+  // the buffer waiting for its missing bytes
+  while( conn->olen + MODBUS_TCP_MAX_ADU_LENGTH <= sizeof( conn->obuf ) && conn->pending < GW_PENDING_MAX &&
+         ( flen = mbap_frame_len( conn->ibuf + off, conn->ilen - off ) ) > 0 ){
+    // One clock read per query: its end is the start of the next one
+    const uint8_t fc = conn->ibuf[ off + MBAP_HEADER_LEN ];
+    struct stats_fc_t *st = &worker->stats->fc[ stats_slot( fc ) ];
+    uint16_t olen = conn->olen;
+    stats_add( &st->requests, 1 );
+    stats_add( &st->bytes_in, flen );
+    stats_record( &st->lat[ STATS_RECEIVE ], tstart - conn->trecv );
+
+    mbtcp_trace( worker, conn, TRACE_RX, conn->ibuf + off, flen, conn->trecv );
+    int rc = mbtcp_query( worker, conn, conn->ibuf + off, flen );
+    if( rc < 0 ){ return -1; }
+    off += flen;
+
+    uint64_t tend = stats_now();
+    if( conn->olen > olen ){ mbtcp_trace( worker, conn, TRACE_TX, conn->obuf + olen, conn->olen - olen, tend ); }
+    stats_record( &st->lat[ STATS_QUERY ], tend - tstart );
+    if( !olen && conn->olen ){ conn->tqueued = tend; }
+    tstart = tend;
+    if( rc > 0 ){ break; }
+  }
+  if( flen < 0 ){
+    log_ver( "Invalid MBAP header from %s:%d on socket %d", conn->addr, conn->port, conn->fd );
+    return -1;
+  }
+
+  if( off ){
+    memmove( conn->ibuf, conn->ibuf + off, conn->ilen - off );
+    conn->ilen -= off;
+  }
+  return 0;
+}
+
+/**
+ * @brief      Moves the gateway replies waiting into the send buffer, as many as fit. Delays and truncations
+ *             matched at submission apply here, as to the replies built in place
+ */
+void mbtcp_conn_ready( struct mbtcp_worker_t *worker, struct mbtcp_conn_t *conn ){
+  while( conn->ready && conn->olen + conn->ready->rlen <= sizeof( conn->obuf ) ){
+    struct gw_req_t *req = conn->ready;
+    enum fault_action_type action = req->fault.action;
+    uint64_t *injected = &worker->stats->fc[ stats_slot( req->query[ MBAP_HEADER_LEN ] ) ].injected;
+    int rlen = req->rlen;
+
+    // A connection holds a single delayed reply at a time: the next one waits for its timer
+    if( action == FAULT_DELAY && conn->timer.armed ){ break; }
+
+    if( !conn->olen ){ conn->tqueued = stats_now(); }
+    if( action == FAULT_TRUNCATE ){ rlen = 1 + req->fault.cut % ( rlen - 1 ); }
+    memcpy( conn->obuf + conn->olen, req->rsp, rlen );
+    mbtcp_trace( worker, conn, TRACE_TX, req->rsp, rlen, stats_now() );
+    if( action == FAULT_DELAY ){
+      log_ver( "[%s:%d] Injected delay %u ms on a gateway reply", conn->addr, conn->port, req->fault.delay );
+      conn->hold = conn->olen;
+      fault_wheel_add( &worker->wheel, &conn->timer, stats_now(), req->fault.delay );
+    }
+    else if( action == FAULT_TRUNCATE ){ log_ver( "[%s:%d] Injected truncate on a gateway reply", conn->addr, conn->port ); }
+    if( action != FAULT_NONE ){ stats_add( injected, 1 ); }
+    conn->olen += rlen;
+    conn->ready = req->next;
+    free( req );
+
+    // A truncated reply ends the batch, as a delayed one holds the replies after it
+    if( action == FAULT_TRUNCATE ){ break; }
+  }
+}
+
+int mbtcp_conn_serve( struct mbtcp_worker_t *worker, struct mbtcp_conn_t *conn ){
+  while( 1 ){
+    // Nothing else is done until the master reads the replies already queued, its requests wait in the kernel
+    if( conn->ready ){ mbtcp_conn_ready( worker, conn ); }
+    if( conn->olen ){
+      if( mbtcp_conn_flush( worker, conn ) < 0 ){ return -1; }
+      if( conn->olen ){ return 0; }
+      if( conn->ready ){ continue; }
+    }
+
+    // Requests already buffered first: every reply they produce goes out with a single send
+    if( mbtcp_conn_parse( worker, conn ) < 0 ){ return -1; }
+    if( conn->olen ){ continue; }
+
+    // Too many queries at the gateway: the next ones are read once their replies come back
+    if( conn->pending >= GW_PENDING_MAX ){ return 0; }
+
+    // Reading until EAGAIN, edge triggered epoll won't notify again for data already queued
+    size_t want = sizeof( conn->ibuf ) - conn->ilen;
+    ssize_t rd  = recv( conn->fd, conn->ibuf + conn->ilen, want, 0 );
+    if( rd == 0 ){ return -1; }
+    if( rd < 0 ){
+      if( errno == EINTR ){ continue; }
+      if( errno == EAGAIN || errno == EWOULDBLOCK ){ return 0; }
+      if( errno != ECONNRESET ){
+        log_ver( "Failed receive from %s:%d closed on socket %d - for: %s", conn->addr, conn->port, conn->fd, strerror( errno ) );
+      }
+      return -1;
+    }
+    conn->ilen += rd;
+    conn->trecv = stats_now();
+
+    // A short read drained the socket: data arriving later raises a new edge, the EAGAIN recv can be skipped
+    if( (size_t)rd < want ){
+      if( mbtcp_conn_parse( worker, conn ) < 0 ){ return -1; }
+      if( !conn->olen ){ return 0; }
+    }
+  }
+}
+
+/**
+ * @brief      Sends the replies of the send buffer through the ring, a single send in flight per connection
+ *
+ * @return     0 on success, -1 to close the connection
+ */
+int mbtcp_uring_flush( struct mbtcp_worker_t *worker, struct mbtcp_conn_t *conn ){
+  // A delayed reply and the ones queued after it wait for its timer
+  uint16_t end = conn->timer.armed ? conn->hold : conn->olen;
+
+  if( conn->osent < end ){
+    struct io_uring_sqe *sqe = uring_sqe( worker->ring );
+    if( !sqe ){
+      log_err( "Worker %d ring full, closing socket %d", worker->id, conn->fd );
+      return -1;
+    }
+    sqe->opcode    = IORING_OP_SEND;
+    sqe->fd        = conn->fd;
+    sqe->addr      = (uintptr_t)( conn->obuf + conn->osent );
+    sqe->len       = end - conn->osent;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uintptr_t)conn | URING_OP_SEND;
+    conn->uring   |= URING_IO_SEND;
+  }
+  else if( end ){ mbtcp_conn_sent( worker, conn, end ); }
+  return 0;
+}
+
+/**
+ * @brief      Moves the held receive buffers into ibuf as long as it has room, giving the emptied ones back
+ */
+void mbtcp_uring_fill( struct mbtcp_worker_t *worker, struct mbtcp_conn_t *conn ){
+  while( conn->held && conn->ilen < sizeof( conn->ibuf ) ){
+    uint16_t bid = conn->held_head;
+    uint16_t n   = worker->buf_len[ bid ] - worker->buf_off[ bid ];
+
+    if( n > sizeof( conn->ibuf ) - conn->ilen ){ n = sizeof( conn->ibuf ) - conn->ilen; }
+    memcpy( conn->ibuf + conn->ilen, uring_buf( worker->ring, bid ) + worker->buf_off[ bid ], n );
+    conn->ilen += n;
+    worker->buf_off[ bid ] += n;
+    if( worker->buf_off[ bid ] < worker->buf_len[ bid ] ){ return; }
+
+    conn->held_head = worker->buf_next[ bid ];
+    if( conn->held_head == URING_NO_BUF ){ conn->held_tail = URING_NO_BUF; }
+    conn->held--;
+    uring_buf_put( worker->ring, bid );
+    worker->bufs_back++;
+  }
+}
+
+int mbtcp_uring_serve( struct mbtcp_worker_t *worker, struct mbtcp_conn_t *conn ){
+  while( 1 ){
+    // Nothing else is done until the master reads the replies already queued, its requests wait in the held buffers
+    if( conn->ready ){ mbtcp_conn_ready( worker, conn ); }
+    if( conn->olen ){
+      if( conn->uring & URING_IO_SEND ){ break; }
+      if( mbtcp_uring_flush( worker, conn ) < 0 ){ return -1; }
+      if( conn->olen ){ break; }
+      if( conn->ready ){ continue; }
+    }
+
+    // Requests already buffered first: every reply they produce goes out with a single send
+    if( mbtcp_conn_parse( worker, conn ) < 0 ){ return -1; }
+    if( conn->olen ){ continue; }
+
+    // Too many queries at the gateway: the next ones are parsed once their replies come back
+    if( conn->pending >= GW_PENDING_MAX || !conn->held ){ break; }
+    mbtcp_uring_fill( worker, conn );
+  }
+
+  // A master sending faster than it reads its replies stops being received, until most held buffers are given back
+  if( conn->held >= URING_HELD_MAX ){
+    if( ( conn->uring & ( URING_IO_RECV | URING_IO_CANCEL ) ) == URING_IO_RECV ){
+      mbtcp_uring_cancel( worker, (uintptr_t)conn | URING_OP_RECV );
+      conn->uring |= URING_IO_CANCEL;
+    }
+  }
+  else if( !( conn->uring & ( URING_IO_RECV | URING_IO_STARVED ) ) && conn->held <= URING_HELD_MAX / 2 && !srv_handoff ){
+    mbtcp_uring_recv( worker, conn );
+  }
+  return 0;
+}
+
+/**
+ * @brief      Frees a closed connection once neither the gateway nor the ring has requests of it
+ */
+static inline void mbtcp_conn_orphan_free( struct mbtcp_worker_t *worker, struct mbtcp_conn_t *conn ){
+  if( conn->fd != -1 || conn->pending || conn->uring ){ return; }
+  mbtcp_conn_unlink( &worker->orphans, conn );
+  free( conn );
+}
+
+/**
+ * @brief      Queues the gateway replies to their connections, freeing the ones closed meanwhile
+ */
+void mbtcp_gw_done( struct mbtcp_worker_t *worker, struct mbtcp_conn_t **conns ){
+  eventfd_t val;
+  struct gw_req_t *req, *next;
+  struct mbtcp_conn_t *wake = NULL;
+
+  // The eventfd first: replies completed after the read raise it again
+  eventfd_read( gw_fd( worker->id ), &val );
+  for( req = gw_done( worker->id ); req; req = next ){
+    struct mbtcp_conn_t *conn = req->owner;
+    next = req->next;
+    conn->pending--;
+
+    if( conn->fd == -1 ){
+      free( req );
+      mbtcp_conn_orphan_free( worker, conn );
+      continue;
+    }
+
+    // A connection with replies already waiting is waiting for the master to read, EPOLLOUT resumes it
+    req->next = NULL;
+    if( conn->ready ){ conn->ready_tail->next = req; }
+    else{
+      conn->ready = req;
+      conn->wake  = wake;
+      wake        = conn;
+    }
+    conn->ready_tail = req;
+  }
+
+  // The connections woken go on, the requests they held back included
+  while( wake ){
+    struct mbtcp_conn_t *conn = wake;
+    wake = conn->wake;
+    if( ( worker->ring ? mbtcp_uring_serve( worker, conn ) : mbtcp_conn_serve( worker, conn ) ) < 0 ){
+      mbtcp_conn_close( worker, conns, conn );
+    }
+  }
+}
+
+/**
+ * @brief      Hands the listening socket and the idle connections of a worker to the process taking over. A busy
+ *             connection goes once its gateway queries, delayed replies and ring requests are over
+ *
+ * @return     1 once the worker has nothing left, 0 otherwise
+ */
+int mbtcp_handoff( struct mbtcp_worker_t *worker, int epfd, struct mbtcp_conn_t **conns ){
+  struct upgrade_msg_t umsg;
+  struct mbtcp_conn_t *conn, *next;
+
+  // Connections queued meanwhile wait in the backlog for the new process, this one accepts no more
+  if( worker->srv_socket != -1 ){
+    if( worker->ring ){ mbtcp_uring_cancel( worker, URING_OP_ACCEPT ); }
+    else{ epoll_ctl( epfd, EPOLL_CTL_DEL, worker->srv_socket, NULL ); }
+    memset( &umsg, 0, offsetof( struct upgrade_msg_t, data ) );
+    umsg.type = UPGRADE_LISTENER;
+    if( upgrade_send( mb_upgrade_peer, &umsg, worker->srv_socket ) != 0 ){
+      log_err( "TCP worker %d: failed handing the listening socket: %s", worker->id, strerror( errno ) );
+    }
+    close( worker->srv_socket );
+    worker->srv_socket = -1;
+  }
+
+  for( conn = *conns; conn; conn = next ){
+    next = conn->next;
+
+    // Nothing more is received here: what the ring already brought is served first
+    if( worker->ring && ( conn->uring & ( URING_IO_RECV | URING_IO_CANCEL ) ) == URING_IO_RECV ){
+      mbtcp_uring_cancel( worker, (uintptr_t)conn | URING_OP_RECV );
+      conn->uring |= URING_IO_CANCEL;
+    }
+    if( conn->pending || conn->ready || conn->timer.armed || conn->held || conn->uring ){ continue; }
+
+    // A partial query and the replies not sent yet go along: the master sees no gap in the stream
+    umsg.type = UPGRADE_CONN;
+    umsg.port = conn->port;
+    umsg.ilen = conn->ilen;
+    umsg.olen = conn->olen - conn->osent;
+    memcpy( umsg.addr, conn->addr, sizeof( umsg.addr ) );
+    memcpy( umsg.data, conn->ibuf, umsg.ilen );
+    memcpy( umsg.data + umsg.ilen, conn->obuf + conn->osent, umsg.olen );
+
+    // An epoll registration outlives the close while the socket is still open elsewhere
+    if( !worker->ring ){ epoll_ctl( epfd, EPOLL_CTL_DEL, conn->fd, NULL ); }
+    if( upgrade_send( mb_upgrade_peer, &umsg, conn->fd ) != 0 ){
+      log_err( "TCP worker %d: failed handing %s:%d, closed: %s", worker->id, conn->addr, conn->port, strerror( errno ) );
+    }
+    else{ __atomic_fetch_add( &srv_handed_conns, 1, __ATOMIC_RELAXED ); }
+    mbtcp_conn_close( worker, conns, conn );
+  }
+
+  return !*conns && !worker->orphans;
+}
+
+/**
+ * @brief      Serves the connections taken over from the previous process, with the bytes they brought along
+ */
+void mbtcp_adopt( struct mbtcp_worker_t *worker, int epfd, struct mbtcp_conn_t **conns ){
+  int n = 0;
+
+  // The ring serves the queries brought along right away: the layout is read
+  conf_online( worker->conf );
+  while( worker->adopted ){
+    struct mbtcp_conn_t *conn = worker->adopted;
+    worker->adopted = conn->next;
+    conn->next      = NULL;
+
+    // Edge triggered: a socket already readable or writable when added raises its first event
+    if( !worker->ring ){
+      struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = conn };
+      if( epoll_ctl( epfd, EPOLL_CTL_ADD, conn->fd, &ev ) == -1 ){
+        log_err( "Failed adding socket %d to epoll: %s", conn->fd, strerror( errno ) );
+        close( conn->fd );
+        free( conn );
+        continue;
+      }
+    }
+    mbtcp_conn_add( worker, conns, conn );
+    if( worker->ring && mbtcp_uring_serve( worker, conn ) < 0 ){ mbtcp_conn_close( worker, conns, conn ); }
+    n++;
+  }
+  if( n ){ log_inf( "TCP worker %d: %d connections taken over", worker->id, n ); }
+}
+
+void mbtcp_runner( struct mbtcp_worker_t *worker ){
+  pthread_setcanceltype( PTHREAD_CANCEL_ASYNCHRONOUS, NULL );
+
+  struct tcp_args_t *args = worker->args;
+  int epfd = -1;                                  // Event loop descriptor
+  struct epoll_event ev, events[ EPOLL_MAX_EVENTS ];
+  struct mbtcp_conn_t *conns = NULL;              // Active connections list
+  int gw_ready = 0;                               // Gateway replies to queue
+
+  // libmodbus contexts are not thread safe: every worker builds its fallback replies with its own
+  modbus_t *ctx_tcp = NULL;
+
+  fault_seed( &worker->rng, stats_now() + worker->id );
+  fault_wheel_init( &worker->wheel, stats_now() );
+
+  while( !srv_terminate && !srv_handoff ){
     // Setting up context
     ctx_tcp = modbus_new_tcp_pi( args->addr, args->port );
+    worker->ctx_tcp = ctx_tcp;
+    if( ctx_tcp ){ modbus_set_socket( ctx_tcp, worker->pair[1] ); }
     if( !ctx_tcp ){
       log_err( "Failed setting up modbus tcp_pi context. Retry in %d seconds", RESTART_CONTEXT_TO );
       sleep( RESTART_CONTEXT_TO );
       continue;
     }
-    // Starting Server
-    srv_socket = modbus_tcp_pi_listen( ctx_tcp, NB_CONNECTION );
-    if( srv_socket == -1 ){
-      log_err( "Failed socket listening err( %d ): %s", errno, modbus_strerror(errno) );
-      modbus_close( ctx_tcp );
+    // Starting Server, on the socket taken over from the previous process if any
+    if( worker->srv_socket == -1 ){ worker->srv_socket = mbtcp_listen( args->addr, args->port ); }
+    if( worker->srv_socket == -1 ){
+      log_err( "Failed socket listening err( %d ): %s", errno, strerror(errno) );
       modbus_free( ctx_tcp );
       sleep( RESTART_CONTEXT_TO );
       continue;
     }
-    log_inf( "TCP server runner thread started: %s:%s", args->addr, args->port );
 
-    FD_ZERO( &refset );
-    FD_SET( srv_socket, &refset );
-    fdmax = srv_socket;
+    // Edge triggered listening socket: it is non-blocking, accept() must never block once the backlog is empty
+    epfd = epoll_create1( EPOLL_CLOEXEC );
+    ev.events   = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if( epfd == -1 || epoll_ctl( epfd, EPOLL_CTL_ADD, worker->srv_socket, &ev ) == -1 ){
+      log_err( "Failed setting up epoll on socket %d: %s", worker->srv_socket, strerror( errno ) );
+      if( epfd != -1 ){ close( epfd ); }
+      close( worker->srv_socket );
+      worker->srv_socket = -1;
+      modbus_free( ctx_tcp );
+      sleep( RESTART_CONTEXT_TO );
+      continue;
+    }
 
-    // Socket infos
-    char s_addr[INET6_ADDRSTRLEN] = { 0 };
-    struct sockaddr_in cli_addr   = { 0 };
-    socklen_t cli_addrlen         = 0;
+    // Gateway replies raise the worker own queue, told apart by the worker as event data
+    ev.events   = EPOLLIN | EPOLLET;
+    ev.data.ptr = worker;
+    if( args->gateway && epoll_ctl( epfd, EPOLL_CTL_ADD, gw_fd( worker->id ), &ev ) == -1 ){
+      log_err( "Failed setting up epoll on the gateway queue: %s", strerror( errno ) );
+    }
+    log_inf( "TCP server worker %d started: %s:%s (max %d connections)", worker->id, args->addr, args->port, args->max_conn );
+    mbtcp_adopt( worker, epfd, &conns );
 
     while( !srv_terminate ){
-      rdset = refset;
-
-      if( select( fdmax+1, &rdset, NULL, NULL, NULL ) == -1 ){
-        log_err( "Server select() failure" );
+      // Delayed replies bound the sleep to their tick. No layout is held while waiting: a reload never waits for the sleep
+      conf_offline( worker->conf );
+      int nev = epoll_wait( epfd, events, EPOLL_MAX_EVENTS, fault_wheel_wait( &worker->wheel, stats_now(), EPOLL_WAIT_MSEC ) );
+      conf_online( worker->conf );
+      if( nev == -1 ){
+        if( errno != EINTR ){ log_err( "Server epoll_wait() failure: %s", strerror( errno ) ); }
         continue;
       }
 
-      // Run through the existing connections looking for data to be read
-      for( master_socket = 0; master_socket <= fdmax; master_socket++ ){
-        if( !FD_ISSET( master_socket, &rdset ) ){ continue; }
+      // Only the ready descriptors are visited
+      for( int i = 0; i < nev; i++ ){
+        struct mbtcp_conn_t *conn = events[i].data.ptr;
 
         // Client asking a new connection
-        if( master_socket == srv_socket ){
-          int newfd = accept( srv_socket, (struct sockaddr *)&cli_addr, &cli_addrlen );
-          if( newfd == -1 ){
-            log_ver( "Server accept() error: %s", strerror( errno ) );
-          }
-          else{
-            FD_SET( newfd, &refset );
-            // Keep track of the maximum
-            if( newfd > fdmax ){ fdmax = newfd; }
-            log_ver( "New connection on socket %d", newfd );
-          }
+        if( !conn ){
+          mbtcp_accept( worker, epfd, &conns );
+          continue;
+        }
 
+        // Replies back from the gateway, queued once every event is handled: they may close connections of this round
+        if( (void *)conn == (void *)worker ){
+          gw_ready = 1;
           continue;
         }
 
-        // Receiving request on existent connection
-        modbus_set_socket( ctx_tcp, master_socket );
-        int rc = modbus_receive( ctx_tcp, query );
+        // Receiving requests and sending back replies on existent connection
+        if( mbtcp_conn_serve( worker, conn ) < 0 ){ mbtcp_conn_close( worker, &conns, conn ); }
+      }
 
-        if( getpeername( master_socket, (struct sockaddr *)&cli_addr, &cli_addrlen ) == 0 ){
-          inet_ntop( cli_addr.sin_family,  &(cli_addr.sin_addr), s_addr, INET6_ADDRSTRLEN );
-        }
+      if( gw_ready ){
+        gw_ready = 0;
+        mbtcp_gw_done( worker, &conns );
+      }
+
+      // Connections whose delayed reply is due go on: the reply is sent, then the queries waiting behind it
+      struct fault_timer_t *timer = fault_wheel_expire( &worker->wheel, stats_now() ), *next;
+      for( ; timer; timer = next ){
+        struct mbtcp_conn_t *conn = (struct mbtcp_conn_t *)( (char *)timer - offsetof( struct mbtcp_conn_t, timer ) );
+        next = timer->next;
+        if( mbtcp_conn_serve( worker, conn ) < 0 ){ mbtcp_conn_close( worker, &conns, conn ); }
+      }
 
-        // Connection error or terminated
-        if( rc < 0 ){
-          if( errno != ECONNRESET ){
-            log_ver( "Failed receive from %s:%d closed on socket %d - for: %s", s_addr, cli_addr.sin_port, master_socket, modbus_strerror( errno ) );
-          }
+      // Once a new process connected, everything goes to it as soon as it is idle
+      if( srv_handoff && mbtcp_handoff( worker, epfd, &conns ) ){
+        __atomic_fetch_add( &srv_handed, 1, __ATOMIC_RELEASE );
+        break;
+      }
+    }
 
-          // Close socket e remove from reference set
-          close( master_socket );
-          FD_CLR( master_socket, &refset );
-          if( master_socket == fdmax ){ fdmax--; }
+    // Server Terminated
+    conf_offline( worker->conf );
+    log_inf( "srv worker %d terminated: %lu requests served", worker->id, worker->tot_req );
+    while( conns ){ mbtcp_conn_close( worker, &conns, conns ); }
+    while( worker->orphans ){
+      struct mbtcp_conn_t *conn = worker->orphans;
+      worker->orphans = conn->next;
+      free( conn );
+    }
+    close( epfd );
+    epfd = -1;
+    if( worker->srv_socket != -1 ){ close( worker->srv_socket ); }
+    worker->srv_socket = -1;
 
-          continue;
+    // Cleaning up, restarting only after a failure
+    modbus_free( ctx_tcp );
+    ctx_tcp    = NULL;
+    worker->ctx_tcp = NULL;
+    if( !srv_terminate && !srv_handoff ){ sleep( RESTART_CONTEXT_TO ); }
+  }
+
+  pthread_exit( NULL );
+}
+
+// ========================================
+// Modbus TCP server, io_uring backend
+// ========================================
+
+static inline void mbtcp_uring_arm( struct mbtcp_worker_t *worker, int op ){
+  struct io_uring_sqe *sqe = uring_sqe( worker->ring );
+  if( !sqe ){
+    log_err( "Worker %d ring full, %s not armed", worker->id, op == URING_OP_ACCEPT ? "accept" : "gateway poll" );
+    return;
+  }
+
+  if( op == URING_OP_ACCEPT ){
+    sqe->opcode       = IORING_OP_ACCEPT;
+    sqe->fd           = worker->srv_socket;
+    sqe->ioprio       = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  }
+  else{
+    sqe->opcode        = IORING_OP_POLL_ADD;
+    sqe->fd            = gw_fd( worker->id );
+    sqe->poll32_events = POLLIN;
+    sqe->len           = IORING_POLL_ADD_MULTI;
+  }
+  sqe->user_data = op;
+}
+
+/**
+ * @brief      Handles a completion of the worker ring
+ */
+void mbtcp_uring_complete( struct mbtcp_worker_t *worker, struct mbtcp_conn_t **conns, uint64_t user_data, int res,
+                           uint32_t flags, int *gw_ready ){
+  struct mbtcp_conn_t *conn = (struct mbtcp_conn_t *)(uintptr_t)( user_data & ~(uint64_t)URING_OP_MASK );
+  struct sockaddr_storage cli_addr;
+  socklen_t cli_addrlen = sizeof( cli_addr );
+
+  switch( user_data & URING_OP_MASK ){
+    case URING_OP_ACCEPT:
+      // A multishot request ends on errors, and on the listening socket shutdown when stopping
+      // and on its handoff to a new process
+      if( !( flags & IORING_CQE_F_MORE ) && !srv_terminate && worker->srv_socket != -1 ){ mbtcp_uring_arm( worker, URING_OP_ACCEPT ); }
+      if( res < 0 ){
+        if( res != -ECONNABORTED && !srv_terminate && worker->srv_socket != -1 ){ log_ver( "Server accept() error: %s", strerror( -res ) ); }
+        return;
+      }
+
+      // The address buffer of a multishot accept is shared by all its completions, the peer is asked instead
+      if( getpeername( res, (struct sockaddr *)&cli_addr, &cli_addrlen ) != 0 ){ cli_addr.ss_family = AF_UNSPEC; }
+      if( !( conn = mbtcp_conn_new( res, &cli_addr, worker->args->max_conn ) ) ){ return; }
+      mbtcp_conn_add( worker, conns, conn );
+      mbtcp_uring_recv( worker, conn );
+      return;
+
+    case URING_OP_POLL:
+      // Queued once every completion is handled: they may close connections of this round
+      *gw_ready = 1;
+      if( !( flags & IORING_CQE_F_MORE ) ){ mbtcp_uring_arm( worker, URING_OP_POLL ); }
+      return;
+
+    case URING_OP_RECV:
+      if( !( flags & IORING_CQE_F_MORE ) ){ conn->uring &= ~( URING_IO_RECV | URING_IO_CANCEL ); }
+
+      // Buffers are queued in arrival order, ibuf takes them once it has room
+      if( res > 0 && ( flags & IORING_CQE_F_BUFFER ) ){
+        uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        if( conn->fd == -1 ){
+          uring_buf_put( worker->ring, bid );
+          worker->bufs_back++;
+        }
+        else{
+          worker->buf_len[ bid ]  = res;
+          worker->buf_off[ bid ]  = 0;
+          worker->buf_next[ bid ] = URING_NO_BUF;
+          if( conn->held_tail != URING_NO_BUF ){ worker->buf_next[ conn->held_tail ] = bid; }
+          else{ conn->held_head = bid; }
+          conn->held_tail = bid;
+          conn->held++;
+          conn->trecv = stats_now();
         }
+      }
+      if( conn->fd == -1 ){
+        mbtcp_conn_orphan_free( worker, conn );
+        return;
+      }
 
-        tot_req++;
-        int err = mb_query(query, rc, MDB_PROTO_TCP, mb_mapping);
-        if (!err && args->error_rate > 0.0) {
-          err = ((rand() % 101) <= args->error_rate) ? -1 : 0;
+      if( res == -ENOBUFS ){
+        conn->uring  |= URING_IO_STARVED;
+        conn->starved = worker->starved;
+        worker->starved = conn;
+      }
+      else if( res == 0 || ( res < 0 && res != -ECANCELED ) ){
+        if( res < 0 && res != -ECONNRESET ){
+          log_ver( "Failed receive from %s:%d closed on socket %d - for: %s", conn->addr, conn->port, conn->fd, strerror( -res ) );
         }
+        mbtcp_conn_close( worker, conns, conn );
+        return;
+      }
+      if( mbtcp_uring_serve( worker, conn ) < 0 ){ mbtcp_conn_close( worker, conns, conn ); }
+      return;
+
+    case URING_OP_SEND:
+      conn->uring &= ~URING_IO_SEND;
+      if( conn->fd == -1 ){
+        mbtcp_conn_orphan_free( worker, conn );
+        return;
+      }
+      if( res < 0 ){
+        log_ver( "Failed send to %s:%d on socket %d - for: %s", conn->addr, conn->port, conn->fd, strerror( -res ) );
+        mbtcp_conn_close( worker, conns, conn );
+        return;
+      }
 
-        // Sending response
-        if (!err) { err = modbus_reply( ctx_tcp, query, rc, mb_mapping ); }
+      // A partial send goes on from where it stopped
+      conn->osent += res;
+      if( mbtcp_uring_serve( worker, conn ) < 0 ){ mbtcp_conn_close( worker, conns, conn ); }
+      return;
 
-        if (err > 0) { log_dbg( "[%s:%d] Reply sent successfully", s_addr, cli_addr.sin_port ); }
-        else{
-          log_war( "[%s:%d] Query failed. Modbus exception %d (%s) %lu", s_addr, cli_addr.sin_port, err, modbus_strerror(err), tot_req );
-          modbus_reply_exception( ctx_tcp, query, err );
+    default:
+      return;
+  }
+}
+
+void mbtcp_uring_runner( struct mbtcp_worker_t *worker ){
+  pthread_setcanceltype( PTHREAD_CANCEL_ASYNCHRONOUS, NULL );
+
+  struct tcp_args_t *args = worker->args;
+  struct uring_t ring;
+  struct io_uring_cqe *cqe;
+  struct mbtcp_conn_t *conns = NULL;              // Active connections list
+  int gw_ready = 0;                               // Gateway replies to queue
+
+  // libmodbus contexts are not thread safe: every worker builds its fallback replies with its own
+  modbus_t *ctx_tcp = NULL;
+
+  fault_seed( &worker->rng, stats_now() + worker->id );
+  fault_wheel_init( &worker->wheel, stats_now() );
+
+  // Receive buffers bookkeeping: next held buffer, length and offset, per buffer id
+  worker->buf_next = calloc( 3 * URING_BUFS, sizeof( uint16_t ) );
+  if( !worker->buf_next ){
+    log_err( "Failed to allocate the receive buffers of tcp worker %d", worker->id );
+    pthread_exit( NULL );
+  }
+  worker->buf_len = worker->buf_next + URING_BUFS;
+  worker->buf_off = worker->buf_len  + URING_BUFS;
+
+  while( !srv_terminate && !srv_handoff ){
+    // The ring belongs to the thread submitting to it. Without io_uring the worker runs the epoll loop, never returning
+    if( uring_init( &ring, URING_ENTRIES ) != 0 || uring_bufs_init( &ring, URING_BGID, URING_BUFS, URING_BUF_SIZE ) != 0 ){
+      log_war( "TCP worker %d: io_uring unavailable (%s), falling back to epoll", worker->id, strerror( errno ) );
+      uring_exit( &ring );
+      free( worker->buf_next );
+      worker->buf_next = NULL;
+      mbtcp_runner( worker );
+    }
+    worker->ring      = &ring;
+    worker->starved   = NULL;
+    worker->bufs_back = 0;
+
+    // Setting up context, listening on the socket taken over from the previous process if any
+    ctx_tcp = modbus_new_tcp_pi( args->addr, args->port );
+    worker->ctx_tcp = ctx_tcp;
+    if( ctx_tcp ){ modbus_set_socket( ctx_tcp, worker->pair[1] ); }
+    if( ctx_tcp && worker->srv_socket == -1 ){ worker->srv_socket = mbtcp_listen( args->addr, args->port ); }
+    if( !ctx_tcp || worker->srv_socket == -1 ){
+      if( !ctx_tcp ){ log_err( "Failed setting up modbus tcp_pi context. Retry in %d seconds", RESTART_CONTEXT_TO ); }
+      else{
+        log_err( "Failed socket listening err( %d ): %s", errno, strerror(errno) );
+        modbus_free( ctx_tcp );
+      }
+      worker->ring = NULL;
+      uring_exit( &ring );
+      sleep( RESTART_CONTEXT_TO );
+      continue;
+    }
+
+    // Multishot requests: every new connection, and every gateway wake up, completes without a new submission
+    mbtcp_uring_arm( worker, URING_OP_ACCEPT );
+    if( args->gateway ){ mbtcp_uring_arm( worker, URING_OP_POLL ); }
+    log_inf( "TCP server worker %d started with io_uring: %s:%s (max %d connections)", worker->id, args->addr, args->port, args->max_conn );
+    mbtcp_adopt( worker, -1, &conns );
+
+    while( !srv_terminate ){
+      // Everything queued by the previous round is submitted by the same system call waiting for completions.
+      // Delayed replies bound the sleep to their tick, no layout is held meanwhile
+      conf_offline( worker->conf );
+      int rc = uring_wait( &ring, fault_wheel_wait( &worker->wheel, stats_now(), EPOLL_WAIT_MSEC ) );
+      conf_online( worker->conf );
+      if( rc != 0 ){
+        log_err( "Server io_uring_enter() failure: %s", strerror( errno ) );
+        continue;
+      }
+
+      while( ( cqe = uring_cqe( &ring ) ) ){
+        uint64_t user_data = cqe->user_data;
+        int      res       = cqe->res;
+        uint32_t flags     = cqe->flags;
+
+        uring_cqe_seen( &ring );
+        mbtcp_uring_complete( worker, &conns, user_data, res, flags, &gw_ready );
+      }
+
+      if( gw_ready ){
+        gw_ready = 0;
+        mbtcp_gw_done( worker, &conns );
+      }
+
+      // Connections that ran out of receive buffers are received again once some came back
+      if( worker->starved && worker->bufs_back ){
+        struct mbtcp_conn_t *conn = worker->starved, *next;
+        worker->starved = NULL;
+        for( ; conn; conn = next ){
+          next = conn->starved;
+          conn->starved = NULL;
+          conn->uring  &= ~URING_IO_STARVED;
+          if( conn->fd == -1 ){ mbtcp_conn_orphan_free( worker, conn ); }
+          else if( mbtcp_uring_serve( worker, conn ) < 0 ){ mbtcp_conn_close( worker, &conns, conn ); }
         }
       }
+      worker->bufs_back = 0;
+
+      // Connections whose delayed reply is due go on: the reply is sent, then the queries waiting behind it
+      struct fault_timer_t *timer = fault_wheel_expire( &worker->wheel, stats_now() ), *next;
+      for( ; timer; timer = next ){
+        struct mbtcp_conn_t *conn = (struct mbtcp_conn_t *)( (char *)timer - offsetof( struct mbtcp_conn_t, timer ) );
+        next = timer->next;
+        if( mbtcp_uring_serve( worker, conn ) < 0 ){ mbtcp_conn_close( worker, &conns, conn ); }
+      }
+
+      // Once a new process connected, everything goes to it as soon as it is idle
+      if( srv_handoff && mbtcp_handoff( worker, -1, &conns ) ){
+        __atomic_fetch_add( &srv_handed, 1, __ATOMIC_RELEASE );
+        break;
+      }
     }
 
-    // Server Terminated
-    log_inf( "srv terminated: %s", modbus_strerror(errno) );
-    if( srv_socket != -1 ){ close( srv_socket ); }
+    // Server Terminated: the ring exit cancels whatever is still in flight
+    conf_offline( worker->conf );
+    log_inf( "srv worker %d terminated: %lu requests served", worker->id, worker->tot_req );
+    while( conns ){ mbtcp_conn_close( worker, &conns, conns ); }
+    worker->ring = NULL;
+    uring_exit( &ring );
+    while( worker->orphans ){
+      struct mbtcp_conn_t *conn = worker->orphans;
+      worker->orphans = conn->next;
+      free( conn );
+    }
+    if( worker->srv_socket != -1 ){ close( worker->srv_socket ); }
+    worker->srv_socket = -1;
 
-    // Cleaning up
-    modbus_close( ctx_tcp );
+    // Cleaning up, restarting only after a failure
     modbus_free( ctx_tcp );
     ctx_tcp    = NULL;
-    sleep( RESTART_CONTEXT_TO );
+    worker->ctx_tcp = NULL;
+    if( !srv_terminate && !srv_handoff ){ sleep( RESTART_CONTEXT_TO ); }
   }
 
-  // Cleaning up
-  modbus_mapping_free( mb_mapping );
-  mb_mapping = NULL;
-
+  free( worker->buf_next );
+  worker->buf_next = NULL;
   pthread_exit( NULL );
 }
 
 // ========================================
 // Modbus RTU slave
 // ========================================
+
+/**
+ * @brief      Fills the RTU lines from a list of "<tty>[@<speed>]", comma separated
+ *
+ * @return     0 on success, -1 if invalid
+ */
+int mbrtu_parse( struct rtu_args_t *args ){
+  char *copy = strdup( args->dev ), *save = NULL, *tok;
+  if( !copy ){ return -1; }
+
+  for( tok = strtok_r( copy, ",", &save ); tok; tok = strtok_r( NULL, ",", &save ) ){
+    if( rtu_nports == RTU_PORTS_MAX ){
+      log_err( "Too many RTU lines: %d at most", RTU_PORTS_MAX );
+      free( copy );
+      return -1;
+    }
+
+    struct mbrtu_port_t *port = &rtu_ports[ rtu_nports ];
+    char *at = strchr( tok, '@' );
+
+    port->speed = args->speed;
+    if( at ){
+      *at = 0;
+      port->speed = atoi( at + 1 );
+    }
+    if( !*tok || strlen( tok ) >= sizeof( port->dev ) || tty_baud( port->speed ) == B0 ){
+      free( copy );
+      return -1;
+    }
+
+    strcpy( port->dev, tok );
+    port->fd  = -1;
+    port->pty = -1;
+    tty_times( port->speed, &port->times );
+    rtu_nports++;
+  }
+
+  free( copy );
+  return rtu_nports ? 0 : -1;
+}
+
+void mbrtu_close( struct mbrtu_port_t *port, uint64_t now ){
+  if( port->fd  != -1 ){ close( port->fd ); }
+  if( port->pty != -1 ){ close( port->pty ); }
+  port->fd    = -1;
+  port->pty   = -1;
+  port->ilen  = 0;
+  port->olen  = 0;
+  port->osent = 0;
+  port->retry = now + RESTART_CONTEXT_TO * 1000000000ULL;
+}
+
+/**
+ * @brief      Opens a line, to be retried later on failure
+ *
+ * @return     0 on success, -1 on failure
+ */
+int mbrtu_open( struct mbrtu_port_t *port, uint64_t now ){
+  char pts[ TTY_PTS_LEN ];
+
+  port->fd = tty_open( port->dev, port->speed, &port->pty, pts );
+  if( port->fd == -1 ){
+    log_err( "Unable to open RTU line %s: %s. Retrying in %d seconds", port->dev, strerror( errno ), RESTART_CONTEXT_TO );
+    mbrtu_close( port, now );
+    return -1;
+  }
+
+  if( port->pty != -1 ){ log_inf( "RTU line %s: %s, %d baud", port->dev, pts, port->speed ); }
+  else{ log_inf( "RTU line %s: %d baud, frames end after %lu usec of silence", port->dev, port->speed, port->times.t35 / 1000 ); }
+  return 0;
+}
+
+static inline int mbrtu_crc_ok( const uint8_t *buf, int len ){
+  return len >= 4 && crc16( buf, len - 2 ) == ( buf[ len - 2 ] | ( buf[ len - 1 ] << 8 ) );
+}
+
+/**
+ * @brief      Builds with libmodbus the reply to a query not handled natively: it is written to the loop pipe
+ *             and read back, so that it waits for the turnaround as the others
+ *
+ * @return     The reply length, 0 if none
+ */
+int mbrtu_fallback( struct mbrtu_loop_t *loop, const uint8_t *query, int qlen, uint8_t *rsp ){
+  int err = mb_query( query, qlen, MDB_PROTO_RTU, mb_fallback );
+
+  if( err == 0 ){ modbus_reply( loop->ctx, query, qlen, mb_fallback ); }
+  else{
+    log_war( "Query failed. Modbus exception %d (%s)", err, modbus_strerror(err) );
+    modbus_reply_exception( loop->ctx, query, err );
+  }
+
+  ssize_t n = read( loop->pipe[0], rsp, MODBUS_RTU_MAX_ADU_LENGTH );
+  return n > 0 ? n : 0;
+}
+
+/**
+ * @brief      Records a frame of a line in the loop trace, if recording
+ */
+static inline void mbrtu_trace( struct mbrtu_loop_t *loop, struct mbrtu_port_t *port, uint8_t kind, const uint8_t *adu, int len, uint64_t t ){
+  if( loop->trace ){ trace_put( loop->trace, t, TRACE_CONN_RTU | ( port - rtu_ports ), kind | TRACE_F_RTU, adu[0], adu, len ); }
+}
+
+/**
+ * @brief      Executes a broadcast query: writes reach every unit served, nothing is ever answered
+ */
+void mbrtu_broadcast( struct mbrtu_loop_t *loop, struct mbrtu_port_t *port, int len, const struct conf_t *conf ){
+  const uint8_t *query = port->ibuf;
+  uint8_t rsp[ MODBUS_RTU_MAX_ADU_LENGTH ];
+
+  switch( query[ RTU_HEADER_LEN ] ){
+    case MODBUS_FC_WRITE_SINGLE_COIL:
+    case MODBUS_FC_WRITE_SINGLE_REGISTER:
+    case MODBUS_FC_WRITE_MULTIPLE_COILS:
+    case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+    case MODBUS_FC_MASK_WRITE_REGISTER:
+      break;
+    default:
+      log_dbg( "Skipping broadcast of function code %d", query[ RTU_HEADER_LEN ] );
+      return;
+  }
+  mbrtu_trace( loop, port, TRACE_RX, query, len, port->tfirst );
+
+  struct stats_fc_t *st = &rtu_stats->fc[ stats_slot( query[ RTU_HEADER_LEN ] ) ];
+  stats_add( &st->requests, 1 );
+  stats_add( &st->bytes_in, len );
+  loop->tot_req++;
+
+  // Replies are built as for any query, then dropped: exceptions included, a broadcast gets none
+  for( int uid = 0; uid < REGS_UNITS; uid++ ){
+    int unit = conf_unit( conf, uid );
+    if( unit < 0 ){ continue; }
+    adu_reply( query, len, MDB_PROTO_RTU, mb_store, unit, conf->nb[ unit ], rsp );
+    if( !conf->routed ){ break; }
+  }
+}
+
+/**
+ * @brief      Serves a query: its reply is queued, to be written once the turnaround is over
+ */
+void mbrtu_query( struct mbrtu_loop_t *loop, struct mbrtu_port_t *port, int len ){
+  const uint8_t *query = port->ibuf;
+  uint64_t tstart, tend;
+  const struct conf_t *conf = conf_get();
+  struct fault_t fault;
+  int rlen;
+
+  // Address 0 is a broadcast, whatever units are served
+  if( query[0] == MODBUS_BROADCAST_ADDRESS ){
+    mbrtu_broadcast( loop, port, len, conf );
+    return;
+  }
+
+  // Skipping query for some other slave: routed units answer on their own address
+  int unit = conf->routed ? conf_unit( conf, query[0] ) : ( query[0] == loop->args->addr ? 0 : -1 );
+  if( unit < 0 ){
+    log_dbg( "Skipping query for different slave: %d", query[0] );
+    return;
+  }
+  mbrtu_trace( loop, port, TRACE_RX, query, len, port->tfirst );
+
+  // A query while a reply still waits means the master gave up on that one
+  if( port->osent < port->olen ){
+    log_ver( "RTU line %s: reply dropped, a new query came first", port->dev );
+    port->olen  = 0;
+    port->osent = 0;
+  }
+
+  // Receive lasts from the first byte to the end of the frame
+  struct stats_fc_t *st = &rtu_stats->fc[ stats_slot( query[ RTU_HEADER_LEN ] ) ];
+  tstart = stats_now();
+  stats_add( &st->requests, 1 );
+  stats_add( &st->bytes_in, len );
+  stats_record( &st->lat[ STATS_RECEIVE ], tstart - port->tfirst );
+
+  loop->tot_req++;
+  fault_check( conf->faults, &loop->rng, query[0], query + RTU_HEADER_LEN, len - RTU_HEADER_LEN - 2, &fault );
+  if( fault.action == FAULT_DROP || fault.action == FAULT_RESET ){
+    stats_add( &st->injected, 1 );
+    log_ver( "Injected drop %lu", loop->tot_req );
+    return;
+  }
+
+  // Reply built natively when possible
+  if( fault.action == FAULT_EXCEPTION ){ rlen = adu_exception( query, MDB_PROTO_RTU, fault.exception, port->obuf ); }
+  else if( !( rlen = adu_reply( query, len, MDB_PROTO_RTU, mb_store, unit, conf->nb[ unit ], port->obuf ) ) ){
+    rlen = mbrtu_fallback( loop, query, len, port->obuf );
+  }
+  tend = stats_now();
+  stats_record( &st->lat[ STATS_QUERY ], tend - tstart );
+  if( rlen <= 0 ){ return; }
+
+  if( fault.action != FAULT_NONE ){
+    stats_add( &st->injected, 1 );
+    log_ver( "Injected fault %d %lu", fault.action, loop->tot_req );
+  }
+  if( fault.action == FAULT_TRUNCATE ){ rlen = 1 + fault.cut % ( rlen - 1 ); }
+  mbrtu_trace( loop, port, TRACE_TX, port->obuf, rlen, tend );
+
+  // The reply starts once the line has been silent for 3.5 characters after the query, or later if delayed
+  port->due = port->tlast + port->times.t35;
+  if( fault.action == FAULT_DELAY && port->tlast + fault.delay * 1000000ULL > port->due ){ port->due = port->tlast + fault.delay * 1000000ULL; }
+  port->olen    = rlen;
+  port->osent   = 0;
+  port->tqueued = tend;
+  port->st      = st;
+}
+
+/**
+ * @brief      Takes the first bytes received as a frame: served if its CRC checks, dropped otherwise
+ */
+void mbrtu_frame( struct mbrtu_loop_t *loop, struct mbrtu_port_t *port, int len ){
+  if( mbrtu_crc_ok( port->ibuf, len ) ){ mbrtu_query( loop, port, len ); }
+  else{ log_ver( "RTU line %s: dropping corrupted frame of %d bytes", port->dev, len ); }
+
+  port->ilen -= len;
+  memmove( port->ibuf, port->ibuf + len, port->ilen );
+  port->tfirst  = port->tlast;
+  port->checked = 0;
+}
+
+/**
+ * @brief      Ends the frame being received after a silence: t1.5 ends it if its CRC already checks, t3.5 always
+ */
+void mbrtu_silence( struct mbrtu_loop_t *loop, struct mbrtu_port_t *port, uint64_t silence ){
+  if( !port->ilen ){ return; }
+
+  if( silence >= port->times.t35 ){ mbrtu_frame( loop, port, port->ilen ); }
+  else if( silence >= port->times.t15 && !port->checked ){
+    if( mbrtu_crc_ok( port->ibuf, port->ilen ) ){ mbrtu_frame( loop, port, port->ilen ); }
+    else{ port->checked = 1; }
+  }
+}
+
+/**
+ * @brief      Reads every byte available on a line
+ *
+ * @return     0 on success, -1 on line errors
+ */
+int mbrtu_read( struct mbrtu_loop_t *loop, struct mbrtu_port_t *port, uint64_t now ){
+  uint8_t buf[ MODBUS_RTU_MAX_ADU_LENGTH ];
+
+  while( 1 ){
+    ssize_t n = read( port->fd, buf, sizeof( buf ) );
+    if( n < 0 && errno == EINTR ){ continue; }
+    if( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ){ return 0; }
+    if( n <= 0 ){ return -1; }
+
+    // The bytes read began about their own transmission time ago: the silence before them is what is left
+    uint64_t start = now - n * port->times.tchar;
+    if( start < port->tlast ){ start = port->tlast; }
+    mbrtu_silence( loop, port, start - port->tlast );
+
+    if( port->ilen + n > sizeof( port->ibuf ) ){
+      log_ver( "RTU line %s: dropping %d bytes with no silence", port->dev, port->ilen );
+      port->ilen = 0;
+    }
+    if( !port->ilen ){ port->tfirst = start; }
+    memcpy( port->ibuf + port->ilen, buf, n );
+    port->ilen   += n;
+    port->tlast   = now;
+    port->checked = 0;
+
+    // Queries of known length end with their last byte, with no silence to wait for
+    int len;
+    while( port->ilen && ( len = rtu_query_len( port->ibuf, port->ilen ) ) > 0 && len <= port->ilen &&
+           mbrtu_crc_ok( port->ibuf, len ) ){
+      mbrtu_frame( loop, port, len );
+    }
+  }
+}
+
+/**
+ * @brief      Writes the reply of a line once its turnaround is over
+ *
+ * @return     0 on success, -1 on line errors
+ */
+int mbrtu_send( struct mbrtu_port_t *port, uint64_t now ){
+  if( port->osent == port->olen || now < port->due ){ return 0; }
+
+  ssize_t n = write( port->fd, port->obuf + port->osent, port->olen - port->osent );
+  if( n < 0 ){ return ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ) ? 0 : -1; }
+  port->osent += n;
+  if( port->osent < port->olen ){ return 0; }
+
+  stats_add( &port->st->bytes_out, port->olen );
+  if( port->obuf[ RTU_HEADER_LEN ] & 0x80 ){ stats_add( &port->st->exceptions, 1 ); }
+  stats_record( &port->st->lat[ STATS_REPLY ], now - port->tqueued );
+  log_dbg( "Reply sent" );
+
+  port->olen  = 0;
+  port->osent = 0;
+  return 0;
+}
+
 void mbrtu_runner( struct rtu_args_t *args ){
   pthread_setcanceltype( PTHREAD_CANCEL_ASYNCHRONOUS, NULL );
 
-  // Modbus mapping, contains all regs values e structures
-  modbus_mapping_t *mb_mapping = modbus_mapping_new( MB_BITS_MAX, MB_BITS_IN_MAX, MB_REGS_MAX, MB_REGS_IN_MAX );
-  if( !mb_mapping ){
-    log_err( "Failed to allocate mapping with err( %d ): %s", errno, modbus_strerror(errno) );
+  struct mbrtu_loop_t loop = { .args = args, .pipe = { -1, -1 }, .conf = rtu_conf };
+  struct pollfd pfds[ RTU_PORTS_MAX ];
+
+  // Turnarounds are timed to the usec: the default 50 usec timer slack would add to each of them
+  prctl( PR_SET_TIMERSLACK, 1UL );
+  fault_seed( &loop.rng, stats_now() );
+  if( mb_trace && !( loop.trace = trace_ring( mb_trace ) ) ){ log_war( "ADU trace: no ring left, RTU lines not recorded" ); }
+
+  loop.ctx = modbus_new_rtu( "/dev/null", DEF_RTU_SPEED, 'N', 8, 1 );
+  if( !loop.ctx || pipe2( loop.pipe, O_NONBLOCK | O_CLOEXEC ) != 0 ){
+    log_err( "Failed setting up the RTU runner: %s", strerror( errno ) );
+    if( loop.ctx ){ modbus_free( loop.ctx ); }
     pthread_exit( NULL );
   }
+  modbus_set_slave( loop.ctx, args->addr );
+  modbus_set_socket( loop.ctx, loop.pipe[1] );
 
-  // Query variables
-  uint8_t query[ MODBUS_RTU_MAX_ADU_LENGTH ];
-  uint64_t tot_req = 0;
+  log_inf( "RTU slave runner thread started: %d lines, address %d", rtu_nports, args->addr );
 
   while( !srv_terminate ){
-    // Setting up modbus rtu
-    ctx_rtu = modbus_new_rtu( args->dev, args->speed, 'N', 8, 1 );
-    if( !ctx_rtu ){
-      log_err( "Failed setting up modbus rtu context. Restarting in %d seconds", RESTART_CONTEXT_TO );
-      ctx_rtu = NULL;
-      sleep( RESTART_CONTEXT_TO );
-      continue;
-    }
-    if( modbus_set_slave( ctx_rtu, args->addr ) != 0 ){
-      log_war( "Invalid rtu address: %d", args->addr );
-      modbus_close( ctx_rtu );
-      modbus_free( ctx_rtu );
-      sleep( RESTART_CONTEXT_TO );
-      continue;
-    }
-    if( modbus_connect( ctx_rtu ) == -1) {
-      log_err( "Unable to connect RTU context: %s", modbus_strerror(errno) );
-      modbus_close( ctx_rtu );
-      modbus_free( ctx_rtu );
-      sleep( RESTART_CONTEXT_TO );
-      continue;
-    }
+    uint64_t now = stats_now(), wait = EPOLL_WAIT_MSEC * 1000000ULL;
 
-    log_inf( "RTU slave runner thread started: %s %d", args->dev, args->addr );
-
-    while( !srv_terminate ){
-      int rc = 0;
-      do{ rc = modbus_receive( ctx_rtu, query ); } while( rc == 0 );
+    // Sleeping up to the first silence to check or reply to write
+    for( int i = 0; i < rtu_nports; i++ ){
+      struct mbrtu_port_t *port = &rtu_ports[i];
+      uint64_t next = now + wait;
 
-      modbus_flush( ctx_rtu );
+      if( port->fd == -1 && now >= port->retry ){ mbrtu_open( port, now ); }
+      if( port->fd == -1 && port->retry < next ){ next = port->retry; }
 
-      // Connection error or terminated
-      if( rc == -1 ){
-        int mb_error = errno;
-        log_ver( "modbus_receive error(%d): %s", mb_error, modbus_strerror( mb_error ) );
-        continue;
+      pfds[i].fd      = port->fd;
+      pfds[i].events  = POLLIN;
+      pfds[i].revents = 0;
+      if( port->ilen && port->tlast + ( port->checked ? port->times.t35 : port->times.t15 ) < next ){
+        next = port->tlast + ( port->checked ? port->times.t35 : port->times.t15 );
+      }
+      if( port->osent < port->olen ){
+        if( port->due > now ){ next = port->due < next ? port->due : next; }
+        else{ pfds[i].events |= POLLOUT; }
       }
+      wait = next > now ? next - now : 0;
+    }
+
+    struct timespec to = { wait / 1000000000ULL, wait % 1000000000ULL };
+    conf_offline( loop.conf );
+    int rc = ppoll( pfds, rtu_nports, &to, NULL );
+    conf_online( loop.conf );
+    if( rc < 0 && errno != EINTR ){
+      log_err( "RTU poll failed: %s", strerror( errno ) );
+      break;
+    }
 
-      // Skipping query for some other slave
-      if( query[0] != args->addr ){
-        log_dbg( "Skipping query for different slave: %d", query[0] );
+    now = stats_now();
+    for( int i = 0; i < rtu_nports; i++ ){
+      struct mbrtu_port_t *port = &rtu_ports[i];
+      if( port->fd == -1 ){ continue; }
+
+      if( pfds[i].revents & ( POLLERR | POLLHUP | POLLNVAL ) ){
+        log_err( "RTU line %s hung up. Retrying in %d seconds", port->dev, RESTART_CONTEXT_TO );
+        mbrtu_close( port, now );
         continue;
       }
-
-      tot_req++;
-      int err = mb_query(query, rc, MDB_PROTO_RTU, mb_mapping);
-      if (!err && args->error_rate > 0.0) {
-        err = ((rand()%101) <= args->error_rate) ? -1 : 0;
+      if( ( pfds[i].revents & POLLIN ) && mbrtu_read( &loop, port, now ) != 0 ){
+        log_err( "RTU line %s failed: %s. Retrying in %d seconds", port->dev, strerror( errno ), RESTART_CONTEXT_TO );
+        mbrtu_close( port, now );
+        continue;
       }
 
-      // Sending response
-      if( err == 0 ){
-        modbus_reply( ctx_rtu, query, rc, mb_mapping );
-        log_dbg( "Reply sent" );
-      }
-      else{
-        log_war( "Query failed. Modbus exception %d (%s)", err, modbus_strerror(err) );
-        modbus_reply_exception( ctx_rtu, query, err );
+      mbrtu_silence( &loop, port, now - port->tlast );
+      if( mbrtu_send( port, now ) != 0 ){
+        log_err( "RTU line %s failed: %s. Retrying in %d seconds", port->dev, strerror( errno ), RESTART_CONTEXT_TO );
+        mbrtu_close( port, now );
       }
     }
+  }
 
-    // Server Terminated
-    log_inf( "srv terminated" );
+  // Server Terminated
+  conf_offline( loop.conf );
+  log_inf( "srv terminated" );
 
-    // Cleaning up
-    modbus_close( ctx_rtu );
-    modbus_free( ctx_rtu );
-    ctx_rtu = NULL;
-    sleep( RESTART_CONTEXT_TO );
-  }
+  for( int i = 0; i < rtu_nports; i++ ){ mbrtu_close( &rtu_ports[i], 0 ); }
+  modbus_free( loop.ctx );
+  close( loop.pipe[0] );
+  close( loop.pipe[1] );
 
-  // Cleaning up
-  modbus_mapping_free( mb_mapping );
-  mb_mapping = NULL;
+  pthread_exit( NULL );
+}
+
+
+// ========================================
+// Registers checkpoint
+// ========================================
+void mbckpt_runner( struct regs_ckpt_t *ckpt ){
+  // Only pages written since the previous round reach the disk, requests never wait on it
+  while( !srv_terminate ){
+    sleep( CKPT_INTERVAL_SEC );
+
+    int written = regs_ckpt_run( mb_store, ckpt );
+    if( written < 0 ){ log_war( "Registers checkpoint failed: %s", strerror( errno ) ); }
+    else if( written > 0 ){ log_dbg( "Registers checkpoint: %d pages written", written ); }
+  }
 
   pthread_exit( NULL );
 }
 
 
+// ========================================
+// Upgrade handover
+// ========================================
+
+/**
+ * @brief      Takes over from the server listening on the upgrade socket: its registers memory file, listening
+ *             sockets and connections are received until it exits, having released everything else it held
+ *
+ * @param[in]  sock      Connection to the upgrade socket
+ * @param[out] takeover  What was received
+ */
+void mbsrv_takeover( int sock, struct mbsrv_takeover_t *takeover ){
+  struct upgrade_msg_t umsg;
+  struct sockaddr_storage none = { .ss_family = AF_UNSPEC };
+  struct mbtcp_conn_t *conn;
+  int *listeners, fd, rc, end = 0;
+
+  while( ( rc = upgrade_recv( sock, &umsg, &fd ) ) > 0 ){
+    switch( umsg.type ){
+      case UPGRADE_STORE:
+        if( takeover->store_fd != -1 ){ close( takeover->store_fd ); }
+        takeover->store_fd = fd;
+        break;
+
+      case UPGRADE_LISTENER:
+        if( fd == -1 ){ break; }
+        listeners = realloc( takeover->listeners, ( takeover->nlisteners + 1 ) * sizeof( int ) );
+        if( !listeners ){
+          close( fd );
+          break;
+        }
+        takeover->listeners = listeners;
+        takeover->listeners[ takeover->nlisteners++ ] = fd;
+        break;
+
+      case UPGRADE_CONN:
+        if( fd == -1 || umsg.ilen > MBTCP_IBUF_SIZE || umsg.olen > MBTCP_OBUF_SIZE ){
+          log_war( "Invalid connection taken over from %s:%d, closed", umsg.addr, umsg.port );
+          if( fd != -1 ){ close( fd ); }
+          break;
+        }
+
+        // Never refused: the connection limit applies to the ones accepted from now on
+        if( !( conn = mbtcp_conn_new( fd, &none, INT_MAX ) ) ){ break; }
+        memcpy( conn->addr, umsg.addr, sizeof( conn->addr ) );
+        conn->addr[ sizeof( conn->addr ) - 1 ] = '\0';
+        conn->port = umsg.port;
+        conn->ilen = umsg.ilen;
+        conn->olen = umsg.olen;
+        memcpy( conn->ibuf, umsg.data, umsg.ilen );
+        memcpy( conn->obuf, umsg.data + umsg.ilen, umsg.olen );
+        conn->trecv   = stats_now();
+        conn->tqueued = conn->trecv;
+        conn->next    = takeover->conns;
+        takeover->conns = conn;
+        takeover->nconns++;
+        break;
+
+      case UPGRADE_END:
+        end = 1;
+        break;
+
+      default:
+        if( fd != -1 ){ close( fd ); }
+        break;
+    }
+  }
+  if( rc < 0 ){ log_err( "Upgrade socket failed: %s", strerror( errno ) ); }
+
+  log_inf( "Taken over%s: %d listening sockets, %d connections, registers %s", end ? "" : " an incomplete handover",
+           takeover->nlisteners, takeover->nconns, takeover->store_fd != -1 ? "included" : "not included" );
+}
+
+/**
+ * @brief      Keeps the listening sockets taken over that the TCP workers can use, and gives them the connections
+ *             taken over, before they start
+ */
+void mbtcp_takeover( struct tcp_args_t *args, struct mbsrv_takeover_t *takeover ){
+  struct sockaddr_storage sa;
+  socklen_t salen;
+  char addr[ INET6_ADDRSTRLEN ];
+  uint16_t port;
+  int n = 0;
+
+  // A socket on another port is not the one asked for anymore
+  for( int l = 0; l < takeover->nlisteners; l++ ){
+    salen = sizeof( sa );
+    if( getsockname( takeover->listeners[l], (struct sockaddr *)&sa, &salen ) != 0 ){ port = 0; }
+    else{ sockaddr_str( &sa, addr, &port ); }
+    if( port != atoi( args->port ) ){
+      log_war( "Listening socket taken over is on port %d, not %s: closed", port, args->port );
+      close( takeover->listeners[l] );
+      continue;
+    }
+    takeover->listeners[ n++ ] = takeover->listeners[l];
+  }
+  takeover->nlisteners = n;
+
+  // Fewer workers than before: the spare sockets backlog is taken over, then they are closed
+  for( ; n > args->workers; n-- ){
+    int fd, lsock = takeover->listeners[ n - 1 ];
+    struct mbtcp_conn_t *conn;
+
+    salen = sizeof( sa );
+    while( ( fd = accept4( lsock, (struct sockaddr *)&sa, &salen, SOCK_NONBLOCK | SOCK_CLOEXEC ) ) != -1 ){
+      salen = sizeof( sa );
+      if( !( conn = mbtcp_conn_new( fd, &sa, INT_MAX ) ) ){ continue; }
+      conn->next = takeover->conns;
+      takeover->conns = conn;
+    }
+    close( lsock );
+  }
+  takeover->nlisteners = n;
+
+  for( int w = 0; takeover->conns; w = ( w + 1 ) % args->workers ){
+    struct mbtcp_conn_t *conn = takeover->conns;
+    takeover->conns = conn->next;
+    conn->next = tcp_workers[w].adopted;
+    tcp_workers[w].adopted = conn;
+  }
+}
+
+
 // ========================================
 // Functions to interface with
 // server thread
@@ -361,35 +1934,312 @@ int mbsrv_start( struct tcp_args_t *tcp_args, struct rtu_args_t *rtu_args ){
     return -1;
   }
 
-  // Seeding the randomizer
-  srand((unsigned int) time(NULL));
-
   // Set the termination status to false
   srv_terminate = 0;
+  srv_handoff   = 0;
+  srv_handed    = 0;
+
+  // Registers and query path options are the same for both protocols, taken from the enabled one
+  const struct srv_common_t *common = tcp_args->enabled ? &tcp_args->common : &rtu_args->common;
+
+  // A server already listening on the upgrade socket hands everything over, then exits: nothing else starts before
+  struct mbsrv_takeover_t takeover = { .store_fd = -1 };
+  mb_upgrade_path = common->upgrade;
+  if( tcp_args->enabled ){ mbtcp_raise_nofile( tcp_args->max_conn ); }
+  if( mb_upgrade_path ){
+    int sock = upgrade_connect( mb_upgrade_path );
+    if( sock != -1 ){
+      log_inf( "Taking over from the server on %s", mb_upgrade_path );
+      mbsrv_takeover( sock, &takeover );
+      close( sock );
+    }
+  }
 
-  // Running modbus tcp srv dedicated thread
-  if( !tcp_args->enabled ){ log_inf( "Modbus TCP disabled. Skipping" ); }
+  // One register image for every transport and worker. Without a segment, upgrades hand the registers over in a memory file
+  const char *shm    = common->shm;
+  uint8_t init_value = common->init_value;
+  uint8_t wire_order = common->wire_order;
+  int store_fd = takeover.store_fd;
+  if( shm && store_fd != -1 ){
+    close( store_fd );
+    store_fd = -1;
+  }
+  if( mb_upgrade_path && !shm && store_fd == -1 && ( store_fd = memfd_create( "mbt-regs", MFD_CLOEXEC ) ) == -1 ){
+    log_war( "Registers will not be handed over on upgrades: %s", strerror( errno ) );
+  }
+  if( shm ){ mb_store = regs_new( MB_BITS_MAX, MB_BITS_IN_MAX, MB_REGS_MAX, MB_REGS_IN_MAX, init_value, wire_order, shm ); }
+  else{ mb_store = regs_new_fd( MB_BITS_MAX, MB_BITS_IN_MAX, MB_REGS_MAX, MB_REGS_IN_MAX, init_value, wire_order, store_fd ); }
+  mb_fallback = modbus_mapping_new( 0, 0, 0, 0 );
+  if( !mb_store || !mb_fallback ){
+    log_err( "Failed to allocate registers with err( %d ): %s", errno, strerror(errno) );
+    return -1;
+  }
+
+  if( shm ){ log_inf( "Registers shared in %s: %lu KiB already written", shm, regs_used( mb_store ) / 1024 ); }
+  else if( takeover.store_fd != -1 ){ log_inf( "Registers taken over: %lu KiB already written", regs_used( mb_store ) / 1024 ); }
+
+  // Warm start from the snapshot, then dirty pages are checkpointed in background
+  const char *persist = common->persist;
+  if( persist ){
+    mb_ckpt = regs_ckpt_open( mb_store, persist );
+    if( !mb_ckpt ){
+      log_err( "Failed to open registers snapshot %s: %s", persist, strerror(errno) );
+      return -1;
+    }
+    log_inf( "Registers snapshot %s: %u pages restored", persist, mb_ckpt->restored );
+
+    if( pthread_create( &trd_ckpt, NULL, (void *)&mbckpt_runner, (void *)mb_ckpt ) ){
+      log_err( "FAILED CREATING checkpoint thread" );
+      return -1;
+    }
+    pthread_setname_np( trd_ckpt, "mbckpt" );
+  }
+
+  // Served units, their tables, initial values and fault rules make the layout: from the config file, or from the
+  // command line with the error rate a drop rule ahead of the others. Listed units get registers of their own,
+  // pages are allocated by their first write
+  const char *units  = common->units;
+  const char *faults = common->faults;
+  float error_rate   = common->error_rate;
+  struct conf_t *conf = NULL;
+
+  mb_config = common->config;
+  if( mb_config ){
+    if( units || faults || error_rate > 0.0 ){
+      log_err( "Units and fault rules come from the config file %s: -u, -F and -e can not be given with it", mb_config );
+      return -1;
+    }
+    conf = conf_load( mb_config, mb_store->hdr->nb );
+  }
   else{
-    if( pthread_create( &trd_tcp, NULL, (void *)&mbtcp_runner, (void *)tcp_args ) ){
-      log_err( "FAILED CREATING mbtcp runner thread" );
+    char *spec = NULL;
+    if( error_rate > 0.0 && asprintf( &spec, "drop:rate=%f%s%s", error_rate, faults ? ";" : "", faults ? faults : "" ) < 0 ){
+      log_err( "Failed to allocate the fault rules" );
       return -1;
     }
+    conf = conf_new( units, spec ? spec : faults, mb_store->hdr->nb );
+    free( spec );
+  }
+  if( !conf || conf_apply( conf, NULL, mb_store ) < 0 ){
+    log_err( "Failed to set up the registers layout" );
+    conf_free( conf );
+    return -1;
+  }
+  regs_set_units( mb_store, conf->routed, conf->units );
+  conf_publish( conf );
+  if( mb_config ){ log_inf( "Config %s: %d init lines", mb_config, conf->ninits ); }
+  if( conf->routed ){ log_inf( "Unit ids with own registers: %s", units ? units : "from the config file" ); }
+  if( conf->faults ){ log_inf( "Fault injection: %d rules", conf->faults->n ); }
+
+  // Generated values are running before the first query is served
+  const char *sim = common->sim;
+  if( sim ){
+    mb_sim = sim_parse( sim );
+    if( !mb_sim ){
+      log_err( "Invalid register generators: %s", sim );
+      return -1;
+    }
+    if( sim_start( mb_sim, mb_store ) != 0 ){
+      log_err( "FAILED STARTING register generators" );
+      return -1;
+    }
+    log_inf( "Register generators: %d", mb_sim->n );
+  }
+
+  // Frames are recorded by the serving threads into rings of their own, a thread of the trace writes them
+  const char *capture = common->capture;
+  if( capture ){
+    mb_trace = trace_open( capture );
+    if( !mb_trace ){
+      log_err( "Failed to open ADU trace %s: %s", capture, strerror(errno) );
+      return -1;
+    }
+    log_inf( "Recording ADUs to %s", capture );
+  }
+
+  // Running modbus tcp srv dedicated threads
+  if( !tcp_args->enabled ){
+    log_inf( "Modbus TCP disabled. Skipping" );
+    if( takeover.nlisteners || takeover.conns ){ log_war( "TCP sockets taken over closed: %d connections", takeover.nconns ); }
+    for( int l = 0; l < takeover.nlisteners; l++ ){ close( takeover.listeners[l] ); }
+    while( takeover.conns ){
+      struct mbtcp_conn_t *conn = takeover.conns;
+      takeover.conns = conn->next;
+      close( conn->fd );
+      free( conn );
+    }
+  }
+  else{
+    // Routed units go to their RTU bus, every worker gets its replies back on its own queue
+    if( tcp_args->gateway ){
+      if( gw_start( tcp_args->gateway, tcp_args->gw_speed, tcp_args->workers, tcp_args->gw_timeout_msec, tcp_args->gw_ttl_msec ) != 0 ){
+        return -1;
+      }
+      log_inf( "Gateway routes: %s", tcp_args->gateway );
+    }
+
+    tcp_workers = calloc( tcp_args->workers, sizeof( struct mbtcp_worker_t ) );
+    if( !tcp_workers ){
+      log_err( "Failed to allocate %d tcp workers", tcp_args->workers );
+      return -1;
+    }
+    mbtcp_takeover( tcp_args, &takeover );
+    for( tcp_nworkers = 0; tcp_nworkers < tcp_args->workers; tcp_nworkers++ ){
+      struct mbtcp_worker_t *worker = &tcp_workers[ tcp_nworkers ];
+      worker->id         = tcp_nworkers;
+      worker->srv_socket = tcp_nworkers < takeover.nlisteners ? takeover.listeners[ tcp_nworkers ] : -1;
+      worker->args       = tcp_args;
+      worker->stats      = stats_new( MDB_PROTO_TCP );
+      worker->conf       = conf_reader();
+      worker->pair[0]    = worker->pair[1] = -1;
+      if( mb_trace && !( worker->trace = trace_ring( mb_trace ) ) ){ log_war( "ADU trace: no ring left, tcp worker %d not recorded", tcp_nworkers ); }
+      if( !worker->stats || !worker->conf ){
+        log_err( "Failed to allocate statistics and layout reader of tcp worker %d", tcp_nworkers );
+        return -1;
+      }
+      if( socketpair( AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, worker->pair ) != 0 ){
+        log_err( "Failed to create the libmodbus socket pair of tcp worker %d: %s", tcp_nworkers, strerror( errno ) );
+        return -1;
+      }
+
+      void *runner = tcp_args->backend == MBTCP_BACKEND_URING ? (void *)&mbtcp_uring_runner : (void *)&mbtcp_runner;
+      if( pthread_create( &worker->thread, NULL, runner, (void *)worker ) ){
+        log_err( "FAILED CREATING mbtcp runner thread %d", tcp_nworkers );
+        return -1;
+      }
+
+      char tname[16];
+      snprintf( tname, sizeof( tname ), "mbtcp-%d", tcp_nworkers );
+      pthread_setname_np( worker->thread, tname );
+    }
     pthread_setcanceltype( PTHREAD_CANCEL_ASYNCHRONOUS, NULL );
   }
 
   // Running modbus rtu slave dedicated thread
   if( !rtu_args->enabled ){ log_inf( "Modbus RTU disabled. Skipping" ); }
   else{
+    rtu_stats = stats_new( MDB_PROTO_RTU );
+    rtu_ports = calloc( RTU_PORTS_MAX, sizeof( struct mbrtu_port_t ) );
+    rtu_conf  = conf_reader();
+    if( !rtu_stats || !rtu_ports || !rtu_conf ){
+      log_err( "Failed to allocate the rtu runner" );
+      return -1;
+    }
+    if( mbrtu_parse( rtu_args ) != 0 ){
+      log_err( "Invalid RTU lines: %s", rtu_args->dev );
+      return -1;
+    }
     if( pthread_create( &trd_rtu, NULL, (void *)&mbrtu_runner, (void *)rtu_args ) ){
       log_err( "FAILED CREATING mbrtu runner thread" );
       return -1;
     }
+    pthread_setname_np( trd_rtu, "mbrtu" );
   }
+  free( takeover.listeners );
 
+  // The next process takes over from this one
+  if( mb_upgrade_path ){
+    mb_upgrade_fd = upgrade_listen( mb_upgrade_path );
+    if( mb_upgrade_fd == -1 ){
+      log_err( "Failed listening on the upgrade socket %s: %s", mb_upgrade_path, strerror( errno ) );
+      return -1;
+    }
+    log_inf( "Upgrade socket %s", mb_upgrade_path );
+  }
+
+  return 0;
+}
+
+
+int mbsrv_reload(){
+  if( !mb_config ){
+    log_war( "No config file to reload" );
+    return -1;
+  }
+
+  // The layout in use stays on any error: a bad edit never takes the server down
+  struct conf_t *conf = conf_load( mb_config, mb_store->hdr->nb );
+  if( !conf ){
+    log_err( "Config %s not reloaded, the current layout stays", mb_config );
+    return -1;
+  }
+  int written = conf_apply( conf, conf_get(), mb_store );
+  if( written < 0 ){
+    log_err( "Config %s not reloaded: failed writing its initial values", mb_config );
+    conf_free( conf );
+    return -1;
+  }
+
+  // Queries in flight end with the old layout, the next ones get the new one: nobody waits but this thread.
+  // The store lists the new units first: it never lags behind the layout being served
+  int ninits = conf->ninits, nfaults = conf->faults ? conf->faults->n : 0;
+  regs_set_units( mb_store, conf->routed, conf->units );
+  uint64_t grace = conf_publish( conf );
+  log_inf( "Config %s reloaded: %d of %d init lines written, %d fault rules, old layout released after %.1f usec",
+           mb_config, written, ninits, nfaults, grace / 1e3 );
   return 0;
 }
 
 
+int mbsrv_upgrade_fd(){
+  return mb_upgrade_fd;
+}
+
+
+int mbsrv_handoff(){
+  struct upgrade_msg_t umsg;
+  struct timespec ts = { 0, 1000000L };
+
+  mb_upgrade_peer = upgrade_accept( mb_upgrade_fd );
+  if( mb_upgrade_peer == -1 ){
+    if( errno != EAGAIN && errno != EWOULDBLOCK ){ log_err( "Upgrade socket accept() failed: %s", strerror( errno ) ); }
+    return -1;
+  }
+  log_inf( "New server connected on %s, handing over", mb_upgrade_path );
+
+  // The registers first: the new process maps them once this one is gone. Until then nothing is lost
+  memset( &umsg, 0, offsetof( struct upgrade_msg_t, data ) );
+  umsg.type = UPGRADE_STORE;
+  if( upgrade_send( mb_upgrade_peer, &umsg, mb_store->shm_fd ) != 0 ){
+    log_err( "Handover failed, serving on: %s", strerror( errno ) );
+    close( mb_upgrade_peer );
+    mb_upgrade_peer = -1;
+    return -1;
+  }
+
+  // Workers hand their sockets, then each connection once idle. Busy ones are given some time
+  __atomic_store_n( &srv_handoff, 1, __ATOMIC_RELEASE );
+  uint64_t deadline = stats_now() + UPGRADE_DRAIN_SEC * 1000000000ULL;
+  while( __atomic_load_n( &srv_handed, __ATOMIC_ACQUIRE ) < tcp_nworkers && stats_now() < deadline ){ nanosleep( &ts, NULL ); }
+  if( srv_handed < tcp_nworkers ){
+    log_war( "Handover: %d tcp workers still busy after %d seconds, their connections are closed", tcp_nworkers - srv_handed, UPGRADE_DRAIN_SEC );
+  }
+
+  umsg.type = UPGRADE_END;
+  if( upgrade_send( mb_upgrade_peer, &umsg, -1 ) != 0 ){ log_err( "Handover end not sent: %s", strerror( errno ) ); }
+  log_inf( "Handed over %lu connections, the new server starts once this one stopped", srv_handed_conns );
+  return 0;
+}
+
+
+void mbsrv_tcp_counters( struct mbtcp_counters_t *counters ){
+  counters->accepted = __atomic_load_n( &tcp_counters.accepted, __ATOMIC_RELAXED );
+  counters->closed   = __atomic_load_n( &tcp_counters.closed,   __ATOMIC_RELAXED );
+  counters->rejected = __atomic_load_n( &tcp_counters.rejected, __ATOMIC_RELAXED );
+  counters->active   = __atomic_load_n( &tcp_counters.active,   __ATOMIC_RELAXED );
+}
+
+
+void mbsrv_stats( enum mdb_proto_type proto, struct stats_t *stats ){
+  stats_merge( proto, stats );
+}
+
+
+size_t mbsrv_regs_used(){
+  return mb_store ? regs_used( mb_store ) : 0;
+}
+
+
 int mbsrv_stop(){
   // Asks srv runner thread to terminate;
   srv_terminate = 1;
@@ -397,10 +2247,12 @@ int mbsrv_stop(){
   int ret;
   struct timespec killtime;
 
-  // Wait for tcp thread to self terminate
-  if( !trd_tcp ){ log_inf( "Thread mbsrv seems not started" ); }
+  // Wait for tcp threads to self terminate
+  if( !tcp_nworkers ){ log_inf( "Thread mbsrv seems not started" ); }
   else{
-    if( srv_socket != -1 ){ shutdown( srv_socket, SHUT_RDWR ); }
+    for( int i = 0; i < tcp_nworkers; i++ ){
+      if( tcp_workers[i].srv_socket != -1 ){ shutdown( tcp_workers[i].srv_socket, SHUT_RDWR ); }
+    }
 
     if( clock_gettime( CLOCK_REALTIME, &killtime ) != -1 ){ killtime.tv_sec += MBSRV_THREAD_TO; }
     else{
@@ -409,17 +2261,32 @@ int mbsrv_stop(){
       killtime.tv_sec  = 0;
     }
 
-    ret = pthread_timedjoin_np( trd_tcp, NULL, &killtime );
-    if( ret != 0 ){
-      log_war( "Failed to wait for tcp runner thread. Killing it" );
-      pthread_cancel( trd_tcp );
+    for( int i = 0; i < tcp_nworkers; i++ ){
+      ret = pthread_timedjoin_np( tcp_workers[i].thread, NULL, &killtime );
+      if( ret != 0 ){
+        log_war( "Failed to wait for tcp runner thread %d. Killing it", i );
+        pthread_cancel( tcp_workers[i].thread );
+      }
+    }
+    log_inf( "TCP connections: %lu accepted, %lu closed, %lu rejected",
+             tcp_counters.accepted, tcp_counters.closed, tcp_counters.rejected );
+
+    // No worker submits anymore: the gateway goes with the queries still on its buses
+    gw_stop();
+
+    for( int i = 0; i < tcp_nworkers; i++ ){
+      stats_free( tcp_workers[i].stats );
+      if( tcp_workers[i].pair[0] != -1 ){ close( tcp_workers[i].pair[0] ); }
+      if( tcp_workers[i].pair[1] != -1 ){ close( tcp_workers[i].pair[1] ); }
     }
+    free( tcp_workers );
+    tcp_workers  = NULL;
+    tcp_nworkers = 0;
   }
 
   // Wait for rtu thread to self terminate
   if( !trd_rtu ){ log_inf( "Thread mbsrv seems not started" ); }
   else{
-    if( ctx_rtu ){ modbus_close( ctx_rtu ); }
     if( clock_gettime( CLOCK_REALTIME, &killtime ) != -1 ){ killtime.tv_sec += MBSRV_THREAD_TO; }
     else{
       log_ver( "RTU Failed getting CLOCK_REALTIME" );
@@ -432,66 +2299,61 @@ int mbsrv_stop(){
       log_war( "Failed to wait for rtu runner thread. Killing it" );
       pthread_cancel( trd_rtu );
     }
+    trd_rtu = 0;
+    stats_free( rtu_stats );
+    rtu_stats = NULL;
+    rtu_conf  = NULL;
+  }
+  if( rtu_ports ){
+    free( rtu_ports );
+    rtu_ports  = NULL;
+    rtu_nports = 0;
   }
 
-  return 0;
-}
-
-// ~~~~~~~~~~~~~~~~~~~~~ LOG FUNCTIONS
-int msg_colors = 0;         ///< Global variable to set colored msg output
-int msg_dbgl   = DBG_INF;   ///< Sets debug level, higher means more informations
-
-void set_debug( int lvl ){
-  msg_dbgl = lvl;
-}
-void set_msg_colors( int on ){
-  msg_colors = on == 1 ? 1 : 0;
-}
-
-int is_msg_colors(){
-  return msg_colors;
-}
-int get_debug(){
-  return msg_dbgl;
-}
-
-void msg( int lvl, const char* pfx, const char *logstr , ... ){
-   if( msg_dbgl < lvl ){ return; }
-
-  char    buff[20];
-  struct  tm* tm_info;
-  time_t  timer;
-  int     multiline_pad_len = 16;
-
-  // Printing timestamp
-  time( &timer );
-  tm_info = localtime( &timer );
-  if( strftime( buff, sizeof buff, "%Y%m%d %H%M%S", tm_info ) ){
-    printf( "%s%s%s ", ( msg_colors ? COL_BRIGHT_BLACK : "" ), buff, ( msg_colors ? COL_RESET : "" ) );
+  // Every recording thread has ended: the trace gets their last records
+  if( mb_trace ){
+    trace_close( mb_trace );
+    mb_trace = NULL;
   }
 
-  // Printing dbg level
-  switch( lvl ){
-    case DBG_ERR: printf( "%sERR%s ", ( msg_colors ? COL_BRIGHT_RED    : "" ), ( msg_colors ? COL_RESET : "" ) ); break;
-    case DBG_WAR: printf( "%sWAR%s ", ( msg_colors ? COL_BRIGHT_YELLOW : "" ), ( msg_colors ? COL_RESET : "" ) ); break;
-    case DBG_INF: printf( "%sINF%s ", ( msg_colors ? COL_BRIGHT_CYAN   : "" ), ( msg_colors ? COL_RESET : "" ) ); break;
-    case DBG_VER: printf( "%sVER%s ", ( msg_colors ? COL_BRIGHT_PURPLE : "" ), ( msg_colors ? COL_RESET : "" ) ); break;
-    case DBG_DBG: printf( "%sDBG%s ", ( msg_colors ? COL_BRIGHT_GREEN  : "" ), ( msg_colors ? COL_RESET : "" ) ); break;
-    default:      printf( "%sUNK%s ", ( msg_colors ? COL_BRIGHT_BLACK  : "" ), ( msg_colors ? COL_RESET : "" ) ); break;
+  // Generators are writers too
+  if( mb_sim ){
+    sim_free( mb_sim );
+    mb_sim = NULL;
   }
 
-  // Printing pfx
-  if( pfx ){
-    printf( "[%s%s%s] ", ( msg_colors ? COL_BRIGHT_BLACK : "" ), pfx, ( msg_colors ? COL_RESET : "" ) );
-    multiline_pad_len += strlen( pfx ) + 3 ;
+  // Last checkpoint once nobody writes anymore
+  if( trd_ckpt ){
+    pthread_join( trd_ckpt, NULL );
+    trd_ckpt = 0;
+  }
+  if( mb_ckpt ){
+    if( regs_ckpt_run( mb_store, mb_ckpt ) < 0 ){ log_war( "Registers checkpoint failed: %s", strerror( errno ) ); }
+    regs_ckpt_close( mb_ckpt );
+    mb_ckpt = NULL;
   }
 
-  // Printing message
-  va_list arglist;
-  va_start( arglist, logstr );
-  vprintf( logstr, arglist );
-  va_end( arglist );
+  regs_free( mb_store );
+  mb_store = NULL;
+  conf_end();
+  mb_config = NULL;
+  if( mb_fallback ){ modbus_mapping_free( mb_fallback ); }
+  mb_fallback = NULL;
+
+  // Last: the process taking over waits for this close, everything else is released
+  if( mb_upgrade_fd != -1 ){
+    close( mb_upgrade_fd );
+    unlink( mb_upgrade_path );
+    mb_upgrade_fd = -1;
+  }
+  if( mb_upgrade_peer != -1 ){
+    close( mb_upgrade_peer );
+    mb_upgrade_peer = -1;
+  }
+  mb_upgrade_path  = NULL;
+  srv_handoff      = 0;
+  srv_handed       = 0;
+  srv_handed_conns = 0;
 
-  // Forcing newline
-  printf( "\n" );
+  return 0;
 }
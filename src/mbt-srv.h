@@ -9,8 +9,12 @@
 
 #include <modbus/modbus.h>
 
+#include "mbt-log.h"
+#include "mbt-stats.h"
+
 // ~~~~~~~~~~~~~~~~~~~~~~~~~~ DEFINITIONS
-#define NB_CONNECTION           15                 ///< Max num of simultaneous connections
+#define DEF_MAX_CONN            4096               ///< Default max num of simultaneous TCP connections
+#define DEF_WORKERS             1                  ///< Default num of TCP event loop threads
 
 #define MB_BITS_MAX             0xFFFF
 #define MB_BITS_IN_MAX          0xFFFF
@@ -29,58 +33,78 @@
 #define DEF_ERR_RATE            0.0                ///< Default modbus error rate
 #define DEF_INIT_VAL            0                  ///< Default init value for the modbus registries
 
-// Term colors
-#define COL_RESET               "\e[0m"
-#define COL_BRIGHT_RED          "\e[0;91m"
-#define COL_BRIGHT_CYAN         "\e[0;96m"
-#define COL_BRIGHT_GREEN        "\e[0;92m"
-#define COL_BRIGHT_YELLOW       "\e[0;93m"
-#define COL_BRIGHT_BLACK        "\e[0;90m"
-#define COL_BRIGHT_BLUE         "\e[0;94m"
-#define COL_BRIGHT_PURPLE       "\e[0;95m"
-#define COL_BRIGHT_WHITE        "\e[0;97m"
-
-// Debug levels
-#define DBG_NONE  0
-#define DBG_ERR   1
-#define DBG_WAR   2
-#define DBG_INF   3
-#define DBG_VER   4
-#define DBG_DBG   5
-
-// Debug shortcut
-#define log_dbg(...)  msg( DBG_DBG, __FUNCTION__, __VA_ARGS__ )
-#define log_ver(...)  msg( DBG_VER, __FUNCTION__, __VA_ARGS__ )
-#define log_inf(...)  msg( DBG_INF, __FUNCTION__, __VA_ARGS__ )
-#define log_war(...)  msg( DBG_WAR, __FUNCTION__, __VA_ARGS__ )
-#define log_err(...)  msg( DBG_ERR, __FUNCTION__, __VA_ARGS__ )
-
 // ~~~~~~~~~~~~~~~~~~~~~~~~~~ TYPES
-struct rtu_args_t{
-  uint8_t enabled;
+/**
+ * @brief      Options of the register image and the query path, the same whichever protocol serves them
+ */
+struct srv_common_t{
   float   error_rate;
+  char    *faults;
+  char    *sim;                                    ///< Register generators, NULL if none
+  char    *capture;                                ///< ADU trace file, NULL if not recording
+  char    *config;                                 ///< Layout file, reloaded on SIGHUP. NULL if none
+  char    *upgrade;                                ///< UNIX socket a new process takes over from. NULL if none
   uint8_t init_value;
+  uint8_t wire_order;                              ///< Registers stored big endian
+  char    *units;
+  char    *shm;
+  char    *persist;
+};
+
+struct rtu_args_t{
+  uint8_t enabled;
+  struct srv_common_t common;
   char    *dev;
   int     addr;
   int     speed;
 };
 struct tcp_args_t{
   uint8_t enabled;
-  float   error_rate;
-  uint8_t init_value;
+  struct srv_common_t common;
   char    *addr;
   char    port[6];
+  int     max_conn;
+  int     workers;
+  int     backend;                                 ///< Event loop of the workers, an mbtcp_backend
+  char    *gateway;                                ///< Units routed to RTU buses, NULL if none
+  int     gw_speed;                                ///< Baud rate of the buses without their own
+  int     gw_timeout_msec;                         ///< Wait for a slave reply
+  int     gw_ttl_msec;                             ///< Age of the cached reads still served, 0 for no cache
+};
+struct mbtcp_counters_t{
+  uint64_t accepted;                               ///< Connections accepted since start
+  uint64_t closed;                                 ///< Connections closed since start
+  uint64_t rejected;                               ///< Connections refused because of the max_conn limit
+  uint64_t active;                                 ///< Connections currently open
 };
 
 extern const char *mdb_proto_strings[];
+extern const char *mbtcp_backend_strings[];
 
 enum mdb_proto_type {
   MDB_PROTO_TCP,
   MDB_PROTO_RTU
 };
 
+enum mbtcp_backend {
+  MBTCP_BACKEND_EPOLL,                             ///< Readiness: every worker drains its ready sockets
+  MBTCP_BACKEND_URING                              ///< Completions: io_uring receives into a shared buffers ring
+};
+
 // ~~~~~~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS
 
+/**
+ * @brief      Decodes and checks the header of a query left to libmodbus
+ *
+ * @param[in]  query       The query ADU
+ * @param[in]  qlen        The query length
+ * @param[in]  mproto      The query protocol
+ * @param      mb_mapping  The libmodbus mapping
+ *
+ * @return     0 if the query can be answered, a modbus exception code otherwise
+ */
+int mb_query( const uint8_t *query, const uint16_t qlen, enum mdb_proto_type mproto, modbus_mapping_t *mb_mapping );
+
 /**
  * @brief      Starts the modbus server
  *
@@ -99,42 +123,48 @@ int mbsrv_start( struct tcp_args_t *tcp_args, struct rtu_args_t *rtu_args );
 int mbsrv_stop();
 
 /**
- * @brief      Sets the debug level.
+ * @brief      Reloads the config file: its layout is swapped in while queries are served, connections stay open
  *
- * @param[in]  lvl   The new value
+ * @return     0 on success, -1 if the file is invalid or missing: the layout in use stays
  */
-void set_debug( int lvl );
+int mbsrv_reload();
 
 /**
- * @brief      Sets the colored output for debug messages.
+ * @brief      Gets the upgrade socket, readable once a new process connected to take over
  *
- * @param[in]  on    The new value
+ * @return     The socket, -1 if none
  */
-void set_msg_colors( int on );
+int mbsrv_upgrade_fd();
 
 /**
- * @brief      Determines if messages are colored.
+ * @brief      Hands the server over to the process connected to the upgrade socket: the registers, the listening
+ *             sockets, then every connection once it is idle. The caller then stops the server with mbsrv_stop(),
+ *             the new process starts serving once this one stopped
  *
- * @return     1 if message are colored, 0 otherwise.
+ * @return     0 once handed over, -1 if nothing was: the server goes on
  */
-int is_msg_colors();
+int mbsrv_handoff();
 
 /**
- * @brief      Gets the debug level.
+ * @brief      Reads the TCP connections counters
  *
- * @return     The debug.
+ * @param[out] counters  Filled with a snapshot of the counters
  */
-int get_debug();
+void mbsrv_tcp_counters( struct mbtcp_counters_t *counters );
 
+/**
+ * @brief      Reads the requests statistics of a transport, summed over its threads
+ *
+ * @param[in]  proto  The transport
+ * @param[out] stats  Filled with a snapshot of the statistics
+ */
+void mbsrv_stats( enum mdb_proto_type proto, struct stats_t *stats );
 
 /**
- * @brief      { function_description }
+ * @brief      Gets the memory taken by the registers written so far, over all the units
  *
- * @param[in]  lvl        The Message Level
- * @param[in]  fname      The Message Prefix
- * @param[in]  logstr     The String to be logged (as for printf)
- * @param[in]  <unnamed>  printf arguments
+ * @return     The bytes
  */
-void msg( int lvl, const char* pfx, const char *logstr , ... );
+size_t mbsrv_regs_used();
 
 #endif // _MBT_SRV_H_
@@ -0,0 +1,135 @@
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ INCLUDES
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mbt-stats.h"
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ GLOBAL VARS
+const uint8_t stats_slot_fc[ STATS_FCS ] = { 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x0F, 0x10, 0x11, 0x16, 0x17, 0x00 };
+
+const uint8_t stats_slots[ 0x80 ] = {                      ///< Slot plus one of every function code, 0 for the others
+  [0x01] = 1, [0x02] = 2, [0x03] = 3,  [0x04] = 4,  [0x05] = 5,  [0x06] = 6, [0x07] = 7,
+  [0x08] = 8, [0x0F] = 9, [0x10] = 10, [0x11] = 11, [0x16] = 12, [0x17] = 13
+};
+
+struct stats_t *stats_list = NULL;                         ///< Every registered thread statistics
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;    ///< Serializes registrations and merges
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS
+int stats_slot( uint8_t fc ){
+  uint8_t slot = stats_slots[ fc & 0x7F ];
+  return slot ? slot - 1 : STATS_FCS - 1;
+}
+
+void stats_record( struct stats_hist_t *hist, uint64_t ns ){
+  int idx;
+
+  // Below 2^STATS_SUB_BITS the bucket is the value, then the top STATS_SUB_BITS + 1 bits pick it
+  if( ns < ( 1ULL << STATS_SUB_BITS ) ){ idx = ns; }
+  else{
+    int msb = 63 - __builtin_clzll( ns );
+    idx = ( ( msb - STATS_SUB_BITS + 1 ) << STATS_SUB_BITS ) + ( ( ns >> ( msb - STATS_SUB_BITS ) ) - ( 1 << STATS_SUB_BITS ) );
+    if( idx >= STATS_BUCKETS ){ idx = STATS_BUCKETS - 1; }
+  }
+
+  stats_add( &hist->buckets[ idx ], 1 );
+  stats_add( &hist->count, 1 );
+  stats_add( &hist->sum, ns );
+  if( ns > hist->max ){ __atomic_store_n( &hist->max, ns, __ATOMIC_RELAXED ); }
+}
+
+void stats_hist_add( struct stats_hist_t *dst, const struct stats_hist_t *src ){
+  uint64_t max = __atomic_load_n( &src->max, __ATOMIC_RELAXED );
+
+  // Samples without a bucket would be skipped by the percentiles: count is the sum of the buckets
+  for( int i = 0; i < STATS_BUCKETS; i++ ){
+    uint64_t n = __atomic_load_n( &src->buckets[i], __ATOMIC_RELAXED );
+    dst->buckets[i] += n;
+    dst->count      += n;
+  }
+  dst->sum += __atomic_load_n( &src->sum, __ATOMIC_RELAXED );
+  if( max > dst->max ){ dst->max = max; }
+}
+
+/**
+ * @brief      Gets the highest value recorded in a bucket
+ */
+uint64_t stats_bucket_top( int idx ){
+  int group = idx >> STATS_SUB_BITS;
+  uint64_t sub = idx & ( ( 1 << STATS_SUB_BITS ) - 1 );
+
+  if( !group ){ return sub; }
+  return ( ( ( 1ULL << STATS_SUB_BITS ) + sub + 1 ) << ( group - 1 ) ) - 1;
+}
+
+uint64_t stats_percentile( const struct stats_hist_t *hist, double pct ){
+  if( !hist->count ){ return 0; }
+
+  uint64_t want = (uint64_t)( hist->count * pct / 100.0 + 0.5 );
+  uint64_t seen = 0;
+  if( want < 1 ){ want = 1; }
+
+  for( int i = 0; i < STATS_BUCKETS; i++ ){
+    seen += hist->buckets[i];
+    if( seen >= want ){
+      uint64_t top = stats_bucket_top( i );
+      return top < hist->max ? top : hist->max;
+    }
+  }
+
+  return hist->max;
+}
+
+struct stats_t *stats_new( int proto ){
+  struct stats_t *stats = calloc( 1, sizeof( struct stats_t ) );
+  if( !stats ){ return NULL; }
+  stats->proto = proto;
+
+  pthread_mutex_lock( &stats_lock );
+  stats->next = stats_list;
+  stats_list  = stats;
+  pthread_mutex_unlock( &stats_lock );
+
+  return stats;
+}
+
+void stats_free( struct stats_t *stats ){
+  if( !stats ){ return; }
+
+  pthread_mutex_lock( &stats_lock );
+  for( struct stats_t **s = &stats_list; *s; s = &(*s)->next ){
+    if( *s == stats ){
+      *s = stats->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock( &stats_lock );
+
+  free( stats );
+}
+
+void stats_merge( int proto, struct stats_t *dst ){
+  memset( dst, 0, sizeof( struct stats_t ) );
+  dst->proto = proto;
+
+  // Writers never take the lock: it only keeps the list and the statistics in it alive while they are read
+  pthread_mutex_lock( &stats_lock );
+  for( struct stats_t *s = stats_list; s; s = s->next ){
+    if( s->proto != proto ){ continue; }
+
+    for( int f = 0; f < STATS_FCS; f++ ){
+      const struct stats_fc_t *src = &s->fc[f];
+      struct stats_fc_t *fc = &dst->fc[f];
+
+      fc->requests   += __atomic_load_n( &src->requests,   __ATOMIC_RELAXED );
+      fc->exceptions += __atomic_load_n( &src->exceptions, __ATOMIC_RELAXED );
+      fc->injected   += __atomic_load_n( &src->injected,   __ATOMIC_RELAXED );
+      fc->bytes_in   += __atomic_load_n( &src->bytes_in,   __ATOMIC_RELAXED );
+      fc->bytes_out  += __atomic_load_n( &src->bytes_out,  __ATOMIC_RELAXED );
+
+      for( int p = 0; p < STATS_PHASES; p++ ){ stats_hist_add( &fc->lat[p], &src->lat[p] ); }
+    }
+  }
+  pthread_mutex_unlock( &stats_lock );
+}
@@ -0,0 +1,133 @@
+#ifndef _MBT_STATS_H_
+#define _MBT_STATS_H_
+
+#include <stdint.h>
+#include <time.h>
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ DEFINITIONS
+#define STATS_SUB_BITS          5                  ///< Histogram sub-buckets per power of 2: 32, about 3% precision
+#define STATS_MAX_BITS          35                 ///< Histogram range: up to 2^35 ns (34 s), longer samples go in the last bucket
+#define STATS_BUCKETS           ( ( STATS_MAX_BITS - STATS_SUB_BITS + 1 ) << STATS_SUB_BITS )
+#define STATS_FCS               14                 ///< Function code slots, the last one for every other code
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ TYPES
+enum stats_phase_type {
+  STATS_RECEIVE,                                   ///< Query received, up to its decoding
+  STATS_QUERY,                                     ///< Query decoded and reply built
+  STATS_REPLY,                                     ///< Reply built, up to its last byte sent
+  STATS_PHASES
+};
+
+/**
+ * Log-linear latency histogram, HDR style: samples below 2^STATS_SUB_BITS ns are exact, then every power of 2 is
+ * split in 2^STATS_SUB_BITS buckets. Fixed size, recording is an index computation and an increment.
+ */
+struct stats_hist_t{
+  uint64_t count;                                  ///< Samples
+  uint64_t sum;                                    ///< Sum of the samples, ns
+  uint64_t max;                                    ///< Longest sample, ns
+  uint64_t buckets[ STATS_BUCKETS ];               ///< Samples per bucket
+};
+
+struct stats_fc_t{
+  uint64_t            requests;                    ///< Queries received
+  uint64_t            exceptions;                  ///< Exception replies sent
+  uint64_t            injected;                    ///< Queries hit by a fault rule
+  uint64_t            bytes_in;                    ///< Query bytes
+  uint64_t            bytes_out;                   ///< Reply bytes
+  struct stats_hist_t lat[ STATS_PHASES ];         ///< Latency of every phase
+};
+
+/**
+ * Statistics of a single thread. Only the owner thread writes them, with plain stores: readers merge all the
+ * threads of a transport on demand and may see a sample half recorded, never a corrupted counter.
+ */
+struct stats_t{
+  int                 proto;                       ///< Transport, an mdb_proto_type
+  struct stats_t     *next;                        ///< Every registered thread statistics
+  struct stats_fc_t   fc[ STATS_FCS ];             ///< Per function code, see stats_slot()
+};
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ GLOBAL VARS
+extern const uint8_t stats_slot_fc[ STATS_FCS ];   ///< Function code of every slot, 0 for the others slot
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS
+
+/**
+ * @brief      Gets the monotonic clock, a vDSO read
+ *
+ * @return     The time in ns
+ */
+static inline uint64_t stats_now(){
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief      Adds to a counter owned by the calling thread: a plain add, never a locked instruction
+ */
+static inline void stats_add( uint64_t *counter, uint64_t val ){
+  __atomic_store_n( counter, *counter + val, __ATOMIC_RELAXED );
+}
+
+/**
+ * @brief      Gets the slot of a function code, exception replies included
+ *
+ * @param[in]  fc    The function code
+ *
+ * @return     The slot in stats_t fc
+ */
+int stats_slot( uint8_t fc );
+
+/**
+ * @brief      Records a latency sample
+ *
+ * @param      hist  The histogram, owned by the calling thread
+ * @param[in]  ns    The sample
+ */
+void stats_record( struct stats_hist_t *hist, uint64_t ns );
+
+/**
+ * @brief      Adds the samples of a histogram to another one
+ *
+ * @param      dst   The sum
+ * @param      src   The histogram added
+ */
+void stats_hist_add( struct stats_hist_t *dst, const struct stats_hist_t *src );
+
+/**
+ * @brief      Allocates and registers the statistics of a thread
+ *
+ * @param[in]  proto  The transport served by the thread
+ *
+ * @return     The statistics, NULL on failure
+ */
+struct stats_t *stats_new( int proto );
+
+/**
+ * @brief      Unregisters and frees the statistics of a thread
+ *
+ * @param      stats  The statistics, the owner thread must be done with them
+ */
+void stats_free( struct stats_t *stats );
+
+/**
+ * @brief      Sums the statistics of every thread serving a transport
+ *
+ * @param[in]  proto  The transport
+ * @param[out] dst    The sum
+ */
+void stats_merge( int proto, struct stats_t *dst );
+
+/**
+ * @brief      Gets a percentile of a histogram
+ *
+ * @param      hist  The histogram
+ * @param[in]  pct   The percentile [0.0 - 100.0]
+ *
+ * @return     The highest value equivalent to the percentile bucket, ns. 0 without samples
+ */
+uint64_t stats_percentile( const struct stats_hist_t *hist, double pct );
+
+#endif // _MBT_STATS_H_
@@ -0,0 +1,257 @@
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ INCLUDES
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mbt-trace.h"
+#include "mbt-log.h"
+#include "mbt-stats.h"
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ DEFINITIONS
+#define TRACE_WBUF_SIZE     ( 256 * 1024 )                 ///< Writer thread buffer, records merged from every ring
+#define TRACE_RING_MASK     ( TRACE_RING_SIZE - 1 )
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS
+/**
+ * @brief      Copies bytes into a ring at a position, wrapping at its end
+ */
+static inline void trace_ring_write( struct trace_ring_t *ring, uint64_t pos, const void *src, size_t n ){
+  size_t off = pos & TRACE_RING_MASK, first = n < TRACE_RING_SIZE - off ? n : TRACE_RING_SIZE - off;
+
+  memcpy( ring->buf + off, src, first );
+  if( n > first ){ memcpy( ring->buf, (const uint8_t *)src + first, n - first ); }
+}
+
+static inline void trace_ring_read( const struct trace_ring_t *ring, uint64_t pos, void *dst, size_t n ){
+  size_t off = pos & TRACE_RING_MASK, first = n < TRACE_RING_SIZE - off ? n : TRACE_RING_SIZE - off;
+
+  memcpy( dst, ring->buf + off, first );
+  if( n > first ){ memcpy( (uint8_t *)dst + first, ring->buf, n - first ); }
+}
+
+void trace_put( struct trace_ring_t *ring, uint64_t t, uint32_t conn, uint8_t flags, uint8_t unit, const uint8_t *frame, uint16_t len ){
+  static const uint8_t pad[8] = { 0 };
+  const size_t need = TRACE_REC_LEN( len );
+  uint64_t head = ring->head;
+
+  if( TRACE_RING_SIZE - ( head - __atomic_load_n( &ring->tail, __ATOMIC_ACQUIRE ) ) < need ){
+    __atomic_store_n( &ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED );
+    return;
+  }
+
+  struct trace_rec_t rec = { .t = t - ring->start, .conn = conn, .len = len, .unit = unit, .flags = flags };
+  trace_ring_write( ring, head, &rec, sizeof( rec ) );
+  if( len ){ trace_ring_write( ring, head + sizeof( rec ), frame, len ); }
+  trace_ring_write( ring, head + sizeof( rec ) + len, pad, need - sizeof( rec ) - len );
+  __atomic_store_n( &ring->head, head + need, __ATOMIC_RELEASE );
+}
+
+/**
+ * @brief      Writes a buffer to the trace file. A failed write ends the recording, records are then discarded
+ */
+void trace_write( struct trace_t *trace, const uint8_t *buf, size_t len ){
+  while( len && trace->fd != -1 ){
+    ssize_t wr = write( trace->fd, buf, len );
+    if( wr < 0 ){
+      if( errno == EINTR ){ continue; }
+      log_err( "Trace write failed, recording stopped: %s", strerror( errno ) );
+      close( trace->fd );
+      trace->fd = -1;
+      return;
+    }
+    buf += wr;
+    len -= wr;
+    trace->bytes += wr;
+  }
+}
+
+/**
+ * @brief      Writes every record the rings hold, merged by time: each ring is already in order
+ */
+void trace_flush( struct trace_t *trace, uint8_t *wbuf ){
+  int n = __atomic_load_n( &trace->nrings, __ATOMIC_ACQUIRE );
+  uint64_t pos[ TRACE_RINGS_MAX ], end[ TRACE_RINGS_MAX ];
+  size_t wlen = 0;
+
+  for( int r = 0; r < n; r++ ){
+    pos[r] = trace->rings[r]->tail;
+    end[r] = __atomic_load_n( &trace->rings[r]->head, __ATOMIC_ACQUIRE );
+  }
+
+  while( 1 ){
+    struct trace_rec_t rec, best_rec;
+    int best = -1;
+
+    // A handful of rings, one per thread: a linear scan finds the oldest record
+    for( int r = 0; r < n; r++ ){
+      if( pos[r] == end[r] ){ continue; }
+      trace_ring_read( trace->rings[r], pos[r], &rec, sizeof( rec ) );
+      if( best < 0 || rec.t < best_rec.t ){
+        best     = r;
+        best_rec = rec;
+      }
+    }
+    if( best < 0 ){ break; }
+
+    size_t len = TRACE_REC_LEN( best_rec.len );
+    if( wlen + len > TRACE_WBUF_SIZE ){
+      trace_write( trace, wbuf, wlen );
+      wlen = 0;
+    }
+    trace_ring_read( trace->rings[ best ], pos[ best ], wbuf + wlen, len );
+    wlen += len;
+    pos[ best ] += len;
+    trace->records++;
+  }
+  trace_write( trace, wbuf, wlen );
+
+  // Room is given back once written: the recording threads only ever see the tail move forward
+  for( int r = 0; r < n; r++ ){ __atomic_store_n( &trace->rings[r]->tail, pos[r], __ATOMIC_RELEASE ); }
+}
+
+void *trace_run( struct trace_t *trace ){
+  uint8_t *wbuf = malloc( TRACE_WBUF_SIZE );
+  struct timespec ts = { 0, TRACE_FLUSH_MSEC * 1000000L };
+
+  if( !wbuf ){
+    log_err( "Failed to allocate the trace buffer, recording stopped" );
+    return NULL;
+  }
+
+  // The disk is only ever waited for by this thread
+  while( !trace->stop ){
+    nanosleep( &ts, NULL );
+    trace_flush( trace, wbuf );
+  }
+  trace_flush( trace, wbuf );
+
+  free( wbuf );
+  return NULL;
+}
+
+struct trace_t *trace_open( const char *path ){
+  struct trace_t *trace = calloc( 1, sizeof( struct trace_t ) );
+  struct timespec real;
+  struct trace_hdr_t hdr;
+
+  if( !trace ){ return NULL; }
+  trace->fd = open( path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+  if( trace->fd == -1 ){
+    free( trace );
+    return NULL;
+  }
+
+  clock_gettime( CLOCK_REALTIME, &real );
+  trace->start = stats_now();
+  memset( &hdr, 0, sizeof( hdr ) );
+  memcpy( hdr.magic, TRACE_MAGIC, sizeof( hdr.magic ) );
+  hdr.version    = TRACE_VERSION;
+  hdr.hdr_len    = sizeof( hdr );
+  hdr.start_real = (uint64_t)real.tv_sec * 1000000000ULL + real.tv_nsec;
+  hdr.start_mono = trace->start;
+  trace_write( trace, (const uint8_t *)&hdr, sizeof( hdr ) );
+  if( trace->fd == -1 ){
+    free( trace );
+    return NULL;
+  }
+
+  pthread_mutex_init( &trace->lock, NULL );
+  if( pthread_create( &trace->thread, NULL, (void *)&trace_run, trace ) != 0 ){
+    close( trace->fd );
+    pthread_mutex_destroy( &trace->lock );
+    free( trace );
+    return NULL;
+  }
+  pthread_setname_np( trace->thread, "mbtrace" );
+  return trace;
+}
+
+struct trace_ring_t *trace_ring( struct trace_t *trace ){
+  struct trace_ring_t *ring = NULL;
+
+  pthread_mutex_lock( &trace->lock );
+  if( trace->nrings < TRACE_RINGS_MAX && ( ring = aligned_alloc( 64, sizeof( struct trace_ring_t ) ) ) ){
+    ring->head    = 0;
+    ring->tail    = 0;
+    ring->dropped = 0;
+    ring->start   = trace->start;
+    trace->rings[ trace->nrings ] = ring;
+    __atomic_store_n( &trace->nrings, trace->nrings + 1, __ATOMIC_RELEASE );
+  }
+  pthread_mutex_unlock( &trace->lock );
+  return ring;
+}
+
+void trace_close( struct trace_t *trace ){
+  uint64_t dropped = 0;
+
+  if( !trace ){ return; }
+  trace->stop = 1;
+  pthread_join( trace->thread, NULL );
+
+  for( int r = 0; r < trace->nrings; r++ ){
+    dropped += trace->rings[r]->dropped;
+    free( trace->rings[r] );
+  }
+  log_inf( "Trace: %lu records, %lu KiB written, %lu dropped", trace->records, trace->bytes / 1024, dropped );
+
+  if( trace->fd != -1 ){ close( trace->fd ); }
+  pthread_mutex_destroy( &trace->lock );
+  free( trace );
+}
+
+int trace_map( const char *path, struct trace_map_t *map ){
+  struct stat st;
+  int fd = open( path, O_RDONLY | O_CLOEXEC );
+
+  memset( map, 0, sizeof( struct trace_map_t ) );
+  if( fd == -1 ){ return -1; }
+  if( fstat( fd, &st ) != 0 ){
+    close( fd );
+    return -1;
+  }
+  if( (size_t)st.st_size < sizeof( struct trace_hdr_t ) ){
+    close( fd );
+    errno = EINVAL;
+    return -1;
+  }
+
+  // Read once front to back: the kernel reads ahead and drops the pages behind
+  map->len  = st.st_size;
+  map->data = mmap( NULL, map->len, PROT_READ, MAP_PRIVATE, fd, 0 );
+  close( fd );
+  if( map->data == MAP_FAILED ){
+    map->data = NULL;
+    return -1;
+  }
+  madvise( (void *)map->data, map->len, MADV_SEQUENTIAL );
+
+  map->hdr = (const struct trace_hdr_t *)map->data;
+  map->off = map->hdr->hdr_len;
+  if( memcmp( map->hdr->magic, TRACE_MAGIC, sizeof( map->hdr->magic ) ) != 0 || map->hdr->version != TRACE_VERSION ||
+      map->off < sizeof( struct trace_hdr_t ) || map->off > map->len || ( map->off & 7 ) ){
+    trace_unmap( map );
+    errno = EINVAL;
+    return -1;
+  }
+  return 0;
+}
+
+const struct trace_rec_t *trace_next( struct trace_map_t *map ){
+  const struct trace_rec_t *rec;
+
+  if( map->len - map->off < sizeof( struct trace_rec_t ) ){ return NULL; }
+  rec = (const struct trace_rec_t *)( map->data + map->off );
+  if( map->len - map->off < TRACE_REC_LEN( rec->len ) ){ return NULL; }
+  map->off += TRACE_REC_LEN( rec->len );
+  return rec;
+}
+
+void trace_unmap( struct trace_map_t *map ){
+  if( map->data ){ munmap( (void *)map->data, map->len ); }
+  memset( map, 0, sizeof( struct trace_map_t ) );
+}
@@ -0,0 +1,150 @@
+#ifndef _MBT_TRACE_H_
+#define _MBT_TRACE_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ DEFINITIONS
+#define TRACE_MAGIC             "MBTTRACE"         ///< First 8 bytes of a trace file
+#define TRACE_VERSION           1                  ///< Bumped on any change of the file layout
+#define TRACE_RING_SIZE         ( 1 << 20 )        ///< Bytes buffered per thread, a power of 2
+#define TRACE_RINGS_MAX         64                 ///< Threads recording to a trace
+#define TRACE_FLUSH_MSEC        10                 ///< Interval between two writes of the buffered records
+#define TRACE_CONN_RTU          0x80000000u        ///< Connection ids of RTU lines, the line index in the low bits
+
+// Record flags: the kind in the low bits, then the frame transport
+#define TRACE_KIND_MASK         0x03
+#define TRACE_F_RTU             0x04               ///< Frame is an RTU ADU, a TCP one otherwise
+
+/**
+ * @brief      Bytes of a record carrying len frame bytes: the header and the frame padded to 8 bytes
+ */
+#define TRACE_REC_LEN( len )    ( sizeof( struct trace_rec_t ) + ( ( (size_t)( len ) + 7 ) & ~(size_t)7 ) )
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ TYPES
+enum trace_kind_type {
+  TRACE_RX,                                        ///< Query received
+  TRACE_TX,                                        ///< Reply queued
+  TRACE_OPEN,                                      ///< Connection accepted, the frame is the master "address:port"
+  TRACE_CLOSE                                      ///< Connection closed, no frame
+};
+
+/**
+ * Trace file header, host byte order. Records follow at hdr_len, sorted by time within each flush.
+ */
+struct trace_hdr_t{
+  char                 magic[8];                   ///< TRACE_MAGIC, not terminated
+  uint32_t             version;                    ///< TRACE_VERSION
+  uint32_t             hdr_len;                    ///< Offset of the first record
+  uint64_t             start_real;                 ///< Wall clock time of the start, ns since the epoch
+  uint64_t             start_mono;                 ///< Monotonic time of the start, ns
+};
+
+/**
+ * A record, followed by its frame padded to 8 bytes: records stay aligned in a mapped file.
+ */
+struct trace_rec_t{
+  uint64_t             t;                          ///< Time from the start, ns
+  uint32_t             conn;                       ///< Connection id, unique within a trace: worker << 24 | sequence over TCP
+  uint16_t             len;                        ///< Frame bytes
+  uint8_t              unit;                       ///< Unit id of the frame, 0 without one
+  uint8_t              flags;                      ///< An trace_kind_type, ored with TRACE_F_*
+};
+
+/**
+ * Records of a single thread, waiting for the writer thread. The thread never waits: a record not fitting
+ * is dropped and counted.
+ */
+struct trace_ring_t{
+  uint64_t             head __attribute__(( aligned( 64 ) ));   ///< Bytes put, by the recording thread
+  uint64_t             dropped;                    ///< Records dropped for lack of room
+  uint64_t             start;                      ///< Monotonic time of the trace start, ns
+  uint64_t             tail __attribute__(( aligned( 64 ) ));   ///< Bytes written to the file, by the writer thread
+  uint8_t              buf[ TRACE_RING_SIZE ];
+};
+
+struct trace_t{
+  int                  fd;                         ///< Trace file, -1 once a write failed
+  pthread_t            thread;                     ///< Writer thread
+  volatile int         stop;                       ///< Asks the writer thread to end
+  uint64_t             start;                      ///< Monotonic time of the start, ns
+  pthread_mutex_t      lock;                       ///< Serializes the rings creation
+  int                  nrings;                     ///< Rings in use
+  struct trace_ring_t *rings[ TRACE_RINGS_MAX ];
+  uint64_t             records;                    ///< Records written
+  uint64_t             bytes;                      ///< Bytes written, header included
+};
+
+/**
+ * A trace file mapped for reading
+ */
+struct trace_map_t{
+  const uint8_t       *data;                       ///< The whole file
+  size_t               len;                        ///< File bytes
+  size_t               off;                        ///< Offset of the next record
+  const struct trace_hdr_t *hdr;                   ///< The header, at the start of data
+};
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS
+
+/**
+ * @brief      Creates a trace file and starts its writer thread
+ *
+ * @param[in]  path  The file, truncated if it exists
+ *
+ * @return     The trace, to be closed with trace_close(). NULL on failure (errno set)
+ */
+struct trace_t *trace_open( const char *path );
+
+/**
+ * @brief      Gets a ring for a recording thread, one per thread
+ *
+ * @param      trace  The trace
+ *
+ * @return     The ring, NULL if TRACE_RINGS_MAX are already in use or on allocation failure
+ */
+struct trace_ring_t *trace_ring( struct trace_t *trace );
+
+/**
+ * @brief      Records a frame without ever blocking: dropped if the ring is full
+ *
+ * @param      ring   The ring of the calling thread
+ * @param[in]  t      Time of the frame, stats_now() clock
+ * @param[in]  conn   Connection id
+ * @param[in]  flags  An trace_kind_type, ored with TRACE_F_*
+ * @param[in]  unit   Unit id of the frame
+ * @param[in]  frame  The frame, may be NULL when len is 0
+ * @param[in]  len    Frame bytes
+ */
+void trace_put( struct trace_ring_t *ring, uint64_t t, uint32_t conn, uint8_t flags, uint8_t unit, const uint8_t *frame, uint16_t len );
+
+/**
+ * @brief      Stops the writer thread once every ring is written, closes the file and frees the trace
+ *
+ * @param      trace  The trace, its recording threads already ended
+ */
+void trace_close( struct trace_t *trace );
+
+/**
+ * @brief      Maps a trace file for reading, checking its header
+ *
+ * @param[in]  path  The file
+ * @param[out] map   The mapping
+ *
+ * @return     0 on success, -1 on failure: errno set, EINVAL for a file not a trace or of another version
+ */
+int trace_map( const char *path, struct trace_map_t *map );
+
+/**
+ * @brief      Gets the next record of a mapped trace
+ *
+ * @param      map   The mapping
+ *
+ * @return     The record, its frame following it. NULL at the end, or on a record cut by the file end
+ */
+const struct trace_rec_t *trace_next( struct trace_map_t *map );
+
+void trace_unmap( struct trace_map_t *map );
+
+#endif // _MBT_TRACE_H_
@@ -0,0 +1,80 @@
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ INCLUDES
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/serial.h>
+#include <sys/ioctl.h>
+
+#include "mbt-tty.h"
+#include "mbt-log.h"
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS
+speed_t tty_baud( int speed ){
+  switch( speed ){
+    case 1200:   return B1200;
+    case 2400:   return B2400;
+    case 4800:   return B4800;
+    case 9600:   return B9600;
+    case 19200:  return B19200;
+    case 38400:  return B38400;
+    case 57600:  return B57600;
+    case 115200: return B115200;
+    case 230400: return B230400;
+    case 460800: return B460800;
+    case 921600: return B921600;
+    default:     return B0;
+  }
+}
+
+void tty_times( int speed, struct tty_times_t *times ){
+  times->tchar = 11000000000ULL / speed;
+  times->t15   = ( speed > 19200 ) ?  750000ULL : 16500000000ULL / speed;
+  times->t35   = ( speed > 19200 ) ? 1750000ULL : 38500000000ULL / speed;
+}
+
+int tty_open( const char *dev, int speed, int *pty, char *pts ){
+  struct serial_struct ss;
+  struct termios tio;
+  int fd, tty, err;
+
+  *pty   = -1;
+  pts[0] = '\0';
+  if( strcmp( dev, TTY_PTY ) == 0 ){
+    fd = posix_openpt( O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC );
+    if( fd == -1 || grantpt( fd ) != 0 || unlockpt( fd ) != 0 || ptsname_r( fd, pts, TTY_PTS_LEN ) != 0 ){ goto fail; }
+    *pty = open( pts, O_RDWR | O_NOCTTY | O_CLOEXEC );
+    if( *pty == -1 ){ goto fail; }
+    tty = *pty;
+  }
+  else{
+    fd = open( dev, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC );
+    if( fd == -1 ){ goto fail; }
+    tty = fd;
+  }
+
+  if( tcgetattr( tty, &tio ) == -1 ){ goto fail; }
+  cfmakeraw( &tio );
+  tio.c_cflag |= CLOCAL | CREAD;
+  tio.c_cflag &= ~CSTOPB;
+  cfsetispeed( &tio, tty_baud( speed ) );
+  cfsetospeed( &tio, tty_baud( speed ) );
+  if( tcsetattr( tty, TCSANOW, &tio ) == -1 ){ goto fail; }
+  tcflush( tty, TCIOFLUSH );
+
+  // Serial drivers hold received bytes for a few characters time, low latency hands them over at once
+  if( ioctl( fd, TIOCGSERIAL, &ss ) == 0 && !( ss.flags & ASYNC_LOW_LATENCY ) ){
+    ss.flags |= ASYNC_LOW_LATENCY;
+    if( ioctl( fd, TIOCSSERIAL, &ss ) != 0 ){ log_ver( "Line %s: low latency not available", dev ); }
+  }
+  return fd;
+
+fail:
+  err = errno;
+  if( fd   != -1 ){ close( fd ); }
+  if( *pty != -1 ){ close( *pty ); }
+  *pty  = -1;
+  errno = err;
+  return -1;
+}
@@ -0,0 +1,53 @@
+#ifndef _MBT_TTY_H_
+#define _MBT_TTY_H_
+
+#include <stdint.h>
+#include <termios.h>
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ DEFINITIONS
+#define TTY_PTY                 "pty"              ///< Device name creating a pseudo terminal
+#define TTY_PTS_LEN             64                 ///< Pseudo terminal path buffer
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ TYPES
+/**
+ * Line times of a baud rate, ns: 11 bits per character, fixed silences above 19200 baud as the spec asks
+ */
+struct tty_times_t{
+  uint64_t tchar;                                  ///< Character time
+  uint64_t t15;                                    ///< 1.5 characters silence: longer gaps break a frame
+  uint64_t t35;                                    ///< 3.5 characters silence: frames end after it
+};
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS
+
+/**
+ * @brief      Gets the termios speed of a baud rate
+ *
+ * @return     The speed, B0 if not supported
+ */
+speed_t tty_baud( int speed );
+
+/**
+ * @brief      Gets the line times of a baud rate
+ *
+ * @param[in]  speed  The baud rate
+ * @param[out] times  The line times
+ */
+void tty_times( int speed, struct tty_times_t *times );
+
+/**
+ * @brief      Opens a serial line raw 8N1 and non-blocking, switched to low latency when the driver allows it
+ *
+ * TTY_PTY creates a pseudo terminal instead. Its slave side is kept open, so that the master never polls as hung
+ * up while no one is on it: the masters connect to its path.
+ *
+ * @param[in]  dev    The tty path, or TTY_PTY
+ * @param[in]  speed  The baud rate
+ * @param[out] pty    The pseudo terminal slave side, to be closed with the line. -1 for a tty
+ * @param[out] pts    The pseudo terminal path, at least TTY_PTS_LEN bytes. Empty for a tty
+ *
+ * @return     The line, -1 on failure
+ */
+int tty_open( const char *dev, int speed, int *pty, char *pts );
+
+#endif // _MBT_TTY_H_
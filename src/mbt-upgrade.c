@@ -0,0 +1,141 @@
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ INCLUDES
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "mbt-upgrade.h"
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS
+/**
+ * @brief      Fills the address of a socket path
+ *
+ * @return     0 on success, -1 if the path is too long
+ */
+static inline int upgrade_addr( const char *path, struct sockaddr_un *sun ){
+  memset( sun, 0, sizeof( struct sockaddr_un ) );
+  sun->sun_family = AF_UNIX;
+  if( strlen( path ) >= sizeof( sun->sun_path ) ){
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy( sun->sun_path, path );
+  return 0;
+}
+
+/**
+ * @brief      Bounds the blocking sends and receives of a socket
+ */
+static inline void upgrade_timeout( int sock ){
+  struct timeval tv = { UPGRADE_TIMEOUT_SEC, 0 };
+
+  setsockopt( sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof( tv ) );
+  setsockopt( sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof( tv ) );
+}
+
+int upgrade_connect( const char *path ){
+  struct sockaddr_un sun;
+  int sock;
+
+  if( upgrade_addr( path, &sun ) != 0 ){ return -1; }
+
+  // Message boundaries are kept: a descriptor always comes with the message describing it
+  sock = socket( AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0 );
+  if( sock == -1 ){ return -1; }
+  if( connect( sock, (struct sockaddr *)&sun, sizeof( sun ) ) != 0 ){
+    close( sock );
+    return -1;
+  }
+  upgrade_timeout( sock );
+  return sock;
+}
+
+int upgrade_listen( const char *path ){
+  struct sockaddr_un sun;
+  int sock;
+
+  if( upgrade_addr( path, &sun ) != 0 ){ return -1; }
+
+  // Only called once nobody answers on path: the file left is a stale one
+  unlink( path );
+  sock = socket( AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+  if( sock == -1 ){ return -1; }
+  if( bind( sock, (struct sockaddr *)&sun, sizeof( sun ) ) != 0 || listen( sock, 1 ) != 0 ){
+    close( sock );
+    return -1;
+  }
+  return sock;
+}
+
+int upgrade_accept( int lsock ){
+  int sock = accept4( lsock, NULL, NULL, SOCK_CLOEXEC );
+
+  if( sock != -1 ){ upgrade_timeout( sock ); }
+  return sock;
+}
+
+int upgrade_send( int sock, struct upgrade_msg_t *msg, int fd ){
+  union {
+    struct cmsghdr hdr;
+    char           buf[ CMSG_SPACE( sizeof( int ) ) ];
+  } ctl;
+  struct iovec iov = { .iov_base = msg, .iov_len = offsetof( struct upgrade_msg_t, data ) + msg->ilen + msg->olen };
+  struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+  if( (size_t)msg->ilen + msg->olen > UPGRADE_DATA_MAX ){
+    errno = EMSGSIZE;
+    return -1;
+  }
+  msg->version = UPGRADE_VERSION;
+
+  if( fd != -1 ){
+    memset( &ctl, 0, sizeof( ctl ) );
+    mh.msg_control    = ctl.buf;
+    mh.msg_controllen = sizeof( ctl.buf );
+    struct cmsghdr *cm = CMSG_FIRSTHDR( &mh );
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type  = SCM_RIGHTS;
+    cm->cmsg_len   = CMSG_LEN( sizeof( int ) );
+    memcpy( CMSG_DATA( cm ), &fd, sizeof( int ) );
+  }
+
+  while( sendmsg( sock, &mh, MSG_NOSIGNAL ) == -1 ){
+    if( errno != EINTR ){ return -1; }
+  }
+  return 0;
+}
+
+int upgrade_recv( int sock, struct upgrade_msg_t *msg, int *fd ){
+  union {
+    struct cmsghdr hdr;
+    char           buf[ CMSG_SPACE( sizeof( int ) ) ];
+  } ctl;
+  struct iovec iov = { .iov_base = msg, .iov_len = sizeof( struct upgrade_msg_t ) };
+  struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctl.buf, .msg_controllen = sizeof( ctl.buf ) };
+  ssize_t n;
+
+  *fd = -1;
+  while( ( n = recvmsg( sock, &mh, MSG_CMSG_CLOEXEC ) ) == -1 ){
+    if( errno != EINTR ){ return -1; }
+  }
+  if( n == 0 ){ return 0; }
+
+  for( struct cmsghdr *cm = CMSG_FIRSTHDR( &mh ); cm; cm = CMSG_NXTHDR( &mh, cm ) ){
+    if( cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS && cm->cmsg_len == CMSG_LEN( sizeof( int ) ) ){
+      memcpy( fd, CMSG_DATA( cm ), sizeof( int ) );
+    }
+  }
+
+  // A newer process may speak another protocol: nothing it sent is trusted then
+  if( (size_t)n < offsetof( struct upgrade_msg_t, data ) || msg->version != UPGRADE_VERSION ||
+      (size_t)n != offsetof( struct upgrade_msg_t, data ) + msg->ilen + msg->olen || ( mh.msg_flags & MSG_CTRUNC ) ){
+    if( *fd != -1 ){ close( *fd ); }
+    *fd   = -1;
+    errno = EPROTO;
+    return -1;
+  }
+  return 1;
+}
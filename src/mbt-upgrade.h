@@ -0,0 +1,85 @@
+#ifndef _MBT_UPGRADE_H_
+#define _MBT_UPGRADE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ DEFINITIONS
+#define UPGRADE_VERSION         1                  ///< Bumped on any change of the messages
+#define UPGRADE_DATA_MAX        8192               ///< Bytes carried by a message
+#define UPGRADE_TIMEOUT_SEC     30                 ///< Wait for the other process before giving up
+#define UPGRADE_DRAIN_SEC       10                 ///< Wait for the busy connections to get idle, the ones left are closed
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ TYPES
+enum upgrade_msg_type {
+  UPGRADE_STORE,                                   ///< Memory file of the registers
+  UPGRADE_LISTENER,                                ///< A listening socket
+  UPGRADE_CONN,                                    ///< A client socket, the data its received then its unsent bytes
+  UPGRADE_END                                      ///< Nothing left to hand, the old process exits
+};
+
+/**
+ * A message of the upgrade socket, sent up to its data length. Each carries at most one descriptor.
+ */
+struct upgrade_msg_t{
+  uint16_t             version;                    ///< UPGRADE_VERSION
+  uint8_t              type;                       ///< An upgrade_msg_type
+  uint8_t              pad;
+  uint16_t             port;                       ///< Client port
+  uint16_t             ilen;                       ///< Received bytes not served yet, first in data
+  uint16_t             olen;                       ///< Reply bytes not sent yet, after the received ones
+  char                 addr[ INET6_ADDRSTRLEN ];   ///< Client address in string form
+  uint8_t              data[ UPGRADE_DATA_MAX ];
+};
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS
+
+/**
+ * @brief      Connects to the upgrade socket of a running server
+ *
+ * @param[in]  path  The UNIX socket path
+ *
+ * @return     The socket, -1 if no server listens on path
+ */
+int upgrade_connect( const char *path );
+
+/**
+ * @brief      Listens on the upgrade socket, for the process taking over next. A stale socket file is replaced
+ *
+ * @param[in]  path  The UNIX socket path
+ *
+ * @return     The listening socket, non-blocking. -1 on failure
+ */
+int upgrade_listen( const char *path );
+
+/**
+ * @brief      Accepts the connection of the process taking over, with the send timeout set
+ *
+ * @return     The socket, -1 on failure
+ */
+int upgrade_accept( int lsock );
+
+/**
+ * @brief      Sends a message, safe from several threads: every message goes as a whole
+ *
+ * @param[in]  sock  The upgrade socket
+ * @param      msg   The message, version set here
+ * @param[in]  fd    The descriptor handed with it, -1 for none
+ *
+ * @return     0 on success, -1 on failure
+ */
+int upgrade_send( int sock, struct upgrade_msg_t *msg, int fd );
+
+/**
+ * @brief      Receives a message, waiting up to UPGRADE_TIMEOUT_SEC
+ *
+ * @param[in]  sock  The upgrade socket
+ * @param[out] msg   The message
+ * @param[out] fd    The descriptor handed with it, close on exec. -1 if none
+ *
+ * @return     1 on a message, 0 once the other process closed the socket, -1 on failure or invalid message
+ */
+int upgrade_recv( int sock, struct upgrade_msg_t *msg, int *fd );
+
+#endif // _MBT_UPGRADE_H_
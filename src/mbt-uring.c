@@ -0,0 +1,183 @@
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ INCLUDES
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "mbt-uring.h"
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS
+static inline int uring_enter( struct uring_t *ring, unsigned submit, unsigned min, unsigned flags, void *arg, size_t argsz ){
+  return syscall( __NR_io_uring_enter, ring->fd, submit, min, flags, arg, argsz );
+}
+
+int uring_init( struct uring_t *ring, unsigned entries ){
+  struct io_uring_params p;
+  int err;
+
+  memset( ring, 0, sizeof( struct uring_t ) );
+  ring->fd = -1;
+
+  // Task work run only when the worker waits, falling back to the older kernels default
+  memset( &p, 0, sizeof( p ) );
+  p.flags      = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+  p.cq_entries = entries * 4;
+  if( ( ring->fd = syscall( __NR_io_uring_setup, entries, &p ) ) < 0 ){
+    memset( &p, 0, sizeof( p ) );
+    p.flags      = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;
+    if( ( ring->fd = syscall( __NR_io_uring_setup, entries, &p ) ) < 0 ){ return -1; }
+  }
+  ring->features = p.features;
+  if( !( p.features & IORING_FEAT_EXT_ARG ) ){
+    errno = ENOSYS;
+    goto fail;
+  }
+
+  ring->sq_map_len = p.sq_off.array + p.sq_entries * sizeof( unsigned );
+  ring->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof( struct io_uring_cqe );
+  if( p.features & IORING_FEAT_SINGLE_MMAP ){
+    if( ring->cq_map_len > ring->sq_map_len ){ ring->sq_map_len = ring->cq_map_len; }
+    ring->cq_map_len = ring->sq_map_len;
+  }
+
+  ring->sq_map = mmap( NULL, ring->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING );
+  if( ring->sq_map == MAP_FAILED ){
+    ring->sq_map = NULL;
+    goto fail;
+  }
+  if( p.features & IORING_FEAT_SINGLE_MMAP ){ ring->cq_map = ring->sq_map; }
+  else{
+    ring->cq_map = mmap( NULL, ring->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING );
+    if( ring->cq_map == MAP_FAILED ){
+      ring->cq_map = NULL;
+      goto fail;
+    }
+  }
+  ring->sqes_len = p.sq_entries * sizeof( struct io_uring_sqe );
+  ring->sqes = mmap( NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES );
+  if( ring->sqes == MAP_FAILED ){
+    ring->sqes = NULL;
+    goto fail;
+  }
+
+  ring->sq_head    = (unsigned *)( (uint8_t *)ring->sq_map + p.sq_off.head );
+  ring->sq_tail    = (unsigned *)( (uint8_t *)ring->sq_map + p.sq_off.tail );
+  ring->sq_mask    = *(unsigned *)( (uint8_t *)ring->sq_map + p.sq_off.ring_mask );
+  ring->sq_entries = p.sq_entries;
+  ring->sq_array   = (unsigned *)( (uint8_t *)ring->sq_map + p.sq_off.array );
+  ring->sq_local   = *ring->sq_tail;
+  ring->cq_head    = (unsigned *)( (uint8_t *)ring->cq_map + p.cq_off.head );
+  ring->cq_tail    = (unsigned *)( (uint8_t *)ring->cq_map + p.cq_off.tail );
+  ring->cq_mask    = *(unsigned *)( (uint8_t *)ring->cq_map + p.cq_off.ring_mask );
+  ring->cqes       = (struct io_uring_cqe *)( (uint8_t *)ring->cq_map + p.cq_off.cqes );
+
+  // Entries are always taken in order: the indirection array is set once
+  for( unsigned i = 0; i < p.sq_entries; i++ ){ ring->sq_array[i] = i; }
+  return 0;
+
+fail:
+  err = errno;
+  uring_exit( ring );
+  errno = err;
+  return -1;
+}
+
+void uring_exit( struct uring_t *ring ){
+  if( ring->bufs ){ munmap( ring->bufs, ring->bufs_len ); }
+  if( ring->br ){ munmap( ring->br, ring->br_len ); }
+  if( ring->sqes ){ munmap( ring->sqes, ring->sqes_len ); }
+  if( ring->cq_map && ring->cq_map != ring->sq_map ){ munmap( ring->cq_map, ring->cq_map_len ); }
+  if( ring->sq_map ){ munmap( ring->sq_map, ring->sq_map_len ); }
+  if( ring->fd >= 0 ){ close( ring->fd ); }
+  memset( ring, 0, sizeof( struct uring_t ) );
+  ring->fd = -1;
+}
+
+int uring_bufs_init( struct uring_t *ring, uint16_t bgid, unsigned count, uint32_t size ){
+  struct io_uring_buf_reg reg;
+
+  if( count == 0 || count > 32768 || ( count & ( count - 1 ) ) ){
+    errno = EINVAL;
+    return -1;
+  }
+
+  ring->br_len   = count * sizeof( struct io_uring_buf );
+  ring->bufs_len = (size_t)count * size;
+  ring->br       = mmap( NULL, ring->br_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+  ring->bufs     = mmap( NULL, ring->bufs_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+  if( ring->br == MAP_FAILED || ring->bufs == MAP_FAILED ){
+    if( ring->br != MAP_FAILED ){ munmap( ring->br, ring->br_len ); }
+    if( ring->bufs != MAP_FAILED ){ munmap( ring->bufs, ring->bufs_len ); }
+    ring->br   = NULL;
+    ring->bufs = NULL;
+    return -1;
+  }
+  ring->br_mask  = count - 1;
+  ring->br_tail  = 0;
+  ring->buf_size = size;
+
+  memset( &reg, 0, sizeof( reg ) );
+  reg.ring_addr    = (uintptr_t)ring->br;
+  reg.ring_entries = count;
+  reg.bgid         = bgid;
+  if( syscall( __NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1 ) != 0 ){
+    munmap( ring->br, ring->br_len );
+    munmap( ring->bufs, ring->bufs_len );
+    ring->br   = NULL;
+    ring->bufs = NULL;
+    return -1;
+  }
+
+  for( unsigned i = 0; i < count; i++ ){ uring_buf_put( ring, i ); }
+  return 0;
+}
+
+void uring_buf_put( struct uring_t *ring, uint16_t bid ){
+  struct io_uring_buf *buf = &ring->br->bufs[ ring->br_tail & ring->br_mask ];
+
+  buf->addr = (uintptr_t)uring_buf( ring, bid );
+  buf->len  = ring->buf_size;
+  buf->bid  = bid;
+  ring->br_tail++;
+  __atomic_store_n( &ring->br->tail, ring->br_tail, __ATOMIC_RELEASE );
+}
+
+struct io_uring_sqe *uring_sqe( struct uring_t *ring ){
+  struct io_uring_sqe *sqe;
+
+  if( ring->sq_local - __atomic_load_n( ring->sq_head, __ATOMIC_ACQUIRE ) >= ring->sq_entries ){
+    uring_wait( ring, 0 );
+    if( ring->sq_local - __atomic_load_n( ring->sq_head, __ATOMIC_ACQUIRE ) >= ring->sq_entries ){ return NULL; }
+  }
+
+  sqe = &ring->sqes[ ring->sq_local & ring->sq_mask ];
+  memset( sqe, 0, sizeof( struct io_uring_sqe ) );
+  ring->sq_local++;
+  return sqe;
+}
+
+int uring_wait( struct uring_t *ring, int msec ){
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg = { .sigmask_sz = _NSIG / 8 };
+  unsigned submit;
+
+  __atomic_store_n( ring->sq_tail, ring->sq_local, __ATOMIC_RELEASE );
+  submit = ring->sq_local - __atomic_load_n( ring->sq_head, __ATOMIC_ACQUIRE );
+
+  // Completions already there: the queued entries go without waiting
+  if( uring_cqe( ring ) ){ msec = 0; }
+  if( msec > 0 ){
+    ts.tv_sec  = msec / 1000;
+    ts.tv_nsec = ( msec % 1000 ) * 1000000L;
+    arg.ts     = (uintptr_t)&ts;
+  }
+  if( uring_enter( ring, submit, msec != 0 ? 1 : 0, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                   &arg, sizeof( arg ) ) < 0 ){
+    if( errno == ETIME || errno == EINTR || errno == EAGAIN || errno == EBUSY ){ return 0; }
+    return -1;
+  }
+  return 0;
+}
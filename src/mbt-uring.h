@@ -0,0 +1,127 @@
+#ifndef _MBT_URING_H_
+#define _MBT_URING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <linux/io_uring.h>
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ TYPES
+/**
+ * An io_uring instance driven with the bare system calls, no liburing. Submission entries are taken with
+ * uring_sqe() and only handed to the kernel by the next uring_wait(): everything queued by a loop round goes
+ * with a single system call, the wait for completions included.
+ */
+struct uring_t{
+  int                    fd;                       ///< Ring descriptor, -1 if not set up
+  unsigned               features;                 ///< IORING_FEAT_* of the kernel
+  unsigned              *sq_head;                  ///< Submission queue, shared with the kernel
+  unsigned              *sq_tail;
+  unsigned               sq_mask;
+  unsigned               sq_entries;
+  unsigned              *sq_array;
+  unsigned               sq_local;                 ///< Entries taken, published to the kernel on submission
+  struct io_uring_sqe   *sqes;
+  unsigned              *cq_head;                  ///< Completion queue, shared with the kernel
+  unsigned              *cq_tail;
+  unsigned               cq_mask;
+  struct io_uring_cqe   *cqes;
+  void                  *sq_map, *cq_map;          ///< Ring mappings, the same one for both on recent kernels
+  size_t                 sq_map_len, cq_map_len, sqes_len;
+  struct io_uring_buf_ring *br;                    ///< Provided buffers ring, NULL if none
+  uint16_t               br_mask;
+  uint16_t               br_tail;                  ///< Buffers given back, published at once
+  uint8_t               *bufs;                     ///< Buffers memory
+  uint32_t               buf_size;                 ///< Bytes per buffer
+  size_t                 br_len, bufs_len;
+};
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS
+
+/**
+ * @brief      Sets up a ring for a single thread: completions are only processed when that thread waits
+ *
+ * @param      ring     The ring
+ * @param[in]  entries  Submission queue entries, the completion queue gets four times as many
+ *
+ * @return     0 on success, -1 on failure (errno set)
+ */
+int uring_init( struct uring_t *ring, unsigned entries );
+
+/**
+ * @brief      Releases a ring and its buffers, requests still in flight are cancelled by the kernel
+ *
+ * @param      ring  The ring
+ */
+void uring_exit( struct uring_t *ring );
+
+/**
+ * @brief      Registers a ring of provided buffers, picked by the kernel for the receives with IOSQE_BUFFER_SELECT
+ *
+ * @param      ring   The ring
+ * @param[in]  bgid   Buffer group id, set in buf_group of the receives
+ * @param[in]  count  Number of buffers, a power of 2 up to 32768
+ * @param[in]  size   Bytes per buffer
+ *
+ * @return     0 on success, -1 on failure (errno set)
+ */
+int uring_bufs_init( struct uring_t *ring, uint16_t bgid, unsigned count, uint32_t size );
+
+/**
+ * @brief      Gets the data of a provided buffer
+ *
+ * @param      ring  The ring
+ * @param[in]  bid   The buffer id, from the completion flags
+ *
+ * @return     The buffer
+ */
+static inline uint8_t *uring_buf( struct uring_t *ring, uint16_t bid ){
+  return ring->bufs + (size_t)bid * ring->buf_size;
+}
+
+/**
+ * @brief      Gives a provided buffer back to the kernel
+ *
+ * @param      ring  The ring
+ * @param[in]  bid   The buffer id
+ */
+void uring_buf_put( struct uring_t *ring, uint16_t bid );
+
+/**
+ * @brief      Takes a free submission entry, cleared. A full queue is submitted first
+ *
+ * @param      ring  The ring
+ *
+ * @return     The entry, NULL if the kernel took none of the queued ones
+ */
+struct io_uring_sqe *uring_sqe( struct uring_t *ring );
+
+/**
+ * @brief      Submits the queued entries and waits for a completion
+ *
+ * @param      ring  The ring
+ * @param[in]  msec  Longest wait, 0 to only submit, -1 without limit
+ *
+ * @return     0 on success or timeout, -1 on failure (errno set)
+ */
+int uring_wait( struct uring_t *ring, int msec );
+
+/**
+ * @brief      Gets the next completion
+ *
+ * @param      ring  The ring
+ *
+ * @return     The completion, to be released with uring_cqe_seen(). NULL if none
+ */
+static inline struct io_uring_cqe *uring_cqe( struct uring_t *ring ){
+  unsigned head = *ring->cq_head;
+
+  if( head == __atomic_load_n( ring->cq_tail, __ATOMIC_ACQUIRE ) ){ return NULL; }
+  return &ring->cqes[ head & ring->cq_mask ];
+}
+
+static inline void uring_cqe_seen( struct uring_t *ring ){
+  __atomic_store_n( ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE );
+}
+
+#endif // _MBT_URING_H_
@@ -0,0 +1,264 @@
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ INCLUDES
+#include <signal.h>
+
+#include "mbt-srv.h"
+#include "mbt-load.h"
+#include "mbt-scan.h"
+#include "mbt-replay.h"
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ DEFINITIONS
+#define DEF_CLI_TCP_ADDR       "127.0.0.1"
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS
+void help(){
+  printf( "Command: \n  ./modbus-client tcp -a <address> -p <port> [options]\n  ./modbus-client rtu -d <tty> -s <speed> [options]\n" );
+  printf( "  ./modbus-client scan -C <config> [options]\n" );
+  printf( "  ./modbus-client replay -T <trace> -a <address> -p <port> [options]\n\n" );
+
+  printf( "\nSpecific: \n" );
+  printf( "  rtu                 Load a RTU slave\n" );
+  printf( "  tcp                 Load a TCP server\n" );
+  printf( "  scan                Poll the tags of the TCP devices listed by a config\n" );
+  printf( "  replay              Send the queries of a trace recorded by modbus-server -k to a TCP server\n" );
+  printf( "  -a, --address       TCP server address ( default = %s )\n", DEF_CLI_TCP_ADDR );
+  printf( "  -p, --port          TCP server port ( default = %s )\n", DEF_TCP_PORT );
+  printf( "  -d, --rtu-dev       tty used bu RTU  ( default = %s )\n", DEF_RTU_DEV );
+  printf( "  -s, --rtu-speed     RTU serial speed ( default = %d )\n", DEF_RTU_SPEED );
+  printf( "  -u, --unit          Unit id, the slave address over RTU ( default = %d )\n", DEF_LOAD_UNIT );
+  printf( "  -n, --conns         TCP connections ( default = %d )\n", DEF_LOAD_CONNS );
+  printf( "  -q, --depth         Requests in flight per TCP connection ( default = %d, scan default = %d, replay default = %d )\n", DEF_LOAD_DEPTH, DEF_SCAN_DEPTH, DEF_REPLAY_DEPTH );
+  printf( "  -w, --workers       Event loop threads, connections are spread among them ( default = %d )\n", DEF_WORKERS );
+  printf( "  -R, --rate          Requests per second, open loop. 0 is a closed loop at max rate ( default = 0 )\n" );
+  printf( "  -t, --time          Test seconds, 0 until stopped ( default = %d, scan default = 0 )\n", DEF_LOAD_SECONDS );
+  printf( "  -f, --mix           Function codes with weights, eg. 3:80,16:15,1:5 ( default = %s )\n", DEF_LOAD_MIX );
+  printf( "  -A, --reg-addr      First register or bit ( default = 0 )\n" );
+  printf( "  -k, --count         Registers or bits per request ( default = %d )\n", DEF_LOAD_COUNT );
+  printf( "  -x, --span          Requests start anywhere in the first span registers ( default = count )\n" );
+  printf( "  -o, --timeout       Reply timeout in milliseconds ( default = %d )\n", DEF_LOAD_TIMEOUT_MSEC );
+  printf( "  -C, --config        Scan devices and tags file\n" );
+  printf( "  -T, --trace         Replay: trace file\n" );
+  printf( "  -X, --speed         Replay: time scale, 2 twice as fast as recorded, 0 as fast as the server replies ( default = %.0f )\n", DEF_REPLAY_SPEED );
+  printf( "  -g, --gap           Scan: unused registers or bits a request may read to join two tags ( default = %d )\n", DEF_SCAN_GAP );
+
+  printf( "\nCommon:\n" );
+  printf( "  -l, --level         Sets verbosity level [ error, warning, info, verbose, debug, none ] ( default = info )\n" );
+  printf( "  -c, --colors        Set colored output on\n" );
+  printf( "  -h, --help          Print help\n" );
+  printf( "\n" );
+}
+
+void on_signal( int sig ){
+  load_stop();
+  scan_stop();
+  replay_stop();
+}
+
+void print_latency( const char *name, const struct stats_hist_t *hist ){
+  printf( "  %-16s %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", name,
+          stats_percentile( hist, 50.0 ) / 1e3, stats_percentile( hist, 90.0 ) / 1e3, stats_percentile( hist, 99.0 ) / 1e3,
+          stats_percentile( hist, 99.9 ) / 1e3, hist->max / 1e3, hist->count ? hist->sum / 1e3 / hist->count : 0.0 );
+}
+
+void print_result( struct load_args_t *args, struct load_result_t *res ){
+  static struct stats_hist_t lat, lat_co;
+  uint64_t sent = 0, replies = 0, exceptions = 0, bytes_in = 0, bytes_out = 0;
+  char name[32];
+
+  for( int f = 0; f < STATS_FCS; f++ ){
+    sent       += res->fc[f].sent;
+    replies    += res->fc[f].replies;
+    exceptions += res->fc[f].exceptions;
+    bytes_in   += res->fc[f].bytes_in;
+    bytes_out  += res->fc[f].bytes_out;
+    stats_hist_add( &lat, &res->fc[f].lat );
+    stats_hist_add( &lat_co, &res->fc[f].lat_co );
+  }
+
+  printf( "\n%s load: %d connections, depth %d, %s", mdb_proto_strings[ args->proto ], args->conns, args->depth,
+          args->rate > 0.0 ? "open loop" : "closed loop" );
+  if( args->rate > 0.0 ){ printf( " at %.0f req/s", args->rate ); }
+  printf( ", %.2f s\n", res->elapsed );
+  printf( "  Requests:   %lu sent, %lu replies, %lu exceptions, %lu timeouts, %lu errors, %lu connections opened\n",
+          sent, replies, exceptions, res->timeouts, res->errors, res->connects );
+  printf( "  Throughput: %.1f replies/s, %.1f KiB/s out, %.1f KiB/s in\n",
+          replies / res->elapsed, bytes_out / 1024.0 / res->elapsed, bytes_in / 1024.0 / res->elapsed );
+
+  printf( "\n  Latency usec            p50        p90        p99      p99.9        max       mean\n" );
+  print_latency( "all", &lat );
+  print_latency( "all corrected", &lat_co );
+  for( int f = 0; f < STATS_FCS; f++ ){
+    if( !res->fc[f].replies ){ continue; }
+    snprintf( name, sizeof( name ), "FC %02X", stats_slot_fc[f] );
+    print_latency( name, &res->fc[f].lat );
+    snprintf( name, sizeof( name ), "FC %02X corrected", stats_slot_fc[f] );
+    print_latency( name, &res->fc[f].lat_co );
+  }
+  printf( "\n" );
+}
+
+void print_scan( struct scan_args_t *args, struct scan_result_t *res ){
+  printf( "\nScan: %d devices, %d tags in %d requests, %d workers, %.2f s\n", res->devices, res->tags, res->blocks,
+          args->workers, res->elapsed );
+  printf( "  Config:     %.1f tag polls/s as %.1f requests/s, %.1f tags per request\n", res->tag_polls, res->req_polls,
+          res->req_polls > 0.0 ? res->tag_polls / res->req_polls : 0.0 );
+  printf( "  Requests:   %lu sent, %lu replies, %lu exceptions, %lu timeouts, %lu errors\n",
+          res->sent, res->replies, res->exceptions, res->timeouts, res->errors );
+  printf( "  Skipped:    %lu overruns, %lu unreachable\n", res->overruns, res->unreachable );
+  printf( "  Throughput: %.1f polls/s\n", res->replies / res->elapsed );
+
+  printf( "\n  Latency usec            p50        p90        p99      p99.9        max       mean\n" );
+  print_latency( "from due time", &res->lat );
+  printf( "\n" );
+}
+
+void print_replay( struct replay_args_t *args, struct replay_result_t *res ){
+  struct load_result_t *load = &res->load;
+  static struct stats_hist_t lat, lat_co;
+  uint64_t sent = 0, replies = 0, exceptions = 0;
+
+  for( int f = 0; f < STATS_FCS; f++ ){
+    sent       += load->fc[f].sent;
+    replies    += load->fc[f].replies;
+    exceptions += load->fc[f].exceptions;
+    stats_hist_add( &lat, &load->fc[f].lat );
+    stats_hist_add( &lat_co, &load->fc[f].lat_co );
+  }
+
+  printf( "\nReplay of %s: %.2f s recorded, %lu records, replayed in %.2f s", args->trace, res->span, res->records, load->elapsed );
+  if( args->speed > 0.0 ){ printf( " at %gx\n", args->speed ); }
+  else{ printf( " at max speed\n" ); }
+  printf( "  Requests:   %lu queries, %lu sent, %lu late, %lu replies, %lu exceptions, %lu timeouts, %lu errors\n",
+          res->queries, sent, res->late, replies, exceptions, load->timeouts, load->errors );
+  printf( "  Throughput: %.1f replies/s over %lu connections\n", replies / load->elapsed, res->conns );
+
+  printf( "\n  Latency usec            p50        p90        p99      p99.9        max       mean\n" );
+  print_latency( "from sent", &lat );
+  print_latency( "from due time", &lat_co );
+  printf( "\n" );
+}
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ MAIN
+int main( const int argc, const char** argv ){
+  static struct load_result_t result;
+  static struct scan_result_t scan_result;
+  struct scan_args_t scan_args = {
+    .config       = NULL,
+    .workers      = DEF_WORKERS,
+    .depth        = DEF_SCAN_DEPTH,
+    .gap          = DEF_SCAN_GAP,
+    .seconds      = 0,
+    .timeout_msec = DEF_LOAD_TIMEOUT_MSEC
+  };
+  static struct replay_result_t replay_result;
+  struct replay_args_t replay_args = {
+    .trace        = NULL,
+    .speed        = DEF_REPLAY_SPEED,
+    .depth        = DEF_REPLAY_DEPTH,
+    .timeout_msec = DEF_LOAD_TIMEOUT_MSEC
+  };
+  int scan = 0, replay = 0, seconds = -1, depth = -1;
+  struct load_args_t args = {
+    .proto        = MDB_PROTO_TCP,
+    .addr         = DEF_CLI_TCP_ADDR,
+    .port         = DEF_TCP_PORT,
+    .dev          = DEF_RTU_DEV,
+    .speed        = DEF_RTU_SPEED,
+    .unit         = DEF_LOAD_UNIT,
+    .conns        = DEF_LOAD_CONNS,
+    .depth        = DEF_LOAD_DEPTH,
+    .workers      = DEF_WORKERS,
+    .rate         = 0.0,
+    .seconds      = DEF_LOAD_SECONDS,
+    .mix          = DEF_LOAD_MIX,
+    .reg_addr     = 0,
+    .count        = DEF_LOAD_COUNT,
+    .span         = 0,
+    .timeout_msec = DEF_LOAD_TIMEOUT_MSEC
+  };
+
+  set_debug( DBG_INF );
+
+  // BEGIN: Command line args
+  for( int i = 1; i < argc; i++ ){
+    if(      strcmp( argv[i], "-h"  ) == 0 || strcmp( argv[i], "--help"        ) == 0 ){ help(); return 0; }
+    else if( strcmp( argv[i], "-c"  ) == 0 || strcmp( argv[i], "--colors"      ) == 0 ){ set_msg_colors( 1 ); }
+    else if( strcmp( argv[i], "rtu" ) == 0 ){ args.proto = MDB_PROTO_RTU; }
+    else if( strcmp( argv[i], "tcp" ) == 0 ){ args.proto = MDB_PROTO_TCP; }
+    else if( strcmp( argv[i], "scan" ) == 0 ){ scan = 1; }
+    else if( strcmp( argv[i], "replay" ) == 0 ){ replay = 1; }
+    else if( (strcmp( argv[i], "-a" ) == 0 || strcmp( argv[i], "--address"    ) == 0 ) && (i+1)<argc ){ args.addr = (char *)argv[++i]; }
+    else if( (strcmp( argv[i], "-p" ) == 0 || strcmp( argv[i], "--port"       ) == 0 ) && (i+1)<argc ){ args.port = (char *)argv[++i]; }
+    else if( (strcmp( argv[i], "-d" ) == 0 || strcmp( argv[i], "--rtu-dev"    ) == 0 ) && (i+1)<argc ){ args.dev  = (char *)argv[++i]; }
+    else if( (strcmp( argv[i], "-s" ) == 0 || strcmp( argv[i], "--rtu-speed"  ) == 0 ) && (i+1)<argc ){ args.speed   = atoi( argv[++i] ); }
+    else if( (strcmp( argv[i], "-u" ) == 0 || strcmp( argv[i], "--unit"       ) == 0 ) && (i+1)<argc ){ args.unit    = atoi( argv[++i] ); }
+    else if( (strcmp( argv[i], "-n" ) == 0 || strcmp( argv[i], "--conns"      ) == 0 ) && (i+1)<argc ){ args.conns   = atoi( argv[++i] ); }
+    else if( (strcmp( argv[i], "-q" ) == 0 || strcmp( argv[i], "--depth"      ) == 0 ) && (i+1)<argc ){ depth        = atoi( argv[++i] ); }
+    else if( (strcmp( argv[i], "-w" ) == 0 || strcmp( argv[i], "--workers"    ) == 0 ) && (i+1)<argc ){ args.workers = scan_args.workers = atoi( argv[++i] ); }
+    else if( (strcmp( argv[i], "-R" ) == 0 || strcmp( argv[i], "--rate"       ) == 0 ) && (i+1)<argc ){ args.rate    = atof( argv[++i] ); }
+    else if( (strcmp( argv[i], "-t" ) == 0 || strcmp( argv[i], "--time"       ) == 0 ) && (i+1)<argc ){ seconds      = atoi( argv[++i] ); }
+    else if( (strcmp( argv[i], "-f" ) == 0 || strcmp( argv[i], "--mix"        ) == 0 ) && (i+1)<argc ){ args.mix     = (char *)argv[++i]; }
+    else if( (strcmp( argv[i], "-A" ) == 0 || strcmp( argv[i], "--reg-addr"   ) == 0 ) && (i+1)<argc ){ args.reg_addr = strtol( argv[++i], NULL, 0 ); }
+    else if( (strcmp( argv[i], "-k" ) == 0 || strcmp( argv[i], "--count"      ) == 0 ) && (i+1)<argc ){ args.count   = atoi( argv[++i] ); }
+    else if( (strcmp( argv[i], "-x" ) == 0 || strcmp( argv[i], "--span"       ) == 0 ) && (i+1)<argc ){ args.span    = atoi( argv[++i] ); }
+    else if( (strcmp( argv[i], "-o" ) == 0 || strcmp( argv[i], "--timeout"    ) == 0 ) && (i+1)<argc ){ args.timeout_msec = scan_args.timeout_msec = replay_args.timeout_msec = atoi( argv[++i] ); }
+    else if( (strcmp( argv[i], "-C" ) == 0 || strcmp( argv[i], "--config"     ) == 0 ) && (i+1)<argc ){ scan_args.config = (char *)argv[++i]; }
+    else if( (strcmp( argv[i], "-T" ) == 0 || strcmp( argv[i], "--trace"      ) == 0 ) && (i+1)<argc ){ replay_args.trace = (char *)argv[++i]; }
+    else if( (strcmp( argv[i], "-X" ) == 0 || strcmp( argv[i], "--speed"      ) == 0 ) && (i+1)<argc ){ replay_args.speed = atof( argv[++i] ); }
+    else if( (strcmp( argv[i], "-g" ) == 0 || strcmp( argv[i], "--gap"        ) == 0 ) && (i+1)<argc ){ scan_args.gap    = atoi( argv[++i] ); }
+    else if( (strcmp( argv[i], "-l" ) == 0 || strcmp( argv[i], "--level"      ) == 0 ) && (i+1)<argc ){
+      i++;
+      if(       strcmp( argv[i], "error"   ) == 0 ){ set_debug( DBG_ERR   ); }
+      else if(  strcmp( argv[i], "warning" ) == 0 ){ set_debug( DBG_WAR   ); }
+      else if(  strcmp( argv[i], "info"    ) == 0 ){ set_debug( DBG_INF   ); }
+      else if(  strcmp( argv[i], "verbose" ) == 0 ){ set_debug( DBG_VER   ); }
+      else if(  strcmp( argv[i], "debug"   ) == 0 ){ set_debug( DBG_DBG   ); }
+      else if(  strcmp( argv[i], "none"    ) == 0 ){ set_debug( DBG_NONE  ); }
+    }
+    else{ log_war( "Unknown or invalid argument: '%s'", argv[i] ); }
+  }
+  // END: Command line args
+
+  signal( SIGINT,  on_signal );
+  signal( SIGTERM, on_signal );
+
+  if( scan ){
+    if( seconds >= 0 ){ scan_args.seconds = seconds; }
+    if( depth   >= 0 ){ scan_args.depth   = depth; }
+    if( scan_run( &scan_args, &scan_result ) != 0 ){
+      log_err( "Scan failed to start" );
+      return -1;
+    }
+    msg_flush();
+    print_scan( &scan_args, &scan_result );
+    return EXIT_SUCCESS;
+  }
+
+  if( replay ){
+    if( !replay_args.trace ){
+      log_err( "Replay needs a trace: -T <file>" );
+      return -1;
+    }
+    if( depth >= 0 ){ replay_args.depth = depth; }
+    replay_args.addr = args.addr;
+    replay_args.port = args.port;
+    if( replay_run( &replay_args, &replay_result ) != 0 ){
+      log_err( "Replay failed to start" );
+      return -1;
+    }
+    msg_flush();
+    print_replay( &replay_args, &replay_result );
+    return EXIT_SUCCESS;
+  }
+
+  if( seconds >= 0 ){ args.seconds = seconds; }
+  if( depth   >= 0 ){ args.depth   = depth; }
+
+  if( load_run( &args, &result ) != 0 ){
+    log_err( "Load test failed to start" );
+    return -1;
+  }
+  msg_flush();
+  print_result( &args, &result );
+
+  return EXIT_SUCCESS;
+}
@@ -1,10 +1,47 @@
 // ~~~~~~~~~~~~~~~~~~~~~~~~~~ INCLUDES
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+
 #include "mbt-srv.h"
+#include "mbt-metrics.h"
+#include "mbt-gw.h"
 
 // ~~~~~~~~~~~~~~~~~~~~~~~~~~ DEFINITIONS
-#define STATUS_SLEEP   600    ///< This is the sleep between two check cicles. Nothing is actually done during the main cicle.
+#define STATUS_SLEEP   600    ///< Seconds between two status logs. Meanwhile the main cicle serves the metrics.
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ GLOBAL VARS
+volatile sig_atomic_t reload  = 0;  ///< Set by SIGHUP, the main cicle reloads the config file
+volatile sig_atomic_t upgrade = 0;  ///< Set by SIGUSR2, the main cicle starts the new server taking over
+volatile sig_atomic_t quit    = 0;  ///< Set by SIGTERM and SIGINT, the main cicle stops the server
 
 // ~~~~~~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS
+void on_signal( int sig ){
+  if(      sig == SIGHUP  ){ reload  = 1; }
+  else if( sig == SIGUSR2 ){ upgrade = 1; }
+  else{ quit = 1; }
+}
+
+/**
+ * @brief      Starts the server binary again, with the same arguments: the new process connects to the upgrade
+ *             socket and takes over
+ */
+void respawn( const char **argv ){
+  if( mbsrv_upgrade_fd() == -1 ){
+    log_war( "No upgrade socket: -U is needed to take over" );
+    return;
+  }
+
+  pid_t pid = fork();
+  if( pid == 0 ){
+    execvp( argv[0], (char * const *)argv );
+    _exit( 127 );
+  }
+  if( pid == -1 ){ log_err( "Failed starting the new server: %s", strerror( errno ) ); }
+  else{ log_inf( "New server started with pid %d, handing over once it connects", pid ); }
+}
+
 void help(){
   printf( "Command: \n  ./modbus-tester tcp -a <address> -p <port> [options]\n\n" );
 
@@ -15,11 +52,27 @@ void help(){
   printf( "  tcp                 Enable TCP\n" );
   printf( "  -a, --address       Specify IP address to bind modbus TCP server ( default = %s )\n", DEF_TCP_ADDR );
   printf( "  -p, --port          Port used by TCP socket ( default = %s )\n", DEF_TCP_PORT );
-  printf( "  -d, --rtu-dev       tty used bu RTU  ( default = %s )\n", DEF_RTU_DEV );
+  printf( "  -m, --max-conn      Max simultaneous TCP connections ( default = %d )\n", DEF_MAX_CONN );
+  printf( "  -w, --workers       TCP event loop threads, sharing the same registers ( default = %d )\n", DEF_WORKERS );
+  printf( "  -b, --backend       TCP event loop [ epoll, uring ] ( default = %s )\n", mbtcp_backend_strings[ MBTCP_BACKEND_EPOLL ] );
+  printf( "  -d, --rtu-dev       ttys used by RTU, eg. /dev/ttyUSB0,/dev/ttyS1@19200 or pty ( default = %s )\n", DEF_RTU_DEV );
   printf( "  -r, --rtu-addr      RTU Address number ( default = %d )\n", DEF_RTU_ADDR );
   printf( "  -s, --rtu-speed     RTU serial speed ( default = %d )\n", DEF_RTU_SPEED );
   printf( "  -e, --error-rate    Modbus Errors Rate in percent [0.0 - 100.0] ( default = %f )\n", DEF_ERR_RATE );
+  printf( "  -F, --faults        Fault rules, eg. 'delay=50-200:rate=10:fc=3;reset:rate=0.1:unit=5' ( default = none )\n" );
+  printf( "  -g, --generators    Simulated registers, eg. 'sine:hr=0-9999:max=1000:period=5000;walk:ir=0-99:hz=50' ( default = none )\n" );
+  printf( "  -k, --capture       Records every query and reply to a trace file, replayed by modbus-client replay ( default = none )\n" );
   printf( "  -i, --init-value    Modbus Errors Rate in percent [0x0 - 0xFF] ( default = %02X )\n", DEF_INIT_VAL );
+  printf( "  -W, --wire-order    Registers stored big endian as on the wire: reads and writes are plain copies\n" );
+  printf( "  -S, --shm           Shared memory segment holding the registers, eg. /mbt-regs ( default = private )\n" );
+  printf( "  -P, --persist       File the registers are saved to, and restored from at start ( default = none )\n" );
+  printf( "  -u, --units         Unit ids with their own registers, eg. 1-247 or 1,5,10-20 ( default = all ids share the same )\n" );
+  printf( "  -f, --config        Units, table sizes, initial values and fault rules file, reloaded on SIGHUP ( default = none )\n" );
+  printf( "  -U, --upgrade       UNIX socket a new server takes over from, SIGUSR2 starts one: connections stay open ( default = none )\n" );
+  printf( "  -G, --gateway       Units forwarded to RTU buses, eg. '1-10=/dev/ttyUSB0;11,12=/dev/ttyS1@19200' ( default = none )\n" );
+  printf( "  -T, --gw-timeout    Gateway wait for a slave reply in msec ( default = %d )\n", DEF_GW_TIMEOUT_MSEC );
+  printf( "  -C, --gw-cache      Gateway reads served from the cache up to this age in msec, 0 to disable ( default = %d )\n", DEF_GW_TTL_MSEC );
+  printf( "  -M, --metrics       Prometheus metrics endpoint: a TCP port, or a UNIX socket path ( default = none )\n" );
 
   printf( "\nCommon:\n" );
   printf( "  -l, --level         Sets verbosity level [ error, warning, info, verbose, debug, none ] ( default = %s )\n", DEF_LEVEL_STR );
@@ -30,21 +83,57 @@ void help(){
   printf( "\n" );
 }
 
+void print_stats( enum mdb_proto_type proto ){
+  static struct stats_t stats;
+  mbsrv_stats( proto, &stats );
+
+  for( int f = 0; f < STATS_FCS; f++ ){
+    const struct stats_fc_t *fc = &stats.fc[f];
+    if( !fc->requests ){ continue; }
+
+    log_inf( "%s FC %02X: %lu requests, %lu exceptions, %lu injected, %lu bytes in, %lu bytes out",
+             mdb_proto_strings[ proto ], stats_slot_fc[f], fc->requests, fc->exceptions, fc->injected, fc->bytes_in, fc->bytes_out );
+    log_inf( "%s FC %02X: p50/p99/max usec receive %.1f/%.1f/%.1f query %.1f/%.1f/%.1f reply %.1f/%.1f/%.1f",
+             mdb_proto_strings[ proto ], stats_slot_fc[f],
+             stats_percentile( &fc->lat[ STATS_RECEIVE ], 50.0 ) / 1e3, stats_percentile( &fc->lat[ STATS_RECEIVE ], 99.0 ) / 1e3, fc->lat[ STATS_RECEIVE ].max / 1e3,
+             stats_percentile( &fc->lat[ STATS_QUERY ],   50.0 ) / 1e3, stats_percentile( &fc->lat[ STATS_QUERY ],   99.0 ) / 1e3, fc->lat[ STATS_QUERY ].max / 1e3,
+             stats_percentile( &fc->lat[ STATS_REPLY ],   50.0 ) / 1e3, stats_percentile( &fc->lat[ STATS_REPLY ],   99.0 ) / 1e3, fc->lat[ STATS_REPLY ].max / 1e3 );
+  }
+}
+
 // ~~~~~~~~~~~~~~~~~~~~~~~~~~ MAIN
 int main( const int argc, const char** argv ){
   const char *tcp_addr = NULL,
              *port     = NULL,    // tcp_pi uses string port/service
-             *rtu_dev  = NULL;    // tty path of RTU
+             *rtu_dev  = NULL,    // tty path of RTU
+             *units    = NULL,    // unit ids routed to their own registers
+             *shm      = NULL,    // shared memory segment name of the registers
+             *persist  = NULL,    // snapshot file of the registers
+             *metrics_spec = NULL, // metrics port or socket path
+             *faults   = NULL,    // fault injection rules
+             *sim      = NULL,    // register generators
+             *capture  = NULL,    // ADU trace file
+             *config   = NULL,    // layout file
+             *upgrade_sock = NULL, // upgrade socket path
+             *gateway  = NULL;    // units routed to RTU buses
   int rtu_addr    = 0,
+      gw_timeout  = DEF_GW_TIMEOUT_MSEC,
+      gw_ttl      = DEF_GW_TTL_MSEC,
       rtu_speed   = 0,
+      max_conn    = 0,
+      workers     = 0,
+      backend     = MBTCP_BACKEND_EPOLL,
       rtu_enabled = 0,
-      tcp_enabled = 0;
+      tcp_enabled = 0,
+      wire_order  = 0;
 
   uint8_t init_value = DEF_INIT_VAL;
   float error_rate = DEF_ERR_RATE;
 
   struct tcp_args_t tcp_args = { 0 };
   struct rtu_args_t rtu_args = { 0 };
+  struct srv_common_t common = { 0 };
+  static struct metrics_t metrics;
 
   // Setting default debug level
   set_debug( DEF_LEVEL );
@@ -53,6 +142,7 @@ int main( const int argc, const char** argv ){
   for( int i = 1; i < argc; i++ ){
     if(      strcmp( argv[i], "-h"  ) == 0 || strcmp( argv[i], "--help"        ) == 0 ){ help(); return 0; }
     else if( strcmp( argv[i], "-c"  ) == 0 || strcmp( argv[i], "--colors"      ) == 0 ){ set_msg_colors( 1 ); }
+    else if( strcmp( argv[i], "-W"  ) == 0 || strcmp( argv[i], "--wire-order"  ) == 0 ){ wire_order = 1; }
     else if( strcmp( argv[i], "rtu" ) == 0 ){ rtu_enabled = 1; }
     else if( strcmp( argv[i], "tcp" ) == 0 ){ tcp_enabled = 1; }
     else if( (strcmp( argv[i], "-a" ) == 0 || strcmp( argv[i], "--address"    ) == 0 ) && (i+1)<argc ){
@@ -63,6 +153,20 @@ int main( const int argc, const char** argv ){
       i++;
       port = argv[i]; // tcp_pi uses string port/service
     }
+    else if( (strcmp( argv[i], "-m" ) == 0 || strcmp( argv[i], "--max-conn"   ) == 0 ) && (i+1)<argc && atoi(argv[i+1]) > 0 ){
+      i++;
+      max_conn = atoi( argv[i] );
+    }
+    else if( (strcmp( argv[i], "-w" ) == 0 || strcmp( argv[i], "--workers"    ) == 0 ) && (i+1)<argc && atoi(argv[i+1]) > 0 ){
+      i++;
+      workers = atoi( argv[i] );
+    }
+    else if( (strcmp( argv[i], "-b" ) == 0 || strcmp( argv[i], "--backend"    ) == 0 ) && (i+1)<argc ){
+      i++;
+      if(       strcmp( argv[i], "epoll" ) == 0 ){ backend = MBTCP_BACKEND_EPOLL; }
+      else if(  strcmp( argv[i], "uring" ) == 0 ){ backend = MBTCP_BACKEND_URING; }
+      else{ log_war( "Unknown TCP backend: '%s'", argv[i] ); }
+    }
     else if( (strcmp( argv[i], "-d" ) == 0 || strcmp( argv[i], "--rtu-dev"    ) == 0 ) && (i+1)<argc ){
       i++;
       rtu_dev = argv[i];
@@ -85,6 +189,54 @@ int main( const int argc, const char** argv ){
       long tmp_val = strtol(argv[i], NULL, 0);
       if (tmp_val >= 0x0 && tmp_val <= 0xFF) { init_value = tmp_val & 0xFF; }
     }
+    else if( (strcmp( argv[i], "-F" ) == 0 || strcmp( argv[i], "--faults"     ) == 0 ) && (i+1)<argc ){
+      i++;
+      faults = argv[i];
+    }
+    else if( (strcmp( argv[i], "-g" ) == 0 || strcmp( argv[i], "--generators" ) == 0 ) && (i+1)<argc ){
+      i++;
+      sim = argv[i];
+    }
+    else if( (strcmp( argv[i], "-k" ) == 0 || strcmp( argv[i], "--capture"    ) == 0 ) && (i+1)<argc ){
+      i++;
+      capture = argv[i];
+    }
+    else if( (strcmp( argv[i], "-u" ) == 0 || strcmp( argv[i], "--units"      ) == 0 ) && (i+1)<argc ){
+      i++;
+      units = argv[i];
+    }
+    else if( (strcmp( argv[i], "-f" ) == 0 || strcmp( argv[i], "--config"     ) == 0 ) && (i+1)<argc ){
+      i++;
+      config = argv[i];
+    }
+    else if( (strcmp( argv[i], "-U" ) == 0 || strcmp( argv[i], "--upgrade"    ) == 0 ) && (i+1)<argc ){
+      i++;
+      upgrade_sock = argv[i];
+    }
+    else if( (strcmp( argv[i], "-S" ) == 0 || strcmp( argv[i], "--shm"        ) == 0 ) && (i+1)<argc ){
+      i++;
+      shm = argv[i];
+    }
+    else if( (strcmp( argv[i], "-P" ) == 0 || strcmp( argv[i], "--persist"    ) == 0 ) && (i+1)<argc ){
+      i++;
+      persist = argv[i];
+    }
+    else if( (strcmp( argv[i], "-G" ) == 0 || strcmp( argv[i], "--gateway"    ) == 0 ) && (i+1)<argc ){
+      i++;
+      gateway = argv[i];
+    }
+    else if( (strcmp( argv[i], "-T" ) == 0 || strcmp( argv[i], "--gw-timeout" ) == 0 ) && (i+1)<argc && atoi(argv[i+1]) > 0 ){
+      i++;
+      gw_timeout = atoi( argv[i] );
+    }
+    else if( (strcmp( argv[i], "-C" ) == 0 || strcmp( argv[i], "--gw-cache"   ) == 0 ) && (i+1)<argc && atoi(argv[i+1]) >= 0 ){
+      i++;
+      gw_ttl = atoi( argv[i] );
+    }
+    else if( (strcmp( argv[i], "-M" ) == 0 || strcmp( argv[i], "--metrics"    ) == 0 ) && (i+1)<argc ){
+      i++;
+      metrics_spec = argv[i];
+    }
     else if( (strcmp( argv[i], "-l" ) == 0 || strcmp( argv[i], "--level"      ) == 0 ) && (i+1)<argc ){
       i++;
       if(       strcmp( argv[i], "error"   ) == 0 ){ set_debug( DBG_ERR   ); }
@@ -107,6 +259,12 @@ int main( const int argc, const char** argv ){
   if( !port || atoi(port) < 1 || atoi(port) > 65535 ){
     port = DEF_TCP_PORT;
   }
+  if( max_conn <= 0 ){
+    max_conn = DEF_MAX_CONN;
+  }
+  if( workers <= 0 ){
+    workers = DEF_WORKERS;
+  }
   if( !rtu_dev ){
     rtu_dev = DEF_RTU_DEV;
   }
@@ -120,16 +278,33 @@ int main( const int argc, const char** argv ){
 
   snprintf( tcp_args.port, sizeof(tcp_args.port), "%s", port );
   tcp_args.enabled = tcp_enabled;
+  tcp_args.max_conn = max_conn;
+  tcp_args.workers  = workers;
+  tcp_args.backend  = backend;
   rtu_args.enabled = rtu_enabled;
   rtu_args.addr    = rtu_addr;
   rtu_args.speed   = rtu_speed;
   rtu_args.dev     = (char *)rtu_dev;
   tcp_args.addr    = (char *)tcp_addr;
 
-  tcp_args.init_value = init_value;
-  rtu_args.init_value = init_value;
-  tcp_args.error_rate = error_rate;
-  rtu_args.error_rate = error_rate;
+  common.init_value = init_value;
+  common.wire_order = wire_order;
+  common.units      = (char *)units;
+  common.shm        = (char *)shm;
+  common.persist    = (char *)persist;
+  common.error_rate = error_rate;
+  common.faults     = (char *)faults;
+  common.sim        = (char *)sim;
+  common.capture    = (char *)capture;
+  common.config     = (char *)config;
+  common.upgrade    = (char *)upgrade_sock;
+  tcp_args.common   = common;
+  rtu_args.common   = common;
+
+  tcp_args.gateway         = (char *)gateway;
+  tcp_args.gw_speed        = rtu_speed;
+  tcp_args.gw_timeout_msec = gw_timeout;
+  tcp_args.gw_ttl_msec     = gw_ttl;
 
   // Debug printing used vars
   if( get_debug() <= DBG_DBG ){
@@ -144,13 +319,27 @@ int main( const int argc, const char** argv ){
     }
     log_dbg( "├─ tcp_args.addr:       %s", tcp_args.addr      );
     log_dbg( "├─ tcp_args.port:       %s", tcp_args.port      );
-    log_dbg( "├─ tcp_args.init_value: %d", tcp_args.init_value);
-    log_dbg( "├─ tcp_args.error_rate: %f", tcp_args.error_rate);
+    log_dbg( "├─ tcp_args.max_conn:   %d", tcp_args.max_conn  );
+    log_dbg( "├─ tcp_args.workers:    %d", tcp_args.workers   );
+    log_dbg( "├─ tcp_args.backend:    %s", mbtcp_backend_strings[ tcp_args.backend ] );
+    log_dbg( "├─ tcp_args.gateway:    %s", tcp_args.gateway ? tcp_args.gateway : "none" );
+    log_dbg( "├─ tcp_args.gw_timeout: %d", tcp_args.gw_timeout_msec );
+    log_dbg( "├─ tcp_args.gw_ttl:     %d", tcp_args.gw_ttl_msec );
     log_dbg( "├─ rtu_args.dev:        %s", rtu_args.dev       );
     log_dbg( "├─ rtu_args.addr:       %d", rtu_args.addr      );
     log_dbg( "├─ rtu_args.speed:      %d", rtu_args.speed     );
-    log_dbg( "├─ rtu_args.init_value: %d", rtu_args.init_value);
-    log_dbg( "├─ rtu_args.error_rate: %f", rtu_args.error_rate);
+    log_dbg( "├─ common.init_value:   %d", common.init_value);
+    log_dbg( "├─ common.wire_order:   %s", common.wire_order ? "on" : "off" );
+    log_dbg( "├─ common.error_rate:   %f", common.error_rate);
+    log_dbg( "├─ common.faults:       %s", common.faults ? common.faults : "none" );
+    log_dbg( "├─ common.sim:          %s", common.sim ? common.sim : "none" );
+    log_dbg( "├─ common.capture:      %s", common.capture ? common.capture : "none" );
+    log_dbg( "├─ common.units:        %s", common.units ? common.units : "shared" );
+    log_dbg( "├─ common.config:       %s", common.config ? common.config : "none" );
+    log_dbg( "├─ common.upgrade:      %s", common.upgrade ? common.upgrade : "none" );
+    log_dbg( "├─ common.shm:          %s", common.shm   ? common.shm   : "private" );
+    log_dbg( "├─ common.persist:      %s", common.persist ? common.persist : "none" );
+    log_dbg( "├─ metrics:             %s", metrics_spec ? metrics_spec : "none" );
     log_dbg( "├─────" );
     log_dbg( "├─ dbgl:                %d", get_debug() );
     log_dbg( "├─ colors:              %s", is_msg_colors() ? ( COL_BRIGHT_GREEN "on" COL_RESET ) : "off" );
@@ -158,22 +347,102 @@ int main( const int argc, const char** argv ){
   }
   /** @todo  Add here the paramenters check! Very important!! */
 
+  // Server threads never get the signals: their waits are not interrupted, the main cicle alone handles them
+  sigset_t sigs;
+  sigemptyset( &sigs );
+  sigaddset( &sigs, SIGHUP );
+  sigaddset( &sigs, SIGUSR2 );
+  sigaddset( &sigs, SIGTERM );
+  sigaddset( &sigs, SIGINT );
+  pthread_sigmask( SIG_BLOCK, &sigs, NULL );
+
   const int start_status = mbsrv_start( &tcp_args, &rtu_args );
   if( start_status != 0 ){
     log_err( "Server failed to start with error: %d", start_status );
     return -1;
   }
 
+  struct sigaction sa = { .sa_handler = on_signal };
+  sigemptyset( &sa.sa_mask );
+  sigaction( SIGHUP,  &sa, NULL );
+  sigaction( SIGUSR2, &sa, NULL );
+  sigaction( SIGTERM, &sa, NULL );
+  sigaction( SIGINT,  &sa, NULL );
+
+  // A new server failing to start leaves no zombie behind
+  struct sigaction chld = { .sa_handler = SIG_DFL, .sa_flags = SA_NOCLDWAIT };
+  sigemptyset( &chld.sa_mask );
+  sigaction( SIGCHLD, &chld, NULL );
+  pthread_sigmask( SIG_UNBLOCK, &sigs, NULL );
+
   // ========================================
   // Main cicle starts
   // ========================================
-  while( 1 ){ /** @todo Add support for signals */
-    usleep( STATUS_SLEEP * 1000000 );
+  metrics.enabled[ MDB_PROTO_TCP ] = tcp_args.enabled;
+  metrics.enabled[ MDB_PROTO_RTU ] = rtu_args.enabled;
+  metrics.gateway                  = tcp_args.enabled && tcp_args.gateway;
+  if( metrics_open( &metrics, metrics_spec ) != 0 ){
+    log_err( "Failed opening metrics endpoint %s: %s", metrics_spec, strerror( errno ) );
+    mbsrv_stop();
+    return -1;
+  }
+  if( metrics_spec ){ log_inf( "Metrics served on %s", metrics_spec ); }
+
+  // Metrics scrapes, then the upgrade socket. poll() skips a -1 fd
+  struct pollfd pfd[ METRICS_POLLFDS + 1 ];
+  uint64_t next_status = stats_now() + STATUS_SLEEP * 1000000000ULL;
+  while( !quit ){
+    metrics_pollfds( &metrics, pfd );
+    pfd[ METRICS_POLLFDS ] = (struct pollfd){ .fd = mbsrv_upgrade_fd(), .events = POLLIN };
+
+    // Scrapes never block the loop: a slow one only makes the next poll shorter
+    int timeout = METRICS_SAMPLE_MSEC;
+    for( int c = 0; c < METRICS_CLIENTS_MAX; c++ ){
+      if( metrics.clients[c].fd != -1 ){ timeout = METRICS_IO_MSEC; }
+    }
+
+    if( poll( pfd, METRICS_POLLFDS + 1, timeout ) > 0 ){
+      // Once handed over, this server only stops
+      if( pfd[ METRICS_POLLFDS ].revents && mbsrv_handoff() == 0 ){ break; }
+    }
+    else{
+      for( int i = 0; i <= METRICS_POLLFDS; i++ ){ pfd[i].revents = 0; }
+    }
+    metrics_serve( &metrics, pfd );
+    if( reload ){
+      reload = 0;
+      mbsrv_reload();
+    }
+    if( upgrade ){
+      upgrade = 0;
+      respawn( argv );
+    }
+
+    uint64_t now = stats_now();
+    if( now - metrics.sample_ns >= METRICS_SAMPLE_MSEC * 1000000ULL ){ metrics_sample( &metrics ); }
+    if( now < next_status ){ continue; }
+    next_status = now + STATUS_SLEEP * 1000000000ULL;
 
-    /** @todo add some logic here. Implemented this way to give the possibility to do something while the server is running */
+    if( tcp_args.enabled ){
+      struct mbtcp_counters_t counters;
+      mbsrv_tcp_counters( &counters );
+      log_inf( "TCP connections: %lu active, %lu accepted, %lu closed, %lu rejected",
+               counters.active, counters.accepted, counters.closed, counters.rejected );
+    }
+    if( metrics.gateway ){
+      gw_counters( &metrics.gw );
+      log_inf( "Gateway: %lu requests, %lu cached, %lu coalesced, %lu transactions, %lu timeouts, %lu errors, p50/p99 usec %.1f/%.1f",
+               metrics.gw.requests, metrics.gw.cached, metrics.gw.coalesced, metrics.gw.transactions, metrics.gw.timeouts,
+               metrics.gw.errors, stats_percentile( &metrics.gw.lat, 50.0 ) / 1e3, stats_percentile( &metrics.gw.lat, 99.0 ) / 1e3 );
+    }
+    log_inf( "Registers written: %lu KiB", mbsrv_regs_used() / 1024 );
+    if( tcp_args.enabled ){ print_stats( MDB_PROTO_TCP ); }
+    if( rtu_args.enabled ){ print_stats( MDB_PROTO_RTU ); }
   }
 
   // Here I have to stop server and clean conf to start from 0
+  log_inf( "Stopping the server" );
+  metrics_close( &metrics );
   if( mbsrv_stop() != 0 ){
     log_err( "Failed stopping modbus server runner. I must commit suicide to be sure to kill it." );
     return -1;
@@ -0,0 +1,95 @@
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ INCLUDES
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#include "test.h"
+
+#include "mbt-srv.h"
+#include "mbt-adu.h"
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ DEFINITIONS
+#define UNITS            "0-2"                     ///< Unit 0 served too: a broadcast must still not be answered
+#define REG              5
+#define VALUE            0x1234
+#define SILENCE_MSEC     100                       ///< Far longer than the turnaround at DEF_RTU_SPEED
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ GLOBAL VARS
+static int fd;
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS
+/**
+ * @brief      Sends a query to the server, after the silence a master keeps between frames
+ */
+void send_query( uint8_t *q, int len ){
+  uint16_t crc = crc16( q, len - 2 );
+
+  q[ len - 2 ] = crc & 0xFF;
+  q[ len - 1 ] = crc >> 8;
+  usleep( SILENCE_MSEC * 1000 );
+  TEST_CHECK( write( fd, q, len ) == len, "write: %s", strerror( errno ) );
+}
+
+/**
+ * @brief      Reads what the server sends back within SILENCE_MSEC
+ *
+ * @return     The bytes read
+ */
+int recv_reply( uint8_t *rsp, int size ){
+  struct pollfd pfd = { .fd = fd, .events = POLLIN };
+  int len = 0;
+  ssize_t n;
+
+  while( len < size && poll( &pfd, 1, SILENCE_MSEC ) > 0 && ( n = read( fd, rsp + len, size - len ) ) > 0 ){ len += n; }
+  return len;
+}
+
+void check_broadcast( uint8_t fc ){
+  uint8_t q[8] = { MODBUS_BROADCAST_ADDRESS, fc, 0x00, REG, VALUE >> 8, VALUE & 0xFF };
+  uint8_t rsp[ MODBUS_RTU_MAX_ADU_LENGTH ];
+  int n;
+
+  send_query( q, sizeof( q ) );
+  TEST_CHECK( ( n = recv_reply( rsp, sizeof( rsp ) ) ) == 0, "broadcast of function code %d answered with %d bytes", fc, n );
+}
+
+void check_register( uint8_t unit ){
+  uint8_t q[8] = { unit, MODBUS_FC_READ_HOLDING_REGISTERS, 0x00, REG, 0x00, 1 };
+  uint8_t rsp[ MODBUS_RTU_MAX_ADU_LENGTH ];
+  int n;
+
+  send_query( q, sizeof( q ) );
+  TEST_CHECK( ( n = recv_reply( rsp, 7 ) ) == 7, "unit %d: read got %d bytes", unit, n );
+  TEST_CHECK( rsp[0] == unit && rsp[1] == MODBUS_FC_READ_HOLDING_REGISTERS && ( ( rsp[3] << 8 ) | rsp[4] ) == VALUE,
+              "unit %d: register %d is %04x, broadcast wrote %04x", unit, REG, ( rsp[3] << 8 ) | rsp[4], VALUE );
+}
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ MAIN
+int main(){
+  char pts[64];
+
+  fd = posix_openpt( O_RDWR | O_NOCTTY );
+  TEST_CHECK( fd != -1 && grantpt( fd ) == 0 && unlockpt( fd ) == 0 && ptsname_r( fd, pts, sizeof( pts ) ) == 0,
+              "pseudo terminal: %s", strerror( errno ) );
+
+  struct tcp_args_t tcp_args = { .enabled = 0 };
+  struct rtu_args_t rtu_args = {
+    .enabled = 1,
+    .common  = { .units = UNITS },
+    .dev     = pts,
+    .addr    = DEF_RTU_ADDR,
+    .speed   = DEF_RTU_SPEED
+  };
+
+  set_debug( DBG_ERR );
+  TEST_CHECK( mbsrv_start( &tcp_args, &rtu_args ) == 0, "server start" );
+
+  // Written by the broadcast, then read back from every other unit: nothing may come back in between
+  check_broadcast( MODBUS_FC_WRITE_SINGLE_REGISTER );
+  check_broadcast( MODBUS_FC_READ_HOLDING_REGISTERS );
+  check_register( 1 );
+  check_register( 2 );
+
+  mbsrv_stop();
+  return 0;
+}
@@ -0,0 +1,137 @@
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ INCLUDES
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "test.h"
+
+#include "mbt-regs.h"
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ DEFINITIONS
+#define UNITS            64                        ///< Units written, 256 holding register pages each
+#define PAGES            ( UNITS * 256 )
+#define DIR_ENTRIES      ( REGS_UNITS * REGS_TABLES * REGS_DIR_SIZE )
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ GLOBAL VARS
+static struct regs_store_t *store;
+static int done;
+static uint32_t dir[ DIR_ENTRIES ];
+static uint8_t listed[ PAGES + 1 ];
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS
+static inline uint16_t value( int unit, int page ){ return ( unit << 8 ) | page; }
+
+/**
+ * @brief      Writes one register per page, each write handing out a new page while checkpoints run
+ */
+void *writer( void *arg ){
+  for( int page = 0; page < 256; page++ ){
+    for( int unit = 0; unit < UNITS; unit++ ){
+      uint16_t v = value( unit, page );
+      uint8_t wire[2] = { v >> 8, v & 0xFF };
+      TEST_CHECK( regs_write( store, unit, REGS_HOLDING, page * 256 + page % 256, 1, wire ) == 0, "write unit %d page %d", unit, page );
+
+      // Letting the checkpoints in between allocations, even on a single cpu
+      sched_yield();
+    }
+  }
+  __atomic_store_n( &done, 1, __ATOMIC_RELEASE );
+  return NULL;
+}
+
+/**
+ * @brief      Checks the snapshot file as a restart would find it: every page its header counts is listed by its
+ *             directory, once
+ */
+void check_snapshot( int fd, int round ){
+  struct regs_hdr_t hdr;
+  uint32_t n = 0;
+
+  TEST_CHECK( pread( fd, &hdr, sizeof( hdr ), 0 ) == sizeof( hdr ), "round %d: header", round );
+  if( !hdr.npages ){ return; }
+  TEST_CHECK( hdr.npages <= PAGES, "round %d: %u pages counted", round, hdr.npages );
+  TEST_CHECK( pread( fd, dir, sizeof( dir ), hdr.dir_off ) == sizeof( dir ), "round %d: directory", round );
+
+  memset( listed, 0, sizeof( listed ) );
+  for( int i = 0; i < DIR_ENTRIES; i++ ){
+    if( !dir[i] ){ continue; }
+    TEST_CHECK( dir[i] <= hdr.npages && !listed[ dir[i] ], "round %d: entry %d lists page %u of %u", round, i, dir[i], hdr.npages );
+    listed[ dir[i] ] = 1;
+    n++;
+  }
+  TEST_CHECK( n == hdr.npages, "round %d: %u pages counted, %u listed", round, hdr.npages, n );
+}
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ MAIN
+int main( int argc, char **argv ){
+  char path[64];
+  pthread_t thread;
+  int rounds = 0;
+
+  snprintf( path, sizeof( path ), "/tmp/test-ckpt-%d.snap", getpid() );
+  unlink( path );
+
+  // Checkpoints racing the page allocations: every page must land in the snapshot directory
+  store = regs_new( 0, 0, 0x10000, 0, 0, 0, NULL );
+  TEST_CHECK( store, "store" );
+  struct regs_ckpt_t *ckpt = regs_ckpt_open( store, path );
+  TEST_CHECK( ckpt, "checkpoint open %s", path );
+
+  TEST_CHECK( pthread_create( &thread, NULL, writer, NULL ) == 0, "writer thread" );
+  while( !__atomic_load_n( &done, __ATOMIC_ACQUIRE ) ){
+    TEST_CHECK( regs_ckpt_run( store, ckpt ) >= 0, "checkpoint round %d", rounds );
+    check_snapshot( ckpt->fd, rounds );
+    rounds++;
+  }
+  pthread_join( thread, NULL );
+  TEST_CHECK( regs_ckpt_run( store, ckpt ) >= 0, "last checkpoint" );
+  check_snapshot( ckpt->fd, rounds );
+  regs_ckpt_close( ckpt );
+  regs_free( store );
+
+  // A new store restores every page, each holding its register
+  store = regs_new( 0, 0, 0x10000, 0, 0, 0, NULL );
+  TEST_CHECK( store, "store" );
+  ckpt = regs_ckpt_open( store, path );
+  TEST_CHECK( ckpt, "checkpoint reopen %s", path );
+  TEST_CHECK( ckpt->restored == PAGES, "%u pages restored, %d written", ckpt->restored, PAGES );
+
+  for( int unit = 0; unit < UNITS; unit++ ){
+    for( int page = 0; page < 256; page++ ){
+      uint8_t wire[2];
+      regs_read( store, unit, REGS_HOLDING, page * 256 + page % 256, 1, wire );
+      TEST_CHECK( ( ( wire[0] << 8 ) | wire[1] ) == value( unit, page ), "unit %d page %d reads %04X", unit, page,
+                  ( wire[0] << 8 ) | wire[1] );
+    }
+  }
+
+  regs_ckpt_close( ckpt );
+  regs_free( store );
+
+  // A store already written does not restore: the snapshot stays whole until its first checkpoint replaces it
+  char tmp[80];
+  struct regs_hdr_t hdr;
+  int fd;
+  uint8_t wire[2] = { 0x12, 0x34 };
+
+  snprintf( tmp, sizeof( tmp ), "%s.tmp", path );
+  store = regs_new( 0, 0, 0x10000, 0, 0, 0, NULL );
+  TEST_CHECK( store && regs_write( store, 0, REGS_HOLDING, 0, 1, wire ) == 0, "store written" );
+  ckpt = regs_ckpt_open( store, path );
+  TEST_CHECK( ckpt && !ckpt->restored, "checkpoint open over a written store" );
+  TEST_CHECK( ( fd = open( path, O_RDONLY ) ) != -1 && pread( fd, &hdr, sizeof( hdr ), 0 ) == sizeof( hdr ), "snapshot read" );
+  TEST_CHECK( hdr.npages == PAGES, "snapshot holds %u pages before the first checkpoint, %d written", hdr.npages, PAGES );
+  close( fd );
+
+  TEST_CHECK( regs_ckpt_run( store, ckpt ) == 1, "first checkpoint of the written store" );
+  TEST_CHECK( access( tmp, F_OK ) != 0, "%s left after the first checkpoint", tmp );
+  TEST_CHECK( ( fd = open( path, O_RDONLY ) ) != -1 && pread( fd, &hdr, sizeof( hdr ), 0 ) == sizeof( hdr ), "snapshot read" );
+  TEST_CHECK( hdr.npages == 1, "snapshot holds %u pages after the first checkpoint, 1 written", hdr.npages );
+  close( fd );
+  regs_ckpt_close( ckpt );
+  regs_free( store );
+
+  unlink( path );
+  printf( "test-ckpt: %d pages restored after %d checkpoints racing their allocation\n", PAGES, rounds );
+  return 0;
+}
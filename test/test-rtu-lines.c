@@ -0,0 +1,28 @@
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ INCLUDES
+#include "test.h"
+
+#include "mbt-srv.h"
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ DEFINITIONS
+#define LINES            33                        ///< One more than the RTU runner serves
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ MAIN
+int main(){
+  char devs[ LINES * 4 ] = "";
+
+  // Built with the address sanitizer: a line stored past the last one fails the test before the start does
+  for( int i = 0; i < LINES; i++ ){ strcat( devs, i ? ",pty" : "pty" ); }
+
+  struct tcp_args_t tcp_args = { .enabled = 0 };
+  struct rtu_args_t rtu_args = {
+    .enabled = 1,
+    .dev     = devs,
+    .addr    = DEF_RTU_ADDR,
+    .speed   = DEF_RTU_SPEED
+  };
+
+  set_debug( DBG_NONE );
+  TEST_CHECK( mbsrv_start( &tcp_args, &rtu_args ) != 0, "%d RTU lines accepted", LINES );
+  printf( "test-rtu-lines: %d lines refused\n", LINES );
+  return 0;
+}
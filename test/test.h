@@ -0,0 +1,23 @@
+#ifndef _TEST_H_
+#define _TEST_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~ DEFINITIONS
+/**
+ * Checks a condition: on failure prints where and why, then ends the test with exit code 1
+ */
+#define TEST_CHECK( cond, ... ) do{                                \
+    if( !( cond ) ){                                               \
+      fprintf( stderr, "%s:%d: FAILED ", __FILE__, __LINE__ );    \
+      fprintf( stderr, __VA_ARGS__ );                              \
+      fprintf( stderr, "\n" );                                     \
+      exit( 1 );                                                   \
+    }                                                              \
+  }while( 0 )
+
+#endif // _TEST_H_